@@ -11,7 +11,7 @@
  * Copyright (C) 2014 by Alexander G. M. Smith.
  *
  * Command line to compile in Linux:
- * g++ -Wall -I. -o FFVSO.fcgi FFVSO.cpp parsedate.cpp /usr/local/lib/libfcgi.a
+ * g++ -Wall -std=c++17 -I. -o FFVSO.fcgi FFVSO.cpp parsedate.cpp -lpthread -lz
  *
  * Note that this uses the AGMS vacation coding style.  That means no tabs,
  * indents are two spaces, m_ is the prefix for member variables, g_ is the
@@ -267,12 +267,35 @@
 
 /* Standard C Library. */
 
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h> // Open, close and other standard POSIX functions.
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h> // Linux specific, for the network event loop.
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 vector instructions, see ScanSeparatorBlock().
+#endif
+
+/* zlib for compressing web pages, see CompressResponse(). */
+
+#include <zlib.h>
 
 /* parsedate library taken from Haiku OS source for Unix, native in BeOS. */
 
@@ -283,13 +306,806 @@
 /* STL (Standard Template Library) headers. */
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
-#include <fastcgi.h>  // For FCGI_LISTENSOCK_FILENO.
-#include <fcgi_stdio.h> // Redefines the usual stdio with a hacked up one.
+
+/******************************************************************************
+ * Civil time.  Every event on every web page gets its local date and time
+ * worked out, and every date parsed calls mktime(), and the C library versions
+ * take a process wide lock and go through its time zone machinery each time.
+ * Instead, the time zone file (TZif format, usually from /usr/share/zoneinfo)
+ * is read once, with the rule at its end for future years expanded into more
+ * transitions, and conversions become a binary search plus some arithmetic.
+ * The results are the same as glibc's, including its quirks for a time which
+ * doesn't exist or has the wrong daylight saving flag.  If the zone can't be
+ * loaded (such as one with leap seconds), the C library functions are used.
+ * Changing the TZ environment variable after the first use has no effect.
+ */
+
+const int SECONDS_PER_DAY = 24 * 60 * 60;
+
+const int64_t SECONDS_PER_CYCLE = 146097LL * SECONDS_PER_DAY;
+  /* The Gregorian calendar repeats every 400 years, and so does a time zone's
+  rule.  Transitions from the rule are generated for one whole cycle, and
+  later times are moved back into it. */
+
+static const char *g_DayNames[7] = {"Sunday", "Monday", "Tuesday",
+  "Wednesday", "Thursday", "Friday", "Saturday"};
+static const char *g_MonthNames[12] = {"January", "February", "March",
+  "April", "May", "June", "July", "August", "September", "October",
+  "November", "December"};
+
+struct CivilTimeTypeStruct
+{
+  long m_UTCOffset;
+    /* Seconds east of UTC. */
+
+  bool m_IsDST;
+
+  size_t m_AbbreviationIndex;
+    /* Where the abbreviation ("EST") is in m_Abbreviations of the zone. */
+};
+
+struct CivilTimeZoneStruct
+{
+  std::vector<int64_t> m_Transitions;
+  std::vector<int> m_TransitionTypes;
+    /* Sorted UTC times when the local time type changes, and the type index
+    starting at each one. */
+
+  int m_InitialType;
+    /* The type used before the first transition. */
+
+  std::vector<CivilTimeTypeStruct> m_Types;
+  std::string m_Abbreviations;
+    /* NUL terminated abbreviations, all stuck together. */
+
+  long m_StandardOffset;
+    /* Seconds west of UTC without daylight saving time, like the C library's
+    timezone variable. */
+
+  int64_t m_CycleStart;
+    /* Start of the 400 years of transitions generated from the zone's rule,
+    or INT64_MAX if it doesn't have one with DST. */
+};
+
+/* The time zone rule from the end of a TZif file, in POSIX TZ format such as
+"EST5EDT,M3.2.0,M11.1.0".  Dates are 'J' for a day of the year 1 to 365 not
+counting February 29th, 'D' for a day of the year 0 to 365, or 'M' for the
+m_Week'th (5 is the last) m_Day of the week in m_Month. */
+
+struct PosixZoneDateStruct
+{
+  char m_Kind;
+  int m_Month;
+  int m_Week;
+  int m_Day;
+  long m_Time;
+    /* Local seconds past midnight when it happens, can be negative. */
+};
+
+struct PosixZoneRuleStruct
+{
+  std::string m_StandardName;
+  std::string m_DSTName;
+  long m_StandardOffset;
+  long m_DSTOffset;
+    /* Seconds east of UTC. */
+  bool m_HasDST;
+  PosixZoneDateStruct m_DSTStart;
+  PosixZoneDateStruct m_DSTEnd;
+};
+
+
+/* Days since January 1st 1970 for a year, month (1 to 12) and day, using
+Howard Hinnant's algorithm for the proleptic Gregorian calendar. */
+
+static int64_t DaysFromCivil (int64_t Year, int Month, int Day)
+{
+  Year -= (Month <= 2);
+  const int64_t Era = (Year >= 0 ? Year : Year - 399) / 400;
+  const int64_t YearOfEra = Year - Era * 400;
+  const int64_t DayOfYear = (153 * (Month + (Month > 2 ? -3 : 9)) + 2) / 5 +
+    Day - 1;
+  const int64_t DayOfEra = YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 +
+    DayOfYear;
+  return Era * 146097 + DayOfEra - 719468;
+}
+
+static void CivilFromDays (int64_t Days, int64_t &Year, int &Month, int &Day)
+{
+  Days += 719468;
+  const int64_t Era = (Days >= 0 ? Days : Days - 146096) / 146097;
+  const int64_t DayOfEra = Days - Era * 146097;
+  const int64_t YearOfEra = (DayOfEra - DayOfEra / 1460 + DayOfEra / 36524 -
+    DayOfEra / 146096) / 365;
+  const int64_t DayOfYear = DayOfEra -
+    (365 * YearOfEra + YearOfEra / 4 - YearOfEra / 100);
+  const int64_t MonthIndex = (5 * DayOfYear + 2) / 153;
+  Day = DayOfYear - (153 * MonthIndex + 2) / 5 + 1;
+  Month = MonthIndex < 10 ? MonthIndex + 3 : MonthIndex - 9;
+  Year = YearOfEra + Era * 400 + (Month <= 2);
+}
+
+static bool IsLeapYear (int64_t Year)
+{
+  return (Year % 4 == 0 && Year % 100 != 0) || Year % 400 == 0;
+}
+
+static int64_t FloorDivide (int64_t Numerator, int64_t Denominator)
+{
+  int64_t Quotient = Numerator / Denominator;
+  if ((Numerator % Denominator != 0) && ((Numerator < 0) != (Denominator < 0)))
+    Quotient--;
+  return Quotient;
+}
+
+
+/* Parsing the POSIX TZ rule, advancing pRule past whatever was read. */
+
+static bool ParsePosixZoneName (const char *&pRule, std::string &Name)
+{
+  const char *pStart = pRule;
+  if (*pRule == '<')
+  {
+    pStart = ++pRule;
+    while (*pRule != 0 && *pRule != '>')
+      pRule++;
+    if (*pRule != '>')
+      return false;
+    Name.assign (pStart, pRule++ - pStart);
+  }
+  else
+  {
+    while (isalpha (*pRule))
+      pRule++;
+    Name.assign (pStart, pRule - pStart);
+  }
+  return Name.size () >= 3;
+}
+
+static bool ParsePosixZoneTime (const char *&pRule, long &Seconds)
+{
+  long Sign = 1;
+  if (*pRule == '+' || *pRule == '-')
+    Sign = (*pRule++ == '-') ? -1 : 1;
+  if (!isdigit (*pRule))
+    return false;
+
+  long Parts[3] = {0, 0, 0};
+  for (int iPart = 0; iPart < 3; iPart++)
+  {
+    while (isdigit (*pRule))
+      Parts[iPart] = Parts[iPart] * 10 + (*pRule++ - '0');
+    if (iPart == 2 || *pRule != ':' || !isdigit (pRule[1]))
+      break;
+    pRule++;
+  }
+  Seconds = Sign * (Parts[0] * 3600 + Parts[1] * 60 + Parts[2]);
+  return true;
+}
+
+static bool ParsePosixZoneDate (const char *&pRule, PosixZoneDateStruct &Date)
+{
+  char *pEnd;
+
+  Date.m_Time = 2 * 3600;
+  if (*pRule == 'M')
+  {
+    Date.m_Kind = 'M';
+    Date.m_Month = strtol (pRule + 1, &pEnd, 10);
+    if (*pEnd != '.')
+      return false;
+    Date.m_Week = strtol (pEnd + 1, &pEnd, 10);
+    if (*pEnd != '.')
+      return false;
+    Date.m_Day = strtol (pEnd + 1, &pEnd, 10);
+    if (Date.m_Month < 1 || Date.m_Month > 12 || Date.m_Week < 1 ||
+    Date.m_Week > 5 || Date.m_Day < 0 || Date.m_Day > 6)
+      return false;
+  }
+  else
+  {
+    Date.m_Kind = 'D';
+    if (*pRule == 'J')
+    {
+      Date.m_Kind = 'J';
+      pRule++;
+    }
+    if (!isdigit (*pRule))
+      return false;
+    Date.m_Day = strtol (pRule, &pEnd, 10);
+    if (Date.m_Day > 365 || (Date.m_Kind == 'J' && Date.m_Day < 1))
+      return false;
+  }
+  pRule = pEnd;
+
+  if (*pRule == '/')
+    return ParsePosixZoneTime (++pRule, Date.m_Time);
+  return true;
+}
+
+static bool ParsePosixZoneRule (const char *pRule, PosixZoneRuleStruct &Rule)
+{
+  // Offsets in the rule are hours west of UTC, the opposite of ours.
+
+  if (!ParsePosixZoneName (pRule, Rule.m_StandardName) ||
+  !ParsePosixZoneTime (pRule, Rule.m_StandardOffset))
+    return false;
+  Rule.m_StandardOffset = -Rule.m_StandardOffset;
+
+  Rule.m_HasDST = (*pRule != 0);
+  if (!Rule.m_HasDST)
+    return true;
+
+  if (!ParsePosixZoneName (pRule, Rule.m_DSTName))
+    return false;
+  Rule.m_DSTOffset = Rule.m_StandardOffset + 3600;
+  if (*pRule != ',' && *pRule != 0)
+  {
+    if (!ParsePosixZoneTime (pRule, Rule.m_DSTOffset))
+      return false;
+    Rule.m_DSTOffset = -Rule.m_DSTOffset;
+  }
+
+  // Rules without dates are supposed to use some default which has changed
+  // over the years.  They don't show up in TZif files, so just give up.
+
+  if (*pRule++ != ',' || !ParsePosixZoneDate (pRule, Rule.m_DSTStart) ||
+  *pRule++ != ',' || !ParsePosixZoneDate (pRule, Rule.m_DSTEnd))
+    return false;
+  return *pRule == 0;
+}
+
+
+/* Returns the local seconds since 1970 when the given date of the rule happens
+in the given year. */
+
+static int64_t PosixZoneDateInYear (const PosixZoneDateStruct &Date,
+  int64_t Year)
+{
+  int64_t Days;
+
+  if (Date.m_Kind == 'J')
+    Days = DaysFromCivil (Year, 1, 1) + Date.m_Day - 1 +
+      (IsLeapYear (Year) && Date.m_Day >= 60);
+  else if (Date.m_Kind == 'D')
+    Days = DaysFromCivil (Year, 1, 1) + Date.m_Day;
+  else
+  {
+    static const int DaysInMonth[12] =
+      {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int MonthLength = DaysInMonth[Date.m_Month - 1] +
+      (Date.m_Month == 2 && IsLeapYear (Year));
+    int64_t FirstDay = DaysFromCivil (Year, Date.m_Month, 1);
+    int FirstWeekDay = (int) ((FirstDay % 7 + 11) % 7); // 1970 was Thursday.
+    int Day = (Date.m_Day - FirstWeekDay + 7) % 7 + 7 * (Date.m_Week - 1);
+    while (Day >= MonthLength)
+      Day -= 7;
+    Days = FirstDay + Day;
+  }
+  return Days * SECONDS_PER_DAY + Date.m_Time;
+}
+
+
+/* Finds or adds a local time type with the given offset, DST flag and
+abbreviation. */
+
+static int CivilTimeType (CivilTimeZoneStruct &Zone, long UTCOffset,
+  bool IsDST, const std::string &Abbreviation)
+{
+  for (size_t iType = 0; iType < Zone.m_Types.size (); iType++)
+  {
+    const CivilTimeTypeStruct &Type = Zone.m_Types[iType];
+    if (Type.m_UTCOffset == UTCOffset && Type.m_IsDST == IsDST &&
+    Abbreviation == Zone.m_Abbreviations.c_str () + Type.m_AbbreviationIndex)
+      return iType;
+  }
+
+  CivilTimeTypeStruct NewType;
+  NewType.m_UTCOffset = UTCOffset;
+  NewType.m_IsDST = IsDST;
+  NewType.m_AbbreviationIndex = Zone.m_Abbreviations.size ();
+  Zone.m_Abbreviations.append (Abbreviation.c_str (),
+    Abbreviation.size () + 1);
+  Zone.m_Types.push_back (NewType);
+  return Zone.m_Types.size () - 1;
+}
+
+
+/* Adds the transitions from the rule at the end of the TZif file, for the
+years after the ones in the file. */
+
+static void ExpandPosixZoneRule (CivilTimeZoneStruct &Zone,
+  const PosixZoneRuleStruct &Rule)
+{
+  int StandardType = CivilTimeType (Zone, Rule.m_StandardOffset, false,
+    Rule.m_StandardName);
+  if (!Rule.m_HasDST)
+  {
+    if (Zone.m_Transitions.empty ())
+      Zone.m_InitialType = StandardType;
+    return;
+  }
+  int DSTType = CivilTimeType (Zone, Rule.m_DSTOffset, true, Rule.m_DSTName);
+
+  int64_t LastTransition = INT64_MIN;
+  int64_t FirstYear = 1969;
+  if (!Zone.m_Transitions.empty ())
+  {
+    int64_t Year;
+    int Month, Day;
+    LastTransition = Zone.m_Transitions.back ();
+    CivilFromDays (FloorDivide (LastTransition, SECONDS_PER_DAY), Year, Month,
+      Day);
+    FirstYear = Year;
+  }
+
+  // The cycle starts with the year after the last transition from the file,
+  // which may have been part way through its year.
+
+  Zone.m_CycleStart = DaysFromCivil (FirstYear + 1, 1, 1) * SECONDS_PER_DAY;
+  for (int64_t Year = FirstYear; Year <= FirstYear + 401; Year++)
+  {
+    // The start of DST is in standard time, and the end is in DST.
+
+    int64_t Start = PosixZoneDateInYear (Rule.m_DSTStart, Year) -
+      Rule.m_StandardOffset;
+    int64_t End = PosixZoneDateInYear (Rule.m_DSTEnd, Year) -
+      Rule.m_DSTOffset;
+    int64_t Times[2] = {Start, End};
+    int Types[2] = {DSTType, StandardType};
+    if (End < Start) // Southern hemisphere.
+    {
+      std::swap (Times[0], Times[1]);
+      std::swap (Types[0], Types[1]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+      if (Times[i] <= LastTransition)
+        continue;
+      Zone.m_Transitions.push_back (Times[i]);
+      Zone.m_TransitionTypes.push_back (Types[i]);
+    }
+  }
+}
+
+
+/* Reads the big endian numbers in a TZif file. */
+
+static int64_t ReadTZifNumber (const unsigned char *pData, int Size)
+{
+  uint64_t Value = 0;
+  for (int i = 0; i < Size; i++)
+    Value = (Value << 8) | pData[i];
+  if (Size == 4)
+    return (int32_t) Value;
+  return (int64_t) Value;
+}
+
+
+/* Loads the time zone the C library would use, from the TZ environment
+variable or /etc/localtime.  Returns NULL if it can't be done. */
+
+static CivilTimeZoneStruct *LoadCivilTimeZone ()
+{
+  std::string FileName;
+  const char *pTZ = getenv ("TZ");
+  if (pTZ == NULL)
+    FileName = "/etc/localtime";
+  else
+  {
+    if (*pTZ == ':')
+      pTZ++;
+    if (*pTZ == 0)
+      pTZ = "Universal";
+    if (*pTZ == '/')
+      FileName = pTZ;
+    else
+    {
+      const char *pDirectory = getenv ("TZDIR");
+      FileName = (pDirectory != NULL && *pDirectory != 0) ?
+        pDirectory : "/usr/share/zoneinfo";
+      FileName.append ("/").append (pTZ);
+    }
+  }
+
+  std::string Data;
+  FILE *pFile = fopen (FileName.c_str (), "rb");
+  if (pFile == NULL)
+    return NULL;
+  char Buffer[4096];
+  size_t AmountRead;
+  while ((AmountRead = fread (Buffer, 1, sizeof (Buffer), pFile)) > 0)
+    Data.append (Buffer, AmountRead);
+  fclose (pFile);
+
+  // Skip the 32 bit version of the data if there is a 64 bit one after it.
+
+  const unsigned char *pData = (const unsigned char *) Data.data ();
+  const unsigned char *pEnd = pData + Data.size ();
+  int TimeSize = 4;
+  for (int Pass = 0; Pass < 2; Pass++)
+  {
+    if (pEnd - pData < 44 || memcmp (pData, "TZif", 4) != 0)
+      return NULL;
+    int64_t Counts[6];
+    for (int i = 0; i < 6; i++)
+      Counts[i] = ReadTZifNumber (pData + 20 + 4 * i, 4);
+    int64_t UTCCount = Counts[0], StandardCount = Counts[1],
+      LeapCount = Counts[2], TransitionCount = Counts[3],
+      TypeCount = Counts[4], CharCount = Counts[5];
+    if (LeapCount != 0 || TypeCount < 1)
+      return NULL;
+    int64_t DataSize = TransitionCount * (TimeSize + 1) + TypeCount * 6 +
+      CharCount + LeapCount * (TimeSize + 4) + StandardCount + UTCCount;
+    if (pEnd - pData - 44 < DataSize)
+      return NULL;
+    if (Pass == 0 && pData[4] >= '2')
+    {
+      pData += 44 + DataSize;
+      TimeSize = 8;
+      continue;
+    }
+
+    CivilTimeZoneStruct *pZone = new CivilTimeZoneStruct;
+    CivilTimeZoneStruct &Zone = *pZone;
+    Zone.m_CycleStart = INT64_MAX;
+    const unsigned char *pTimes = pData + 44;
+    const unsigned char *pTypeIndices = pTimes + TransitionCount * TimeSize;
+    const unsigned char *pTypes = pTypeIndices + TransitionCount;
+    const unsigned char *pChars = pTypes + TypeCount * 6;
+    bool Valid = true;
+
+    for (int64_t iType = 0; iType < TypeCount; iType++)
+    {
+      const unsigned char *pType = pTypes + 6 * iType;
+      CivilTimeTypeStruct Type;
+      Type.m_UTCOffset = ReadTZifNumber (pType, 4);
+      Type.m_IsDST = (pType[4] != 0);
+      Type.m_AbbreviationIndex = pType[5];
+      Valid = Valid && pType[5] < CharCount;
+      Zone.m_Types.push_back (Type);
+    }
+    Zone.m_Abbreviations.assign ((const char *) pChars, CharCount);
+    Zone.m_Abbreviations.push_back (0);
+    for (int64_t iTransition = 0; iTransition < TransitionCount; iTransition++)
+    {
+      Zone.m_Transitions.push_back (
+        ReadTZifNumber (pTimes + iTransition * TimeSize, TimeSize));
+      Zone.m_TransitionTypes.push_back (pTypeIndices[iTransition]);
+      Valid = Valid && pTypeIndices[iTransition] < TypeCount;
+    }
+    if (!Valid)
+    {
+      delete pZone;
+      return NULL;
+    }
+
+    // Before the first transition, glibc uses the first standard time type.
+
+    Zone.m_InitialType = 0;
+    while (Zone.m_InitialType < TypeCount &&
+    Zone.m_Types[Zone.m_InitialType].m_IsDST)
+      Zone.m_InitialType++;
+    if (Zone.m_InitialType == TypeCount)
+      Zone.m_InitialType = 0;
+
+    // The standard offset is from the last transition to standard time.
+
+    Zone.m_StandardOffset = -Zone.m_Types[0].m_UTCOffset;
+    for (size_t i = Zone.m_Transitions.size (); i-- > 0; )
+    {
+      const CivilTimeTypeStruct &Type =
+        Zone.m_Types[Zone.m_TransitionTypes[i]];
+      if (!Type.m_IsDST)
+      {
+        Zone.m_StandardOffset = -Type.m_UTCOffset;
+        break;
+      }
+    }
+
+    // Version 2 and later files have a TZ rule for the future at the end,
+    // between line feeds.
+
+    const unsigned char *pFooter = pData + 44 + DataSize;
+    if (TimeSize == 8 && pFooter < pEnd && *pFooter == '\n')
+    {
+      const unsigned char *pFooterEnd = (const unsigned char *)
+        memchr (pFooter + 1, '\n', pEnd - pFooter - 1);
+      PosixZoneRuleStruct Rule;
+      if (pFooterEnd != NULL && pFooterEnd > pFooter + 1 &&
+      ParsePosixZoneRule (std::string ((const char *) pFooter + 1,
+      pFooterEnd - pFooter - 1).c_str (), Rule))
+        ExpandPosixZoneRule (Zone, Rule);
+    }
+    return pZone;
+  }
+  return NULL;
+}
+
+
+/* The zone, loaded on first use, or NULL if the C library is used. */
+
+static const CivilTimeZoneStruct *CivilTimeZone ()
+{
+  static const CivilTimeZoneStruct *pZone = LoadCivilTimeZone ();
+  return pZone;
+}
+
+
+/* Returns how many 400 year cycles to move the time back by so that it's
+within the transitions generated from the zone's rule. */
+
+static int64_t CivilTimeCycles (const CivilTimeZoneStruct &Zone, int64_t Time)
+{
+  if (Time - SECONDS_PER_CYCLE < Zone.m_CycleStart)
+    return 0;
+  return (Time - Zone.m_CycleStart) / SECONDS_PER_CYCLE;
+}
+
+
+/* Finds the local time type in effect at the given time.  Events come in
+order, so the last range of times found is remembered and tried first. */
+
+static const CivilTimeTypeStruct &FindCivilTimeType (
+  const CivilTimeZoneStruct &Zone, int64_t Time)
+{
+  static thread_local const CivilTimeZoneStruct *pCachedZone;
+  static thread_local int64_t CachedStart;
+  static thread_local int64_t CachedEnd;
+  static thread_local int CachedType;
+
+  Time -= CivilTimeCycles (Zone, Time) * SECONDS_PER_CYCLE;
+  if (pCachedZone == &Zone && Time >= CachedStart && Time < CachedEnd)
+    return Zone.m_Types[CachedType];
+
+  const std::vector<int64_t> &Transitions = Zone.m_Transitions;
+  size_t iNext = std::upper_bound (Transitions.begin (), Transitions.end (),
+    Time) - Transitions.begin ();
+  pCachedZone = &Zone;
+  CachedStart = (iNext == 0) ? INT64_MIN : Transitions[iNext - 1];
+  CachedEnd = (iNext == Transitions.size ()) ? INT64_MAX : Transitions[iNext];
+  CachedType = (iNext == 0) ?
+    Zone.m_InitialType : Zone.m_TransitionTypes[iNext - 1];
+  return Zone.m_Types[CachedType];
+}
+
+
+/* Like localtime_r().  The date part for the most recent day is remembered, so
+events on the same day only need a subtraction or two. */
+
+static void CivilLocalTime (time_t Time, struct tm &BrokenUpTime)
+{
+  const CivilTimeZoneStruct *pZone = CivilTimeZone ();
+  if (pZone == NULL)
+  {
+    localtime_r (&Time, &BrokenUpTime);
+    return;
+  }
+
+  static thread_local bool HaveCachedDay;
+  static thread_local int64_t CachedDay;
+  static thread_local struct tm CachedDate;
+
+  const CivilTimeTypeStruct &Type = FindCivilTimeType (*pZone, Time);
+  int64_t LocalTime = (int64_t) Time + Type.m_UTCOffset;
+  int64_t Day = FloorDivide (LocalTime, SECONDS_PER_DAY);
+  int SecondOfDay = LocalTime - Day * SECONDS_PER_DAY;
+
+  if (!HaveCachedDay || Day != CachedDay)
+  {
+    int64_t Year;
+    int Month, DayOfMonth;
+    CivilFromDays (Day, Year, Month, DayOfMonth);
+    CachedDate.tm_year = Year - 1900;
+    CachedDate.tm_mon = Month - 1;
+    CachedDate.tm_mday = DayOfMonth;
+    CachedDate.tm_wday = (Day % 7 + 11) % 7; // 1970 started on a Thursday.
+    CachedDate.tm_yday = Day - DaysFromCivil (Year, 1, 1);
+    CachedDay = Day;
+    HaveCachedDay = true;
+  }
+
+  BrokenUpTime.tm_sec = SecondOfDay % 60;
+  BrokenUpTime.tm_min = SecondOfDay / 60 % 60;
+  BrokenUpTime.tm_hour = SecondOfDay / 3600;
+  BrokenUpTime.tm_mday = CachedDate.tm_mday;
+  BrokenUpTime.tm_mon = CachedDate.tm_mon;
+  BrokenUpTime.tm_year = CachedDate.tm_year;
+  BrokenUpTime.tm_wday = CachedDate.tm_wday;
+  BrokenUpTime.tm_yday = CachedDate.tm_yday;
+  BrokenUpTime.tm_isdst = Type.m_IsDST;
+  BrokenUpTime.tm_gmtoff = Type.m_UTCOffset;
+  BrokenUpTime.tm_zone =
+    pZone->m_Abbreviations.c_str () + Type.m_AbbreviationIndex;
+}
+
+
+/* Like mktime(), and gives the same results as glibc's, for things like a
+time in the hour skipped when daylight saving time starts, or a summer time
+with tm_isdst saying it's standard time (parsedate() does that a lot).  It
+uses the same search, starting with the UTC offset found by the previous call
+(glibc shares that between threads, here each thread has its own), so that
+even for a local time which happens twice with the same DST flag it picks the
+same one as glibc would. */
+
+static time_t CivilMakeTime (struct tm &BrokenUpTime)
+{
+  const CivilTimeZoneStruct *pZone = CivilTimeZone ();
+  if (pZone == NULL)
+    return mktime (&BrokenUpTime);
+
+  static thread_local int64_t PreviousOffset;
+
+  // Work out the local time as seconds since 1970.  Like glibc, seconds out
+  // of range are added at the end, after the UTC offset has been found using
+  // the time at the start of the minute.
+
+  int64_t MonthYears = FloorDivide (BrokenUpTime.tm_mon, 12);
+  int64_t Year = BrokenUpTime.tm_year + 1900LL + MonthYears;
+  int Month = BrokenUpTime.tm_mon - MonthYears * 12 + 1;
+  int Second = BrokenUpTime.tm_sec;
+  int ClampedSecond = Second < 0 ? 0 : (Second > 59 ? 59 : Second);
+  int64_t LocalTime = (DaysFromCivil (Year, Month, 1) +
+    BrokenUpTime.tm_mday - 1) * SECONDS_PER_DAY +
+    BrokenUpTime.tm_hour * 3600LL + BrokenUpTime.tm_min * 60LL +
+    ClampedSecond;
+  int WantDST = BrokenUpTime.tm_isdst;
+  if (WantDST > 0)
+    WantDST = 1;
+
+  // Guess the time using the previous UTC offset, then correct the guess by
+  // how far off its local time is.  If it goes back and forth between two
+  // times, the local time was skipped over when the clock jumped forward, and
+  // glibc stops on the one which gives a different DST flag than asked for,
+  // or if it wasn't specified, on the DST one (the first if neither is).
+
+  int64_t Time = LocalTime + PreviousOffset;
+  int64_t PreviousTime = Time;
+  int64_t OlderTime = Time;
+  bool PreviousIsDST = false;
+  bool InGap = false;
+  int ProbesLeft = 6;
+  const CivilTimeTypeStruct *pType;
+
+  while (true)
+  {
+    pType = &FindCivilTimeType (*pZone, Time);
+    int64_t Error = LocalTime - (Time + pType->m_UTCOffset);
+    if (Error == 0)
+      break;
+    if (Time == OlderTime && Time != PreviousTime &&
+    (WantDST < 0 ? pType->m_IsDST || !PreviousIsDST :
+    pType->m_IsDST != WantDST))
+    {
+      InGap = true;
+      break;
+    }
+    if (--ProbesLeft == 0)
+      return -1;
+    OlderTime = PreviousTime;
+    PreviousTime = Time;
+    Time += Error;
+    PreviousIsDST = pType->m_IsDST;
+  }
+
+  // If the time doesn't have the DST flag asked for, glibc looks a week at a
+  // time in both directions for a time which does, and uses its UTC offset.
+  // If there isn't any, it assumes DST is an hour ahead.
+
+  if (!InGap && WantDST >= 0 && pType->m_IsDST != WantDST)
+  {
+    const int PROBE_STRIDE = 601200;
+    const int PROBE_LIMIT = 457243200 / 2 + PROBE_STRIDE;
+    bool Probed = false;
+    for (int Delta = PROBE_STRIDE; Delta < PROBE_LIMIT && !Probed;
+    Delta += PROBE_STRIDE)
+    {
+      for (int Direction = -1; Direction <= 1 && !Probed; Direction += 2)
+      {
+        const CivilTimeTypeStruct &Type =
+          FindCivilTimeType (*pZone, Time + Direction * Delta);
+        if (Type.m_IsDST == WantDST)
+        {
+          Time = LocalTime - Type.m_UTCOffset;
+          Probed = true;
+        }
+      }
+    }
+    if (!Probed)
+      Time += 3600 * ((WantDST == 0) - (pType->m_IsDST == 0));
+  }
+
+  PreviousOffset = Time - LocalTime;
+  Time += Second - ClampedSecond;
+  CivilLocalTime (Time, BrokenUpTime);
+  return Time;
+}
+
+
+/* Writes the time as "HH:MM", like strftime's "%H:%M", into a buffer of at
+least 6 characters. */
+
+static void FormatClockTime (const struct tm &BrokenUpTime, char *pBuffer)
+{
+  pBuffer[0] = '0' + BrokenUpTime.tm_hour / 10;
+  pBuffer[1] = '0' + BrokenUpTime.tm_hour % 10;
+  pBuffer[2] = ':';
+  pBuffer[3] = '0' + BrokenUpTime.tm_min / 10;
+  pBuffer[4] = '0' + BrokenUpTime.tm_min % 10;
+  pBuffer[5] = 0;
+}
+
+
+/* Writes the date for a day heading, like strftime's "%A, %B %d, %Y" (in the C
+locale) does, such as "Wednesday, June 13, 2018". */
+
+static void FormatDayHeading (const struct tm &BrokenUpTime, char *pBuffer,
+  size_t BufferSize)
+{
+  snprintf (pBuffer, BufferSize, "%s, %s %02d, %d",
+    g_DayNames[BrokenUpTime.tm_wday], g_MonthNames[BrokenUpTime.tm_mon],
+    BrokenUpTime.tm_mday, BrokenUpTime.tm_year + 1900);
+}
+
+
+/* Writes the date and time like asctime_r() or strftime's "%c" in the C
+locale, such as "Wed Jun 13 19:00:00 2018", but without a line feed. */
+
+static void FormatFullTime (const struct tm &BrokenUpTime, char *pBuffer,
+  size_t BufferSize)
+{
+  snprintf (pBuffer, BufferSize, "%.3s %.3s%3d %.2d:%.2d:%.2d %d",
+    g_DayNames[BrokenUpTime.tm_wday], g_MonthNames[BrokenUpTime.tm_mon],
+    BrokenUpTime.tm_mday, BrokenUpTime.tm_hour, BrokenUpTime.tm_min,
+    BrokenUpTime.tm_sec, BrokenUpTime.tm_year + 1900);
+}
+
+
+/* parsedate() gets its local time conversions from here too, through a
+parsedate context, which also makes it reentrant. */
+
+static struct tm *ParseDateLocalTime (const time_t *pTime,
+  struct tm *pBrokenUpTime, void *)
+{
+  CivilLocalTime (*pTime, *pBrokenUpTime);
+  return pBrokenUpTime;
+}
+
+static time_t ParseDateMakeTime (struct tm *pBrokenUpTime, void *)
+{
+  return CivilMakeTime (*pBrokenUpTime);
+}
+
+static long ParseDateStandardOffset (void *)
+{
+  return CivilTimeZone ()->m_StandardOffset;
+}
+
+static const parsedate_ctx *ParseDateContext ()
+{
+  static const parsedate_time_rules Rules = {ParseDateLocalTime,
+    ParseDateMakeTime, ParseDateStandardOffset, NULL};
+  static const parsedate_ctx *pContext =
+    parsedate_ctx_create (NULL, CivilTimeZone () != NULL ? &Rules : NULL);
+  return pContext;
+}
+
+static time_t ParseDate (const char *pDateString, time_t RelativeTo)
+{
+  int Flags = 0;
+  return parsedate_r (ParseDateContext (), pDateString, RelativeTo, &Flags);
+}
 
 
 /******************************************************************************
@@ -302,10 +1118,12 @@
 typedef std::map<std::string, std::string> SettingMap;
 typedef SettingMap::iterator SettingIterator;
 
-SettingMap g_AllSettings;
+thread_local SettingMap g_AllSettings;
   /* The collection of all settings.  Initialised to some standard ones, which
   get overwritten by the settings from the user's web page, see keyword
-  "Setting" in the SavedState block of text. */
+  "Setting" in the SavedState block of text.  Like the other per-request
+  globals, each worker thread has its own copy, so simultaneous requests
+  don't see each other's data. */
 
 
 /******************************************************************************
@@ -359,10 +1177,10 @@ typedef struct ShowStruct
   };
 } ShowRecord, *ShowPointer;
 
-typedef std::map<std::string, ShowRecord> ShowMap;
+typedef std::map<std::string, ShowRecord, std::less<> > ShowMap;
 typedef ShowMap::iterator ShowIterator;
 
-ShowMap g_AllShows;
+thread_local ShowMap g_AllShows;
   /* A collection of all the uniquely named shows.  Hope the input data uses
   exactly the same name for each show! */
 
@@ -426,7 +1244,7 @@ typedef struct TravelTimeStruct TravelTimeRecord, *TravelTimePointer;
  */
 
 typedef struct VenueStruct VenueRecord, *VenuePointer;
-typedef std::map<std::string, VenueRecord> VenueMap;
+typedef std::map<std::string, VenueRecord, std::less<> > VenueMap;
 typedef VenueMap::iterator VenueIterator;
 typedef std::vector<VenueIterator> PathVector;
 
@@ -470,7 +1288,7 @@ struct VenueStruct
 
 };
 
-VenueMap g_AllVenues;
+thread_local VenueMap g_AllVenues;
   /* A collection of all the venues. */
 
 /* The less-than comparison function for sorting venues in the list of
@@ -568,8 +1386,13 @@ typedef struct EventStruct
     next event (includes buying tickets) and the start of the next event.
     Negative if you'll arrive late at the next event. */
 
+  int m_SortedIndex;
+    /* Position of this event in g_EventsSortedByTimeAndShow, which is also
+    its number in compact checkbox names. */
+
   EventStruct () : m_IsSelectedByUser(false), m_IsConflicting(false),
-    m_TravelTimeToNextEvent(-1), m_SpareTimeBeforeNextEvent(0)
+    m_TravelTimeToNextEvent(-1), m_SpareTimeBeforeNextEvent(0),
+    m_SortedIndex(0)
   {};
 
 } EventRecord, *EventPointer;
@@ -577,11 +1400,11 @@ typedef struct EventStruct
 typedef std::map<EventKeyStruct, EventRecord, EventKeyStruct> EventMap;
 typedef EventMap::iterator EventIterator;
 
-EventMap g_AllEvents;
+thread_local EventMap g_AllEvents;
   /* A collection of all the events, indexed by time and venue. */
 
 typedef std::vector<EventIterator> SortedEventVector;
-SortedEventVector g_EventsSortedByTimeAndShow;
+thread_local SortedEventVector g_EventsSortedByTimeAndShow;
   /* A list of all the events sorted by time and show.  The natural order of
   time and venue just doesn't read right when you're looking through a list, so
   we'll use this ordering when printing Human readable output. */
@@ -618,7 +1441,9 @@ struct StatisticsStruct
     m_TotalSecondsWatched(0)
   {};
 
-} g_Statistics;
+};
+
+thread_local StatisticsStruct g_Statistics;
 
 
 /******************************************************************************
@@ -627,6 +1452,12 @@ struct StatisticsStruct
 
 struct CommonUserSettingsStruct
 {
+  bool m_CompactCheckboxNames;
+    /* Name the event and show checkboxes on the edit form with short numbers
+    ("E12" rather than "Event,1403999400,Some Long Venue Name"), which makes
+    the web page and the form data sent back much smaller.  The numbering is
+    checked with the CatalogFingerprint hidden field. */
+
   int m_DefaultShowDuration;
     /* Duration of a show if not otherwise specified, converted from the user
     setting to be in seconds. */
@@ -662,7 +1493,9 @@ struct CommonUserSettingsStruct
   double m_WalkingSpeed;
     /* Walking speed from the user setting, converted to metres per second. */
 
-} g_CommonUserSettings;
+};
+
+thread_local CommonUserSettingsStruct g_CommonUserSettings;
 
 
 /******************************************************************************
@@ -670,36 +1503,81 @@ struct CommonUserSettingsStruct
  * Update Schedule button on the web page.
  */
 
-char *g_InputFormText;
+thread_local char *g_InputFormText;
   /* The state of the form on the web page, as received from the web browser
-  POST command's encoded data.  Will be overwritten with the equivalent decoded
-  text and those in-place strings are then referenced by the collection of
-  form name and value pairs. */
+  POST command's encoded data and decoded by the network code as it arrived
+  (see DecodeFormInput()), each name and value followed by a NUL.  Those
+  in-place strings are then referenced by the collection of form name and
+  value pairs. */
 
-struct CompareCharStruct
+struct HashCharStruct
 {
-  bool operator() ( /* Our less-than comparison function for sorting. */
+  size_t operator() ( /* Our hash function, body is after HashBytes(). */
+    const char * Item) const;
+
+  bool operator() ( /* Our equality comparison function. */
     const char * ItemA,
     const char * ItemB) const
   {
-    return (strcmp (ItemA, ItemB) < 0);
+    return (strcmp (ItemA, ItemB) == 0);
   };
 };
 
-typedef std::map<char *, const char *, CompareCharStruct> FormNameToValuesMap;
+typedef std::unordered_map<char *, const char *, HashCharStruct,
+  HashCharStruct> FormNameToValuesMap;
 
-FormNameToValuesMap g_FormNameValuePairs;
+thread_local FormNameToValuesMap g_FormNameValuePairs;
   /* The form input data decoded and broken up into name and value pairs.
   Usually one pair for each of the form elements, except checkboxes which are
   simply missing if not selected.  The actual strings are stored in
-  g_InputFormText. */
+  g_InputFormText.  The event and show checkboxes, of which there are
+  hundreds, are kept separately in g_EventCheckboxes and g_ShowCheckboxes. */
+
+struct EventCheckboxKeyStruct
+{
+  time_t m_EventTime;
+    /* The time from the checkbox name, "Event,<time>,<venue name>". */
+
+  const char *m_pVenueName;
+    /* Points to the venue name at the end of the checkbox name, in
+    g_InputFormText. */
+
+  size_t operator() ( /* Our hash function, body is after HashBytes(). */
+    const EventCheckboxKeyStruct &Item) const;
+
+  bool operator== (const EventCheckboxKeyStruct &Item) const
+  {
+    return (m_EventTime == Item.m_EventTime &&
+      strcmp (m_pVenueName, Item.m_pVenueName) == 0);
+  };
+};
+
+typedef std::unordered_map<EventCheckboxKeyStruct, const char *,
+  EventCheckboxKeyStruct> EventCheckboxMap;
+
+thread_local EventCheckboxMap g_EventCheckboxes;
+  /* The event checkboxes from the form, with the names already parsed into
+  time and venue so they can be matched up with events in a single pass.
+  The value is "On" for a selected event, unselected ones are missing. */
+
+thread_local FormNameToValuesMap g_ShowCheckboxes;
+  /* The favourite show checkboxes from the form, indexed by the show name
+  (the part of "Show,<show name>" after the comma). */
+
+typedef std::vector<std::pair<size_t, const char *> > CompactCheckboxVector;
+
+thread_local CompactCheckboxVector g_CompactEventCheckboxes;
+thread_local CompactCheckboxVector g_CompactShowCheckboxes;
+  /* Checkboxes using the compact names, "E<number>" and "S<number>", with
+  the number and the value.  Only meaningful if the CatalogFingerprint sent
+  with them matches the current events and shows. */
 
 
 /******************************************************************************
  * Miscellaneous other global variables, shouldn't be too many.
  */
 
-static std::string g_HostNameURLFragment;
+static thread_local std::string g_HostNameURLFragment;
   /* Name of this computer as the user's browser sees it, with URL text prefix.
   Will usually be "http://www.agmsmith.ca" or maybe a LAN IP address for local
   testing.  If something is wrong, an empty string is used.  Prepended to the
@@ -709,6 +1587,503 @@ static std::string g_HostNameURLFragment;
   page. */
 
 
+/******************************************************************************
+ * Fast hashing, using the XXH64 algorithm by Yann Collet (from the BSD
+ * licensed xxHash library, reimplemented here to avoid another dependency).
+ * Used to identify the submitted form state, so repeated identical requests
+ * can be recognised without redoing all the work.  Not cryptographic, just
+ * fast and well distributed.
+ */
+
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t RotateLeft64 (uint64_t Value, int Bits)
+{
+  return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+
+static inline uint64_t ReadLittleEndian64 (const unsigned char *pBytes)
+{
+  uint64_t Value = 0;
+  for (int i = 7; i >= 0; i--)
+    Value = (Value << 8) | pBytes[i];
+  return Value;
+}
+
+
+static inline uint64_t HashRound64 (uint64_t Accumulator, uint64_t Input)
+{
+  Accumulator += Input * XXH_PRIME64_2;
+  Accumulator = RotateLeft64 (Accumulator, 31);
+  return Accumulator * XXH_PRIME64_1;
+}
+
+
+static inline uint64_t HashMergeRound64 (uint64_t Accumulator, uint64_t Value)
+{
+  Accumulator ^= HashRound64 (0, Value);
+  return Accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+/* Returns the XXH64 hash of the given bytes.  Hashes of several pieces of data
+can be chained by using the previous hash as the seed for the next piece. */
+
+uint64_t HashBytes (const void *pData, size_t Length, uint64_t Seed)
+{
+  const unsigned char *pBytes = (const unsigned char *) pData;
+  const unsigned char *pEnd = pBytes + Length;
+  uint64_t Hash;
+
+  if (Length >= 32)
+  {
+    uint64_t V1 = Seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t V2 = Seed + XXH_PRIME64_2;
+    uint64_t V3 = Seed;
+    uint64_t V4 = Seed - XXH_PRIME64_1;
+
+    do
+    {
+      V1 = HashRound64 (V1, ReadLittleEndian64 (pBytes));
+      V2 = HashRound64 (V2, ReadLittleEndian64 (pBytes + 8));
+      V3 = HashRound64 (V3, ReadLittleEndian64 (pBytes + 16));
+      V4 = HashRound64 (V4, ReadLittleEndian64 (pBytes + 24));
+      pBytes += 32;
+    } while (pEnd - pBytes >= 32);
+
+    Hash = RotateLeft64 (V1, 1) + RotateLeft64 (V2, 7) +
+      RotateLeft64 (V3, 12) + RotateLeft64 (V4, 18);
+    Hash = HashMergeRound64 (Hash, V1);
+    Hash = HashMergeRound64 (Hash, V2);
+    Hash = HashMergeRound64 (Hash, V3);
+    Hash = HashMergeRound64 (Hash, V4);
+  }
+  else
+    Hash = Seed + XXH_PRIME64_5;
+
+  Hash += Length;
+
+  while (pEnd - pBytes >= 8)
+  {
+    Hash ^= HashRound64 (0, ReadLittleEndian64 (pBytes));
+    Hash = RotateLeft64 (Hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    pBytes += 8;
+  }
+  if (pEnd - pBytes >= 4)
+  {
+    uint64_t Word = (uint64_t) pBytes[0] | ((uint64_t) pBytes[1] << 8) |
+      ((uint64_t) pBytes[2] << 16) | ((uint64_t) pBytes[3] << 24);
+    Hash ^= Word * XXH_PRIME64_1;
+    Hash = RotateLeft64 (Hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    pBytes += 4;
+  }
+  while (pBytes < pEnd)
+  {
+    Hash ^= (*pBytes++) * XXH_PRIME64_5;
+    Hash = RotateLeft64 (Hash, 11) * XXH_PRIME64_1;
+  }
+
+  Hash ^= Hash >> 33;
+  Hash *= XXH_PRIME64_2;
+  Hash ^= Hash >> 29;
+  Hash *= XXH_PRIME64_3;
+  Hash ^= Hash >> 32;
+  return Hash;
+}
+
+
+/* Hash functions for the form data collections, declared with their
+structures before HashBytes() existed. */
+
+size_t HashCharStruct::operator() (const char * Item) const
+{
+  return HashBytes (Item, strlen (Item), 0);
+}
+
+size_t EventCheckboxKeyStruct::operator() (
+  const EventCheckboxKeyStruct &Item) const
+{
+  return HashBytes (Item.m_pVenueName, strlen (Item.m_pVenueName),
+    (uint64_t) Item.m_EventTime);
+}
+
+
+/* Hash everything that goes into making the web page: the decoded form
+fields (the SavedState and all the form controls), the host name used in the
+form's URL, and the version of this program.  Identical hashes should give
+identical web pages, other than the time stamps.  The decoded form text has a
+NUL after each name and value, so moving text between them changes the hash.
+Since the hash tables of form pairs have no useful order, the text is hashed
+as it arrived, in the order the browser sent the fields. */
+
+uint64_t ComputeStateHash (const std::string &FormText)
+{
+  static const char VERSION_TEXT[] =
+    "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
+    __DATE__ " " __TIME__;
+  uint64_t Hash;
+
+  Hash = HashBytes (VERSION_TEXT, sizeof (VERSION_TEXT), 0);
+  Hash = HashBytes (g_HostNameURLFragment.c_str (),
+    g_HostNameURLFragment.size () + 1, Hash);
+  Hash = HashBytes (FormText.data (), FormText.size (), Hash);
+  return Hash;
+}
+
+
+/* See if an entity tag is in the list from an If-None-Match header, which is
+a comma separated list of quoted tags, possibly marked weak with a "W/" prefix
+(which we ignore, since weak comparison is used for If-None-Match).  A "*"
+doesn't count as a match, the page is always made fresh for that. */
+
+bool EntityTagListMatches (const char *pTagList, const std::string &Tag)
+{
+  if (pTagList == NULL)
+    return false;
+
+  std::string List (pTagList);
+  size_t Start = 0;
+  while (Start < List.size ())
+  {
+    size_t End = List.find (',', Start);
+    if (End == std::string::npos)
+      End = List.size ();
+    size_t ItemStart = List.find_first_not_of (" \t", Start);
+    size_t ItemEnd = List.find_last_not_of (" \t", End - 1);
+    Start = End + 1;
+    if (ItemStart == std::string::npos || ItemStart > ItemEnd ||
+    ItemEnd >= End)
+      continue;
+    if (List.compare (ItemStart, 2, "W/") == 0)
+      ItemStart += 2;
+    std::string Item (List, ItemStart, ItemEnd + 1 - ItemStart);
+    if (Item == Tag)
+      return true;
+  }
+  return false;
+}
+
+
+/******************************************************************************
+ * Class holding one request from the web server, and our response to it.
+ * The network code fills in the CGI parameters and the POSTed form data, then
+ * hands it to a worker thread, which runs mainloop() to append the web page to
+ * the output text, then it goes back to the network code to be sent to the
+ * web server.
+ */
+
+const int MAX_CONTENT_LENGTH = 50000000;
+  /* Should be big enough for the largest Fringe show, but not so large that
+  it will cause an out of memory problem (max 800MB user space in BeOS, minus
+  overhead of web server). */
+
+typedef std::map<std::string, std::string> ParameterMap;
+
+struct FormDecoderStruct
+{
+  std::string m_FormText;
+    /* The decoded form data so far, each name and value followed by a NUL.
+    Usually a lot smaller than the encoded data, since every tab and line end
+    in the SavedState is sent as three bytes. */
+
+  size_t m_BytesWanted;
+    /* How many more bytes of encoded form data we'll accept, from the
+    CONTENT_LENGTH parameter.  Excess is ignored. */
+
+  size_t m_FieldStart;
+    /* Where the name or value being decoded starts in m_FormText. */
+
+  bool m_InValue;
+    /* True if decoding a value, false if decoding a name. */
+
+  bool m_HaveName;
+    /* The name being decoded isn't empty.  Pairs with empty names are
+    ignored. */
+
+  bool m_SkipValue;
+    /* Ignoring the rest of this value, since its name was empty. */
+
+  bool m_FieldTruncated;
+    /* Decoded a NUL, which ends the name or value early. */
+
+  bool m_Finished;
+    /* Reached the end of the form data, or a NUL byte in a name which also
+    ends it. */
+
+  int m_PendingCount;
+  char m_PendingDigit;
+    /* A "%" hex code split between chunks of input.  Count is 1 after the
+    "%", 2 after the first hex digit. */
+
+  char m_PreviousLineEnd;
+    /* CR or LF if that was the last decoded letter, for merging CRLF or LFCR
+    into one LF. */
+
+  FormDecoderStruct () : m_BytesWanted(MAX_CONTENT_LENGTH), m_FieldStart(0),
+    m_InValue(false), m_HaveName(false), m_SkipValue(false),
+    m_FieldTruncated(false), m_Finished(false), m_PendingCount(0),
+    m_PendingDigit(0), m_PreviousLineEnd(0)
+  {};
+};
+
+enum RequestPriority
+{
+  PRIORITY_PRINT = 0,
+    /* Printable schedule requests, cheap and usually from someone on their
+    phone about to go into a show, so they go first. */
+  PRIORITY_NORMAL,
+    /* Regular updates of the schedule editing form. */
+  PRIORITY_HEAVY,
+    /* Unusually large requests, which take a while, so they go last. */
+  PRIORITY_MAX
+};
+
+struct RequestStruct
+{
+  uint64_t m_ConnectionSerial;
+    /* Identifies the network connection the request came in on, so the reply
+    can go back the same way.  A serial number rather than a pointer since the
+    connection may be closed while a worker thread is busy with the request. */
+
+  int m_RequestID;
+    /* FastCGI request ID number, chosen by the web server.  Several requests
+    can be in progress on the same connection, each with a different ID. */
+
+  bool m_KeepConnection;
+    /* True if the web server wants the connection kept open after this
+    request is done (the FCGI_KEEP_CONN flag), false to close it. */
+
+  ParameterMap m_Parameters;
+    /* CGI parameters (HTTP_HOST, CONTENT_LENGTH and so on) from the web
+    server, replacing what would have been environment variables for a plain
+    CGI program. */
+
+  std::string m_ParameterText;
+    /* Raw encoded parameters, collected until the web server has sent them
+    all, then decoded into m_Parameters. */
+
+  FormDecoderStruct m_FormDecoder;
+    /* The form data POSTed by the web browser, the CGI standard input,
+    decoded as it arrives. */
+
+  std::string m_OutputText;
+    /* Our response, CGI headers followed by the web page. */
+
+  int m_ExitStatus;
+    /* Return code from mainloop(), passed back to the web server. */
+
+  double m_WallClockDeadline;
+    /* When the web browser will have given up on us, as CLOCK_MONOTONIC
+    seconds.  Counted from when the request was received, so time spent
+    waiting in the queue counts too.  Zero for no limit. */
+
+  RequestPriority m_Priority;
+    /* Which waiting queue the request goes in, see ClassifyRequest(). */
+
+  uint64_t m_StateHash;
+    /* Hash of the decoded form state, see ComputeStateHash().  Also sent as
+    the ETag of the web page.  Zero until mainloop() has decoded the form. */
+
+  uint64_t m_CacheKey;
+  std::shared_ptr<const std::string> m_pCacheKeyText;
+    /* Identifies the response in the response cache and among the requests
+    in progress, or zero if it shouldn't be cached or shared.  The key is a
+    hash of the key text, which has everything that went into it.  See
+    ComputeResponseCacheKey(). */
+
+  bool m_TooSlow;
+    /* The request ran out of time and got an error page, which shouldn't be
+    cached. */
+
+  std::shared_ptr<std::string> m_pSharedOutputText;
+    /* Our response when it's shared with the response cache, used instead of
+    m_OutputText if not NULL. */
+
+  RequestStruct () : m_ConnectionSerial(0), m_RequestID(0),
+    m_KeepConnection(false), m_ExitStatus(0), m_WallClockDeadline(0),
+    m_Priority(PRIORITY_NORMAL), m_StateHash(0), m_CacheKey(0),
+    m_TooSlow(false)
+  {};
+};
+
+static thread_local RequestStruct *g_pCurrentRequest;
+  /* The request this thread is currently working on.  NULL when the thread
+  is between requests. */
+
+
+/******************************************************************************
+ * Look up a CGI parameter of the current request.  Returns NULL if it doesn't
+ * exist, like getenv() did back when this was a plain CGI program.
+ */
+
+const char *GetRequestParameter (const char *pName)
+{
+  ParameterMap::iterator iParameter;
+
+  iParameter = g_pCurrentRequest->m_Parameters.find (pName);
+  if (iParameter == g_pCurrentRequest->m_Parameters.end ())
+    return NULL;
+  return iParameter->second.c_str ();
+}
+
+
+/******************************************************************************
+ * Formatted printing to the web browser, appended to the output text of the
+ * request this thread is working on.  Used instead of printf, since several
+ * worker threads are generating web pages at the same time.  The network code
+ * sends the text to the web server once the whole page has been generated.
+ */
+
+__attribute__ ((format (printf, 1, 2)))
+int WebPrintf (const char *pFormat, ...)
+{
+  va_list ArgumentList;
+  char Buffer[1024];
+  int ReturnCode;
+  std::string &OutputText = g_pCurrentRequest->m_OutputText;
+
+  va_start (ArgumentList, pFormat);
+  ReturnCode = vsnprintf (Buffer, sizeof (Buffer), pFormat, ArgumentList);
+  va_end (ArgumentList);
+  if (ReturnCode < 0)
+    return ReturnCode;
+
+  if (ReturnCode < (int) sizeof (Buffer))
+    OutputText.append (Buffer, ReturnCode);
+  else // Too big for the buffer, format it again directly into the output.
+  {
+    size_t OldSize = OutputText.size ();
+    OutputText.resize (OldSize + ReturnCode + 1);
+    va_start (ArgumentList, pFormat);
+    vsnprintf (&OutputText[OldSize], ReturnCode + 1, pFormat, ArgumentList);
+    va_end (ArgumentList);
+    OutputText.resize (OldSize + ReturnCode);
+  }
+  return ReturnCode;
+}
+
+
+/******************************************************************************
+ * Faster output for the bulk of the web page, appending text and numbers
+ * directly to the output without parsing a printf format each time.  The event
+ * listings are thousands of rows, so it adds up.
+ */
+
+void WebPutText (const char *pText, size_t Length)
+{
+  g_pCurrentRequest->m_OutputText.append (pText, Length);
+}
+
+
+void WebPutText (const char *pText)
+{
+  g_pCurrentRequest->m_OutputText.append (pText);
+}
+
+
+void WebPutText (const std::string &Text)
+{
+  g_pCurrentRequest->m_OutputText.append (Text);
+}
+
+
+void WebPutInt (long Number)
+{
+  char Digits[24];
+  char *pDigit = Digits + sizeof (Digits);
+  unsigned long Magnitude =
+    (Number < 0) ? 0UL - (unsigned long) Number : (unsigned long) Number;
+
+  do
+  {
+    *--pDigit = '0' + Magnitude % 10;
+    Magnitude /= 10;
+  } while (Magnitude != 0);
+  if (Number < 0)
+    *--pDigit = '-';
+  WebPutText (pDigit, Digits + sizeof (Digits) - pDigit);
+}
+
+
+/******************************************************************************
+ * Request deadlines.  Generating a web page shouldn't take long, but a huge or
+ * weird SavedState could make it take ages, tying up a worker thread long
+ * after the web browser has given up.  So the time is checked between the
+ * major phases of work (and now and then in the path search loop), and if
+ * either the elapsed time or the thread's CPU time is over the limit, the
+ * remaining work is skipped and an error page is sent instead.
+ */
+
+struct RequestDeadlineStruct
+{
+  double m_WallClockDeadline;
+    /* CLOCK_MONOTONIC time in seconds to give up at, zero for no limit. */
+
+  double m_CPUDeadline;
+    /* Thread CPU time in seconds to give up at, zero for no limit. */
+
+  int m_CheckCounter;
+    /* Counts calls to RequestDeadlineExpiredOccasionally(). */
+
+  bool m_HasExpired;
+    /* Once expired, stays expired for the rest of the request. */
+};
+
+static thread_local RequestDeadlineStruct g_RequestDeadline;
+
+const char REQUEST_TOO_SLOW_TEXT[] =
+  "Status: 503 Service Unavailable\r\n"
+  "Retry-After: 30\r\n"
+  "Content-Type: text/html\r\n\r\n"
+  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
+  "<HTML><HEAD><TITLE>FFVSO - Took Too Long</TITLE></HEAD>\n"
+  "<BODY><H1>Took Too Long</H1>\n"
+  "<P>Sorry, working on your schedule took too long, probably because the "
+  "server is very busy.  Please go back and try again in a little while.\n"
+  "</BODY></HTML>\n";
+
+
+double GetClockSeconds (clockid_t ClockID)
+{
+  struct timespec Time;
+
+  clock_gettime (ClockID, &Time);
+  return Time.tv_sec + Time.tv_nsec / 1000000000.0;
+}
+
+
+bool RequestDeadlineExpired ()
+{
+  RequestDeadlineStruct &Deadline = g_RequestDeadline;
+
+  if (Deadline.m_HasExpired)
+    return true;
+  if (Deadline.m_WallClockDeadline > 0 &&
+  GetClockSeconds (CLOCK_MONOTONIC) > Deadline.m_WallClockDeadline)
+    Deadline.m_HasExpired = true;
+  else if (Deadline.m_CPUDeadline > 0 &&
+  GetClockSeconds (CLOCK_THREAD_CPUTIME_ID) > Deadline.m_CPUDeadline)
+    Deadline.m_HasExpired = true;
+  return Deadline.m_HasExpired;
+}
+
+
+/* For use in inner loops, only actually reads the clocks every 64th call since
+the thread CPU time is a system call. */
+
+bool RequestDeadlineExpiredOccasionally ()
+{
+  if ((++g_RequestDeadline.m_CheckCounter & 63) != 0)
+    return g_RequestDeadline.m_HasExpired;
+  return RequestDeadlineExpired ();
+}
+
+
 /******************************************************************************
  * Settings which are always updated, overwriting old values from the form.
  * Set the setting for the last update time to the current time and also update
@@ -719,9 +2094,11 @@ void ResetDynamicSettings ()
 {
   time_t TimeNow;
   struct tm BrokenUpTime;
+  char TimeString[60];
   time(&TimeNow);
-  localtime_r (&TimeNow, &BrokenUpTime);
-  g_AllSettings["LastUpdateTime"].assign (asctime (&BrokenUpTime), 24);
+  CivilLocalTime (TimeNow, BrokenUpTime);
+  FormatFullTime (BrokenUpTime, TimeString, sizeof (TimeString));
+  g_AllSettings["LastUpdateTime"] = TimeString;
 
   g_AllSettings["Version"] =
     "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
@@ -739,6 +2116,7 @@ void InitialiseDefaultSettings ()
 {
   /* System level settings.  Usually not changed by the user. */
 
+  g_AllSettings["CompactCheckboxNames"] = "0";
   g_AllSettings["DefaultShowDuration"] = "60";
   g_AllSettings["HTMLAlreadyPickedInPastBegin"] = "<FONT COLOR=\"SILVER\">";
   g_AllSettings["HTMLAlreadyPickedInPastEnd"] = "</FONT>";
@@ -772,125 +2150,378 @@ void InitialiseDefaultSettings ()
 
 
 /******************************************************************************
- * Convert the given string from Form URL Encoded to plain text.  That means
- * replacing all "%xy" codes (byte hex encoded) with the corresponding hex
- * character, and "+" with a space.  Then run through the text again and
- * replace CRLF or plain CR with just LF, our standard end of line character.
+ * Decode form data from Form URL Encoded to plain text as it arrives from the
+ * web browser, a chunk at a time, so we don't have to hold the encoded and
+ * decoded copies of a big SavedState at the same time.  The form data is a
+ * name followed by an equals sign, followed by the value, followed by an
+ * ampersand and then the next name and value etc.  Each name and value is
+ * decoded by replacing all "%xy" codes (byte hex encoded) with the
+ * corresponding hex character, and "+" with a space.  CRLF or plain CR are
+ * replaced with just LF, our standard end of line character.  Pairs with an
+ * empty name are ignored, as is a name at the end without a value.
  */
 
-void FormEncodedToPlainText (char *pBuffer)
+static int HexDigitValue (char Letter)
+{
+  if (Letter >= '0' && Letter <= '9')
+    return Letter - '0';
+  if (Letter >= 'a' && Letter <= 'f')
+    return Letter - 'a' + 10;
+  if (Letter >= 'A' && Letter <= 'F')
+    return Letter - 'A' + 10;
+  return -1;
+}
+
+
+/* Decoded letters are written directly into the text buffer through pDest,
+which the caller has already made long enough, rather than appending one
+letter at a time to the string.  That's most of the cost of decoding. */
+
+static inline void AppendDecodedLetter (FormDecoderStruct &Decoder,
+  char *&pDest, char Letter)
+{
+  if (Decoder.m_FieldTruncated || Decoder.m_SkipValue)
+    return;
+
+  if (Letter == 0)
+    Decoder.m_FieldTruncated = true; // Would end the string, ignore the rest.
+  else if ((Letter == '\n' && Decoder.m_PreviousLineEnd == '\r') ||
+  (Letter == '\r' && Decoder.m_PreviousLineEnd == '\n'))
+    Decoder.m_PreviousLineEnd = 0; // Second half of CRLF or LFCR.
+  else if (Letter == '\r' || Letter == '\n')
+  {
+    *pDest++ = '\n';
+    Decoder.m_PreviousLineEnd = Letter;
+  }
+  else
+  {
+    *pDest++ = Letter;
+    Decoder.m_PreviousLineEnd = 0;
+  }
+}
+
+
+/* Letters which need more than copying while decoding.  Most of a SavedState
+is plain text with an encoded tab, space or line end every half dozen letters,
+too short a run for SIMD scanning to pay off, a byte at a time measured
+faster. */
+
+static inline bool IsFormSpecialLetter (char Letter)
+{
+  switch (Letter)
+  {
+    case '%': case '+': case '=': case '&': case '\r': case '\n': case 0:
+      return true;
+  }
+  return false;
+}
+
+
+/* A "%" which turned out not to be followed by two hex digits is just a
+percent sign. */
+
+static void FlushPendingPercent (FormDecoderStruct &Decoder, char *&pDest)
+{
+  if (Decoder.m_PendingCount >= 1)
+    AppendDecodedLetter (Decoder, pDest, '%');
+  if (Decoder.m_PendingCount >= 2)
+    AppendDecodedLetter (Decoder, pDest, Decoder.m_PendingDigit);
+  Decoder.m_PendingCount = 0;
+}
+
+
+static void EndFormField (FormDecoderStruct &Decoder, const char *pBase,
+  char *&pDest, bool StartValue)
+{
+  FlushPendingPercent (Decoder, pDest);
+  if (StartValue && !Decoder.m_HaveName)
+    Decoder.m_SkipValue = true;
+  else if (!Decoder.m_SkipValue)
+    *pDest++ = 0;
+  else
+    Decoder.m_SkipValue = false;
+
+  Decoder.m_FieldStart = pDest - pBase;
+  Decoder.m_InValue = StartValue;
+  Decoder.m_HaveName = false;
+  Decoder.m_FieldTruncated = false;
+  Decoder.m_PreviousLineEnd = 0;
+}
+
+
+static void EndFormInput (FormDecoderStruct &Decoder, const char *pBase,
+  char *&pDest)
+{
+  Decoder.m_Finished = true;
+
+  if (Decoder.m_InValue)
+    EndFormField (Decoder, pBase, pDest, false);
+  else // Name without a value, throw it away.
+  {
+    Decoder.m_PendingCount = 0;
+    pDest = (char *) pBase + Decoder.m_FieldStart;
+  }
+}
+
+
+void FinishFormInput (FormDecoderStruct &Decoder)
+{
+  if (Decoder.m_Finished)
+    return;
+
+  // Room for a pending percent code and the final NUL.
+
+  std::string &FormText = Decoder.m_FormText;
+  size_t OldSize = FormText.size ();
+  FormText.resize (OldSize + 3);
+  char *pBase = &FormText[0];
+  char *pDest = pBase + OldSize;
+  EndFormInput (Decoder, pBase, pDest);
+  FormText.resize (pDest - pBase);
+}
+
+
+void DecodeFormInput (FormDecoderStruct &Decoder, const char *pInput,
+  size_t Length)
 {
-  char *pDest;
+  const char *pEnd;
   char Letter;
-  char *pSource;
 
-  pSource = pDest = pBuffer;
-  while ((Letter = *pSource++) != 0)
+  if (Length > Decoder.m_BytesWanted)
+    Length = Decoder.m_BytesWanted;
+  Decoder.m_BytesWanted -= Length;
+  if (Length == 0 || Decoder.m_Finished)
+    return;
+
+  // Decoding never makes the text longer, other than letters held over from
+  // a percent code split across the previous chunk, and a NUL.
+
+  std::string &FormText = Decoder.m_FormText;
+  size_t OldSize = FormText.size ();
+  FormText.resize (OldSize + Length + 3);
+  char *pBase = &FormText[0];
+  char *pDest = pBase + OldSize;
+
+  for (pEnd = pInput + Length; pInput < pEnd && !Decoder.m_Finished; )
   {
-    if (Letter == '+') // Just a space.
+    // The usual case is a field being kept, with runs of plain letters
+    // between spaces and complete "%xy" codes.  Do those in a tight loop
+    // which doesn't touch the decoder state, since every letter written
+    // through pDest would otherwise make the compiler reload it.  Line ends,
+    // separators and anything unusual drop through to the general code.
+
+    if (Decoder.m_PendingCount == 0 && !Decoder.m_FieldTruncated &&
+    !Decoder.m_SkipValue)
     {
-      *pDest++ = ' ';
-    }
-    else if (Letter == '%') // Hex encoded byte.
-    {
-      char Hex1 = tolower (pSource[0]);
-      int Value1 = -1;
-      if (Hex1 >= '0' && Hex1 <= '9')
-        Value1 = Hex1 - '0';
-      else if (Hex1 >= 'a' && Hex1 <= 'f')
-        Value1 = Hex1 - 'a' + 10;
-
-      if (Value1 != -1) // Valid hex digit previously, also not a NUL char.
+      const char *pStart = pInput;
+      while (true)
       {
-        char Hex2 = tolower (pSource[1]);
-        int Value2 = -1;
-        if (Hex2 >= '0' && Hex2 <= '9')
-          Value2 = Hex2 - '0';
-        else if (Hex2 >= 'a' && Hex2 <= 'f')
-          Value2 = Hex2 - 'a' + 10;
-
-        if (Value2 != -1)
-          Value1 = 16 * Value1 + Value2;
-        else  // Second digit isn't hex, don't have a valid value.
-          Value1 = -1;
-      }
-      if (Value1 == -1) // Not a %xy hex sequence, or too close to end NUL.
+        while (pInput < pEnd && !IsFormSpecialLetter (*pInput))
+          *pDest++ = *pInput++;
+        if (pInput >= pEnd)
+          break;
+
+        Letter = *pInput;
+        if (Letter == '+') // Just a space.
+          Letter = ' ';
+        else if (Letter == '%' && pEnd - pInput >= 3)
+        {
+          int Value1 = HexDigitValue (pInput[1]);
+          int Value2 = HexDigitValue (pInput[2]);
+          if (Value1 < 0 || Value2 < 0)
+            break;
+          Letter = 16 * Value1 + Value2;
+          if (Letter == 0 || Letter == '\r' || Letter == '\n')
+            break;
+          pInput += 2;
+        }
+        else
+          break;
         *pDest++ = Letter;
-      else // Sucessfully decoded a hex value.
+        pInput++;
+      }
+      if (pInput != pStart)
       {
-        pSource += 2;
-        *pDest++ = Value1;
+        Decoder.m_PreviousLineEnd = 0;
+        if (!Decoder.m_InValue)
+          Decoder.m_HaveName = true;
       }
+      if (pInput >= pEnd)
+        break;
     }
-    else // Some other letter.
+    else if (Decoder.m_PendingCount == 0) // Field is being discarded.
     {
-      *pDest++ = Letter;
+      const char *pStart = pInput;
+      while (pInput < pEnd && !IsFormSpecialLetter (*pInput))
+        pInput++;
+      if (pInput != pStart && !Decoder.m_InValue)
+        Decoder.m_HaveName = true;
+      if (pInput >= pEnd)
+        break;
     }
-  }
-  *pDest = 0;
 
-  // Pass 2 - convert carriage returns and linefeeds to just linefeeds.
+    Letter = *pInput++;
 
-  pSource = pDest = pBuffer;
-  while ((Letter = *pSource++) != 0)
-  {
-    if (Letter == '\r')
-    {
-      if (*pSource == '\n')
-        pSource++; // Convert CRLF to just LF.
+    // Usually the whole "%xy" code is in this chunk of input.
 
-      *pDest++ = '\n';
-    }
-    else if (Letter == '\n')
+    if (Letter == '%' && pEnd - pInput >= 2 && Decoder.m_PendingCount == 0)
     {
-      if (*pSource == '\r')
-        pSource++; // Convert the rarer LFCR to just LF.
+      int Value1 = HexDigitValue (pInput[0]);
+      int Value2 = HexDigitValue (pInput[1]);
+      if (Value1 >= 0 && Value2 >= 0)
+      {
+        if (!Decoder.m_InValue)
+          Decoder.m_HaveName = true;
+        AppendDecodedLetter (Decoder, pDest, 16 * Value1 + Value2);
+        pInput += 2;
+        continue;
+      }
+    }
 
-      *pDest++ = '\n';
+    if (Decoder.m_PendingCount > 0)
+    {
+      int Value = HexDigitValue (Letter);
+      if (Value >= 0 && Decoder.m_PendingCount == 1)
+      {
+        Decoder.m_PendingDigit = Letter;
+        Decoder.m_PendingCount = 2;
+        continue;
+      }
+      if (Value >= 0)
+      {
+        AppendDecodedLetter (Decoder, pDest,
+          16 * HexDigitValue (Decoder.m_PendingDigit) + Value);
+        Decoder.m_PendingCount = 0;
+        continue;
+      }
+      FlushPendingPercent (Decoder, pDest); // Not hex, use letter normally.
     }
+
+    // A NUL byte isn't valid in encoded data, but it ends a value like an
+    // ampersand, and ends all the data if in a name.
+
+    if (!Decoder.m_InValue && Letter == '=')
+      EndFormField (Decoder, pBase, pDest, true);
+    else if (Decoder.m_InValue && (Letter == '&' || Letter == 0))
+      EndFormField (Decoder, pBase, pDest, false);
+    else if (Letter == 0)
+      EndFormInput (Decoder, pBase, pDest);
     else
-      *pDest++ = Letter;
+    {
+      if (!Decoder.m_InValue)
+        Decoder.m_HaveName = true;
+      if (Letter == '+') // Just a space.
+        AppendDecodedLetter (Decoder, pDest, ' ');
+      else if (Letter == '%') // Hex encoded byte, maybe.
+        Decoder.m_PendingCount = 1;
+      else
+        AppendDecodedLetter (Decoder, pDest, Letter);
+    }
   }
-  *pDest = 0;
+
+  FormText.resize (pDest - pBase);
 }
 
 
 /******************************************************************************
- * Break the form input data into pairs of name and associated value.  Also
- * decodes the text.  Overwrites the global g_InputFormText with the decoded
- * text, also adding NUL bytes after each name and value.  The format is a name
- * followed by an equals sign, followed by the value, followed by an ampersand
- * and then the next name and value etc.  Last one has an end of string NUL at
- * the end instead of an ampersand.
+ * Break the decoded form input data into pairs of name and associated value.
+ * Points the global g_InputFormText at the decoded text, which has a NUL after
+ * each name and value, and the pairs then point into it.  If a name is
+ * repeated, the first one wins.  Event and show checkbox names are parsed
+ * into keys here and stored separately, so they don't have to be rebuilt as
+ * strings for every event and show when looking for them later.
  */
 
-void BuildFormNameAndValuePairsFromFormInput ()
+/* Parses the part of an event checkbox name after "Event,", which is the time
+as written by "%ld", a comma, and the venue name.  Returns false if it isn't
+exactly in that form, so it wouldn't have matched any event anyway. */
+
+bool ParseEventCheckboxName (const char *pText, EventCheckboxKeyStruct &Key)
 {
-  char *pName;
-  char *pSource;
-  char *pValue;
+  const char *pDigits;
+  char *pAfterNumber;
+  long Number;
+
+  pDigits = pText;
+  if (*pDigits == '-')
+    pDigits++;
+  if (*pDigits < '0' || *pDigits > '9')
+    return false; // Also rules out spaces and "+", which strtol accepts.
+  if (*pDigits == '0' && (pDigits[1] != ',' || pDigits != pText))
+    return false; // Leading zeroes or "-0" are never written.
+
+  errno = 0;
+  Number = strtol (pText, &pAfterNumber, 10);
+  if (errno != 0 || *pAfterNumber != ',')
+    return false;
 
-  pSource = g_InputFormText;
-  while (*pSource != 0)
+  Key.m_EventTime = Number;
+  Key.m_pVenueName = pAfterNumber + 1;
+  return true;
+}
+
+
+/* Parses the number in a compact checkbox name, after the "E" or "S".  Only
+accepts what the edit form writes, plain digits without leading zeroes. */
+
+bool ParseCompactCheckboxNumber (const char *pText, size_t &Number)
+{
+  const char *pDigit;
+
+  if (*pText == '0' && pText[1] != 0)
+    return false;
+
+  Number = 0;
+  for (pDigit = pText; *pDigit >= '0' && *pDigit <= '9'; pDigit++)
   {
-    pName = pSource;
-    while (*pSource != '=' && *pSource != 0)
-      pSource++;
-    if (*pSource == 0)
-      break; // Malformed pair, no value portion.
-    *pSource++ = 0; // Terminate name portion of the string.
+    if (pDigit - pText >= 9)
+      return false; // Far more than the number of events.
+    Number = Number * 10 + (*pDigit - '0');
+  }
+  return (pDigit != pText && *pDigit == 0);
+}
 
-    pValue = pSource;
-    while (*pSource != '&' && *pSource != 0)
-      pSource++;
-    *pSource++ = 0; // Terminate value portion of the string.
 
-    if (*pName != 0) // Ignore empty names.
+void BuildFormNameAndValuePairsFromFormInput ()
+{
+  EventCheckboxKeyStruct EventKey;
+  size_t CheckboxNumber;
+  std::string &FormText = g_pCurrentRequest->m_FormDecoder.m_FormText;
+  char *pEnd;
+  char *pName;
+  char *pValue;
+
+  g_InputFormText = &FormText[0];
+  pEnd = g_InputFormText + FormText.size ();
+  for (pName = g_InputFormText; pName < pEnd;
+  pName = pValue + strlen (pValue) + 1)
+  {
+    pValue = pName + strlen (pName) + 1;
+    if (pValue >= pEnd)
+      break; // Shouldn't happen, the decoder always makes pairs.
+
+    if (strncmp (pName, "Event,", 6) == 0 &&
+    ParseEventCheckboxName (pName + 6, EventKey))
+    {
+      EventCheckboxMap::value_type NewPair (EventKey, pValue);
+      g_EventCheckboxes.insert (NewPair);
+    }
+    else if (strncmp (pName, "Show,", 5) == 0)
+    {
+      FormNameToValuesMap::value_type NewPair (pName + 5, pValue);
+      g_ShowCheckboxes.insert (NewPair);
+    }
+    else if (pName[0] == 'E' &&
+    ParseCompactCheckboxNumber (pName + 1, CheckboxNumber))
+      g_CompactEventCheckboxes.push_back (
+        CompactCheckboxVector::value_type (CheckboxNumber, pValue));
+    else if (pName[0] == 'S' &&
+    ParseCompactCheckboxNumber (pName + 1, CheckboxNumber))
+      g_CompactShowCheckboxes.push_back (
+        CompactCheckboxVector::value_type (CheckboxNumber, pValue));
+    else
     {
-      FormEncodedToPlainText (pName);
-      FormEncodedToPlainText (pValue);
       FormNameToValuesMap::value_type NewPair (pName, pValue);
-
       g_FormNameValuePairs.insert (NewPair);
     }
   }
@@ -917,2012 +2548,5906 @@ void BuildFormNameAndValuePairsFromFormInput ()
  *
  * The keywords are used for storing extra information.  See near the end of
  * WriteHTMLForm() for their documentation.
+ *
+ * The fields are views into the caller's buffer rather than copies, so the
+ * only memory allocated is for new show and venue names and the few other
+ * things which are kept.
  */
 
-void LoadStateInformation (const char *pBuffer)
+enum StateKeywordEnum
 {
-  // Set the running date to be the current time in the current year, in case
-  // they specify events without mentioning the year.  Not set to January 1st,
-  // since that may specify a different daylight savings time than the current
-  // time (which is more likely to be around when the festival starts), which
-  // makes the first time input parsed be off by an hour.
-
-  struct tm BrokenUpDate;
-  time_t RunningDate;
-  time (&RunningDate);
-
-  // When reading, always consider tabs to be field separators, and optionally
-  // have '|' vertical bar as a field separator (some web browsers don't
-  // support pasting in text with tabs into a TEXTAREA).  Should be fine so
-  // long as the vertical bar isn't used in Show names or other text, and if
-  // it is a problem, a setting turns off vertical bars.
+  KEYWORD_NONE = 0, // Not a keyword, an event or a date.
+  KEYWORD_FAVOURITE,
+  KEYWORD_SELECTED,
+  KEYWORD_SETTING,
+  KEYWORD_SHOW_DURATION,
+  KEYWORD_SHOW_URL,
+  KEYWORD_TRAVEL_TIME,
+  KEYWORD_VENUE_URL
+};
 
-  bool bOnlyTab = (0 != atoi (
-    g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
+static const struct StateKeywordStruct
+{
+  std::string_view m_Name;
+  StateKeywordEnum m_Keyword;
+} g_StateKeywords[] =
+{
+  {"Favourite", KEYWORD_FAVOURITE},
+  {"Selected", KEYWORD_SELECTED},
+  {"Setting", KEYWORD_SETTING},
+  {"ShowDuration", KEYWORD_SHOW_DURATION},
+  {"ShowURL", KEYWORD_SHOW_URL},
+  {"TravelTime", KEYWORD_TRAVEL_TIME},
+  {"VenueURL", KEYWORD_VENUE_URL}
+};
 
-  const int MAX_FIELDS = 6;
-  std::string aFields[MAX_FIELDS];
+/* Most lines are events, which start with a time or a show name, so first
+check the length and first letter, which rules out nearly everything without
+comparing strings. */
 
-  const char *pSource = pBuffer;
-  while (*pSource != 0)
+StateKeywordEnum LookUpStateKeyword (std::string_view Field)
+{
+  for (const StateKeywordStruct &Keyword : g_StateKeywords)
   {
-    // Starting a new line of text, reset the field markers and start hunting
-    // for fields.
-
-    int iField;
-    for (iField = 0; iField < MAX_FIELDS; iField++)
-      aFields[iField].clear();
+    if (Field.size () == Keyword.m_Name.size () &&
+    Field[0] == Keyword.m_Name[0] && Field == Keyword.m_Name)
+      return Keyword.m_Keyword;
+  }
+  return KEYWORD_NONE;
+}
 
-    iField = 0;
-    char Letter = *pSource;
-    while (Letter != 0 && Letter != '\n')
-    {
-      // Skip leading spaces, and for the first field, also field separators
-      // (in case some e-mail software indented the text with tabs).
 
-      while (Letter == ' ' ||
-      (iField == 0 && (Letter == '\t' || (!bOnlyTab && Letter == '|'))))
-        Letter = *++pSource;
-      const char *pFieldStart = pSource;
+/* Find the show or venue with the given name, adding a new default record for
+it if it doesn't exist yet.  That's the only time the name gets copied. */
 
-      while (Letter != '\t' && Letter != '\n' && Letter != 0 &&
-      (bOnlyTab || Letter != '|'))
-        Letter = *++pSource; // Skip over the contents of the field.
+ShowIterator InternShowName (std::string_view Name)
+{
+  ShowIterator iShow = g_AllShows.lower_bound (Name);
+  if (iShow == g_AllShows.end () || iShow->first != Name)
+    iShow = g_AllShows.emplace_hint (iShow, Name, ShowRecord ());
+  return iShow;
+}
 
-      if (iField < MAX_FIELDS)
-      {
-        const char *pFieldEnd = pSource - 1;
-        while (pFieldEnd >= pFieldStart && *pFieldEnd == ' ')
-          pFieldEnd--; // Remove trailing spaces.
-        pFieldEnd++;
+VenueIterator InternVenueName (std::string_view Name)
+{
+  VenueIterator iVenue = g_AllVenues.lower_bound (Name);
+  if (iVenue == g_AllVenues.end () || iVenue->first != Name)
+    iVenue = g_AllVenues.emplace_hint (iVenue, Name, VenueRecord ());
+  return iVenue;
+}
 
-        int FieldLen = pFieldEnd - pFieldStart;
-        aFields[iField].assign (pFieldStart, FieldLen);
-      }
-      iField++;
 
-      // Leave LF and NUL alone (still in Letter) so outer loop exits.
+/* Numbers and dates are converted with the C library functions, which need a
+NUL at the end, so copy the field into a reused string buffer first. */
 
-      if (Letter == '\t' || (!bOnlyTab && Letter == '|'))
-      {
-        Letter = *++pSource;
-        pFieldStart = pSource;
-      }
-    }
-    int nFields = iField; // Keep the count of the number of fields for later.
+static int FieldToInt (std::string_view Field, std::string &Scratch)
+{
+  Scratch.assign (Field.data (), Field.size ());
+  return atoi (Scratch.c_str ());
+}
 
-    // Finished reading a line of input, now process the fields.
+/* A memo of parsedate() results.  Festival catalogs have the same few dozen
+time strings ("19:00", "20:30") thousands of times, relative to running dates
+on a handful of days, and each parse tokenises the text and converts the time.
+Results are remembered for each day of the running date, by the date text.
+That's only valid if the running date's time of day doesn't matter, so the
+first time a string is seen on a day, it's also parsed relative to the start
+and end of the day, and only remembered if all three agree ("+2 hours" won't,
+"19:00" will).  Days with a daylight saving time change aren't memoised at
+all, since the running date's DST flag leaks into the parsed time.  The memo
+lasts across requests, so it is kept small: only short strings are memoised,
+and it's all forgotten when it gets too big. */
+
+const size_t MAX_DATE_MEMO_TEXT_LENGTH = 64;
+  /* Longer strings, usually show names on lines without a date, are just
+  parsed each time and never go into the memo. */
+
+const size_t MAX_DATE_MEMO_BYTES = 256 * 1024;
+  /* Forget everything once the memo uses about this much memory, so someone
+  pasting in endless unique dates doesn't tie up memory in every worker
+  thread. */
+
+const size_t DATE_MEMO_NODE_OVERHEAD = 64;
+  /* Rough guess at the memory used by a hash table or map node, on top of
+  the contents, for adding up the memo's size. */
+
+struct DateMemoEntryStruct
+{
+  time_t m_Date;
+  bool m_DependsOnTimeOfDay;
+    /* If true, m_Date isn't used and the text is always parsed. */
+};
 
-    if (nFields > 0 && !aFields[0].empty ())
-    {
-      const char *kWrongNumberOfFields =
-        "<P><B>Wrong number of fields</B> (%d) after \"%s\" keyword,"
-        "ignoring it.\n";
+struct DateMemoDayStruct
+{
+  time_t m_DayEnd;
+    /* The day goes from its key in DateMemoDayMap up to just before this. */
 
-      // Look for keywords in the first field.
-      if (aFields[0] == "Favourite")
-      {
-        if (nFields != 2)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          // Favourite keyword is followed by a field identifying a show.
+  bool m_HasDSTChange;
+    /* The UTC offset changes during the day, nothing is memoised. */
 
-          ShowIterator iShow = g_AllShows.find (aFields[1]);
-          if (iShow != g_AllShows.end ())
-            iShow->second.m_IsFavourite = true;
-          else
-            printf ("<P><B>Unknown show name</B> \"%s\" after Favourite "
-              "keyword, ignoring it.\n", aFields[1].c_str ());
-        }
-      }
-      else if (aFields[0] == "Setting")
-      {
-        if (nFields != 3)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          // Hopefully the important settings were written near the beginning,
-          // like the one which controls parsing of tabs and vertical bars.
+  std::unordered_map<std::string, DateMemoEntryStruct> m_Dates;
+};
 
-          g_AllSettings[aFields[1]] = aFields[2];
+typedef std::map<time_t, DateMemoDayStruct> DateMemoDayMap;
 
-          bOnlyTab = (0 != atoi (
-            g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
-        }
-      }
-      else if (aFields[0] == "ShowURL")
-      {
-        if (nFields != 3)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          ShowIterator iShow = g_AllShows.find (aFields[1]);
-          if (iShow != g_AllShows.end ())
-            iShow->second.m_ShowURL.assign (aFields[2]);
-          else
-            printf ("<P><B>Unknown show name</B> \"%s\" after ShowURL "
-              "keyword, ignoring it.\n", aFields[1].c_str ());
-        }
-      }
-      else if (aFields[0] == "ShowDuration")
-      {
-        if (nFields != 3)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          ShowIterator iShow = g_AllShows.find (aFields[1]);
-          if (iShow != g_AllShows.end ())
-            iShow->second.m_ShowDuration = 60 * atoi (aFields[2].c_str ());
-          else
-            printf ("<P><B>Unknown show name</B> \"%s\" after ShowDuration "
-              "keyword, ignoring it.\n", aFields[1].c_str ());
-        }
-      }
-      else if (aFields[0] == "VenueURL")
-      {
-        if (nFields != 3)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          // If the venue isn't found, create a default record for it, so
-          // non-show venues (street corners used in path finding) can have a
-          // URL too.
+static thread_local DateMemoDayMap g_DateMemoDays;
+static thread_local size_t g_DateMemoBytes;
+  /* Approximate memory used by g_DateMemoDays. */
 
-          g_AllVenues[aFields[1]].m_VenueURL.assign (aFields[2]);
-        }
-      }
-      else if (aFields[0] == "TravelTime")
-      {
-        if (nFields < 4)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          VenueIterator iVenueFrom = g_AllVenues.find (aFields[1]);
-          if (iVenueFrom == g_AllVenues.end () && !aFields[1].empty())
-          {
-            VenueRecord NewVenue;
-            VenueMap::value_type NewVenuePair (aFields[1], NewVenue);
-            std::pair<VenueIterator, bool> InsertVenueResult (
-              g_AllVenues.insert (NewVenuePair));
-            iVenueFrom = InsertVenueResult.first;
-          }
+static std::atomic<uint64_t> g_DateMemoHits;
+static std::atomic<uint64_t> g_DateMemoMisses;
+  /* Dates found in the memo and ones on memoised days which had to be parsed,
+  counted for all threads and shown in the server statistics. */
 
-          VenueIterator iVenueTo = g_AllVenues.find (aFields[2]);
-          if (iVenueTo == g_AllVenues.end () && !aFields[2].empty())
-          {
-            VenueRecord NewVenue;
-            VenueMap::value_type NewVenuePair (aFields[2], NewVenue);
-            std::pair<VenueIterator, bool> InsertVenueResult (
-              g_AllVenues.insert (NewVenuePair));
-            iVenueTo = InsertVenueResult.first;
-          }
 
-          int Distance = atoi (aFields[3].c_str ());
+/* Finds the memo for the day the given time is in, adding it if needed. */
 
-          int WorstDelay = 0;
-          if (nFields >= 5)
-            WorstDelay = atoi (aFields[4].c_str ());
+static DateMemoDayStruct &FindDateMemoDay (time_t Time)
+{
+  DateMemoDayMap::iterator iDay = g_DateMemoDays.upper_bound (Time);
+  if (iDay != g_DateMemoDays.begin ())
+  {
+    --iDay;
+    if (Time < iDay->second.m_DayEnd)
+      return iDay->second;
+  }
 
-          const char *pNotes = "";
-          if (nFields >= 6)
-            pNotes = aFields[5].c_str ();
+  struct tm BrokenUpTime;
+  struct tm DayStartTime;
+  struct tm DayEndTime;
+  CivilLocalTime (Time, BrokenUpTime);
+  time_t DayStart = Time - (BrokenUpTime.tm_hour * 3600 +
+    BrokenUpTime.tm_min * 60 + BrokenUpTime.tm_sec);
+  time_t DayEnd = DayStart + 24 * 60 * 60;
+  time_t LastSecond = DayEnd - 1;
+  CivilLocalTime (DayStart, DayStartTime);
+  CivilLocalTime (LastSecond, DayEndTime);
+
+  DateMemoDayStruct &Day = g_DateMemoDays[DayStart];
+  g_DateMemoBytes += sizeof (DateMemoDayStruct) + DATE_MEMO_NODE_OVERHEAD;
+  Day.m_DayEnd = DayEnd;
+  Day.m_HasDSTChange =
+    DayStartTime.tm_gmtoff != BrokenUpTime.tm_gmtoff ||
+    DayEndTime.tm_gmtoff != BrokenUpTime.tm_gmtoff ||
+    DayStartTime.tm_isdst != BrokenUpTime.tm_isdst ||
+    DayEndTime.tm_isdst != BrokenUpTime.tm_isdst ||
+    DayStartTime.tm_mday != BrokenUpTime.tm_mday ||
+    DayEndTime.tm_mday != BrokenUpTime.tm_mday;
+  return Day;
+}
 
-          if (iVenueFrom != g_AllVenues.end () &&
-          iVenueTo != g_AllVenues.end ())
-          {
-            TravelTimeRecord NewTravelTime;
-            NewTravelTime.m_DistanceInMeters = Distance;
-            NewTravelTime.m_WorstCaseDelaySeconds = WorstDelay;
-            NewTravelTime.m_Notes.assign (pNotes);
-
-            TravelTimeMap::value_type NewTravelTimePair (
-              iVenueTo, NewTravelTime);
-
-            std::pair<TravelTimeIterator, bool> InsertTravelTimeResult (
-              iVenueFrom->second.m_TravelTimesToOtherPlaces.insert
-              (NewTravelTimePair));
-            if (!InsertTravelTimeResult.second)
-              printf (
-                "<P><B>Already have a TravelTime entry</B> from %s to %s, "
-                "ignoring redundant entry.\n",
-                aFields[1].c_str (), aFields[2].c_str ());
-          }
-          else
-            printf ("<P><B>Empty venue name(s)</B> after TravelTime "
-              "keyword, ignoring it.\n");
-        }
-      }
-      else if (aFields[0] == "Selected")
-      {
-        if (nFields != 3)
-          printf (kWrongNumberOfFields, nFields, aFields[0].c_str ());
-        else
-        {
-          time_t SelectedDate = parsedate (aFields[1].c_str(), RunningDate);
-          if (SelectedDate <= 0)
-          {
-            printf ("<P><B>Bad date</B> \"%s\" after Selected "
-              "keyword, ignoring it.\n", aFields[1].c_str ());
-          }
-          else
-          {
-            VenueIterator iVenue = g_AllVenues.find (aFields[2]);
-            if (iVenue == g_AllVenues.end ())
-            {
-              printf ("<P><B>Unknown venue name</B> \"%s\" after Selected "
-                "keyword, ignoring it.\n", aFields[2].c_str ());
-            }
-            else
-            {
-              EventKeyRecord SelectedEventKey;
-              SelectedEventKey.m_EventTime = SelectedDate;
-              SelectedEventKey.m_Venue = iVenue;
-              EventIterator iSelectedEvent = g_AllEvents.find (SelectedEventKey);
-              if (iSelectedEvent == g_AllEvents.end ())
-              {
-                printf ("<P><B>No event exists</B> for date \"%s\" and venue "
-                  "\"%s\" after Selected keyword, ignoring it.\n",
-                  aFields[1].c_str (), aFields[2].c_str ());
-              }
-              else
-              {
-                iSelectedEvent->second.m_IsSelectedByUser = true;
-              }
-            }
-          }
-        }
-      }
-      else // Not a known keyword, must be an event, or just a date/time.
-      {
-        // Events start with an optional date/time, then a show name field,
-        // then a venue field, then an optional extra info field.  Plain
-        // date/time has just the date/time and no fields after it.
 
-        int ShowNameFieldIndex = 0;
+/* Parses the NUL terminated date text relative to RunningDate, using the memo
+when possible. */
 
-        time_t NewDate = parsedate (aFields[0].c_str(), RunningDate);
-        if (NewDate > 0) // Got a valid date.
-        {
-#if 0
-          localtime_r (&NewDate, &BrokenUpDate);
-          printf ("Converted date \"%s\" to %s", aFields[0].c_str(),
-            asctime (&BrokenUpDate));
-#endif
-          // Update the running date, so subsequent times are based off this
-          // one.  Useful if the date is a subtitle like "Thursday, June 19"
-          // and subsequent entries just list the hour and minute, in
-          // increasing order.
+static time_t MemoisedParseDate (const std::string &Text, time_t RunningDate)
+{
+  if (RunningDate <= 0 || Text.size () > MAX_DATE_MEMO_TEXT_LENGTH)
+    return ParseDate (Text.c_str (), RunningDate);
 
-          RunningDate = NewDate;
+  if (g_DateMemoBytes >= MAX_DATE_MEMO_BYTES)
+  {
+    g_DateMemoDays.clear ();
+    g_DateMemoBytes = 0;
+  }
 
-          ShowNameFieldIndex = 1;
-        }
+  DateMemoDayStruct &Day = FindDateMemoDay (RunningDate);
+  if (Day.m_HasDSTChange)
+    return ParseDate (Text.c_str (), RunningDate);
 
-        if (nFields == 1 && ShowNameFieldIndex == 1)
-        {
-          // Just have a time/date entry, already processed.
-        }
-        else if (nFields == ShowNameFieldIndex + 2 ||
-        nFields == ShowNameFieldIndex + 3)
-        {
-          // Create an event using show and venue fields after the optional
-          // date field.  Also creates Show and Venue records if needed.
-
-          ShowRecord NewShow;
-          ShowMap::value_type NewShowPair (
-            aFields[ShowNameFieldIndex], NewShow);
-          std::pair<ShowIterator, bool> InsertShowResult (
-            g_AllShows.insert (NewShowPair));
-
-          VenueRecord NewVenue;
-          VenueMap::value_type NewVenuePair (
-            aFields[ShowNameFieldIndex + 1], NewVenue);
-          std::pair<VenueIterator, bool> InsertVenueResult (
-            g_AllVenues.insert (NewVenuePair));
-
-          EventKeyRecord NewEventKey;
-          NewEventKey.m_EventTime = RunningDate;
-          NewEventKey.m_Venue = InsertVenueResult.first;
-
-          EventRecord NewEvent;
-          NewEvent.m_ShowIter = InsertShowResult.first;
-          if (nFields == ShowNameFieldIndex + 3)
-            NewEvent.m_ShowingSpecificInfo.assign(
-              aFields[ShowNameFieldIndex + 2]);
-
-          EventMap::value_type NewEventPair (NewEventKey, NewEvent);
-          std::pair<EventIterator, bool> InsertEventResult (
-            g_AllEvents.insert (NewEventPair));
-          if (!InsertEventResult.second)
-          {
-            localtime_r (&RunningDate, &BrokenUpDate);
-
-            printf ("<P><B>Slight redundancy problem</B>: ignoring redundant "
-              "occurance of an identical event (same place and time).  It is "
-              "show \"%s\" (prior show is \"%s\"), venue \"%s\", at time %s",
-              NewEvent.m_ShowIter->first.c_str(),
-              InsertEventResult.first->second.m_ShowIter->first.c_str(),
-              NewEventKey.m_Venue->first.c_str(),
-              asctime (&BrokenUpDate));
-          }
-          else // Successfully added a new event.
-          {
-            InsertShowResult.first->second.m_EventCount++;
-            InsertVenueResult.first->second.m_EventCount++;
-          }
-        }
-        else // Wrong number of fields for an event.
-        {
-          printf ("<P><B>Ignoring unparseable line</B> with %d fields: ",
-            nFields);
-          for (iField = 0; iField < nFields; iField++)
-          {
-            if (iField >= MAX_FIELDS)
-            {
-              printf ("...");
-              break;
-            }
-            printf ("%s%s", aFields[iField].c_str(),
-              (iField < nFields - 1) ? ", " : "");
-          }
-          printf ("\n");
-        }
-      }
+  std::unordered_map<std::string, DateMemoEntryStruct>::iterator iEntry =
+    Day.m_Dates.find (Text);
+  if (iEntry != Day.m_Dates.end ())
+  {
+    if (!iEntry->second.m_DependsOnTimeOfDay)
+    {
+      g_DateMemoHits++;
+      return iEntry->second.m_Date;
     }
-
-    if (Letter == '\n') // Leave NUL alone so outer loop exits.
-      Letter = *++pSource;
+    g_DateMemoMisses++;
+    return ParseDate (Text.c_str (), RunningDate);
   }
+
+  g_DateMemoMisses++;
+  time_t DayStart = Day.m_DayEnd - 24 * 60 * 60;
+  DateMemoEntryStruct NewEntry;
+  NewEntry.m_Date = ParseDate (Text.c_str (), RunningDate);
+  NewEntry.m_DependsOnTimeOfDay =
+    NewEntry.m_Date != ParseDate (Text.c_str (), DayStart) ||
+    NewEntry.m_Date != ParseDate (Text.c_str (), Day.m_DayEnd - 1);
+  Day.m_Dates.emplace (Text, NewEntry);
+  g_DateMemoBytes += sizeof (std::string) + Text.size () + 1 +
+    sizeof (DateMemoEntryStruct) + DATE_MEMO_NODE_OVERHEAD;
+  return NewEntry.m_Date;
 }
 
+static time_t FieldToDate (std::string_view Field, time_t RunningDate,
+  std::string &Scratch)
+{
+  Scratch.assign (Field.data (), Field.size ());
+  return MemoisedParseDate (Scratch, RunningDate);
+}
 
-/******************************************************************************
- * Look at the data from the form controls and add it to the current state.
- */
 
-void ReadFormControls ()
+/* Finds the field separators and line ends in the saved state text 64 letters
+at a time, using bitmaps with a bit for each letter, similar to the structural
+index in simdjson.  Large festivals have megabytes of SavedState and looking
+at each letter in turn adds up.  Tabs and line ends are in one bitmap and
+vertical bars in another, since a Setting line part way through the text can
+turn off vertical bars as separators. */
+
+struct SeparatorScannerStruct
 {
-  FormNameToValuesMap::iterator iFormPair;
+  const char *m_pText;
+  size_t m_Length;
+    /* The text being scanned, not including the NUL at the end. */
+
+  size_t m_BlockStart;
+    /* Offset of the 64 letter block the bitmaps are for, or SIZE_MAX if
+    none has been scanned yet. */
+
+  uint64_t m_TabsAndLineEnds;
+  uint64_t m_Bars;
+    /* Bit N is set if the letter at m_BlockStart + N is a tab or line end,
+    or a vertical bar. */
+
+  SeparatorScannerStruct (const char *pText) : m_pText(pText),
+    m_Length(strlen (pText)), m_BlockStart(SIZE_MAX), m_TabsAndLineEnds(0),
+    m_Bars(0)
+  {};
+};
 
-  // Look for the checkboxes for events.  Goofily, if the checkbox is
-  // unchecked, there is no data.  So we have to look for each event's checkbox
-  // to see if it is on or if it is missing.
 
-  EventIterator iEvent;
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+#ifdef __SSE2__
+static void ScanSeparatorBlock (SeparatorScannerStruct &Scanner,
+  size_t BlockStart)
+{
+  const char *pBlock = Scanner.m_pText + BlockStart;
+  char PaddedBlock[64];
+  uint64_t TabsAndLineEnds = 0;
+  uint64_t Bars = 0;
+
+  if (Scanner.m_Length - BlockStart < 64) // Don't read past the end.
   {
-    time_t EventTime = iEvent->first.m_EventTime;
-    char TimeString[60];
-    sprintf (TimeString, "Event,%ld,", EventTime);
-    std::string CheckboxName (TimeString);
-    CheckboxName.append (iEvent->first.m_Venue->first);
-
-    iFormPair = g_FormNameValuePairs.find (
-      const_cast<char *>(CheckboxName.c_str ()));
-    if (iFormPair != g_FormNameValuePairs.end () &&
-    strcmp (iFormPair->second, "On") == 0)
-      iEvent->second.m_IsSelectedByUser = true;
-    else
-      iEvent->second.m_IsSelectedByUser = false;
+    memset (PaddedBlock, 0, sizeof (PaddedBlock));
+    memcpy (PaddedBlock, pBlock, Scanner.m_Length - BlockStart);
+    pBlock = PaddedBlock;
   }
 
-  // Look for the checkboxes that mark favourite shows.
+  const __m128i Tab = _mm_set1_epi8 ('\t');
+  const __m128i NewLine = _mm_set1_epi8 ('\n');
+  const __m128i Bar = _mm_set1_epi8 ('|');
 
-  ShowIterator iShow;
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  for (int i = 0; i < 64; i += 16)
   {
-    std::string CheckboxName ("Show,");
-    CheckboxName.append (iShow->first);
-
-    iFormPair = g_FormNameValuePairs.find (
-      const_cast<char *>(CheckboxName.c_str ()));
-    if (iFormPair != g_FormNameValuePairs.end () &&
-    strcmp (iFormPair->second, "On") == 0)
-      iShow->second.m_IsFavourite = true;
-    else
-      iShow->second.m_IsFavourite = false;
+    __m128i Letters = _mm_loadu_si128 ((const __m128i *) (pBlock + i));
+    uint64_t TabsOrLineEnds = (uint16_t) _mm_movemask_epi8 (_mm_or_si128 (
+      _mm_cmpeq_epi8 (Letters, Tab), _mm_cmpeq_epi8 (Letters, NewLine)));
+    uint64_t VerticalBars =
+      (uint16_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (Letters, Bar));
+    TabsAndLineEnds |= TabsOrLineEnds << i;
+    Bars |= VerticalBars << i;
   }
 
-  // Look for the checkbox that controls the path printing option.
+  Scanner.m_BlockStart = BlockStart;
+  Scanner.m_TabsAndLineEnds = TabsAndLineEnds;
+  Scanner.m_Bars = Bars;
+}
+#endif
 
-  iFormPair = g_FormNameValuePairs.find (
-    const_cast<char *> ("ShowPaths"));
-  if (iFormPair != g_FormNameValuePairs.end () &&
-  strcmp (iFormPair->second, "On") == 0)
-    g_AllSettings["ShowPaths"].assign ("1");
-  else
-    g_AllSettings["ShowPaths"].assign ("0");
 
-  // Look for the text box with the luckiness percent number.
+/* Returns the offset of the next tab, line end or (if bOnlyTab is false)
+vertical bar at or after Position, or the length of the text if none. */
 
-  iFormPair = g_FormNameValuePairs.find (
-    const_cast<char *> ("Luckiness"));
-  if (iFormPair != g_FormNameValuePairs.end ())
-    g_AllSettings["Luckiness Percent"].assign (iFormPair->second);
+static size_t FindNextSeparator (SeparatorScannerStruct &Scanner,
+  size_t Position, bool bOnlyTab)
+{
+#ifndef __SSE2__
+  // Building the bitmaps a letter at a time is slower than just looking for
+  // the separator, so do that if there are no vector instructions.
+
+  const char *pLetter = Scanner.m_pText + Position;
+  while (*pLetter != '\t' && *pLetter != '\n' && *pLetter != 0 &&
+  (bOnlyTab || *pLetter != '|'))
+    pLetter++;
+  return pLetter - Scanner.m_pText;
+#else
+  while (Position < Scanner.m_Length)
+  {
+    size_t BlockStart = Position & ~(size_t) 63;
+    if (BlockStart != Scanner.m_BlockStart)
+      ScanSeparatorBlock (Scanner, BlockStart);
+
+    uint64_t Separators = Scanner.m_TabsAndLineEnds;
+    if (!bOnlyTab)
+      Separators |= Scanner.m_Bars;
+    Separators &= ~(uint64_t) 0 << (Position - BlockStart);
+    if (Separators != 0)
+      return BlockStart + __builtin_ctzll (Separators);
+
+    Position = BlockStart + 64;
+  }
+  return Scanner.m_Length;
+#endif
+}
 
-  // Look for the text box with the walking speed number.
 
-  iFormPair = g_FormNameValuePairs.find (
-    const_cast<char *> ("WalkingSpeed"));
-  if (iFormPair != g_FormNameValuePairs.end ())
-    g_AllSettings["WalkingSpeed km/h"].assign (iFormPair->second);
-}
+/* One line of the saved state, split into fields.  The fields are views into
+the text, so it has to stay around while the line is in use.  m_Date is the
+date from the first field of an event or date line, or the second field of a
+Selected line, when it has been worked out ahead of time by another thread.
+See LoadStateInformationInParallel(). */
 
+const int MAX_STATE_FIELDS = 6;
 
-/******************************************************************************
- * Make sure the user settings aren't crazy.  Fix them if so.  Also cache
- * converted values in a global.
- */
+struct StateLineStruct
+{
+  int m_nFields;
+    /* Number of fields found, may be more than MAX_STATE_FIELDS. */
 
-void ValidateUserSettings ()
+  std::string_view m_aFields[MAX_STATE_FIELDS];
+  StateKeywordEnum m_Keyword;
+  bool m_HasDate;
+  time_t m_Date;
+};
+
+
+/* Splits the line starting at pSource into fields, leaving pSource at the
+start of the next line (or at the NUL at the end of the text).  Returns false
+for lines which should be ignored, ones with an empty first field. */
+
+static bool SplitStateLine (SeparatorScannerStruct &Scanner,
+  const char *&pSource, bool bOnlyTab, StateLineStruct &Line)
 {
-  char TempString[80];
+  const char *pBuffer = Scanner.m_pText;
+  std::string_view *aFields = Line.m_aFields;
 
-  g_CommonUserSettings.m_LineupTime =
-    60 * atoi (g_AllSettings["DefaultLineupTime"].c_str ());
-  if (g_CommonUserSettings.m_LineupTime < 0)
+  // Starting a new line of text, reset the field markers and start hunting
+  // for fields.
+
+  int iField;
+  for (iField = 0; iField < MAX_STATE_FIELDS; iField++)
+    aFields[iField] = std::string_view ();
+
+  iField = 0;
+  char Letter = *pSource;
+  while (Letter != 0 && Letter != '\n')
   {
-    g_CommonUserSettings.m_LineupTime = 0;
-    g_AllSettings["DefaultLineupTime"].assign ("0");
-  }
+    // Skip leading spaces, and for the first field, also field separators
+    // (in case some e-mail software indented the text with tabs).
 
-  // Luckiness is an integer from 0 to 100.
+    while (Letter == ' ' ||
+    (iField == 0 && (Letter == '\t' || (!bOnlyTab && Letter == '|'))))
+      Letter = *++pSource;
+    const char *pFieldStart = pSource;
 
-  g_CommonUserSettings.m_Luckiness =
-    atoi (g_AllSettings["Luckiness Percent"].c_str ());
-  if (g_CommonUserSettings.m_Luckiness < 0)
-    g_CommonUserSettings.m_Luckiness = 0;
-  else if (g_CommonUserSettings.m_Luckiness > 100)
-    g_CommonUserSettings.m_Luckiness = 100;
-  sprintf (TempString, "%d", g_CommonUserSettings.m_Luckiness);
-  g_AllSettings["Luckiness Percent"].assign (TempString);
+    pSource = pBuffer + FindNextSeparator (Scanner, pSource - pBuffer,
+      bOnlyTab); // Skip over the contents of the field.
+    Letter = *pSource;
 
-  g_CommonUserSettings.m_DefaultShowDuration =
-    60 * atoi (g_AllSettings["DefaultShowDuration"].c_str ());
-  if (g_CommonUserSettings.m_DefaultShowDuration < 0)
-  {
-    g_CommonUserSettings.m_DefaultShowDuration = 0;
-    g_AllSettings["DefaultShowDuration"].assign ("0");
-  }
+    if (iField < MAX_STATE_FIELDS)
+    {
+      const char *pFieldEnd = pSource - 1;
+      while (pFieldEnd >= pFieldStart && *pFieldEnd == ' ')
+        pFieldEnd--; // Remove trailing spaces.
+      pFieldEnd++;
 
-  g_CommonUserSettings.m_DefaultTravelTime =
-    60 * atoi (g_AllSettings["DefaultTravelTime"].c_str ());
-  if (g_CommonUserSettings.m_DefaultTravelTime < 0)
-  {
-    g_CommonUserSettings.m_DefaultTravelTime = 0;
-    g_AllSettings["DefaultTravelTime"].assign ("0");
-  }
+      aFields[iField] =
+        std::string_view (pFieldStart, pFieldEnd - pFieldStart);
+    }
+    iField++;
 
-  g_CommonUserSettings.m_NewDayGap =
-    60 * atoi (g_AllSettings["NewDayGapMinutes"].c_str ());
-  if (g_CommonUserSettings.m_NewDayGap < 0)
-  {
-    g_CommonUserSettings.m_NewDayGap = 0;
-    g_AllSettings["NewDayGapMinutes"].assign ("0");
+    // Leave LF and NUL alone (still in Letter) so outer loop exits.
+
+    if (Letter == '\t' || (!bOnlyTab && Letter == '|'))
+      Letter = *++pSource;
   }
 
-  g_CommonUserSettings.m_ShowPaths =
-    (0 != atoi (g_AllSettings["ShowPaths"].c_str ()));
-  g_AllSettings["ShowPaths"].assign (
-    g_CommonUserSettings.m_ShowPaths ? "1" : "0");
-
-  g_CommonUserSettings.m_OnlyTab =
-    (0 != atoi (g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
-  g_AllSettings["UseOnlyTabForFieldSeparator"].assign (
-    g_CommonUserSettings.m_OnlyTab ? "1" : "0");
-
-  // Walking speed has more conversion and limits than usual.
-
-  g_CommonUserSettings.m_WalkingSpeed =
-    atof (g_AllSettings["WalkingSpeed km/h"].c_str ());
-
-  if (g_CommonUserSettings.m_WalkingSpeed < 0.1)
-    g_CommonUserSettings.m_WalkingSpeed = 2.0; // Negative, invalid, etc.
-  else if (g_CommonUserSettings.m_WalkingSpeed > 1079252848.8)
-    g_CommonUserSettings.m_WalkingSpeed = 1079252848.8; // Speed of light.
-
-  sprintf (TempString, "%0.1f", g_CommonUserSettings.m_WalkingSpeed);
-  g_AllSettings["WalkingSpeed km/h"].assign (TempString);
+  if (Letter == '\n') // Leave NUL alone so the caller's loop exits.
+    pSource++;
 
-  // Convert walking speed to metres per second.
-  g_CommonUserSettings.m_WalkingSpeed *= 1000.0 / 60.0 / 60.0;
+  Line.m_nFields = iField;
+  Line.m_HasDate = false;
+  if (iField == 0 || aFields[0].empty ())
+    return false;
+  Line.m_Keyword = LookUpStateKeyword (aFields[0]);
+  return true;
 }
 
 
-/******************************************************************************
- * Prints the given string to standard output, converting special characters
- * into their HTML encoded equivalents.  Ampersand becomes "&amp;", tab becomes
- * "&#9;", less than and greater than are also encoded.  This should help with
- * web browsers that can't have tabs in text areas.
- */
+/* Does what a line of the saved state says, adding an event or changing a
+setting or whatever.  RunningDate is updated by lines with a date, and
+bOnlyTab if the field separator setting changes.  Fields aren't NUL
+terminated, so are printed with "%.*s" and their size. */
 
-void EncodeAndPrintText (const char *pBuffer)
+static void ApplyStateLine (const StateLineStruct &Line, time_t &RunningDate,
+  bool &bOnlyTab, std::string &Scratch)
 {
-  int OutputLength = strlen (pBuffer) * 5 + 1; // &amp; is the worst case one.
-  char *pOutputBuffer = new char [OutputLength];
+  struct tm BrokenUpDate;
+  const int nFields = Line.m_nFields;
+  const std::string_view *aFields = Line.m_aFields;
 
-  const char *pSource = pBuffer;
-  char *pDest = pOutputBuffer;
-  char Letter;
+  const char *kWrongNumberOfFields =
+    "<P><B>Wrong number of fields</B> (%d) after \"%.*s\" keyword,"
+    "ignoring it.\n";
+  const int Length0 = aFields[0].size ();
+  const int Length1 = aFields[1].size ();
+  const int Length2 = aFields[2].size ();
+
+  // The keyword, if any, was found in the first field.
 
-  while ((Letter = *pSource++) != 0)
+  StateKeywordEnum Keyword = Line.m_Keyword;
+  if (Keyword == KEYWORD_FAVOURITE)
   {
-    if ('\t' == Letter)
+    if (nFields != 2)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
     {
-      strcpy (pDest, "&#9;");
-      pDest += 4;
+      // Favourite keyword is followed by a field identifying a show.
+
+      ShowIterator iShow = g_AllShows.find (aFields[1]);
+      if (iShow != g_AllShows.end ())
+        iShow->second.m_IsFavourite = true;
+      else
+        WebPrintf ("<P><B>Unknown show name</B> \"%.*s\" after Favourite "
+          "keyword, ignoring it.\n", Length1, aFields[1].data ());
     }
-    else if ('&' == Letter)
+  }
+  else if (Keyword == KEYWORD_SETTING)
+  {
+    if (nFields != 3)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
     {
-      strcpy (pDest, "&amp;");
-      pDest += 5;
+      // Hopefully the important settings were written near the beginning,
+      // like the one which controls parsing of tabs and vertical bars.
+
+      g_AllSettings[std::string (aFields[1])].assign (aFields[2]);
+
+      bOnlyTab = (0 != atoi (
+        g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
     }
-    else if ('<' == Letter)
+  }
+  else if (Keyword == KEYWORD_SHOW_URL)
+  {
+    if (nFields != 3)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
     {
-      strcpy (pDest, "&lt;");
-      pDest += 4;
+      ShowIterator iShow = g_AllShows.find (aFields[1]);
+      if (iShow != g_AllShows.end ())
+        iShow->second.m_ShowURL.assign (aFields[2]);
+      else
+        WebPrintf ("<P><B>Unknown show name</B> \"%.*s\" after ShowURL "
+          "keyword, ignoring it.\n", Length1, aFields[1].data ());
     }
-    else if ('>' == Letter)
+  }
+  else if (Keyword == KEYWORD_SHOW_DURATION)
+  {
+    if (nFields != 3)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
     {
-      strcpy (pDest, "&gt;");
-      pDest += 4;
+      ShowIterator iShow = g_AllShows.find (aFields[1]);
+      if (iShow != g_AllShows.end ())
+        iShow->second.m_ShowDuration =
+          60 * FieldToInt (aFields[2], Scratch);
+      else
+        WebPrintf ("<P><B>Unknown show name</B> \"%.*s\" after "
+          "ShowDuration keyword, ignoring it.\n",
+          Length1, aFields[1].data ());
     }
-    else
-      *pDest++ = Letter;
   }
-  *pDest = 0;
+  else if (Keyword == KEYWORD_VENUE_URL)
+  {
+    if (nFields != 3)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
+    {
+      // If the venue isn't found, create a default record for it, so
+      // non-show venues (street corners used in path finding) can have a
+      // URL too.
 
-  printf ("%s", pOutputBuffer);
-  delete [] pOutputBuffer;
-}
+      InternVenueName (aFields[1])->second.m_VenueURL.assign (aFields[2]);
+    }
+  }
+  else if (Keyword == KEYWORD_TRAVEL_TIME)
+  {
+    if (nFields < 4)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
+    {
+      // Empty venue names aren't added, but may already exist.
 
+      VenueIterator iVenueFrom = aFields[1].empty () ?
+        g_AllVenues.find (aFields[1]) : InternVenueName (aFields[1]);
+      VenueIterator iVenueTo = aFields[2].empty () ?
+        g_AllVenues.find (aFields[2]) : InternVenueName (aFields[2]);
 
-/******************************************************************************
- * Pretty print a path (a sequence of venues) to a string.
- */
+      int Distance = FieldToInt (aFields[3], Scratch);
 
-void WritePathToString (PathVector &Path, std::string &ResultString)
-{
-  char TempString [80];
+      int WorstDelay = 0;
+      if (nFields >= 5)
+        WorstDelay = FieldToInt (aFields[4], Scratch);
 
-  if (Path.empty ())
-    ResultString.assign ("No path found, using default travel time");
-  else if (Path.size () == 1)
-    ResultString.assign ("Stay at ");
-  else
-    ResultString.clear ();
+      if (iVenueFrom != g_AllVenues.end () &&
+      iVenueTo != g_AllVenues.end ())
+      {
+        TravelTimeRecord NewTravelTime;
+        NewTravelTime.m_DistanceInMeters = Distance;
+        NewTravelTime.m_WorstCaseDelaySeconds = WorstDelay;
+        if (nFields >= 6)
+          NewTravelTime.m_Notes.assign (aFields[5]);
 
-  int iPath;
-  for (iPath = 0; iPath < (int) Path.size (); iPath++)
+        TravelTimeMap::value_type NewTravelTimePair (
+          iVenueTo, NewTravelTime);
+
+        std::pair<TravelTimeIterator, bool> InsertTravelTimeResult (
+          iVenueFrom->second.m_TravelTimesToOtherPlaces.insert
+          (NewTravelTimePair));
+        if (!InsertTravelTimeResult.second)
+          WebPrintf (
+            "<P><B>Already have a TravelTime entry</B> from %.*s to %.*s, "
+            "ignoring redundant entry.\n",
+            Length1, aFields[1].data (), Length2, aFields[2].data ());
+      }
+      else
+        WebPrintf ("<P><B>Empty venue name(s)</B> after TravelTime "
+          "keyword, ignoring it.\n");
+    }
+  }
+  else if (Keyword == KEYWORD_SELECTED)
   {
-    VenueIterator iFromVenue = Path[iPath];
+    if (nFields != 3)
+      WebPrintf (kWrongNumberOfFields, nFields,
+        Length0, aFields[0].data ());
+    else
+    {
+      time_t SelectedDate = Line.m_HasDate ? Line.m_Date :
+      FieldToDate (aFields[1], RunningDate, Scratch);
+      if (SelectedDate <= 0)
+      {
+        WebPrintf ("<P><B>Bad date</B> \"%.*s\" after Selected "
+          "keyword, ignoring it.\n", Length1, aFields[1].data ());
+      }
+      else
+      {
+        VenueIterator iVenue = g_AllVenues.find (aFields[2]);
+        if (iVenue == g_AllVenues.end ())
+        {
+          WebPrintf ("<P><B>Unknown venue name</B> \"%.*s\" after "
+            "Selected keyword, ignoring it.\n",
+            Length2, aFields[2].data ());
+        }
+        else
+        {
+          EventKeyRecord SelectedEventKey;
+          SelectedEventKey.m_EventTime = SelectedDate;
+          SelectedEventKey.m_Venue = iVenue;
+          EventIterator iSelectedEvent =
+            g_AllEvents.find (SelectedEventKey);
+          if (iSelectedEvent == g_AllEvents.end ())
+          {
+            WebPrintf ("<P><B>No event exists</B> for date \"%.*s\" and "
+              "venue \"%.*s\" after Selected keyword, ignoring it.\n",
+              Length1, aFields[1].data (), Length2, aFields[2].data ());
+          }
+          else
+          {
+            iSelectedEvent->second.m_IsSelectedByUser = true;
+          }
+        }
+      }
+    }
+  }
+  else // Not a known keyword, must be an event, or just a date/time.
+  {
+    // Events start with an optional date/time, then a show name field,
+    // then a venue field, then an optional extra info field.  Plain
+    // date/time has just the date/time and no fields after it.
 
-    ResultString.append (iFromVenue->first.c_str ()); // Name of venue.
+    int ShowNameFieldIndex = 0;
 
-    // If this isn't the last venue in the path, print information about the
-    // trip between this venue and the next one (time and notes).
+    time_t NewDate = Line.m_HasDate ? Line.m_Date :
+      FieldToDate (aFields[0], RunningDate, Scratch);
+    if (NewDate > 0) // Got a valid date.
+    {
+#if 0
+      char TimeString[60];
+      localtime_r (&NewDate, &BrokenUpDate);
+      WebPrintf ("Converted date \"%.*s\" to %s", Length0,
+        aFields[0].data (), asctime_r (&BrokenUpDate, TimeString));
+#endif
+      // Update the running date, so subsequent times are based off this
+      // one.  Useful if the date is a subtitle like "Thursday, June 19"
+      // and subsequent entries just list the hour and minute, in
+      // increasing order.
 
-    if (iPath < (int) Path.size () - 1)
+      RunningDate = NewDate;
+
+      ShowNameFieldIndex = 1;
+    }
+
+    if (nFields == 1 && ShowNameFieldIndex == 1)
     {
-      VenueIterator iToVenue = Path[iPath+1];
-      TravelTimeIterator iTravelTime =
-        iFromVenue->second.m_TravelTimesToOtherPlaces.find (iToVenue);
-      if (iTravelTime != iFromVenue->second.m_TravelTimesToOtherPlaces.end ())
-      {
-        int SecondsToNextVenue = (int) (
-          iTravelTime->second.m_DistanceInMeters /
-          g_CommonUserSettings.m_WalkingSpeed +
-          iTravelTime->second.m_WorstCaseDelaySeconds *
-          (100 - g_CommonUserSettings.m_Luckiness) / 100);
+      // Just have a time/date entry, already processed.
+    }
+    else if (nFields == ShowNameFieldIndex + 2 ||
+    nFields == ShowNameFieldIndex + 3)
+    {
+      // Create an event using show and venue fields after the optional
+      // date field.  Also creates Show and Venue records if needed.
 
-        sprintf (TempString, " (%0.1f", SecondsToNextVenue / 60.0);
-        ResultString.append (TempString);
+      ShowIterator iShow = InternShowName (aFields[ShowNameFieldIndex]);
+      VenueIterator iVenue =
+        InternVenueName (aFields[ShowNameFieldIndex + 1]);
 
-        if (!iTravelTime->second.m_Notes.empty ())
+      EventKeyRecord NewEventKey;
+      NewEventKey.m_EventTime = RunningDate;
+      NewEventKey.m_Venue = iVenue;
+
+      std::pair<EventIterator, bool> InsertEventResult (
+        g_AllEvents.emplace (NewEventKey, EventRecord ()));
+      if (!InsertEventResult.second)
+      {
+        char TimeString[60];
+        CivilLocalTime (RunningDate, BrokenUpDate);
+        FormatFullTime (BrokenUpDate, TimeString, sizeof (TimeString));
+
+        WebPrintf ("<P><B>Slight redundancy problem</B>: ignoring "
+          "redundant occurance of an identical event (same place and "
+          "time).  It is "
+          "show \"%s\" (prior show is \"%s\"), venue \"%s\", at time "
+          "%s\n",
+          iShow->first.c_str(),
+          InsertEventResult.first->second.m_ShowIter->first.c_str(),
+          iVenue->first.c_str(),
+          TimeString);
+      }
+      else // Successfully added a new event.
+      {
+        EventRecord &NewEvent = InsertEventResult.first->second;
+        NewEvent.m_ShowIter = iShow;
+        if (nFields == ShowNameFieldIndex + 3)
+          NewEvent.m_ShowingSpecificInfo.assign(
+            aFields[ShowNameFieldIndex + 2]);
+
+        iShow->second.m_EventCount++;
+        iVenue->second.m_EventCount++;
+      }
+    }
+    else // Wrong number of fields for an event.
+    {
+      WebPrintf ("<P><B>Ignoring unparseable line</B> with %d fields: ",
+        nFields);
+      for (int iField = 0; iField < nFields; iField++)
+      {
+        if (iField >= MAX_STATE_FIELDS)
         {
-          ResultString.append (", ");
-          ResultString.append (iTravelTime->second.m_Notes);
+          WebPrintf ("...");
+          break;
         }
-        ResultString.append (") ");
+        WebPrintf ("%.*s%s", (int) aFields[iField].size (),
+          aFields[iField].data (), (iField < nFields - 1) ? ", " : "");
       }
-      else // No travel time data for some reason.
-        ResultString.append (", ");
+      WebPrintf ("\n");
     }
   }
 }
 
 
-/******************************************************************************
- * Write the headers for our web page, whatever kind it is.  After this, error
- * message printf's will be visible, so you need to do this fairly early on.
- */
-
-void WriteHTMLHeader ()
+/* Large saved states, from festivals with thousands of events, can be parsed
+with several threads.  Most of the time goes into parsedate(), and every
+event's time depends on the date before it, so the text is cut into chunks at
+date header lines; ones with just a complete date (day, month and year) which
+doesn't depend on earlier dates.  Helper threads work out the dates for each
+chunk, while this thread goes through the lines in order doing what they say,
+so duplicate events, error messages and settings come out just the same as
+parsing them one at a time.  If a chunk's header turns out to give a
+different date when parsed in order (the running date's daylight saving time
+leaks into it), its precomputed dates are ignored. */
+
+int g_ParseThreads = 1;
+  /* Number of threads, including the request's own thread, to use for large
+  saved states.  Set by the --parse-threads server option.  The extra threads
+  are a pool shared by all the worker threads, started when first needed. */
+
+const size_t PARSE_CHUNK_MIN_SIZE = 256 * 1024;
+  /* Smallest amount of text worth handing to a helper thread, and saved
+  states shorter than twice this are just parsed in order. */
+
+/* The request's deadlines, for the helper threads to check while working on
+its chunks.  The CPU time limit is for the total of the request's own thread
+and the helpers, so they read the request thread's CPU clock and add on their
+own time. */
+
+struct StateParseJobStruct
 {
-  printf ("Content-Type: text/html\r\n\r\n" // Magic CGI header.
-    "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
-    "<HTML>\n"
-    "<HEAD>\n"
-    "<TITLE>FFVSO - Fringe Theatre Festival Visitor Schedule Optimizer by "
-      "AGMS</TITLE>\n"
-    "<META HTTP-EQUIV=\"Content-Type\" CONTENT=\"text/html; charset=utf-8\">\n"
-    "<META NAME=\"viewport\" CONTENT=\"width=device-width, initial-scale=1\">\n"
-    "<META NAME=\"author\" CONTENT=\"Alexander G. M. Smith\">\n"
-    "<META NAME=\"description\" CONTENT=\"Output from the FFVSO web app.  "
-      "It's used for scheduling attendance at theatre performances so that "
-      "you don't miss the shows you want, and so you can pack in as many "
-      "shows as possible while avoiding duplicates.  #FFVSO by @AGMS00 on "
-      "Twitter.\">\n"
-    "<META NAME=\"keywords\" CONTENT=\"Schedule, Organizer, Optimizer, "
-      "Time table\">\n"
-    "<META NAME=\"version\" CONTENT=\"$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $\">\n"
-    "</HEAD>\n"
-    "<BODY BGCOLOR=\"WHITE\" TEXT=\"BLACK\">\n");
-}
+  double m_WallClockDeadline;
+  double m_CPUDeadline;
+  clockid_t m_RequestCPUClock;
+    /* Copied from the request's g_RequestDeadline, zero for no limit, and
+    the clock m_CPUDeadline is measured with. */
 
+  std::atomic<int64_t> m_HelperCPUNanoseconds;
+    /* CPU time used by the helper threads so far. */
 
-/******************************************************************************
- * Print the table row for an event listing.  If printing for the editable
- * display, include the checkbox at the end for selecting the event and
- * highlight more things (printable mode is plainer).  Also optionally print
- * the path between venues.  This is mostly about avoiding the problems with
- * duplication of code for edit/printout mode.
- */
+  std::atomic<bool> m_HasExpired;
+    /* Set when a deadline has passed, remaining chunks are skipped. */
+};
 
-void WriteHTMLEventRow (EventIterator iEvent, bool bIncludeEditModeFeatures)
+enum StateChunkStateEnum
 {
-  struct tm BrokenUpDate;
-  time_t EventTime = iEvent->first.m_EventTime;
-  char TimeString[60];
+  CHUNK_QUEUED = 0,
+  CHUNK_RUNNING,
+  CHUNK_DONE
+};
 
-  // Just use the hours and minutes for the time to avoid cluttering the
-  // display with full date and time values.
+struct StateChunkStruct
+{
+  StateLineStruct *m_pFirstLine;
+  StateLineStruct *m_pEndLine;
+    /* The chunk's lines, the first being its date header line except for the
+    first chunk. */
+
+  time_t m_StartDate;
+    /* The running date at the start of the chunk. */
+
+  StateParseJobStruct *m_pJob;
+  StateChunkStateEnum m_State;
+    /* Which load it is for, and how far along it is.  m_State is protected by
+    g_ParseMutex. */
+};
 
-  localtime_r (&EventTime, &BrokenUpDate);
-  strftime (TimeString, sizeof (TimeString), "%H:%M", &BrokenUpDate);
+static pthread_mutex_t g_ParseMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_ParseQueueCondition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_ParseDoneCondition = PTHREAD_COND_INITIALIZER;
+static std::deque<StateChunkStruct *> g_ParseQueue;
+static pthread_once_t g_ParsePoolOnce = PTHREAD_ONCE_INIT;
 
-  // Add highlighting for selected events, conflicts and favourite shows.
-  // Print mode doesn't do any highlighting.
 
-  std::string StartHTML;
-  std::string EndHTML;
+/* Returns true if the request the chunk is for has run out of time.  Also
+adds the CPU time used since LastCPUTime to the helper total, if running on a
+helper thread rather than the request's own thread. */
 
-  std::string ShowNameAppendedExtraInfo; /* Empty or " (extra info)". */
-  if (!iEvent->second.m_ShowingSpecificInfo.empty ()) /* AGMS20250608 */
+static bool StateParseJobExpired (StateParseJobStruct &Job, bool bOnHelper,
+  double &LastCPUTime)
+{
+  if (bOnHelper)
   {
-    ShowNameAppendedExtraInfo.append(" (");
-    ShowNameAppendedExtraInfo.append(iEvent->second.m_ShowingSpecificInfo);
-    ShowNameAppendedExtraInfo.append(")");
+    double CPUTime = GetClockSeconds (CLOCK_THREAD_CPUTIME_ID);
+    Job.m_HelperCPUNanoseconds +=
+      (int64_t) ((CPUTime - LastCPUTime) * 1000000000.0);
+    LastCPUTime = CPUTime;
   }
+  if (Job.m_HasExpired)
+    return true;
+  if ((Job.m_WallClockDeadline > 0 &&
+  GetClockSeconds (CLOCK_MONOTONIC) > Job.m_WallClockDeadline) ||
+  (Job.m_CPUDeadline > 0 && GetClockSeconds (Job.m_RequestCPUClock) +
+  Job.m_HelperCPUNanoseconds / 1000000000.0 > Job.m_CPUDeadline))
+    Job.m_HasExpired = true;
+  return Job.m_HasExpired;
+}
 
-  char ShowNameAppendedSequenceNumber [10]; /* Empty or " #2" etc. */
-  ShowNameAppendedSequenceNumber [0] = 0;
 
-  if (bIncludeEditModeFeatures)
+/* Works out the dates for the lines in a chunk.  Stops early if the request
+runs out of time, leaving the rest of the lines without dates. */
+
+static void ParseStateChunkDates (StateChunkStruct &Chunk, bool bOnHelper)
+{
+  StateParseJobStruct &Job = *Chunk.m_pJob;
+  time_t RunningDate = Chunk.m_StartDate;
+  std::string Scratch;
+  double LastCPUTime = 0;
+  int nDates = 0;
+
+  if (bOnHelper)
+    LastCPUTime = GetClockSeconds (CLOCK_THREAD_CPUTIME_ID);
+  if (StateParseJobExpired (Job, bOnHelper, LastCPUTime))
+    return;
+
+  for (StateLineStruct *pLine = Chunk.m_pFirstLine;
+  pLine < Chunk.m_pEndLine; pLine++)
   {
-    if (iEvent->second.m_IsSelectedByUser)
+    if (pLine->m_Keyword == KEYWORD_NONE)
     {
-      StartHTML.append (g_AllSettings["HTMLSelectBegin"]);
-      EndHTML.insert (0, g_AllSettings["HTMLSelectEnd"]);
-
-      if (iEvent->second.m_ShowIter->second.m_ScheduledCount >= 2)
-      {
-        // This show has duplicates, append a sequence number to the name.
+      pLine->m_Date = FieldToDate (pLine->m_aFields[0], RunningDate, Scratch);
+      if (pLine->m_Date > 0)
+        RunningDate = pLine->m_Date;
+    }
+    else if (pLine->m_Keyword == KEYWORD_SELECTED && pLine->m_nFields == 3)
+      pLine->m_Date = FieldToDate (pLine->m_aFields[1], RunningDate, Scratch);
+    else
+      continue;
+    pLine->m_HasDate = true;
 
-        iEvent->second.m_ShowIter->second.m_ScheduledPrintCounter++;
+    if ((++nDates & 63) == 0 &&
+    StateParseJobExpired (Job, bOnHelper, LastCPUTime))
+      break;
+  }
+  StateParseJobExpired (Job, bOnHelper, LastCPUTime);
+}
 
-        snprintf (ShowNameAppendedSequenceNumber,
-          sizeof (ShowNameAppendedSequenceNumber), " #%d",
-          iEvent->second.m_ShowIter->second.m_ScheduledPrintCounter);
-      }
-    }
-    else if (iEvent->second.m_ShowIter->second.m_ScheduledCount > 0)
-    {
-      // Unselected event which is seen at some other time.  Coloured to show
-      // that you've already seen it, so you don't pick it twice.  Two
-      // different colours are used to make it easier to change your schedule
-      // on the fly while in the middle of the festival.  If the show is seen
-      // in the future relative to this event's time, then draw it in a darker
-      // gray, suggesting that you can safely move it up to this earlier time.
-      // If the user selected a show viewing in the relative past, then drawn
-      // in lighter gray suggesting that you've already seen it by now and it's
-      // not worth selecting this event.
 
-      if (difftime(EventTime,
-      iEvent->second.m_ShowIter->second.m_ScheduledFirstTime) < 0.0)
-      {
-        StartHTML.append (g_AllSettings["HTMLAlreadyPickedInFutureBegin"]);
-        EndHTML.insert (0, g_AllSettings["HTMLAlreadyPickedInFutureEnd"]);
-      }
-      else
-      {
-        StartHTML.append (g_AllSettings["HTMLAlreadyPickedInPastBegin"]);
-        EndHTML.insert (0, g_AllSettings["HTMLAlreadyPickedInPastEnd"]);
-      }
-    }
+/* Thread function for the helper threads, which take chunks from the queue
+forever.  They're never stopped, the process just exits. */
 
-    if (iEvent->second.m_ShowIter->second.m_IsFavourite)
-    {
-      StartHTML.append (g_AllSettings["HTMLFavouriteBegin"]);
-      EndHTML.insert (0, g_AllSettings["HTMLFavouriteEnd"]);
-    }
+static void *ParseHelperThread (void *)
+{
+  pthread_mutex_lock (&g_ParseMutex);
+  while (true)
+  {
+    while (g_ParseQueue.empty ())
+      pthread_cond_wait (&g_ParseQueueCondition, &g_ParseMutex);
+    StateChunkStruct *pChunk = g_ParseQueue.front ();
+    g_ParseQueue.pop_front ();
+    pChunk->m_State = CHUNK_RUNNING;
+    pthread_mutex_unlock (&g_ParseMutex);
+
+    ParseStateChunkDates (*pChunk, true);
+
+    pthread_mutex_lock (&g_ParseMutex);
+    pChunk->m_State = CHUNK_DONE;
+    pthread_cond_broadcast (&g_ParseDoneCondition);
   }
+  return NULL;
+}
 
-  // Conflict state for path display depends on the next event being missed,
-  // though the path is printed for the current event.  Conceptually it's
-  // between events.
 
-  std::string StartPathHTML (StartHTML);
-  std::string EndPathHTML (EndHTML);
-  if (bIncludeEditModeFeatures)
-  {
-    if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
-    {
-      StartPathHTML.append (g_AllSettings["HTMLConflictBegin"]);
-      EndPathHTML.insert (0, g_AllSettings["HTMLConflictEnd"]);
-    }
+/* Starts the helper threads, once per process.  If none can be started, the
+request threads end up doing all the chunks themselves. */
 
-    if (iEvent->second.m_IsConflicting)
-    {
-      StartHTML.append (g_AllSettings["HTMLConflictBegin"]);
-      EndHTML.insert (0, g_AllSettings["HTMLConflictEnd"]);
-    }
+static void StartParseHelperThreads ()
+{
+  pthread_attr_t Attributes;
+
+  pthread_attr_init (&Attributes);
+  pthread_attr_setdetachstate (&Attributes, PTHREAD_CREATE_DETACHED);
+  for (int iThread = 1; iThread < g_ParseThreads; iThread++)
+  {
+    pthread_t Thread;
+    if (0 != pthread_create (&Thread, &Attributes, ParseHelperThread, NULL))
+      break;
   }
+  pthread_attr_destroy (&Attributes);
+}
 
-  // Also include a URL link with the highlighting, for shows and venues.
 
-  std::string StartShowHTML (StartHTML);
-  std::string EndShowHTML (EndHTML);
-  if (bIncludeEditModeFeatures)
+/* Waits for a chunk's dates to be worked out.  If a helper hasn't started on
+it yet (they're busy with other requests), take it back and do it here rather
+than waiting. */
+
+static void FinishStateChunk (StateChunkStruct &Chunk)
+{
+  bool bDoItHere = false;
+
+  pthread_mutex_lock (&g_ParseMutex);
+  if (Chunk.m_State == CHUNK_QUEUED)
   {
-    if (!iEvent->second.m_ShowIter->second.m_ShowURL.empty ())
-    {
-      StartShowHTML.append ("<A HREF=\"");
-      StartShowHTML.append (iEvent->second.m_ShowIter->second.m_ShowURL);
-      StartShowHTML.append ("\">");
-      EndShowHTML.insert (0, "</A>");
-    }
+    g_ParseQueue.erase (std::find (g_ParseQueue.begin (), g_ParseQueue.end (),
+      &Chunk));
+    Chunk.m_State = CHUNK_RUNNING;
+    bDoItHere = true;
   }
+  while (!bDoItHere && Chunk.m_State != CHUNK_DONE)
+    pthread_cond_wait (&g_ParseDoneCondition, &g_ParseMutex);
+  pthread_mutex_unlock (&g_ParseMutex);
 
-  std::string StartVenueHTML (StartHTML);
-  std::string EndVenueHTML (EndHTML);
-  if (bIncludeEditModeFeatures)
+  if (bDoItHere)
   {
-    if (!iEvent->first.m_Venue->second.m_VenueURL.empty ())
-    {
-      StartVenueHTML.append ("<A HREF=\"");
-      StartVenueHTML.append (iEvent->first.m_Venue->second.m_VenueURL);
-      StartVenueHTML.append ("\">");
-      EndVenueHTML.insert (0, "</A>");
-    }
+    ParseStateChunkDates (Chunk, false);
+    Chunk.m_State = CHUNK_DONE;
   }
+}
 
-  char SpareTimeAfterThisShowString [32];
-  if (iEvent->second.m_IsSelectedByUser)
-  {
-    // Round up to the next minute, negative values round to more negative.
 
-    if (iEvent->second.m_TravelTimeToNextEvent < 0)
-      strcpy (SpareTimeAfterThisShowString, "-"); // Very last event, go home.
-    else if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
-      sprintf (SpareTimeAfterThisShowString, "%d",
-        - (59 - iEvent->second.m_SpareTimeBeforeNextEvent) / 60);
-    else if (iEvent->second.m_SpareTimeBeforeNextEvent <
-    g_CommonUserSettings.m_NewDayGap)
-      sprintf (SpareTimeAfterThisShowString, "%d",
-        iEvent->second.m_SpareTimeBeforeNextEvent / 60);
-    else // Too much spare time, don't print it.
-      strcpy (SpareTimeAfterThisShowString, "-");
+/* Returns true if the line is a date header, just a date which doesn't depend
+on the running date, and its date in HeaderDate.  parsedate_etc() flags even
+complete dates as relative, so instead check that it comes out the same when
+parsed relative to a year later, with a different weekday and time of day.
+Both are near the header's own date, since the daylight saving time of the
+running date leaks into the result and the running date before a header is
+usually the day before. */
+
+static bool IsStateDateHeader (const StateLineStruct &Line,
+  time_t RunningDate, std::string &Scratch, time_t &HeaderDate)
+{
+  if (Line.m_Keyword != KEYWORD_NONE || Line.m_nFields != 1)
+    return false;
+
+  HeaderDate = FieldToDate (Line.m_aFields[0], RunningDate, Scratch);
+  if (HeaderDate <= 0)
+    return false;
+  HeaderDate = FieldToDate (Line.m_aFields[0], HeaderDate, Scratch);
+  const time_t YearLater = HeaderDate + 365 * 86400 + 7 * 3600 + 13 * 60;
+  return HeaderDate > 0 &&
+    HeaderDate == FieldToDate (Line.m_aFields[0], YearLater, Scratch);
+}
+
+
+static void LoadStateInformationInParallel (SeparatorScannerStruct &Scanner,
+  time_t RunningDate, bool bOnlyTab)
+{
+  // Split up all the lines first.  That's quick, but has to be done in order
+  // since a Setting line can change the field separators for later lines.
+
+  std::vector<StateLineStruct> Lines;
+  StateLineStruct Line;
+  std::string Scratch;
+
+  Lines.reserve (Scanner.m_Length / 32);
+  const char *pSource = Scanner.m_pText;
+  while (*pSource != 0)
+  {
+    if (!SplitStateLine (Scanner, pSource, bOnlyTab, Line))
+      continue;
+    if (Line.m_Keyword == KEYWORD_SETTING && Line.m_nFields == 3 &&
+    Line.m_aFields[1] == "UseOnlyTabForFieldSeparator")
+      bOnlyTab = (0 != FieldToInt (Line.m_aFields[2], Scratch));
+    Lines.push_back (Line);
   }
-  else // Need something in the table cell, else borders vanish.
-    strcpy (SpareTimeAfterThisShowString, "&nbsp;");
 
-  // Dump out the event row.
-
-  printf ("<TR VALIGN=\"TOP\"><TD>%s%s%s</TD><TD>%s%d%s</TD><TD>%s%s%s</TD>"
-    "<TD>%s%s%s%s%s</TD><TD>%s%s%s</TD>",
-    StartHTML.c_str(), TimeString, EndHTML.c_str(),
-    StartHTML.c_str(),
-      (iEvent->second.m_ShowIter->second.m_ShowDuration + 59) / 60,
-      EndHTML.c_str(),
-    StartHTML.c_str(), SpareTimeAfterThisShowString, EndHTML.c_str(),
-    StartShowHTML.c_str(), iEvent->second.m_ShowIter->first.c_str(),
-      ShowNameAppendedSequenceNumber, ShowNameAppendedExtraInfo.c_str(),
-      EndShowHTML.c_str(),
-    StartVenueHTML.c_str(),
-      iEvent->first.m_Venue->first.c_str(), EndVenueHTML.c_str()
-    );
+  // Cut the lines into chunks of about the same size, each starting at the
+  // first date header line after the evenly spaced cut.  If there isn't one
+  // before the next cut, the chunk before gets longer.
 
-  // Add a checkbox if in edit mode.
+  size_t nChunks = std::min ((size_t) g_ParseThreads,
+    Scanner.m_Length / PARSE_CHUNK_MIN_SIZE);
+  std::vector<StateChunkStruct> Chunks;
+  StateChunkStruct Chunk;
+  Chunk.m_pFirstLine = Lines.data ();
+  Chunk.m_StartDate = RunningDate;
+  Chunks.push_back (Chunk);
 
-  if (bIncludeEditModeFeatures)
+  size_t iLine = 0;
+  for (size_t iCut = 1; iCut < nChunks; iCut++)
+  {
+    size_t iNextCut = Lines.size () * (iCut + 1) / nChunks;
+    iLine = std::max (iLine, Lines.size () * iCut / nChunks);
+    while (iLine < iNextCut && !IsStateDateHeader (Lines[iLine],
+    RunningDate, Scratch, Chunk.m_StartDate))
+      iLine++;
+    if (iLine >= iNextCut)
+      continue;
+    Chunk.m_pFirstLine = &Lines[iLine++];
+    Chunks.push_back (Chunk);
+  }
+  for (size_t iChunk = 0; iChunk < Chunks.size (); iChunk++)
+    Chunks[iChunk].m_pEndLine = (iChunk + 1 < Chunks.size ()) ?
+      Chunks[iChunk + 1].m_pFirstLine : Lines.data () + Lines.size ();
+
+  // Queue up all but the first chunk for the helper threads, this thread
+  // does the first one directly.  Later chunks which no helper has got to by
+  // the time they're needed are done here too.
+
+  StateParseJobStruct Job;
+  Job.m_WallClockDeadline = g_RequestDeadline.m_WallClockDeadline;
+  Job.m_CPUDeadline = g_RequestDeadline.m_CPUDeadline;
+  if (0 != pthread_getcpuclockid (pthread_self (), &Job.m_RequestCPUClock))
+    Job.m_RequestCPUClock = CLOCK_THREAD_CPUTIME_ID;
+  Job.m_HelperCPUNanoseconds = 0;
+  Job.m_HasExpired = g_RequestDeadline.m_HasExpired;
+
+  pthread_once (&g_ParsePoolOnce, StartParseHelperThreads);
+  Chunks[0].m_pJob = &Job;
+  Chunks[0].m_State = CHUNK_DONE;
+  pthread_mutex_lock (&g_ParseMutex);
+  for (size_t iChunk = 1; iChunk < Chunks.size (); iChunk++)
   {
-    printf ("<TD><INPUT TYPE=\"CHECKBOX\" NAME=\"Event,%ld,%s\" "
-      "VALUE=\"On\"%s></TD>",
-      EventTime, iEvent->first.m_Venue->first.c_str(),
-      (iEvent->second.m_IsSelectedByUser) ? " CHECKED" : "");
+    Chunks[iChunk].m_pJob = &Job;
+    Chunks[iChunk].m_State = CHUNK_QUEUED;
+    g_ParseQueue.push_back (&Chunks[iChunk]);
   }
+  pthread_cond_broadcast (&g_ParseQueueCondition);
+  pthread_mutex_unlock (&g_ParseMutex);
 
-  printf ("</TR>\n");
+  // Go through the chunks in order.  The helpers' CPU time is charged to this
+  // request as it goes, so later deadline checks count it too.  If time runs
+  // out, stop, but still wait for the helpers since they use Lines.
 
-  /* Print the path between the venues.  Only if this is a show the user is
-  going to attend, and the next attended show isn't too long away
-  (presumably they go home rather than needing a path). */
+  int64_t ChargedNanoseconds = 0;
+  size_t iChunk;
+  for (iChunk = 0; iChunk < Chunks.size (); iChunk++)
+  {
+    StateChunkStruct &DoneChunk = Chunks[iChunk];
+    FinishStateChunk (DoneChunk);
+
+    int64_t HelperNanoseconds = Job.m_HelperCPUNanoseconds;
+    if (g_RequestDeadline.m_CPUDeadline > 0)
+      g_RequestDeadline.m_CPUDeadline = std::max (1e-9,
+        g_RequestDeadline.m_CPUDeadline -
+        (HelperNanoseconds - ChargedNanoseconds) / 1000000000.0);
+    ChargedNanoseconds = HelperNanoseconds;
+    if (Job.m_HasExpired || RequestDeadlineExpired ())
+      break;
+
+    StateLineStruct *pLine = DoneChunk.m_pFirstLine;
+    if (iChunk > 0 && pLine->m_HasDate && FieldToDate (pLine->m_aFields[0],
+    RunningDate, Scratch) != pLine->m_Date)
+    {
+      for (; pLine < DoneChunk.m_pEndLine; pLine++)
+        pLine->m_HasDate = false;
+    }
 
-  if (g_CommonUserSettings.m_ShowPaths &&
-  iEvent->second.m_IsSelectedByUser &&
-  iEvent->second.m_SpareTimeBeforeNextEvent <
-  g_CommonUserSettings.m_NewDayGap &&
-  iEvent->second.m_TravelTimeToNextEvent >= 0 /* there is a next event */)
+    for (pLine = DoneChunk.m_pFirstLine; pLine < DoneChunk.m_pEndLine;
+    pLine++)
+      ApplyStateLine (*pLine, RunningDate, bOnlyTab, Scratch);
+  }
+
+  if (iChunk < Chunks.size ())
   {
-    std::string PathAsString;
-    char TempString [80];
+    Job.m_HasExpired = true;
+    g_RequestDeadline.m_HasExpired = true;
+    for (; iChunk < Chunks.size (); iChunk++)
+      FinishStateChunk (Chunks[iChunk]);
+  }
+}
 
-    WritePathToString (iEvent->second.m_PathToNextEvent, PathAsString);
 
-    // Print the total travel time.
+void LoadStateInformation (const char *pBuffer)
+{
+  // Set the running date to be the current time in the current year, in case
+  // they specify events without mentioning the year.  Not set to January 1st,
+  // since that may specify a different daylight savings time than the current
+  // time (which is more likely to be around when the festival starts), which
+  // makes the first time input parsed be off by an hour.
 
-    sprintf (TempString, "%d+%d: ",
-      (g_CommonUserSettings.m_LineupTime + 59) / 60,
-      (iEvent->second.m_TravelTimeToNextEvent + 59) / 60);
-    PathAsString.insert (0, TempString);
+  time_t RunningDate;
+  time (&RunningDate);
 
-    // Print the spare time.
+  // When reading, always consider tabs to be field separators, and optionally
+  // have '|' vertical bar as a field separator (some web browsers don't
+  // support pasting in text with tabs into a TEXTAREA).  Should be fine so
+  // long as the vertical bar isn't used in Show names or other text, and if
+  // it is a problem, a setting turns off vertical bars.
 
-    if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
-      sprintf (TempString, ", late by %d minutes.",
-        (59 - iEvent->second.m_SpareTimeBeforeNextEvent) / 60);
-    else
-      sprintf (TempString, ", %d spare minutes.",
-        iEvent->second.m_SpareTimeBeforeNextEvent / 60);
+  bool bOnlyTab = (0 != atoi (
+    g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
 
-    printf ("<TR VALIGN=\"TOP\"><TD>&nbsp;</TD>"
-      "<TD COLSPAN=\"%d\">%s%s%s%s</TD></TR>\n",
-      bIncludeEditModeFeatures ? 5 : 4,
-      StartPathHTML.c_str (),
-      PathAsString.c_str (), TempString,
-      EndPathHTML.c_str ());
+  SeparatorScannerStruct Scanner (pBuffer);
+  if (g_ParseThreads > 1 && Scanner.m_Length >= 2 * PARSE_CHUNK_MIN_SIZE)
+  {
+    LoadStateInformationInParallel (Scanner, RunningDate, bOnlyTab);
+    return;
+  }
+
+  StateLineStruct Line;
+  std::string Scratch;
+  const char *pSource = pBuffer;
+  while (*pSource != 0)
+  {
+    if (SplitStateLine (Scanner, pSource, bOnlyTab, Line))
+      ApplyStateLine (Line, RunningDate, bOnlyTab, Scratch);
   }
 }
 
 
 /******************************************************************************
- * Write the deluxe format web page, with controls for editing the schedule,
- * an area for the saved data, and various listings of items.
+ * Compute a hash identifying the numbering used by compact checkbox names.
+ * Events are numbered by their position in g_EventsSortedByTimeAndShow, and
+ * shows by their position in g_AllShows.  If the SavedState was edited, the
+ * numbers from the previous web page may refer to different events or shows,
+ * in which case the fingerprint sent back with them won't match.
  */
 
-void WriteHTMLForm ()
+uint64_t ComputeCatalogFingerprint ()
 {
-  EventIterator iEvent;
+  uint64_t Hash;
+  uint64_t Counts[2];
+
+  Counts[0] = g_EventsSortedByTimeAndShow.size ();
+  Counts[1] = g_AllShows.size ();
+  Hash = HashBytes (Counts, sizeof (Counts), 0);
+
+  for (size_t i = 0; i < g_EventsSortedByTimeAndShow.size (); i++)
+  {
+    EventIterator iEvent = g_EventsSortedByTimeAndShow[i];
+    const std::string &VenueName = iEvent->first.m_Venue->first;
+    int64_t EventTime = iEvent->first.m_EventTime;
+
+    Hash = HashBytes (&EventTime, sizeof (EventTime), Hash);
+    Hash = HashBytes (VenueName.c_str (), VenueName.size () + 1, Hash);
+  }
+
   ShowIterator iShow;
-  SettingIterator iSetting;
-  VenueIterator iVenue;
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+    Hash = HashBytes (iShow->first.c_str (), iShow->first.size () + 1, Hash);
 
-  struct tm BrokenUpDate;
-  char OutputBuffer[4096];
-  char TimeString[60];
+  return Hash;
+}
 
-  printf ("%s\n", g_AllSettings["TitleEdit"].c_str ());
-  printf ("<FORM ACTION=\"%s/cgi-bin/FFVSO.cgi\" method=\"POST\">\n",
-    g_HostNameURLFragment.c_str ());
-  printf ("<P ALIGN=\"CENTER\">");
-  printf ("Jump to <A HREF=\"#Events\">Events</A> "
-    "<A HREF=\"#Shows\">Shows</A> "
-    "<A HREF=\"#Venues\">Venues</A> "
-    "<A HREF=\"#RawData\">Raw Data</A>\n"
-    "<P ALIGN=\"CENTER\">You have %d conflicts and you are seeing %d "
-    "performances (total time %d:%02d).\n"
-    "<BR>There are %d redundant, %d unseen shows, and %d unseen favourites.\n",
-    g_Statistics.m_TotalNumberOfConflicts,
-    g_Statistics.m_TotalNumberOfEventsScheduled,
-    g_Statistics.m_TotalSecondsWatched / 60 / 60,
-    g_Statistics.m_TotalSecondsWatched / 60 % 60,
-    g_Statistics.m_TotalNumberOfRedundantShows,
-    g_Statistics.m_TotalNumberOfUnseenShows,
-    g_Statistics.m_TotalNumberOfUnseenFavouriteShows);
-  printf ("<P ALIGN=\"CENTER\">");
-  printf ("<INPUT TYPE=\"SUBMIT\" NAME=\"UpdateSchedule\" "
-    "VALUE=\"Update Schedule with your Changes\">\n");
-  printf ("<INPUT TYPE=\"SUBMIT\" NAME=\"PrintSchedule\" "
-    "VALUE=\"See Printable Schedule\"><BR>\n");
-  printf ("<UL><LI>Walking speed <INPUT TYPE=\"TEXT\" "
-    "NAME=\"WalkingSpeed\" SIZE=\"3\" VALUE=\"%s\">km/h.\n",
-    g_AllSettings["WalkingSpeed km/h"].c_str ());
-  printf ("<LI>Luckiness <INPUT TYPE=\"TEXT\" "
-    "NAME=\"Luckiness\" SIZE=\"3\" VALUE=\"%s\">percent (use 0%% for worst "
-    "case delays).\n",
-    g_AllSettings["Luckiness Percent"].c_str ());
-  printf ("<LI>Show paths between venues: "
-    "<INPUT TYPE=\"CHECKBOX\" NAME=\"ShowPaths\" VALUE=\"On\"%s>\n",
-    (g_CommonUserSettings.m_ShowPaths) ? " CHECKED" : "");
-  printf ("</UL>\n");
 
-  // Write out the event listing with checkboxes beside each event to let the
-  // user select it.  Done as a table with six columns: event time, duration,
-  // spare minutes to next show, show name, venue name, checkbox.  Optionally
-  // show path to the next event's venue in a line underneath.
+/******************************************************************************
+ * Look at the data from the form controls and add it to the current state.
+ */
 
-  printf ("<H2><A NAME=\"Events\"></A>Listing of %ld Events</H2>\n"
-    "<P>Use the checkboxes to select the events you want to see, then hit the "
-    "Update Schedule button to see if you have conflicts or other problems."
-    "&nbsp; Repeat until you're happy with your schedule, then use the "
-    "Printable Schedule button to get a clean copy.&nbsp; Use your browser's "
-    "Back button to go back to editing after printing.&nbsp; See the Raw Data "
-    "box near the bottom of this page for info about saving your schedule.\n"
-    "<P><TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllEvents.size ());
+void ReadFormControls ()
+{
+  FormNameToValuesMap::iterator iFormPair;
 
-  time_t PreviousTime = 0;
-  time_t EventTime = 0;
-  int iSortedEvent;
-  const int iEndSortedEvent = g_EventsSortedByTimeAndShow.size ();
+  // If the form used compact checkbox names, check that they number the same
+  // events and shows as we now have.  If not, ignore the checkboxes and keep
+  // the selections and favourites listed in the SavedState.
 
-  for (iSortedEvent = 0; iSortedEvent < iEndSortedEvent;
-  PreviousTime = EventTime, ++iSortedEvent)
+  bool bUseCheckboxes = true;
+  bool bUseCompactCheckboxes = false;
+
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *> ("CatalogFingerprint"));
+  if (iFormPair != g_FormNameValuePairs.end ())
   {
-    iEvent = g_EventsSortedByTimeAndShow[iSortedEvent];
+    char Fingerprint[24];
+    snprintf (Fingerprint, sizeof (Fingerprint), "%016llx",
+      (unsigned long long) ComputeCatalogFingerprint ());
+    bUseCompactCheckboxes = (strcmp (iFormPair->second, Fingerprint) == 0);
+    bUseCheckboxes = bUseCompactCheckboxes;
+    if (!bUseCheckboxes)
+      WebPrintf ("<P><B>Checkbox changes ignored</B>: the list of shows "
+        "and events was edited after this page was made, so the checkboxes "
+        "may not line up with the events any more.  Your selections and "
+        "favourites from the saved state were kept, please redo any "
+        "changes you made to them.\n");
+  }
 
-    // If more than 6 hours (or whatever NewDayGapMinutes is set to) since the
-    // previous event, print out a new day heading.  The Ottawa Fringe last
-    // show is usually at midnight, and the first one after that is at noon.
+  // Look at the checkboxes for events.  Goofily, if the checkbox is
+  // unchecked, there is no data.  So start with all events unselected, then
+  // select the ones for the checkboxes which were sent.
 
-    EventTime = iEvent->first.m_EventTime;
-    localtime_r (&EventTime, &BrokenUpDate);
-    double DeltaTime = difftime (EventTime, PreviousTime);
-    if (fabs (DeltaTime) > g_CommonUserSettings.m_NewDayGap)
-    {
-      strftime (TimeString, sizeof (TimeString), "%A, %B %d, %Y",
-        &BrokenUpDate);
-      printf ("<TR><TH COLSPAN=\"6\">%s</TH></TR>\n", TimeString);
-    }
+  EventIterator iEvent;
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end() &&
+  bUseCheckboxes; ++iEvent)
+    iEvent->second.m_IsSelectedByUser = false;
+
+  EventCheckboxMap::iterator iEventCheckbox;
+  for (iEventCheckbox = g_EventCheckboxes.begin ();
+  iEventCheckbox != g_EventCheckboxes.end () && bUseCheckboxes;
+  ++iEventCheckbox)
+  {
+    if (strcmp (iEventCheckbox->second, "On") != 0)
+      continue;
 
-    WriteHTMLEventRow (iEvent, true /* bIncludeEditModeFeatures */);
+    EventKeyRecord EventKey;
+    EventKey.m_Venue = g_AllVenues.find (iEventCheckbox->first.m_pVenueName);
+    if (EventKey.m_Venue == g_AllVenues.end ())
+      continue; // Venue no longer exists, SavedState was edited.
+    EventKey.m_EventTime = iEventCheckbox->first.m_EventTime;
+
+    iEvent = g_AllEvents.find (EventKey);
+    if (iEvent != g_AllEvents.end ())
+      iEvent->second.m_IsSelectedByUser = true;
   }
 
-  printf ("</TABLE>\n");
+  CompactCheckboxVector::iterator iCompact;
+  for (iCompact = g_CompactEventCheckboxes.begin ();
+  iCompact != g_CompactEventCheckboxes.end () && bUseCompactCheckboxes;
+  ++iCompact)
+  {
+    if (iCompact->first < g_EventsSortedByTimeAndShow.size () &&
+    strcmp (iCompact->second, "On") == 0)
+      g_EventsSortedByTimeAndShow[iCompact->first]->second.m_IsSelectedByUser =
+        true;
+  }
 
-  // Write out a list of the shows.  Includes show name, duration,
-  // #performances, #times seen, and a checkbox to select favourite ones.
+  // Look at the checkboxes that mark favourite shows, same way.
 
-  printf ("<H2><A NAME=\"Shows\"></A>Listing of %ld Shows</H2><P>"
-    "<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllShows.size ());
-  printf ("<TR><TH>Show Title</TH><TH>Minutes</TH><TH>Perform-<BR>ances</TH>"
-    "<TH>Times<BR>Seen</TH><TH>Your<BR>Favourite?</TH></TR>\n");
+  ShowIterator iShow;
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end() &&
+  bUseCheckboxes; ++iShow)
+    iShow->second.m_IsFavourite = false;
 
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  for (iFormPair = g_ShowCheckboxes.begin ();
+  iFormPair != g_ShowCheckboxes.end () && bUseCheckboxes; ++iFormPair)
   {
-    // Add highlighting for favourite shows, and a link to the show's page.
+    if (strcmp (iFormPair->second, "On") != 0)
+      continue;
 
-    std::string StartHTML;
-    std::string EndHTML;
+    iShow = g_AllShows.find (iFormPair->first);
+    if (iShow != g_AllShows.end ())
+      iShow->second.m_IsFavourite = true;
+  }
 
-    if (iShow->second.m_IsFavourite)
-    {
-      StartHTML.append (g_AllSettings["HTMLFavouriteBegin"]);
-      EndHTML.insert (0, g_AllSettings["HTMLFavouriteEnd"]);
-    }
+  if (bUseCompactCheckboxes && !g_CompactShowCheckboxes.empty ())
+  {
+    std::vector<ShowIterator> ShowsByIndex;
+    ShowsByIndex.reserve (g_AllShows.size ());
+    for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+      ShowsByIndex.push_back (iShow);
 
-    std::string StartShowHTML (StartHTML);
-    std::string EndShowHTML (EndHTML);
-    if (!iShow->second.m_ShowURL.empty ())
+    for (iCompact = g_CompactShowCheckboxes.begin ();
+    iCompact != g_CompactShowCheckboxes.end (); ++iCompact)
     {
-      StartShowHTML.append ("<A HREF=\"");
-      StartShowHTML.append (iShow->second.m_ShowURL);
-      StartShowHTML.append ("\">");
-      EndShowHTML.insert (0, "</A>");
+      if (iCompact->first < ShowsByIndex.size () &&
+      strcmp (iCompact->second, "On") == 0)
+        ShowsByIndex[iCompact->first]->second.m_IsFavourite = true;
     }
-
-    printf ("<TR VALIGN=\"TOP\"><TD>%s%s%s</TD><TD>%s%d%s</TD><TD>%s%d%s</TD>"
-      "<TD>%s%d%s</TD><TD><INPUT TYPE=\"CHECKBOX\" NAME=\"Show,%s\" "
-      "VALUE=\"On\"%s></TD></TR>\n",
-      StartShowHTML.c_str(), iShow->first.c_str(), EndShowHTML.c_str(),
-      StartHTML.c_str(), iShow->second.m_ShowDuration / 60, EndHTML.c_str(),
-      StartHTML.c_str(), iShow->second.m_EventCount, EndHTML.c_str(),
-      StartHTML.c_str(), iShow->second.m_ScheduledCount, EndHTML.c_str(),
-      iShow->first.c_str(), iShow->second.m_IsFavourite ? " CHECKED" : "");
   }
 
-  printf ("</TABLE>\n");
-
-  // Write out a list of the venues.  Includes venue name, #performances and
-  // count of paths (so you can find junk Venue names).
+  // Look for the checkbox that controls the path printing option.
 
-  printf ("<H2><A NAME=\"Venues\"></A>Listing of %ld Venues</H2><P>"
-    "<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllVenues.size ());
-  printf ("<TR><TH>Venue Name</TH><TH>Perform-<BR>ances</TH>"
-    "<TH>Travel<BR>Time<BR>Entries</TH></TR>\n");
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *> ("ShowPaths"));
+  if (iFormPair != g_FormNameValuePairs.end () &&
+  strcmp (iFormPair->second, "On") == 0)
+    g_AllSettings["ShowPaths"].assign ("1");
+  else
+    g_AllSettings["ShowPaths"].assign ("0");
+
+  // Look for the text box with the luckiness percent number.
+
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *> ("Luckiness"));
+  if (iFormPair != g_FormNameValuePairs.end ())
+    g_AllSettings["Luckiness Percent"].assign (iFormPair->second);
+
+  // Look for the text box with the walking speed number.
+
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *> ("WalkingSpeed"));
+  if (iFormPair != g_FormNameValuePairs.end ())
+    g_AllSettings["WalkingSpeed km/h"].assign (iFormPair->second);
+}
+
+
+/******************************************************************************
+ * Make sure the user settings aren't crazy.  Fix them if so.  Also cache
+ * converted values in a global.
+ */
+
+void ValidateUserSettings ()
+{
+  char TempString[80];
+
+  g_CommonUserSettings.m_LineupTime =
+    60 * atoi (g_AllSettings["DefaultLineupTime"].c_str ());
+  if (g_CommonUserSettings.m_LineupTime < 0)
+  {
+    g_CommonUserSettings.m_LineupTime = 0;
+    g_AllSettings["DefaultLineupTime"].assign ("0");
+  }
+
+  // Luckiness is an integer from 0 to 100.
+
+  g_CommonUserSettings.m_Luckiness =
+    atoi (g_AllSettings["Luckiness Percent"].c_str ());
+  if (g_CommonUserSettings.m_Luckiness < 0)
+    g_CommonUserSettings.m_Luckiness = 0;
+  else if (g_CommonUserSettings.m_Luckiness > 100)
+    g_CommonUserSettings.m_Luckiness = 100;
+  sprintf (TempString, "%d", g_CommonUserSettings.m_Luckiness);
+  g_AllSettings["Luckiness Percent"].assign (TempString);
+
+  g_CommonUserSettings.m_DefaultShowDuration =
+    60 * atoi (g_AllSettings["DefaultShowDuration"].c_str ());
+  if (g_CommonUserSettings.m_DefaultShowDuration < 0)
+  {
+    g_CommonUserSettings.m_DefaultShowDuration = 0;
+    g_AllSettings["DefaultShowDuration"].assign ("0");
+  }
+
+  g_CommonUserSettings.m_DefaultTravelTime =
+    60 * atoi (g_AllSettings["DefaultTravelTime"].c_str ());
+  if (g_CommonUserSettings.m_DefaultTravelTime < 0)
+  {
+    g_CommonUserSettings.m_DefaultTravelTime = 0;
+    g_AllSettings["DefaultTravelTime"].assign ("0");
+  }
+
+  g_CommonUserSettings.m_NewDayGap =
+    60 * atoi (g_AllSettings["NewDayGapMinutes"].c_str ());
+  if (g_CommonUserSettings.m_NewDayGap < 0)
+  {
+    g_CommonUserSettings.m_NewDayGap = 0;
+    g_AllSettings["NewDayGapMinutes"].assign ("0");
+  }
+
+  g_CommonUserSettings.m_ShowPaths =
+    (0 != atoi (g_AllSettings["ShowPaths"].c_str ()));
+  g_AllSettings["ShowPaths"].assign (
+    g_CommonUserSettings.m_ShowPaths ? "1" : "0");
+
+  g_CommonUserSettings.m_CompactCheckboxNames =
+    (0 != atoi (g_AllSettings["CompactCheckboxNames"].c_str ()));
+  g_AllSettings["CompactCheckboxNames"].assign (
+    g_CommonUserSettings.m_CompactCheckboxNames ? "1" : "0");
+
+  g_CommonUserSettings.m_OnlyTab =
+    (0 != atoi (g_AllSettings["UseOnlyTabForFieldSeparator"].c_str ()));
+  g_AllSettings["UseOnlyTabForFieldSeparator"].assign (
+    g_CommonUserSettings.m_OnlyTab ? "1" : "0");
+
+  // Walking speed has more conversion and limits than usual.
+
+  g_CommonUserSettings.m_WalkingSpeed =
+    atof (g_AllSettings["WalkingSpeed km/h"].c_str ());
+
+  if (g_CommonUserSettings.m_WalkingSpeed < 0.1)
+    g_CommonUserSettings.m_WalkingSpeed = 2.0; // Negative, invalid, etc.
+  else if (g_CommonUserSettings.m_WalkingSpeed > 1079252848.8)
+    g_CommonUserSettings.m_WalkingSpeed = 1079252848.8; // Speed of light.
+
+  sprintf (TempString, "%0.1f", g_CommonUserSettings.m_WalkingSpeed);
+  g_AllSettings["WalkingSpeed km/h"].assign (TempString);
+
+  // Convert walking speed to metres per second.
+  g_CommonUserSettings.m_WalkingSpeed *= 1000.0 / 60.0 / 60.0;
+}
+
+
+/******************************************************************************
+ * Prints the given string to standard output, converting special characters
+ * into their HTML encoded equivalents.  Ampersand becomes "&amp;", tab becomes
+ * "&#9;", less than and greater than are also encoded.  This should help with
+ * web browsers that can't have tabs in text areas.
+ */
+
+void EncodeAndPrintText (const char *pBuffer)
+{
+  const char *pRunStart = pBuffer;
+  const char *pSource = pBuffer;
+  const char *pEntity;
+  char Letter;
+
+  // Copy runs of plain text directly to the output, interrupted by the
+  // occasional special character.
+
+  while ((Letter = *pSource) != 0)
+  {
+    if ('\t' == Letter)
+      pEntity = "&#9;";
+    else if ('&' == Letter)
+      pEntity = "&amp;";
+    else if ('<' == Letter)
+      pEntity = "&lt;";
+    else if ('>' == Letter)
+      pEntity = "&gt;";
+    else
+    {
+      pSource++;
+      continue;
+    }
+    WebPutText (pRunStart, pSource - pRunStart);
+    WebPutText (pEntity);
+    pRunStart = ++pSource;
+  }
+  WebPutText (pRunStart, pSource - pRunStart);
+}
+
+
+/******************************************************************************
+ * Pretty print a path (a sequence of venues) to a string.
+ */
+
+void WritePathToString (PathVector &Path, std::string &ResultString)
+{
+  char TempString [80];
+
+  if (Path.empty ())
+    ResultString.assign ("No path found, using default travel time");
+  else if (Path.size () == 1)
+    ResultString.assign ("Stay at ");
+  else
+    ResultString.clear ();
+
+  int iPath;
+  for (iPath = 0; iPath < (int) Path.size (); iPath++)
+  {
+    VenueIterator iFromVenue = Path[iPath];
+
+    ResultString.append (iFromVenue->first.c_str ()); // Name of venue.
+
+    // If this isn't the last venue in the path, print information about the
+    // trip between this venue and the next one (time and notes).
+
+    if (iPath < (int) Path.size () - 1)
+    {
+      VenueIterator iToVenue = Path[iPath+1];
+      TravelTimeIterator iTravelTime =
+        iFromVenue->second.m_TravelTimesToOtherPlaces.find (iToVenue);
+      if (iTravelTime != iFromVenue->second.m_TravelTimesToOtherPlaces.end ())
+      {
+        int SecondsToNextVenue = (int) (
+          iTravelTime->second.m_DistanceInMeters /
+          g_CommonUserSettings.m_WalkingSpeed +
+          iTravelTime->second.m_WorstCaseDelaySeconds *
+          (100 - g_CommonUserSettings.m_Luckiness) / 100);
+
+        sprintf (TempString, " (%0.1f", SecondsToNextVenue / 60.0);
+        ResultString.append (TempString);
+
+        if (!iTravelTime->second.m_Notes.empty ())
+        {
+          ResultString.append (", ");
+          ResultString.append (iTravelTime->second.m_Notes);
+        }
+        ResultString.append (") ");
+      }
+      else // No travel time data for some reason.
+        ResultString.append (", ");
+    }
+  }
+}
+
+
+/******************************************************************************
+ * Write the headers for our web page, whatever kind it is.  After this, error
+ * message printf's will be visible, so you need to do this fairly early on.
+ */
+
+void WriteHTMLHeader ()
+{
+  WebPrintf ("Content-Type: text/html\r\n\r\n" // Magic CGI header.
+    "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
+    "<HTML>\n"
+    "<HEAD>\n"
+    "<TITLE>FFVSO - Fringe Theatre Festival Visitor Schedule Optimizer by "
+      "AGMS</TITLE>\n"
+    "<META HTTP-EQUIV=\"Content-Type\" CONTENT=\"text/html; charset=utf-8\">\n"
+    "<META NAME=\"viewport\" CONTENT=\"width=device-width, initial-scale=1\">\n"
+    "<META NAME=\"author\" CONTENT=\"Alexander G. M. Smith\">\n"
+    "<META NAME=\"description\" CONTENT=\"Output from the FFVSO web app.  "
+      "It's used for scheduling attendance at theatre performances so that "
+      "you don't miss the shows you want, and so you can pack in as many "
+      "shows as possible while avoiding duplicates.  #FFVSO by @AGMS00 on "
+      "Twitter.\">\n"
+    "<META NAME=\"keywords\" CONTENT=\"Schedule, Organizer, Optimizer, "
+      "Time table\">\n"
+    "<META NAME=\"version\" CONTENT=\"$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $\">\n"
+    "</HEAD>\n"
+    "<BODY BGCOLOR=\"WHITE\" TEXT=\"BLACK\">\n");
+}
+
+
+/******************************************************************************
+ * Print the table row for an event listing.  If printing for the editable
+ * display, include the checkbox at the end for selecting the event and
+ * highlight more things (printable mode is plainer).  Also optionally print
+ * the path between venues.  This is mostly about avoiding the problems with
+ * duplication of code for edit/printout mode.
+ */
+
+void WriteHTMLEventRow (EventIterator iEvent, bool bIncludeEditModeFeatures)
+{
+  struct tm BrokenUpDate;
+  time_t EventTime = iEvent->first.m_EventTime;
+  char TimeString[60];
+
+  // Just use the hours and minutes for the time to avoid cluttering the
+  // display with full date and time values.
+
+  CivilLocalTime (EventTime, BrokenUpDate);
+  FormatClockTime (BrokenUpDate, TimeString);
+
+  // Add highlighting for selected events, conflicts and favourite shows.
+  // Print mode doesn't do any highlighting.
+
+  std::string StartHTML;
+  std::string EndHTML;
+
+  std::string ShowNameAppendedExtraInfo; /* Empty or " (extra info)". */
+  if (!iEvent->second.m_ShowingSpecificInfo.empty ()) /* AGMS20250608 */
+  {
+    ShowNameAppendedExtraInfo.append(" (");
+    ShowNameAppendedExtraInfo.append(iEvent->second.m_ShowingSpecificInfo);
+    ShowNameAppendedExtraInfo.append(")");
+  }
+
+  char ShowNameAppendedSequenceNumber [10]; /* Empty or " #2" etc. */
+  ShowNameAppendedSequenceNumber [0] = 0;
+
+  if (bIncludeEditModeFeatures)
+  {
+    if (iEvent->second.m_IsSelectedByUser)
+    {
+      StartHTML.append (g_AllSettings["HTMLSelectBegin"]);
+      EndHTML.insert (0, g_AllSettings["HTMLSelectEnd"]);
+
+      if (iEvent->second.m_ShowIter->second.m_ScheduledCount >= 2)
+      {
+        // This show has duplicates, append a sequence number to the name.
+
+        iEvent->second.m_ShowIter->second.m_ScheduledPrintCounter++;
+
+        snprintf (ShowNameAppendedSequenceNumber,
+          sizeof (ShowNameAppendedSequenceNumber), " #%d",
+          iEvent->second.m_ShowIter->second.m_ScheduledPrintCounter);
+      }
+    }
+    else if (iEvent->second.m_ShowIter->second.m_ScheduledCount > 0)
+    {
+      // Unselected event which is seen at some other time.  Coloured to show
+      // that you've already seen it, so you don't pick it twice.  Two
+      // different colours are used to make it easier to change your schedule
+      // on the fly while in the middle of the festival.  If the show is seen
+      // in the future relative to this event's time, then draw it in a darker
+      // gray, suggesting that you can safely move it up to this earlier time.
+      // If the user selected a show viewing in the relative past, then drawn
+      // in lighter gray suggesting that you've already seen it by now and it's
+      // not worth selecting this event.
+
+      if (difftime(EventTime,
+      iEvent->second.m_ShowIter->second.m_ScheduledFirstTime) < 0.0)
+      {
+        StartHTML.append (g_AllSettings["HTMLAlreadyPickedInFutureBegin"]);
+        EndHTML.insert (0, g_AllSettings["HTMLAlreadyPickedInFutureEnd"]);
+      }
+      else
+      {
+        StartHTML.append (g_AllSettings["HTMLAlreadyPickedInPastBegin"]);
+        EndHTML.insert (0, g_AllSettings["HTMLAlreadyPickedInPastEnd"]);
+      }
+    }
+
+    if (iEvent->second.m_ShowIter->second.m_IsFavourite)
+    {
+      StartHTML.append (g_AllSettings["HTMLFavouriteBegin"]);
+      EndHTML.insert (0, g_AllSettings["HTMLFavouriteEnd"]);
+    }
+  }
+
+  // Conflict state for path display depends on the next event being missed,
+  // though the path is printed for the current event.  Conceptually it's
+  // between events.
+
+  std::string StartPathHTML (StartHTML);
+  std::string EndPathHTML (EndHTML);
+  if (bIncludeEditModeFeatures)
+  {
+    if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
+    {
+      StartPathHTML.append (g_AllSettings["HTMLConflictBegin"]);
+      EndPathHTML.insert (0, g_AllSettings["HTMLConflictEnd"]);
+    }
+
+    if (iEvent->second.m_IsConflicting)
+    {
+      StartHTML.append (g_AllSettings["HTMLConflictBegin"]);
+      EndHTML.insert (0, g_AllSettings["HTMLConflictEnd"]);
+    }
+  }
+
+  // Also include a URL link with the highlighting, for shows and venues.
+
+  std::string StartShowHTML (StartHTML);
+  std::string EndShowHTML (EndHTML);
+  if (bIncludeEditModeFeatures)
+  {
+    if (!iEvent->second.m_ShowIter->second.m_ShowURL.empty ())
+    {
+      StartShowHTML.append ("<A HREF=\"");
+      StartShowHTML.append (iEvent->second.m_ShowIter->second.m_ShowURL);
+      StartShowHTML.append ("\">");
+      EndShowHTML.insert (0, "</A>");
+    }
+  }
+
+  std::string StartVenueHTML (StartHTML);
+  std::string EndVenueHTML (EndHTML);
+  if (bIncludeEditModeFeatures)
+  {
+    if (!iEvent->first.m_Venue->second.m_VenueURL.empty ())
+    {
+      StartVenueHTML.append ("<A HREF=\"");
+      StartVenueHTML.append (iEvent->first.m_Venue->second.m_VenueURL);
+      StartVenueHTML.append ("\">");
+      EndVenueHTML.insert (0, "</A>");
+    }
+  }
+
+  char SpareTimeAfterThisShowString [32];
+  if (iEvent->second.m_IsSelectedByUser)
+  {
+    // Round up to the next minute, negative values round to more negative.
+
+    if (iEvent->second.m_TravelTimeToNextEvent < 0)
+      strcpy (SpareTimeAfterThisShowString, "-"); // Very last event, go home.
+    else if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
+      sprintf (SpareTimeAfterThisShowString, "%d",
+        - (59 - iEvent->second.m_SpareTimeBeforeNextEvent) / 60);
+    else if (iEvent->second.m_SpareTimeBeforeNextEvent <
+    g_CommonUserSettings.m_NewDayGap)
+      sprintf (SpareTimeAfterThisShowString, "%d",
+        iEvent->second.m_SpareTimeBeforeNextEvent / 60);
+    else // Too much spare time, don't print it.
+      strcpy (SpareTimeAfterThisShowString, "-");
+  }
+  else // Need something in the table cell, else borders vanish.
+    strcpy (SpareTimeAfterThisShowString, "&nbsp;");
+
+  // Dump out the event row.  Done piece by piece rather than with one big
+  // WebPrintf since this is the bulk of the web page.
+
+  WebPutText ("<TR VALIGN=\"TOP\"><TD>");
+  WebPutText (StartHTML);
+  WebPutText (TimeString);
+  WebPutText (EndHTML);
+  WebPutText ("</TD><TD>");
+  WebPutText (StartHTML);
+  WebPutInt ((iEvent->second.m_ShowIter->second.m_ShowDuration + 59) / 60);
+  WebPutText (EndHTML);
+  WebPutText ("</TD><TD>");
+  WebPutText (StartHTML);
+  WebPutText (SpareTimeAfterThisShowString);
+  WebPutText (EndHTML);
+  WebPutText ("</TD><TD>");
+  WebPutText (StartShowHTML);
+  WebPutText (iEvent->second.m_ShowIter->first);
+  WebPutText (ShowNameAppendedSequenceNumber);
+  WebPutText (ShowNameAppendedExtraInfo);
+  WebPutText (EndShowHTML);
+  WebPutText ("</TD><TD>");
+  WebPutText (StartVenueHTML);
+  WebPutText (iEvent->first.m_Venue->first);
+  WebPutText (EndVenueHTML);
+  WebPutText ("</TD>");
+
+  // Add a checkbox if in edit mode.
+
+  if (bIncludeEditModeFeatures)
+  {
+    if (g_CommonUserSettings.m_CompactCheckboxNames)
+    {
+      WebPutText ("<TD><INPUT TYPE=\"CHECKBOX\" NAME=\"E");
+      WebPutInt (iEvent->second.m_SortedIndex);
+    }
+    else
+    {
+      WebPutText ("<TD><INPUT TYPE=\"CHECKBOX\" NAME=\"Event,");
+      WebPutInt (EventTime);
+      WebPutText (",");
+      WebPutText (iEvent->first.m_Venue->first);
+    }
+    WebPutText ("\" VALUE=\"On\"");
+    if (iEvent->second.m_IsSelectedByUser)
+      WebPutText (" CHECKED");
+    WebPutText ("></TD>");
+  }
+
+  WebPutText ("</TR>\n");
+
+  /* Print the path between the venues.  Only if this is a show the user is
+  going to attend, and the next attended show isn't too long away
+  (presumably they go home rather than needing a path). */
+
+  if (g_CommonUserSettings.m_ShowPaths &&
+  iEvent->second.m_IsSelectedByUser &&
+  iEvent->second.m_SpareTimeBeforeNextEvent <
+  g_CommonUserSettings.m_NewDayGap &&
+  iEvent->second.m_TravelTimeToNextEvent >= 0 /* there is a next event */)
+  {
+    std::string PathAsString;
+    char TempString [80];
+
+    WritePathToString (iEvent->second.m_PathToNextEvent, PathAsString);
+
+    // Print the total travel time.
+
+    sprintf (TempString, "%d+%d: ",
+      (g_CommonUserSettings.m_LineupTime + 59) / 60,
+      (iEvent->second.m_TravelTimeToNextEvent + 59) / 60);
+    PathAsString.insert (0, TempString);
+
+    // Print the spare time.
+
+    if (iEvent->second.m_SpareTimeBeforeNextEvent < 0)
+      sprintf (TempString, ", late by %d minutes.",
+        (59 - iEvent->second.m_SpareTimeBeforeNextEvent) / 60);
+    else
+      sprintf (TempString, ", %d spare minutes.",
+        iEvent->second.m_SpareTimeBeforeNextEvent / 60);
+
+    WebPrintf ("<TR VALIGN=\"TOP\"><TD>&nbsp;</TD>"
+      "<TD COLSPAN=\"%d\">%s%s%s%s</TD></TR>\n",
+      bIncludeEditModeFeatures ? 5 : 4,
+      StartPathHTML.c_str (),
+      PathAsString.c_str (), TempString,
+      EndPathHTML.c_str ());
+  }
+}
+
+
+/******************************************************************************
+ * Write the deluxe format web page, with controls for editing the schedule,
+ * an area for the saved data, and various listings of items.
+ */
+
+void WriteHTMLForm ()
+{
+  EventIterator iEvent;
+  ShowIterator iShow;
+  SettingIterator iSetting;
+  VenueIterator iVenue;
+
+  struct tm BrokenUpDate;
+  char OutputBuffer[4096];
+  char TimeString[60];
+
+  WebPrintf ("%s\n", g_AllSettings["TitleEdit"].c_str ());
+  WebPrintf ("<FORM ACTION=\"%s/cgi-bin/FFVSO.cgi\" method=\"POST\">\n",
+    g_HostNameURLFragment.c_str ());
+  WebPrintf ("<P ALIGN=\"CENTER\">");
+  WebPrintf ("Jump to <A HREF=\"#Events\">Events</A> "
+    "<A HREF=\"#Shows\">Shows</A> "
+    "<A HREF=\"#Venues\">Venues</A> "
+    "<A HREF=\"#RawData\">Raw Data</A>\n"
+    "<P ALIGN=\"CENTER\">You have %d conflicts and you are seeing %d "
+    "performances (total time %d:%02d).\n"
+    "<BR>There are %d redundant, %d unseen shows, and %d unseen favourites.\n",
+    g_Statistics.m_TotalNumberOfConflicts,
+    g_Statistics.m_TotalNumberOfEventsScheduled,
+    g_Statistics.m_TotalSecondsWatched / 60 / 60,
+    g_Statistics.m_TotalSecondsWatched / 60 % 60,
+    g_Statistics.m_TotalNumberOfRedundantShows,
+    g_Statistics.m_TotalNumberOfUnseenShows,
+    g_Statistics.m_TotalNumberOfUnseenFavouriteShows);
+  WebPrintf ("<P ALIGN=\"CENTER\">");
+  WebPrintf ("<INPUT TYPE=\"SUBMIT\" NAME=\"UpdateSchedule\" "
+    "VALUE=\"Update Schedule with your Changes\">\n");
+  WebPrintf ("<INPUT TYPE=\"SUBMIT\" NAME=\"PrintSchedule\" "
+    "VALUE=\"See Printable Schedule\"><BR>\n");
+  WebPrintf ("<UL><LI>Walking speed <INPUT TYPE=\"TEXT\" "
+    "NAME=\"WalkingSpeed\" SIZE=\"3\" VALUE=\"%s\">km/h.\n",
+    g_AllSettings["WalkingSpeed km/h"].c_str ());
+  WebPrintf ("<LI>Luckiness <INPUT TYPE=\"TEXT\" "
+    "NAME=\"Luckiness\" SIZE=\"3\" VALUE=\"%s\">percent (use 0%% for worst "
+    "case delays).\n",
+    g_AllSettings["Luckiness Percent"].c_str ());
+  WebPrintf ("<LI>Show paths between venues: "
+    "<INPUT TYPE=\"CHECKBOX\" NAME=\"ShowPaths\" VALUE=\"On\"%s>\n",
+    (g_CommonUserSettings.m_ShowPaths) ? " CHECKED" : "");
+  WebPrintf ("</UL>\n");
+
+  // Write out the event listing with checkboxes beside each event to let the
+  // user select it.  Done as a table with six columns: event time, duration,
+  // spare minutes to next show, show name, venue name, checkbox.  Optionally
+  // show path to the next event's venue in a line underneath.
+
+  WebPrintf ("<H2><A NAME=\"Events\"></A>Listing of %ld Events</H2>\n"
+    "<P>Use the checkboxes to select the events you want to see, then hit the "
+    "Update Schedule button to see if you have conflicts or other problems."
+    "&nbsp; Repeat until you're happy with your schedule, then use the "
+    "Printable Schedule button to get a clean copy.&nbsp; Use your browser's "
+    "Back button to go back to editing after printing.&nbsp; See the Raw Data "
+    "box near the bottom of this page for info about saving your schedule.\n"
+    "<P><TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllEvents.size ());
+
+  time_t PreviousTime = 0;
+  time_t EventTime = 0;
+  int iSortedEvent;
+  const int iEndSortedEvent = g_EventsSortedByTimeAndShow.size ();
+
+  for (iSortedEvent = 0; iSortedEvent < iEndSortedEvent;
+  PreviousTime = EventTime, ++iSortedEvent)
+  {
+    iEvent = g_EventsSortedByTimeAndShow[iSortedEvent];
+
+    // If more than 6 hours (or whatever NewDayGapMinutes is set to) since the
+    // previous event, print out a new day heading.  The Ottawa Fringe last
+    // show is usually at midnight, and the first one after that is at noon.
+
+    EventTime = iEvent->first.m_EventTime;
+    CivilLocalTime (EventTime, BrokenUpDate);
+    double DeltaTime = difftime (EventTime, PreviousTime);
+    if (fabs (DeltaTime) > g_CommonUserSettings.m_NewDayGap)
+    {
+      FormatDayHeading (BrokenUpDate, TimeString, sizeof (TimeString));
+      WebPrintf ("<TR><TH COLSPAN=\"6\">%s</TH></TR>\n", TimeString);
+    }
+
+    WriteHTMLEventRow (iEvent, true /* bIncludeEditModeFeatures */);
+  }
+
+  WebPrintf ("</TABLE>\n");
+
+  // Write out a list of the shows.  Includes show name, duration,
+  // #performances, #times seen, and a checkbox to select favourite ones.
+
+  WebPrintf ("<H2><A NAME=\"Shows\"></A>Listing of %ld Shows</H2><P>"
+    "<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllShows.size ());
+  WebPrintf ("<TR><TH>Show Title</TH><TH>Minutes</TH>"
+    "<TH>Perform-<BR>ances</TH><TH>Times<BR>Seen</TH>"
+    "<TH>Your<BR>Favourite?</TH></TR>\n");
+
+  int iShowIndex = 0;
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end();
+  ++iShow, ++iShowIndex)
+  {
+    // Add highlighting for favourite shows, and a link to the show's page.
+
+    std::string StartHTML;
+    std::string EndHTML;
+
+    if (iShow->second.m_IsFavourite)
+    {
+      StartHTML.append (g_AllSettings["HTMLFavouriteBegin"]);
+      EndHTML.insert (0, g_AllSettings["HTMLFavouriteEnd"]);
+    }
+
+    std::string StartShowHTML (StartHTML);
+    std::string EndShowHTML (EndHTML);
+    if (!iShow->second.m_ShowURL.empty ())
+    {
+      StartShowHTML.append ("<A HREF=\"");
+      StartShowHTML.append (iShow->second.m_ShowURL);
+      StartShowHTML.append ("\">");
+      EndShowHTML.insert (0, "</A>");
+    }
+
+    std::string CheckboxName;
+    if (g_CommonUserSettings.m_CompactCheckboxNames)
+    {
+      snprintf (TimeString, sizeof (TimeString), "S%d", iShowIndex);
+      CheckboxName.assign (TimeString);
+    }
+    else
+    {
+      CheckboxName.assign ("Show,");
+      CheckboxName.append (iShow->first);
+    }
+
+    WebPrintf ("<TR VALIGN=\"TOP\"><TD>%s%s%s</TD><TD>%s%d%s</TD>"
+      "<TD>%s%d%s</TD><TD>%s%d%s</TD>"
+      "<TD><INPUT TYPE=\"CHECKBOX\" NAME=\"%s\" VALUE=\"On\"%s></TD>"
+      "</TR>\n",
+      StartShowHTML.c_str(), iShow->first.c_str(), EndShowHTML.c_str(),
+      StartHTML.c_str(), iShow->second.m_ShowDuration / 60, EndHTML.c_str(),
+      StartHTML.c_str(), iShow->second.m_EventCount, EndHTML.c_str(),
+      StartHTML.c_str(), iShow->second.m_ScheduledCount, EndHTML.c_str(),
+      CheckboxName.c_str(), iShow->second.m_IsFavourite ? " CHECKED" : "");
+  }
+
+  WebPrintf ("</TABLE>\n");
+
+  // Write out a list of the venues.  Includes venue name, #performances and
+  // count of paths (so you can find junk Venue names).
+
+  WebPrintf ("<H2><A NAME=\"Venues\"></A>Listing of %ld Venues</H2><P>"
+    "<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n", g_AllVenues.size ());
+  WebPrintf ("<TR><TH>Venue Name</TH><TH>Perform-<BR>ances</TH>"
+    "<TH>Travel<BR>Time<BR>Entries</TH></TR>\n");
+
+  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+  {
+    std::string StartVenueHTML;
+    std::string EndVenueHTML;
+    if (!iVenue->second.m_VenueURL.empty ())
+    {
+      StartVenueHTML.append ("<A HREF=\"");
+      StartVenueHTML.append (iVenue->second.m_VenueURL);
+      StartVenueHTML.append ("\">");
+      EndVenueHTML.insert (0, "</A>");
+    }
+
+    WebPrintf ("<TR VALIGN=\"TOP\"><TD>%s%s%s</TD><TD>%d</TD><TD>%d</TD>"
+      "</TR>\n",
+      StartVenueHTML.c_str (), iVenue->first.c_str(), EndVenueHTML.c_str (),
+      iVenue->second.m_EventCount,
+      (int) iVenue->second.m_TravelTimesToOtherPlaces.size ());
+  }
+
+  WebPrintf ("</TABLE>\n");
+
+  // Write the hidden text box with the last update date, so we can tell if the
+  // form controls match the pasted in state data.  If not, the controls will
+  // be ignored as things like checkboxes won't match.
+
+  WebPrintf ("<INPUT TYPE=\"HIDDEN\" NAME=\"LastUpdateTime\" VALUE=\"%s\">\n",
+    g_AllSettings["LastUpdateTime"].c_str ());
+
+  // Compact checkbox names are just numbers, so also write the fingerprint of
+  // the list of events and shows they are numbering.
+
+  if (g_CommonUserSettings.m_CompactCheckboxNames)
+    WebPrintf ("<INPUT TYPE=\"HIDDEN\" NAME=\"CatalogFingerprint\" "
+      "VALUE=\"%016llx\">\n",
+      (unsigned long long) ComputeCatalogFingerprint ());
+
+  // Write out the SavedState giant text area.  To avoid HTML misinterpretation
+  // problems, encode suspect characters for the data inside the textarea.
+
+  char Separator = g_CommonUserSettings.m_OnlyTab ? '\t' : '|';
+
+  WebPrintf ("<H2><A NAME=\"RawData\"></A>Raw Data</H2>"
+    "<P>You can copy this out and save it in a text file to preserve your "
+    "selections.  Paste it back in later and hit the update button to "
+    "restore your custom schedule.  Or maybe just save the whole web page "
+    "or e-mail it to yourself.  If things go awry (or updated schedule "
+    "times have been posted for your festival), start a fresh session for "
+    "your festival and append just the lines near the end that start with "
+    "\"Selected\" or \"Favourite\".\n"
+    "<P><TEXTAREA NAME=\"SavedState\" cols=80 rows=40>\n");
+
+  // Dump the settings state.  Do it first so default settings get used when
+  // reading the events.
+
+  for (iSetting = g_AllSettings.begin(); iSetting != g_AllSettings.end();
+  ++iSetting)
+  {
+    snprintf (OutputBuffer, sizeof (OutputBuffer), "Setting%c%s%c%s\n",
+      Separator, iSetting->first.c_str(), Separator, iSetting->second.c_str());
+    EncodeAndPrintText (OutputBuffer);
+  }
+
+  // Dump the event states.
+
+  int PreviousDayOfMonth = 0;
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  {
+    EventTime = iEvent->first.m_EventTime;
+    CivilLocalTime (EventTime, BrokenUpDate);
+
+    if (PreviousDayOfMonth != BrokenUpDate.tm_mday)
+    {
+      FormatDayHeading (BrokenUpDate, TimeString, sizeof (TimeString));
+      WebPrintf ("%s\n", TimeString);
+      PreviousDayOfMonth = BrokenUpDate.tm_mday;
+    }
+
+    FormatClockTime (BrokenUpDate, TimeString);
+    bool empty_extra = iEvent->second.m_ShowingSpecificInfo.empty(); 
+    snprintf (OutputBuffer, sizeof (OutputBuffer),
+      empty_extra ? "%s%c%s%c%s\n" : "%s%c%s%c%s%c%s\n", /* AGMS20250608 */
+      TimeString, Separator,
+      iEvent->second.m_ShowIter->first.c_str(), Separator,
+      iEvent->first.m_Venue->first.c_str(), Separator,
+      iEvent->second.m_ShowingSpecificInfo.c_str());
+    EncodeAndPrintText (OutputBuffer);
+  }
+
+  // Dump the show states, for the duration if not default, and the URL.
+  // Favourites done later to make cutting and pasting easier.
+
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  {
+    if (iShow->second.m_ShowDuration !=
+    g_CommonUserSettings.m_DefaultShowDuration)
+    {
+      snprintf (OutputBuffer, sizeof (OutputBuffer),
+        "ShowDuration%c%s%c%d\n", Separator, iShow->first.c_str (), Separator,
+        iShow->second.m_ShowDuration / 60);
+      EncodeAndPrintText (OutputBuffer);
+    }
+
+    if (!iShow->second.m_ShowURL.empty ())
+    {
+      snprintf (OutputBuffer, sizeof (OutputBuffer),
+        "ShowURL%c%s%c%s\n", Separator, iShow->first.c_str(), Separator,
+        iShow->second.m_ShowURL.c_str());
+      EncodeAndPrintText (OutputBuffer);
+    }
+  }
+
+  // Dump the venue states, URL and user specified path finding data.
+
+  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+  {
+    // List the venue's URL string, if present.
+
+    if (!iVenue->second.m_VenueURL.empty ())
+    {
+      snprintf (OutputBuffer, sizeof (OutputBuffer), "VenueURL%c%s%c%s\n",
+        Separator, iVenue->first.c_str(), Separator,
+        iVenue->second.m_VenueURL.c_str());
+      EncodeAndPrintText (OutputBuffer);
+    }
+
+    // List all the destinations you can go to from this venue, and their
+    // travel properties.
+
+    TravelTimeIterator iTravelTime;
+    TravelTimeIterator iTravelEnd =
+      iVenue->second.m_TravelTimesToOtherPlaces.end ();
+    for (iTravelTime = iVenue->second.m_TravelTimesToOtherPlaces.begin ();
+    iTravelTime != iTravelEnd; iTravelTime++)
+    {
+      if (iTravelTime->second.m_IsPhantomReverse)
+        continue; // Don't dump the phantoms, only genuine user data.
+
+      snprintf (OutputBuffer, sizeof (OutputBuffer),
+        "TravelTime%c%s%c%s%c%d",
+        Separator, iVenue->first.c_str(), Separator,
+        iTravelTime->first->first.c_str(), Separator,
+        iTravelTime->second.m_DistanceInMeters);
+      char *pNextOut = OutputBuffer + strlen (OutputBuffer);
+      int LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
+
+      if (iTravelTime->second.m_WorstCaseDelaySeconds != 0 ||
+      !iTravelTime->second.m_Notes.empty ())
+      {
+        snprintf (pNextOut, LengthRemaining,
+          "%c%d", Separator, iTravelTime->second.m_WorstCaseDelaySeconds);
+        pNextOut = OutputBuffer + strlen (OutputBuffer);
+        LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
+      }
+
+      if (!iTravelTime->second.m_Notes.empty ())
+      {
+        snprintf (pNextOut, LengthRemaining,
+          "%c%s", Separator, iTravelTime->second.m_Notes.c_str ());
+        pNextOut = OutputBuffer + strlen (OutputBuffer);
+        LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
+      }
+
+      if (LengthRemaining >= 2)
+        strcpy (pNextOut, "\n");
+
+      EncodeAndPrintText (OutputBuffer);
+    }
+  }
+
+  // Write out the favourite shows.
+
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  {
+    if (iShow->second.m_IsFavourite)
+    {
+      snprintf (OutputBuffer, sizeof (OutputBuffer),
+        "Favourite%c%s\n", Separator, iShow->first.c_str());
+      EncodeAndPrintText (OutputBuffer);
+    }
+  }
+
+  // Write out the selected event flags.  Done after everything else, so the
+  // user can more easily cut and paste their selections into a new schedule.
+
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  {
+    if (!iEvent->second.m_IsSelectedByUser)
+      continue;
+
+    EventTime = iEvent->first.m_EventTime;
+    CivilLocalTime (EventTime, BrokenUpDate);
+    FormatFullTime (BrokenUpDate, TimeString, sizeof (TimeString));
+
+    snprintf (OutputBuffer, sizeof (OutputBuffer), "Selected%c%s%c%s\n",
+      Separator, TimeString, Separator,
+      iEvent->first.m_Venue->first.c_str());
+    EncodeAndPrintText (OutputBuffer);
+  }
+
+  WebPrintf ("</TEXTAREA>\n");
+
+
+  WebPrintf ("<H3>Raw Data Keywords and Use</H3>\n");
+  WebPrintf ("<P>Here's some documentation, in case you're interested in "
+    "details.  In general fields are separated by tabs or vertical bar \"|\" "
+    "characters.  The first field specifies what to do with the rest of the "
+    "line of raw data.  Here's the list of possibilities:\n<UL>\n");
+  WebPrintf ("<LI>An event is defined by an optional date and time field "
+    "followed by a show name field and then a venue name field and finally an "
+    "optional extra showing specific info (like are face masks required) "
+    "field.  You can also "
+    "specify a date or time by itself (such as \"Thursday, June 19, 2014\", "
+    "or \"7:00 PM\"), which will be used as the day / time for the event "
+    "definitions after it (they then only need to specify the time or nothing "
+    "to use the previous date or time).  Show names that are the same as "
+    "keywords or look like dates or times (pure numbers for example) won't "
+    "work; preceed them with at least the time.\n");
+  WebPrintf ("<LI>\"Selected\" is followed by a date & time field, and a "
+    "field naming the venue.  That is enough to specify an event the user "
+    "will be attending.\n");
+  WebPrintf ("<LI>\"Favourite\" is followed by the show name.  That show is "
+    "then marked as being one of the higher priority ones for the user to "
+    "see.\n");
+
+  WebPrintf ("<LI>\"Setting\" is followed by the name of the setting and then "
+    "a field with the value to be used for that setting.  Here are some of "
+    "the settings you can use:\n<UL>\n");
+  WebPrintf ("<LI>TitleEdit - followed by HTML for the title text shown "
+    "while editing.  Useful for noting the date when the schedule "
+    "times were last updated with data from the festival.\n");
+  WebPrintf ("<LI>TitlePrint - followed by HTML for the title text shown "
+    "on the printable listing.  You may want to customise it with your "
+    "own name and other information.\n");
+  WebPrintf ("<LI>CompactCheckboxNames - 1 to give the event and show "
+    "checkboxes short numbered names, which makes this web page and the "
+    "data sent back when updating a lot smaller.  0 (the default) uses "
+    "names made from the event time and venue or the show name.\n");
+  WebPrintf ("<LI>ToDo - need to finish writing this documentation.\n");
+  WebPrintf ("</UL>\n");
+
+  WebPrintf ("<LI>\"ShowURL\" has a second field that names a show and a "
+    "third that specifies a web link to show information about the show.\n");
+  WebPrintf ("<LI>\"ShowDuration\" is followed by the show name and the "
+    "duration (number of minutes) of that show.  If not specified, a default "
+    "(usually one hour, there's a setting for it) is used.\n");
+  WebPrintf ("<LI>\"VenueURL\" is followed by the name of a venue and then "
+    "the URL for information about that venue.\n");
+  WebPrintf ("<LI>\"TravelTime\" is followed by a field naming the From venue "
+    "and then a field with the To venue, then the distance in metres, and "
+    "then the optional worst case delay time in seconds, and finally another "
+    "optional field with notes for the user (like \"Take Elevator B\")."
+    "<P>This is used for calculating the shortest path between venues and the "
+    "time it takes to walk it, which is then used for detecting shows you "
+    "can't get to in time."
+    "<P>The Venues usually name places with shows, or you can make up venue "
+    "names for intermediate locations to help with the path finding.  Use "
+    "something descriptive for the user such as \"Fifth-and-Main\" street "
+    "intersections.  They'll show up as venues with no performances.  If you "
+    "want to, you can add a VenueURL for intermediate places that points to, "
+    "for example, a subway station web page."
+    "<P>The user's walking speed setting will be combined with the distance "
+    "to get their walking time.  The worst case delay time (multiplied by "
+    "(100 - Luckiness) percent) is added to the "
+    "walking time to get the time it takes to travel between venues.  If we "
+    "can't find a path between the venues, the DefaultTravelTime setting is "
+    "used for the travel time instead.  The setting for time spent in "
+    "line-ups getting tickets is added to the travel time to get the total "
+    "time to go between venues.  If a show starts before you can get to it "
+    "from the previous show, it will be displayed (usually in red) as a "
+    "conflict."
+    "<P>You don't have to specify every possible path when setting up your "
+    "Festival; the shortest path composed from multiple TravelTime segments "
+    "will be found.  A rough grid of TravelTime segments covering the "
+    "Festival's area will be sufficient.  If you don't specify a TravelTime "
+    "in the opposite direction, the reverse direction will be assumed to take "
+    "as long to travel.  If there's a one-way path for some reason, you have "
+    "to specify that there's no reverse direction by putting in a TravelTime "
+    "entry for the reverse direction with a negative distance (-1 is "
+    "good)."
+    "<P>The worst case delay time measures the time spent waiting at traffic "
+    "lights, elevators and so on.  Measure the time from when the light stops "
+    "being green (as if you just missed it) to the next time it turns green.  "
+    "Elevator worst case time is measured by sending the elevator to the "
+    "furthest floor and seeing how long it takes to go and return.  Though "
+    "crowded elevators take longer than that, so maybe measuring on a busy "
+    "day would be better.  For bus, subways, car and other vehicular travel "
+    "limited by a schedule or speed limits (all cars go about the same "
+    "speed), include the vehicular travel time and waiting time at the bus "
+    "stop/station in the worst case delay time and only count the distance "
+    "walked to the bus stop, station or parked car in the distance "
+    "measurement."
+    "<P>Bicycle travel would be somewhat complicated (are they walking or "
+    "biking indoors or both?), so we currently don't handle it, though you "
+    "can approximate it with a very fast walking speed setting."
+    "<P>The Notes field is optional, and you do need to specify a worst case "
+    "value prior to it if you use it (0 if you don't have a worst case "
+    "number).  It's included verbatim in the web output, so you can include "
+    "HTML if you wish to do something like link to information about a bus "
+    "route.\n");
+
+  WebPrintf ("</UL>\n");
+
+  WebPrintf ("<P><FONT SIZE=\"-1\">Software version "
+    "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
+    "was compiled on " __DATE__ " at " __TIME__ ".  This program is "
+    "copyright 2014 by Alexander G. M. Smith.  You can contact me at <A "
+    "HREF=\"mailto:?to=%%22Alexander G. M. Smith%%22 "
+    "%%3Cagmsmith@ncf.ca%%3E&amp;subject=Fringe Festival Visitor Schedule "
+    "Optimizer\">agmsmith@ncf.ca</A> or on Twitter as <A "
+    "HREF=\"http://twitter.com/agms00\">@AGMS00</A> or with the <A "
+    "HREF=\"http://twitter.com/search?q=%%23FFVSO\">#FFVSO</A> "
+    "hashtag.  This program is distributed under the GNU General Public "
+    "License, version 3, which may be available at <A "
+    "HREF=\"http://www.gnu.org/copyleft/gpl.html\">"
+    "http://www.gnu.org/copyleft/gpl.html</A>.  Source code for this program "
+    "is available on GitHub at <A HREF=\"http://github.com/agmsmith/FFVSO\">"
+    "http://github.com/agmsmith/FFVSO</A>.</FONT>\n");
+
+  WebPrintf ("</FORM>\n");
+}
+
+
+/******************************************************************************
+ * Write out HTML for just the user's events, using only plain text, no form
+ * controls or other things that would look bad on a printed page.
+ */
+
+void WritePrintableListing ()
+{
+  struct tm BrokenUpDate;
+  EventIterator iEvent;
+  char TimeString[60]; // Need at least 50 for date+time in September.
+
+  WebPrintf ("%s\n", g_AllSettings["TitlePrint"].c_str ());
+
+  // Write out the event listing, with just the user's selected events.  Done
+  // as a table with five columns: event time, duration, spare time,
+  // show name, venue name.
+
+  WebPrintf ("<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n");
+
+  time_t EventTime = 0;
+  time_t PreviousTime = 0;
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end();
+  ++iEvent)
+  {
+    if (!iEvent->second.m_IsSelectedByUser)
+      continue;
+
+    // If long enough time has gone by, print out a new day heading.
+
+    EventTime = iEvent->first.m_EventTime;
+    CivilLocalTime (EventTime, BrokenUpDate);
+    double DeltaTime = difftime (EventTime, PreviousTime);
+    if (fabs (DeltaTime) > g_CommonUserSettings.m_NewDayGap)
+    {
+      FormatDayHeading (BrokenUpDate, TimeString, sizeof (TimeString));
+      WebPrintf ("<TR><TH COLSPAN=\"5\">%s</TH></TR>\n", TimeString);
+    }
+
+    // Print out the event itself.
+
+    WriteHTMLEventRow (iEvent, false /* bIncludeEditModeFeatures */);
+
+    // Update the previous time but only for events which are printed.  This
+    // lets us skip whole days if the user isn't going to see anything then.
+
+    PreviousTime = EventTime;
+  }
+
+  WebPrintf ("</TABLE>\n");
+
+  // Print a footer with the statistics.
+
+  WebPrintf ("<P ALIGN=\"CENTER\">");
+  WebPrintf ("<P ALIGN=\"CENTER\">You have %d conflicts and you are seeing %d "
+    "performances (total time %d:%02d).<BR>"
+    "There are %d redundant, %d unseen shows, and %d unseen favourites.\n",
+    g_Statistics.m_TotalNumberOfConflicts,
+    g_Statistics.m_TotalNumberOfEventsScheduled,
+    g_Statistics.m_TotalSecondsWatched / 60 / 60,
+    g_Statistics.m_TotalSecondsWatched / 60 % 60,
+    g_Statistics.m_TotalNumberOfRedundantShows,
+    g_Statistics.m_TotalNumberOfUnseenShows,
+    g_Statistics.m_TotalNumberOfUnseenFavouriteShows);
+
+  // Include the time when the table was printed, so you can tell different
+  // versions of the table apart.
+
+  time_t CurrentTime;
+  time (&CurrentTime);
+  CivilLocalTime (CurrentTime, BrokenUpDate);
+  strftime (TimeString, sizeof (TimeString), "%A, %B %d, %Y at %T",
+    &BrokenUpDate);
+  WebPrintf ("<P><FONT SIZE=\"-1\">Printed on %s.&nbsp;  Software version "
+    "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
+    "was compiled on " __DATE__ " at " __TIME__ ".</FONT>\n", TimeString);
+}
+
+
+/******************************************************************************
+ * Build a list of all the events sorted by time and show name, a more
+ * convenient order for the user than time and venue name.
+ */
+
+bool CompareEventByTimeAndShowName (EventIterator ItemA, EventIterator ItemB)
+{
+  // Compare the starting time of the events first.
+
+  if (ItemA->first.m_EventTime < ItemB->first.m_EventTime)
+    return true;
+
+  if (ItemA->first.m_EventTime > ItemB->first.m_EventTime)
+    return false;
+
+  // If at the same time, then compare show names to sort them out.
+
+  int StringTest = strcasecmp (
+    ItemA->second.m_ShowIter->first.c_str (),
+    ItemB->second.m_ShowIter->first.c_str ());
+
+  if (StringTest < 0)
+    return true;
+
+  if (StringTest > 0)
+    return false;
+
+  // Fall back to comparing venue names.  Could happen if the show is showing
+  // at two venues at the same time.
+
+  StringTest = strcasecmp (
+    ItemA->first.m_Venue->first.c_str (),
+    ItemB->first.m_Venue->first.c_str ());
+
+  if (StringTest < 0)
+    return true;
+
+  return false;
+}
+
+
+void SortEventsByTimeAndShow ()
+{
+  EventIterator iEvent;
+
+  g_EventsSortedByTimeAndShow.clear ();
+  g_EventsSortedByTimeAndShow.reserve (g_AllEvents.size ());
+
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+    g_EventsSortedByTimeAndShow.push_back (iEvent);
+
+  std::sort (g_EventsSortedByTimeAndShow.begin (),
+    g_EventsSortedByTimeAndShow.end (),
+    CompareEventByTimeAndShowName);
+
+  for (size_t i = 0; i < g_EventsSortedByTimeAndShow.size (); i++)
+    g_EventsSortedByTimeAndShow[i]->second.m_SortedIndex = i;
+}
+
+
+/******************************************************************************
+ * Generate the phantom reverse travel times for all the ones the user has
+ * specified which don't already have a reverse direction entry.
+ */
+
+void GeneratePhantomReverseTravelTimes ()
+{
+  VenueIterator iFromVenue, iFromVenueEnd;
+  TravelTimeIterator iToVenueTravelTime, iToVenueTravelTimeEnd;
+
+  iFromVenueEnd = g_AllVenues.end ();
+  for (iFromVenue = g_AllVenues.begin (); iFromVenue != iFromVenueEnd;
+  iFromVenue++)
+  {
+    iToVenueTravelTimeEnd =
+      iFromVenue->second.m_TravelTimesToOtherPlaces.end ();
+    for (iToVenueTravelTime =
+    iFromVenue->second.m_TravelTimesToOtherPlaces.begin ();
+    iToVenueTravelTime != iToVenueTravelTimeEnd; iToVenueTravelTime++)
+    {
+      if (iToVenueTravelTime->second.m_IsPhantomReverse)
+        continue; // Don't make phantoms from phantoms.
+
+      VenueIterator iReverseFromVenue, iReverseToVenue;
+
+      iReverseFromVenue = iToVenueTravelTime->first;
+      iReverseToVenue = iFromVenue;
+
+      // See if the reverse direction TravelTime entry exists.
+
+      TravelTimeIterator iReverseTravelTime = iReverseFromVenue->
+        second.m_TravelTimesToOtherPlaces.find (iReverseToVenue);
+      if (iReverseTravelTime ==
+      iReverseFromVenue->second.m_TravelTimesToOtherPlaces.end ())
+      {
+        // Not there, make a phantom reverse travel time record.
+
+        TravelTimeRecord NewTravelTime (iToVenueTravelTime->second);
+        NewTravelTime.m_IsPhantomReverse = true;
+
+        TravelTimeMap::value_type NewTravelTimePair (
+          iReverseToVenue, NewTravelTime);
+
+        iReverseFromVenue->second.m_TravelTimesToOtherPlaces.insert
+          (NewTravelTimePair);
+      }
+    }
+  }
+}
+
+
+/******************************************************************************
+ * Find the shortest path from the origin to the destination.  Stores the path
+ * in the ResultingPath vector.  Returns true if a path was found, false if the
+ * destination is unreachable (vector will be empty in that case).
+ */
+
+struct VenuePathLengthComparator {
+  bool operator() (
+    const VenueIterator ItemA,
+    const VenueIterator ItemB) const
+  {
+    int PathLengthA = ItemA->second.m_PathSearchTravelTimeToHere;
+    int PathLengthB = ItemB->second.m_PathSearchTravelTimeToHere;
+
+    if (PathLengthA < PathLengthB)
+      return true;
+    if (PathLengthA > PathLengthB)
+      return false;
+
+    // For equal path lengths, sort by venue name.
+
+    const char *NameA = ItemA->first.c_str ();
+    const char *NameB = ItemB->first.c_str ();
+    return (strcmp (NameA, NameB) < 0);
+  }
+};
+
+
+bool FindShortestPath (VenueIterator iOriginVenue,
+  VenueIterator iDestinationVenue,
+  PathVector &ResultingPath, int &PathTravelTime)
+{
+  typedef std::set<VenueIterator, VenuePathLengthComparator> VenuesSortedSet;
+  VenuesSortedSet ExploreableVenues;
+
+  ResultingPath.clear ();
+  PathTravelTime = 0;
+
+  // Mark all nodes in the graph (venues) as unreached.
+
+  VenueIterator iVenue, iVenueEnd;
+
+  iVenueEnd = g_AllVenues.end ();
+  for (iVenue = g_AllVenues.begin (); iVenue != iVenueEnd; iVenue++)
+  {
+    iVenue->second.m_PathSearchTravelledFromVenue = iVenueEnd;
+    iVenue->second.m_PathSearchTravelTimeToHere = -1;
+  }
+
+  // Start with the origin as the first place to explore.
+
+  iOriginVenue->second.m_PathSearchTravelTimeToHere = 0;
+  ExploreableVenues.insert (iOriginVenue);
+
+  // Get the next exploreable venue with the smallest path from the origin
+  // found so far.  This must be the shortest possible path to that venue.
+  // If it's the destination, then we're done.  If everything has been
+  // explored, then we can't get to the destination from the origin.
+
+  while (!ExploreableVenues.empty ())
+  {
+    if (RequestDeadlineExpiredOccasionally ())
+      break; // Out of time, pretend there is no path, the result is unused.
+
+    // Remove the venue with the shortest path from the unexplored list,
+    // we're now searching that far from the origin and we know no paths
+    // shorter than that exist.
+
+    VenueIterator iCurrentVenue = *ExploreableVenues.begin ();
+    ExploreableVenues.erase (ExploreableVenues.begin ());
+
+    // If the destination is reached, build the path vector by backtracking
+    // to the original venue and return it.  Mission accomplished.
+
+    if (iCurrentVenue == iDestinationVenue)
+    {
+      // Count up the number of venues in the path.
+
+      VenueIterator iBacktrackVenue = iCurrentVenue;
+      int PathSize = 0;
+      do {
+        PathSize++;
+        if (iBacktrackVenue == iOriginVenue)
+          break;
+        iBacktrackVenue =
+          iBacktrackVenue->second.m_PathSearchTravelledFromVenue;
+      } while (PathSize < 1000);
+
+      ResultingPath.resize (PathSize, iVenueEnd);
+
+      // Write the backtracked path in reverse order, so it appears in the
+      // ResultingPath vector from origin to destination.
+
+      iBacktrackVenue = iCurrentVenue;
+      int iPath = PathSize;
+      do {
+        iPath--;
+        ResultingPath[iPath] = iBacktrackVenue;
+        if (iBacktrackVenue == iOriginVenue)
+          break;
+        iBacktrackVenue =
+          iBacktrackVenue->second.m_PathSearchTravelledFromVenue;
+      } while (iPath > 0);
+
+      PathTravelTime = iCurrentVenue->second.m_PathSearchTravelTimeToHere;
+      return true;
+    }
+
+    // Check all the places that you can go to from this venue.  If they have
+    // shorter paths than any other path found so far to that place, update
+    // their path as coming from this venue and put them in the unexplored
+    // list.
+
+    TravelTimeIterator iTravelTimeEnd =
+      iCurrentVenue->second.m_TravelTimesToOtherPlaces.end ();
+    TravelTimeIterator iTravelTime =
+      iCurrentVenue->second.m_TravelTimesToOtherPlaces.begin ();
+    for (; iTravelTime != iTravelTimeEnd; iTravelTime++)
+    {
+      VenueIterator iNextVenue = iTravelTime->first;
+
+      int TravelDistance = iTravelTime->second.m_DistanceInMeters;
+      if (TravelDistance < 0)
+        continue; // Marks a non-traversable edge, wrong way on one way street.
+
+      int OriginToNextVenueTime = (int) (
+        TravelDistance / g_CommonUserSettings.m_WalkingSpeed +
+        iTravelTime->second.m_WorstCaseDelaySeconds *
+          (100 - g_CommonUserSettings.m_Luckiness) / 100 +
+        iCurrentVenue->second.m_PathSearchTravelTimeToHere);
+
+      if (iNextVenue->second.m_PathSearchTravelTimeToHere < 0 ||
+      OriginToNextVenueTime < iNextVenue->second.m_PathSearchTravelTimeToHere)
+      {
+        // Have found a shorter path to iNextVenue.  Update its distance and
+        // backtrack path info, and (re)add it to the exploreable list in the
+        // new distance position.
+
+        ExploreableVenues.erase (iNextVenue);
+
+        iNextVenue->second.m_PathSearchTravelTimeToHere =
+          OriginToNextVenueTime;
+        iNextVenue->second.m_PathSearchTravelledFromVenue = iCurrentVenue;
+
+        ExploreableVenues.insert (iNextVenue);
+      }
+    }
+  }
+
+  return false;
+}
+
+
+/******************************************************************************
+ * Compute conflicts, estimate walking times for the user, count number of
+ * times the user sees each show and compute various other statistics.
+ */
+
+void ComputeConflictsAndStatistics ()
+{
+  EventIterator iEvent;
+
+  /* Count up the scheduled events.  Each one gets added to the total for the
+  show, and to the grand total. */
+
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  {
+    if (!iEvent->second.m_IsSelectedByUser)
+      continue;
+
+    ShowIterator iShow = iEvent->second.m_ShowIter;
+
+    if (iShow->second.m_ScheduledCount <= 0) // First one?
+      iShow->second.m_ScheduledFirstTime = iEvent->first.m_EventTime;
+    else // Keep earliest start time.
+    {
+      if (difftime(iEvent->first.m_EventTime,
+      iShow->second.m_ScheduledFirstTime) < 0.0)
+        iShow->second.m_ScheduledFirstTime = iEvent->first.m_EventTime;
+    }
+
+    iShow->second.m_ScheduledCount++;
+
+    g_Statistics.m_TotalNumberOfEventsScheduled++;
+
+    g_Statistics.m_TotalSecondsWatched +=
+      iShow->second.m_ShowDuration;
+  }
+
+  /* Look for conflicts, where the start time of a show is inside the time
+  range of the previous show (including the time it takes to walk between
+  venues and the time it takes to wait in line to buy tickets).  Fortunately
+  the events are already sorted by start time.  Only consider adjacent shows,
+  don't worry about a really long show that overlaps multiple following
+  shows.  Also do a shortest path search to calculate the time it takes to
+  go from one venue to another.  No more big approximations! */
+
+  EventIterator iPreviousEvent = g_AllEvents.end();
+
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  {
+    if (!iEvent->second.m_IsSelectedByUser)
+      continue;
+
+    if (RequestDeadlineExpired ())
+      return; // Out of time, the caller will send an error page instead.
+
+    // Find out how long it takes to travel between events.  Sort of
+    // retroactively find it for the previous event.  The result gets
+    // saved in the event structure so it can be printed non-retroactively
+    // when showing that previous event later on.
+
+    int TravelTime = 0;
+    time_t PreviousEventEndTime = 0;
+
+    if (iPreviousEvent != g_AllEvents.end())
+    {
+      if (!FindShortestPath (iPreviousEvent->first.m_Venue,
+      iEvent->first.m_Venue, iPreviousEvent->second.m_PathToNextEvent,
+      TravelTime))
+      {
+        // Not found, empty path, use default time.
+        TravelTime = g_CommonUserSettings.m_DefaultTravelTime;
+      }
+      iPreviousEvent->second.m_TravelTimeToNextEvent = TravelTime;
+
+      PreviousEventEndTime = iPreviousEvent->first.m_EventTime +
+        iPreviousEvent->second.m_ShowIter->second.m_ShowDuration +
+        TravelTime + g_CommonUserSettings.m_LineupTime;
+
+      iPreviousEvent->second.m_SpareTimeBeforeNextEvent =
+        iEvent->first.m_EventTime - PreviousEventEndTime;
+    }
+
+    if (iEvent->first.m_EventTime < PreviousEventEndTime &&
+    iPreviousEvent != g_AllEvents.end())
+    {
+      // Have a conflict with the previous event.
+
+      iEvent->second.m_IsConflicting = true;
+      g_Statistics.m_TotalNumberOfConflicts++;
+    }
+
+    iPreviousEvent = iEvent;
+  }
+
+  // Count up the shows seen more than once and ones not seen at all.
+
+  ShowIterator iShow;
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  {
+    if (iShow->second.m_ScheduledCount > 1)
+      g_Statistics.m_TotalNumberOfRedundantShows++;
+    else if (iShow->second.m_ScheduledCount <= 0)
+    {
+      g_Statistics.m_TotalNumberOfUnseenShows++;
+
+      if (iShow->second.m_IsFavourite)
+        g_Statistics.m_TotalNumberOfUnseenFavouriteShows++;
+    }
+  }
+}
+
+
+/******************************************************************************
+ * Clearing all variables at the end of the program paid off for FastCGI where
+ * the program becomes a repeated loop.
+ */
+
+void ClearRequestData ()
+{
+  g_EventsSortedByTimeAndShow.clear();
+  g_AllEvents.clear();
+  g_AllShows.clear();
+  g_AllVenues.clear();
+  g_AllSettings.clear();
+  g_FormNameValuePairs.clear ();
+  g_EventCheckboxes.clear ();
+  g_ShowCheckboxes.clear ();
+  g_CompactEventCheckboxes.clear ();
+  g_CompactShowCheckboxes.clear ();
+  g_InputFormText = NULL;
+  g_HostNameURLFragment.clear();
+  g_Statistics.m_TotalNumberOfConflicts = 0;
+  g_Statistics.m_TotalNumberOfEventsScheduled = 0;
+  g_Statistics.m_TotalNumberOfRedundantShows = 0;
+  g_Statistics.m_TotalNumberOfUnseenFavouriteShows = 0;
+  g_Statistics.m_TotalNumberOfUnseenShows = 0;
+  g_Statistics.m_TotalSecondsWatched = 0;
+}
+
+
+/******************************************************************************
+ * Give up on the current request since it has run out of time, replacing the
+ * partly generated web page with an apology.  Returns the exit code for
+ * mainloop().
+ */
+
+int AbandonSlowRequest ()
+{
+  g_pCurrentRequest->m_OutputText.assign (REQUEST_TOO_SLOW_TEXT);
+  ClearRequestData ();
+  return 0;
+}
+
+
+/******************************************************************************
+ * The main FastCGI processing loop contents.
+ */
+
+int mainloop (int argc, char **argv)
+{
+  FormNameToValuesMap::iterator iFormPair;
+
+  // Get the host name the user used for this web server.  We'll echo it back
+  // in the URL for POSTing the form next time.  That way, if they copy and
+  // paste the web page, it will have an absolute reference to the web server
+  // and still work.  But yet also work with a LAN IP address as the host name.
+  // And preserve the http or https type of reference; we want to support both
+  // for compatibility with older unupgradable browsers.
+
+  const char *pHostName;
+  pHostName = GetRequestParameter ("HTTP_HOST");
+  if (pHostName != NULL)
+  {
+    const char *pRequestScheme; // Will be "http" or "https".
+    pRequestScheme = GetRequestParameter ("REQUEST_SCHEME");
+    if (pRequestScheme == NULL || pRequestScheme[0] == 0)
+      pRequestScheme = "http";
+    g_HostNameURLFragment.assign (pRequestScheme);
+    g_HostNameURLFragment.append ("://");
+    g_HostNameURLFragment.append (pHostName);
+  }
+  else
+    g_HostNameURLFragment.clear ();
+
+  /* The data from the web browser has already been read and decoded by the
+  network code as it arrived, limited to the length given by the CGI
+  parameters, see DecodeFormInput().
+  */
+
+  size_t FormTextLength = g_pCurrentRequest->m_FormDecoder.m_FormText.size ();
+
+  // The web page is mostly the saved state text again plus the listings, so
+  // make room for several times the input up front rather than growing the
+  // output text bit by bit.
+
+  g_pCurrentRequest->m_OutputText.reserve (5 * FormTextLength + 65536);
+
+  WriteHTMLHeader ();
+
+#if 0
+  WebPrintf ("<PRE>Argc %d, argv: ", argc);
+  for (int i = 0; i < argc; i++)
+    WebPrintf ("%s%s", argv[i], (i < argc - 1) ? ", " : "\n");
+  WebPrintf ("Decoded form text length is %lu.\n",
+    (unsigned long) FormTextLength);
+  WebPrintf ("CGI parameters are:\n");
+  {
+    int iEnv = 0;
+    ParameterMap::iterator iParameter;
+    for (iParameter = g_pCurrentRequest->m_Parameters.begin ();
+    iParameter != g_pCurrentRequest->m_Parameters.end ();
+    ++iParameter, iEnv++)
+    {
+      WebPrintf ("%02d: \"%s=%s\"\n", iEnv,
+        iParameter->first.c_str (), iParameter->second.c_str ());
+    }
+  }
+  WebPrintf ("</PRE>\n");
+#endif
+
+  BuildFormNameAndValuePairsFromFormInput ();
+
+#if 0
+  WebPrintf ("Converted form input:\n<PRE>");
+  for (iFormPair = g_FormNameValuePairs.begin();
+  iFormPair != g_FormNameValuePairs.end(); ++iFormPair)
+  {
+    WebPrintf ("Name \"%s\", value: %s\n",
+      iFormPair->first, iFormPair->second);
+  }
+  WebPrintf ("</PRE>\n");
+#endif
+
+  // If the web browser already has the page for this exact form state (the
+  // user reloaded the page without changing anything), tell it to reuse that
+  // page and skip all the work.  Only GET and HEAD can be answered that way,
+  // other methods like POST always get the page.  Either way label the page
+  // with the hash, as a weak entity tag since the time stamps in it will
+  // differ.
+
+  char EntityTag[24];
+  g_pCurrentRequest->m_StateHash =
+    ComputeStateHash (g_pCurrentRequest->m_FormDecoder.m_FormText);
+  snprintf (EntityTag, sizeof (EntityTag), "\"%016llx\"",
+    (unsigned long long) g_pCurrentRequest->m_StateHash);
+  std::string ETagHeader ("ETag: W/");
+  ETagHeader.append (EntityTag);
+  ETagHeader.append ("\r\n");
+
+  const char *pMethod = GetRequestParameter ("REQUEST_METHOD");
+  if (pMethod != NULL &&
+  (strcmp (pMethod, "GET") == 0 || strcmp (pMethod, "HEAD") == 0) &&
+  EntityTagListMatches (GetRequestParameter ("HTTP_IF_NONE_MATCH"),
+  EntityTag))
+  {
+    g_pCurrentRequest->m_OutputText.assign ("Status: 304 Not Modified\r\n");
+    g_pCurrentRequest->m_OutputText.append (ETagHeader);
+    g_pCurrentRequest->m_OutputText.append ("\r\n");
+    ClearRequestData ();
+    return 0;
+  }
+  g_pCurrentRequest->m_OutputText.insert (0, ETagHeader);
+
+  // Set up the global list of settings, for things like the HTML strings that
+  // highlight selected items.  They will be overwritten by user provided
+  // settings.  Some are also used for defaults while reading other values.
+
+  InitialiseDefaultSettings ();
+
+  // Load up the saved state information first, we'll apply the user's changes
+  // (checkbox markings) afterwards.  If there isn't any saved data, just leave
+  // it empty.
+
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *>("SavedState"));
+  if (iFormPair != g_FormNameValuePairs.end ())
+  {
+    LoadStateInformation (iFormPair->second);
+  }
+  if (RequestDeadlineExpired ())
+    return AbandonSlowRequest ();
+
+  // Check that the submitted form controls match the SavedState data.  They
+  // can mismatch if someone pastes in some old or new data into the SavedState
+  // text box.  If so, don't read the controls from the form, they are invalid
+  // in so many ways.
+
+  bool bFormDataMatchesStateData = false;
+  iFormPair = g_FormNameValuePairs.find (
+    const_cast<char *> ("LastUpdateTime"));
+  if (iFormPair != g_FormNameValuePairs.end ())
+  {
+    bFormDataMatchesStateData =
+     (g_AllSettings["LastUpdateTime"] == iFormPair->second);
+  }
+  SortEventsByTimeAndShow (); // Also numbers events for compact checkboxes.
+  if (bFormDataMatchesStateData)
+  {
+    ReadFormControls ();
+  }
+
+  ValidateUserSettings ();
+  GeneratePhantomReverseTravelTimes ();
+  ComputeConflictsAndStatistics ();
+  if (RequestDeadlineExpired ())
+    return AbandonSlowRequest ();
+  ResetDynamicSettings (); // New form needs new date.
+
+  if (g_FormNameValuePairs.find (const_cast<char *> ("PrintSchedule")) !=
+  g_FormNameValuePairs.end ()) // Was the printable schedule button used?
+    WritePrintableListing (); // Just the user's events listed plainly.
+  else // Output the user interface with all the bells and whistles.
+    WriteHTMLForm ();
+
+  // Dump out some debug information.
+
+#if 0
+  WebPrintf ("<PRE>\n");
+  WebPrintf ("List of %lu shows:\n", g_AllShows.size ());
+  ShowIterator iShow;
+  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  {
+    WebPrintf ("Show \"%s\", Favourite %d, EventCount %d, ScheduledCount %d, URL \"%s\".\n",
+      iShow->first.c_str(), iShow->second.m_IsFavourite,
+      iShow->second.m_EventCount, iShow->second.m_ScheduledCount,
+      iShow->second.m_ShowURL.c_str());
+  }
+
+  WebPrintf ("List of %lu venues:\n", g_AllVenues.size ());
+  VenueIterator iVenue;
+  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+  {
+    WebPrintf ("Venue \"%s\", EventCount %d, URL \"%s\".\n",
+      iVenue->first.c_str(), iVenue->second.m_EventCount,
+      iVenue->second.m_VenueURL.c_str());
+  }
+
+  WebPrintf ("List of %lu events:\n", g_AllEvents.size ());
+  EventIterator iEvent;
+  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  {
+    struct tm BrokenUpDate;
+    char TimeString[60];
+
+    CivilLocalTime (iEvent->first.m_EventTime, BrokenUpDate);
+    FormatFullTime (BrokenUpDate, TimeString, sizeof (TimeString));
+
+    WebPrintf ("Event %s/%s, \"%s\"%s\n",
+      TimeString, iEvent->first.m_Venue->first.c_str(),
+      iEvent->second.m_ShowIter->first.c_str(),
+      (iEvent->second.m_IsSelectedByUser) ? ", Selected" : "");
+  }
+
+  WebPrintf ("List of %lu settings:\n", g_AllSettings.size ());
+  SettingIterator iSetting;
+  for (iSetting = g_AllSettings.begin(); iSetting != g_AllSettings.end(); ++iSetting)
+  {
+    WebPrintf ("Setting \"%s\" is \"%s\".\n",
+      iSetting->first.c_str(), iSetting->second.c_str());
+  }
+  WebPrintf ("</PRE>\n");
+#endif
+
+  WebPrintf ("</BODY>\n</HTML>\n");
+
+  ClearRequestData ();
+  return 0;
+}
+
+
+/******************************************************************************
+ * Settings for running the server, mostly from the command line.
+ */
+
+enum ProtocolType
+{
+  PROTOCOL_FASTCGI = 0, /* Talking to a web server like NGINX. */
+  PROTOCOL_HTTP /* Talking directly to web browsers. */
+};
+
+struct ListenSocketStruct
+{
+  std::string m_Address;
+    /* Where to listen, as specified by the user.  Things like "127.0.0.1:9000"
+    or "[::1]:9000" or "unix:/run/ffvso.sock,mode=0660,http", see
+    OpenListenSocket() for details. */
+
+  int m_Socket;
+    /* File handle of the listening socket, -1 if not open yet. */
+
+  ProtocolType m_Protocol;
+    /* What the connections accepted from this socket speak. */
+
+  ListenSocketStruct () : m_Socket(-1), m_Protocol(PROTOCOL_FASTCGI)
+  {};
+};
+
+struct ServerSettingsStruct
+{
+  std::vector<ListenSocketStruct> m_ListenSockets;
+    /* Sockets listening for connections from the web server, or from web
+    browsers.  All are handled by the same event loop. */
+
+  int m_Backlog;
+    /* Length of the queue of not yet accepted connections, for each listen
+    socket. */
+
+  ProtocolType m_DefaultProtocol;
+    /* What the listen sockets speak, unless their address says otherwise.
+    Usually FastCGI, but for testing and small installations without a
+    separate web server we can do HTTP/1.1 ourselves. */
+
+  int m_NumberOfProcesses;
+    /* How many worker processes to pre-fork.  One means no forking, the
+    original process does all the work. */
+
+  int m_NumberOfThreads;
+    /* How many worker threads to run in each process, each thread handling
+    one request at a time. */
+
+  int m_QueueLimit;
+    /* Maximum number of requests waiting for a worker thread.  Once the queue
+    is full, further requests get an immediate "busy, try again" page, which
+    is better than them waiting until the web browser times out.  Zero for no
+    limit. */
+
+  size_t m_HeavySize;
+    /* Requests with more form data than this many bytes are considered heavy
+    and get handled after the others. */
+
+  double m_TimeLimit;
+  double m_CPULimit;
+    /* Seconds allowed for a request, counting from when it was received, and
+    seconds of CPU time allowed for generating the web page.  Zero for no
+    limit.  See RequestDeadlineExpired(). */
+
+  int m_argc;
+  char **m_argv;
+    /* Command line arguments, passed on to mainloop() for debugging, and
+    reused when starting a new copy of the program for an upgrade. */
+
+  std::string m_ProgramPath;
+    /* Where the program file is, for starting a new copy of it.  An absolute
+    path if possible, since the current directory may change. */
+
+  int m_CompressLevel;
+  size_t m_CompressMinSize;
+    /* Web pages are compressed with this zlib level (1 fastest to 9 smallest,
+    zero to turn off compression), if the web browser accepts it and the page
+    is at least this many bytes long.  Small pages aren't worth the effort. */
+
+  size_t m_CacheSize;
+  double m_CacheMaxAge;
+    /* Memory budget in bytes for the response cache (zero to turn it off),
+    and how many seconds a cached web page can be reused for.  The pages have
+    the time they were made in them, so they shouldn't live too long. */
+
+  bool m_ServeStatistics;
+    /* Answer requests for the server statistics.  Off unless asked for, since
+    they're for the people running the server, not for the whole world. */
+
+  ServerSettingsStruct () : m_Backlog(100),
+    m_DefaultProtocol(PROTOCOL_FASTCGI), m_NumberOfProcesses(1),
+    m_NumberOfThreads(1), m_QueueLimit(100), m_HeavySize(200000),
+    m_TimeLimit(30), m_CPULimit(10), m_argc(0), m_argv(NULL),
+    m_CompressLevel(6), m_CompressMinSize(1024), m_CacheSize(32000000),
+    m_CacheMaxAge(300), m_ServeStatistics(false)
+  {};
+
+} g_ServerSettings;
+
+
+/******************************************************************************
+ * Server statistics, counting what happened since the process started.  Each
+ * process has its own.  If the --statistics option is on, they can be seen by
+ * asking for the CGI path with a query string of "ServerStatistics".  Atomic
+ * since both the network thread and the worker threads update them.
+ */
+
+struct ServerStatisticsStruct
+{
+  std::atomic<uint64_t> m_ConnectionsAccepted;
+  std::atomic<uint64_t> m_RequestsReceived;
+  std::atomic<uint64_t> m_RequestsByPriority[PRIORITY_MAX];
+    /* Received requests, counted by what kind they are. */
+  std::atomic<uint64_t> m_RequestsCompleted;
+    /* Requests where a worker thread ran mainloop(). */
+  std::atomic<uint64_t> m_RequestsRejected;
+    /* Requests answered with the busy page since the queue was full. */
+  std::atomic<uint64_t> m_RequestsTooSlow;
+    /* Requests which ran out of time and were abandoned. */
+  std::atomic<uint64_t> m_RequestsTooLarge;
+    /* Requests turned away since they had too much form data. */
+  std::atomic<uint64_t> m_LongestQueue;
+    /* Most requests seen waiting for a worker thread at once. */
+  std::atomic<uint64_t> m_ResponsesCompressed;
+  std::atomic<uint64_t> m_BytesBeforeCompression;
+  std::atomic<uint64_t> m_BytesAfterCompression;
+    /* Compressed web pages and the size of their bodies. */
+  std::atomic<uint64_t> m_CacheHits;
+  std::atomic<uint64_t> m_CacheMisses;
+    /* Requests answered from the response cache, and cacheable requests
+    which weren't in it. */
+  std::atomic<uint64_t> m_RequestsCoalesced;
+    /* Requests which waited for an identical one already in progress and
+    shared its response, rather than doing the same work again. */
+};
+
+static ServerStatisticsStruct g_ServerStatistics;
+
+
+/******************************************************************************
+ * Response compression.  The edit web page has the whole catalog in it twice,
+ * once as the event table and again in the saved state text box, so it's
+ * hundreds of kilobytes for a full festival, and people are often using
+ * mobile data.  It's mostly repetitive HTML, so gzip shrinks it a lot.  The
+ * compression is done in the worker thread right after the page is generated,
+ * to keep the network thread responsive.
+ */
+
+/* Pick the encoding from the web browser's Accept-Encoding header, which is a
+comma separated list of names, each optionally followed by ";q=" and a
+preference value from 0 to 1.  Zero means not acceptable.  Returns the zlib
+window bits to use for the chosen encoding (with 16 added to get a gzip
+wrapper rather than a zlib one), or zero for no compression. */
+
+int ChooseContentEncoding (const char *pAcceptEncoding,
+  const char **ppEncodingName)
+{
+  double BestQuality = 0;
+  int BestWindowBits = 0;
+
+  *ppEncodingName = NULL;
+  if (pAcceptEncoding == NULL)
+    return 0;
+
+  std::string Accept (pAcceptEncoding);
+  size_t Start = 0;
+  while (Start < Accept.size ())
+  {
+    size_t End = Accept.find (',', Start);
+    if (End == std::string::npos)
+      End = Accept.size ();
+    std::string Item (Accept, Start, End - Start);
+    Start = End + 1;
+
+    double Quality = 1.0;
+    size_t Semicolon = Item.find (';');
+    if (Semicolon != std::string::npos)
+    {
+      size_t QualityStart = Item.find ("q=", Semicolon);
+      if (QualityStart != std::string::npos)
+        Quality = atof (Item.c_str () + QualityStart + 2);
+      Item.erase (Semicolon);
+    }
+    size_t NameStart = Item.find_first_not_of (" \t");
+    size_t NameEnd = Item.find_last_not_of (" \t");
+    if (NameStart == std::string::npos)
+      continue;
+    std::string Name (Item, NameStart, NameEnd + 1 - NameStart);
+    for (size_t i = 0; i < Name.size (); i++)
+      Name[i] = tolower (Name[i]);
+
+    // Prefer gzip when there's a tie, it's the most widely supported.
+
+    if ((Name == "gzip" || Name == "x-gzip" || Name == "*") &&
+    Quality > 0 && Quality >= BestQuality)
+    {
+      BestQuality = Quality;
+      BestWindowBits = 16 + MAX_WBITS;
+      *ppEncodingName = "gzip";
+    }
+    else if (Name == "deflate" && Quality > BestQuality)
+    {
+      BestQuality = Quality;
+      BestWindowBits = MAX_WBITS;
+      *ppEncodingName = "deflate";
+    }
+  }
+  return BestWindowBits;
+}
+
+
+/* Compress the body of the request's output text, if the settings and the web
+browser allow it.  The CGI headers at the start of the text get the
+Content-Encoding header added.  Pages which have already been encoded are left
+alone, ones which aren't text or are small just get the Vary header. */
+
+void CompressResponse (RequestStruct *pRequest)
+{
+  std::string &Text = pRequest->m_OutputText;
+  size_t BodyStart = 0;
+  size_t LineStart = 0;
+  bool IsText = false;
+
+  if (g_ServerSettings.m_CompressLevel <= 0)
+    return;
+
+  // Find the end of the headers, and check the content type.
+
+  while (LineStart < Text.size ())
+  {
+    size_t LineEnd = Text.find ('\n', LineStart);
+    if (LineEnd == std::string::npos)
+      return; // No headers, leave it alone.
+    size_t LineLength = LineEnd - LineStart;
+    if (LineLength > 0 && Text[LineEnd - 1] == '\r')
+      LineLength--;
+    if (LineLength == 0)
+    {
+      BodyStart = LineEnd + 1;
+      break;
+    }
+    if (strncasecmp (Text.c_str () + LineStart, "Content-Encoding:", 17) == 0)
+      return;
+    if (strncasecmp (Text.c_str () + LineStart, "Content-Type:", 13) == 0)
+    {
+      size_t ValueStart = Text.find_first_not_of (" \t", LineStart + 13);
+      IsText = (ValueStart < LineEnd &&
+        strncasecmp (Text.c_str () + ValueStart, "text/", 5) == 0);
+    }
+    LineStart = LineEnd + 1;
+  }
+  if (BodyStart == 0)
+    return;
+
+  // With compression turned on, what gets sent could depend on what the
+  // browser accepts, so caches need to know that, even if this particular
+  // page ends up not being compressed.
+
+  std::string Headers ("Vary: Accept-Encoding\r\n");
+  const char *pEncodingName;
+  int WindowBits = ChooseContentEncoding (
+    GetRequestParameter ("HTTP_ACCEPT_ENCODING"), &pEncodingName);
+  if (WindowBits == 0 || !IsText ||
+  Text.size () - BodyStart < g_ServerSettings.m_CompressMinSize)
+  {
+    Text.insert (0, Headers);
+    return;
+  }
+  Headers.append ("Content-Encoding: ");
+  Headers.append (pEncodingName);
+  Headers.append ("\r\n");
+
+  // Compress directly from the page text into the new output text, after the
+  // headers.  The zlib bound is the worst case size, so it's done in one go.
+
+  z_stream Stream;
+  memset (&Stream, 0, sizeof (Stream));
+  if (deflateInit2 (&Stream, g_ServerSettings.m_CompressLevel, Z_DEFLATED,
+  WindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    Text.insert (0, "Vary: Accept-Encoding\r\n");
+    return;
+  }
+
+  size_t BodyLength = Text.size () - BodyStart;
+  size_t HeadersLength = Headers.size () + BodyStart;
+  std::string Compressed;
+  Compressed.reserve (HeadersLength + deflateBound (&Stream, BodyLength));
+  Compressed.append (Headers);
+  Compressed.append (Text, 0, BodyStart);
+  Compressed.resize (HeadersLength + deflateBound (&Stream, BodyLength));
+
+  Stream.next_in = (Bytef *) &Text[BodyStart];
+  Stream.avail_in = BodyLength;
+  Stream.next_out = (Bytef *) &Compressed[HeadersLength];
+  Stream.avail_out = Compressed.size () - HeadersLength;
+  int ErrorCode = deflate (&Stream, Z_FINISH);
+  size_t CompressedLength = Stream.total_out;
+  deflateEnd (&Stream);
+
+  if (ErrorCode != Z_STREAM_END || CompressedLength >= BodyLength)
+  {
+    Text.insert (0, "Vary: Accept-Encoding\r\n");
+    return;
+  }
+  Compressed.resize (HeadersLength + CompressedLength);
+  Text.swap (Compressed);
+
+  g_ServerStatistics.m_ResponsesCompressed++;
+  g_ServerStatistics.m_BytesBeforeCompression += BodyLength;
+  g_ServerStatistics.m_BytesAfterCompression += CompressedLength;
+}
+
+
+/******************************************************************************
+ * Worker threads.  Each one takes complete requests off the waiting queue,
+ * runs mainloop() to generate the web page and puts the finished request on
+ * the finished queue for the network thread to send.  The per-request globals
+ * are thread_local, so several web browsers can be served at the same time
+ * without one slow request (a huge SavedState or a long path search) holding
+ * up everybody else.  Workers never touch the network, so a web browser which
+ * is slowly uploading its form doesn't tie one up.
+ */
+
+static pthread_mutex_t g_QueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_QueueCondition = PTHREAD_COND_INITIALIZER;
+  /* Protects the queues and the exit flag below.  The condition is signalled
+  when a request is added to the waiting queue, or when it's time to exit. */
+
+static std::deque<RequestStruct *> g_WaitingRequests[PRIORITY_MAX];
+  /* Complete requests received from the web server, waiting for a worker
+  thread to become available.  One queue for each priority level. */
+
+static size_t g_NumberOfWaitingRequests = 0;
+  /* Total number of requests in all the waiting queues. */
+
+static int g_TimesPassedOver[PRIORITY_MAX];
+  /* For each queue, how many requests in a row were taken from other queues
+  while it had something waiting. */
+
+const int MAX_TIMES_PASSED_OVER = 8;
+  /* After this many, a queue gets a turn regardless of its priority, so a
+  steady stream of print and normal requests can't starve the heavy ones (or
+  print requests the normal ones) forever. */
+
+static std::deque<RequestStruct *> g_FinishedRequests;
+  /* Requests with their web page generated, waiting for the network thread to
+  send them back to the web server. */
+
+static bool g_WorkersShouldExit = false;
+  /* Set when shutting down.  Worker threads exit once the waiting queue is
+  empty. */
+
+static int g_WakeUpEventFD = -1;
+  /* An eventfd watched by the network thread.  Written to by worker threads
+  when they finish a request, and by signal handlers, to wake it up. */
+
+
+void WakeUpNetworkThread ()
+{
+  uint64_t One = 1;
+  ssize_t AmountWritten;
+
+  AmountWritten = write (g_WakeUpEventFD, &One, sizeof (One));
+  (void) AmountWritten; // Only fails if the counter is huge, still awake.
+}
+
+
+/******************************************************************************
+ * Take the next request to work on from the waiting queues.  Usually that's
+ * the oldest one from the highest priority queue with something in it.  The
+ * queue mutex must be locked, and there must be something waiting.
+ */
+
+RequestStruct *TakeWaitingRequest ()
+{
+  int iPriority;
+  int iTake = -1;
+
+  // If several queues have been passed over too often, the lowest priority
+  // one goes first, the others get their turns right after.
+
+  for (iPriority = 0; iPriority < PRIORITY_MAX; iPriority++)
+  {
+    if (g_WaitingRequests[iPriority].empty ())
+      g_TimesPassedOver[iPriority] = 0;
+    else if (iTake < 0 ||
+    g_TimesPassedOver[iPriority] >= MAX_TIMES_PASSED_OVER)
+      iTake = iPriority;
+  }
+
+  for (iPriority = 0; iPriority < PRIORITY_MAX; iPriority++)
+  {
+    if (iPriority == iTake)
+      g_TimesPassedOver[iPriority] = 0;
+    else if (!g_WaitingRequests[iPriority].empty ())
+      g_TimesPassedOver[iPriority]++;
+  }
+
+  RequestStruct *pRequest = g_WaitingRequests[iTake].front ();
+  g_WaitingRequests[iTake].pop_front ();
+  g_NumberOfWaitingRequests--;
+  return pRequest;
+}
+
+
+/******************************************************************************
+ * Response cache.  People often submit exactly the same form again: reloading
+ * the page, pressing Print right after Update, or several people starting from
+ * the same shared starter page.  Rather than redoing all the parsing and path
+ * finding, the finished web page (compressed, if it was) is kept in memory and
+ * reused for identical requests.  The least recently used pages are discarded
+ * when over the memory budget.  Only the network thread uses the cache, so no
+ * locking is needed.
+ */
+
+struct CachedResponseStruct
+{
+  uint64_t m_Key;
+  std::shared_ptr<const std::string> m_pKeyText;
+    /* The hashed key and what went into it.  Different requests can have the
+    same hash, so the text gets compared too. */
+  std::shared_ptr<std::string> m_pText;
+    /* The whole response, CGI headers and web page, shared with the requests
+    which are sending it. */
+  double m_TimeAdded;
+    /* CLOCK_MONOTONIC seconds when it was added to the cache. */
+};
+
+typedef std::list<CachedResponseStruct> CachedResponseList;
+typedef std::map<uint64_t, CachedResponseList::iterator> CachedResponseMap;
+
+static CachedResponseList g_CachedResponses;
+  /* Most recently used first. */
+
+static CachedResponseMap g_CachedResponsesByKey;
+  /* For finding responses in the list by key. */
+
+static size_t g_CachedResponsesSize;
+  /* Total bytes used by the cached responses, roughly. */
+
+const size_t CACHED_RESPONSE_OVERHEAD = 256;
+  /* Estimated bytes used by the list and map for each cached response. */
+
+struct RequestInFlightStruct
+{
+  std::shared_ptr<const std::string> m_pKeyText;
+    /* Key text of the request being worked on. */
+  std::vector<RequestStruct *> m_WaitingRequests;
+    /* Identical requests waiting to share its response. */
+};
+
+typedef std::map<uint64_t, RequestInFlightStruct> RequestsInFlightMap;
+
+static RequestsInFlightMap g_RequestsInFlight;
+  /* Cacheable requests being worked on, by cache key, each with the identical
+  requests which arrived meanwhile and are waiting to share its response.
+  When a festival posts a link to its starter page, dozens of people submit
+  the same form at once, and only one worker thread needs to do the work. */
+
+static uint64_t g_CacheKeySeed;
+  /* Random for each process, so nobody can work out ahead of time which
+  requests will have the same cache key hash. */
+
+
+/* Pick a new random hash seed for the cache keys. */
+
+void ChooseCacheKeySeed ()
+{
+  if (getrandom (&g_CacheKeySeed, sizeof (g_CacheKeySeed), 0) !=
+  sizeof (g_CacheKeySeed))
+    g_CacheKeySeed = HashBytes (&g_CacheKeySeed, sizeof (g_CacheKeySeed),
+      ((uint64_t) getpid () << 32) ^ (uint64_t) (GetClockSeconds (
+      CLOCK_REALTIME) * 1000000)); // Not great, but better than nothing.
+}
+
+
+/* The text is the same only if all the bytes are the same, a matching hash
+just means it's likely. */
+
+bool SameCacheKeyText (const std::string &TextA, const std::string &TextB)
+{
+  return TextA.size () == TextB.size () &&
+    memcmp (TextA.data (), TextB.data (), TextA.size ()) == 0;
+}
+
+
+/* Bytes of memory used by a cached response, roughly. */
+
+size_t CachedResponseSize (const CachedResponseStruct &Response)
+{
+  return Response.m_pText->size () + Response.m_pKeyText->size () +
+    CACHED_RESPONSE_OVERHEAD;
+}
+
+
+/* Figure out the key for a request, a hash of everything which affects the
+response: the decoded form data, the host name and scheme used in the form's
+URL, and the compression the web browser accepts.  The text that was hashed is
+saved in the request, to tell apart different requests with the same hash.
+Returns zero for requests which shouldn't be cached or shared, such as ones
+asking if their copy is still good, since they want a different answer.  Heavy
+ones aren't worth it either, they're rarely repeated and hashing them would
+hold up the network thread. */
+
+uint64_t ComputeResponseCacheKey (RequestStruct *pRequest)
+{
+  const char *pEncodingName;
+  const char *pValue;
+
+  pRequest->m_pCacheKeyText.reset ();
+  if (pRequest->m_Parameters.count ("HTTP_IF_NONE_MATCH") != 0 ||
+  pRequest->m_FormDecoder.m_FormText.size () > g_ServerSettings.m_HeavySize)
+    return 0;
+
+  // GetRequestParameter() only works for the current request.
+
+  RequestStruct *pSavedRequest = g_pCurrentRequest;
+  g_pCurrentRequest = pRequest;
+
+  std::shared_ptr<std::string> pKeyText = std::make_shared<std::string> ();
+  pKeyText->assign (pRequest->m_FormDecoder.m_FormText);
+  pKeyText->append (1, 0);
+  const char *ParameterNames[] = {"HTTP_HOST", "REQUEST_SCHEME"};
+  for (size_t i = 0; i < sizeof (ParameterNames) / sizeof (char *); i++)
+  {
+    pValue = GetRequestParameter (ParameterNames[i]);
+    if (pValue == NULL)
+      pValue = "";
+    pKeyText->append (pValue, strlen (pValue) + 1);
+  }
+  if (g_ServerSettings.m_CompressLevel > 0 && ChooseContentEncoding (
+  GetRequestParameter ("HTTP_ACCEPT_ENCODING"), &pEncodingName) != 0)
+    pKeyText->append (pEncodingName);
+
+  g_pCurrentRequest = pSavedRequest;
+  pRequest->m_pCacheKeyText = pKeyText;
+  uint64_t Hash = HashBytes (pKeyText->data (), pKeyText->size (),
+    g_CacheKeySeed);
+  return (Hash == 0) ? 1 : Hash;
+}
+
+
+/* Returns the cached response for the key, or NULL if there isn't a fresh
+one. */
+
+std::shared_ptr<std::string> LookUpCachedResponse (uint64_t Key,
+  const std::string &KeyText)
+{
+  CachedResponseMap::iterator iFound = g_CachedResponsesByKey.find (Key);
+
+  if (iFound == g_CachedResponsesByKey.end () ||
+  !SameCacheKeyText (*iFound->second->m_pKeyText, KeyText))
+  {
+    g_ServerStatistics.m_CacheMisses++;
+    return std::shared_ptr<std::string> ();
+  }
+
+  CachedResponseList::iterator iResponse = iFound->second;
+  if (g_ServerSettings.m_CacheMaxAge > 0 && iResponse->m_TimeAdded +
+  g_ServerSettings.m_CacheMaxAge < GetClockSeconds (CLOCK_MONOTONIC))
+  {
+    g_CachedResponsesSize -= CachedResponseSize (*iResponse);
+    g_CachedResponses.erase (iResponse);
+    g_CachedResponsesByKey.erase (iFound);
+    g_ServerStatistics.m_CacheMisses++;
+    return std::shared_ptr<std::string> ();
+  }
+
+  g_CachedResponses.splice (g_CachedResponses.begin (), g_CachedResponses,
+    iResponse);
+  g_ServerStatistics.m_CacheHits++;
+  return iResponse->m_pText;
+}
+
+
+/* Add a response to the cache, discarding the least recently used ones to
+stay within the memory budget.  Ones too big to share the cache with several
+others aren't added. */
+
+void AddCachedResponse (uint64_t Key,
+  const std::shared_ptr<const std::string> &pKeyText,
+  const std::shared_ptr<std::string> &pText)
+{
+  CachedResponseStruct NewResponse;
+  NewResponse.m_Key = Key;
+  NewResponse.m_pKeyText = pKeyText;
+  NewResponse.m_pText = pText;
+  size_t Size = CachedResponseSize (NewResponse);
+
+  if (Size > g_ServerSettings.m_CacheSize / 8 ||
+  g_CachedResponsesByKey.find (Key) != g_CachedResponsesByKey.end ())
+    return;
+
+  while (!g_CachedResponses.empty () &&
+  g_CachedResponsesSize + Size > g_ServerSettings.m_CacheSize)
+  {
+    CachedResponseStruct &Oldest = g_CachedResponses.back ();
+    g_CachedResponsesSize -= CachedResponseSize (Oldest);
+    g_CachedResponsesByKey.erase (Oldest.m_Key);
+    g_CachedResponses.pop_back ();
+  }
+
+  NewResponse.m_TimeAdded = GetClockSeconds (CLOCK_MONOTONIC);
+  g_CachedResponses.push_front (NewResponse);
+  g_CachedResponsesByKey[Key] = g_CachedResponses.begin ();
+  g_CachedResponsesSize += Size;
+}
+
+
+/* Get the response to a finished request as a shared string, ready to be
+sent.  Adds it to the response cache if it's cacheable. */
+
+std::shared_ptr<std::string> TakeResponseText (RequestStruct *pRequest)
+{
+  std::shared_ptr<std::string> pText = pRequest->m_pSharedOutputText;
+
+  if (!pText)
+  {
+    pText = std::make_shared<std::string> ();
+    pText->swap (pRequest->m_OutputText);
+    if (pRequest->m_CacheKey != 0 && pRequest->m_ExitStatus == 0 &&
+    !pRequest->m_TooSlow)
+      AddCachedResponse (pRequest->m_CacheKey, pRequest->m_pCacheKeyText,
+        pText);
+  }
+  return pText;
+}
+
+
+/* A request has finished.  If identical ones are waiting for it, give them
+the same response and add them to the list of finished requests, so they get
+sent too.  The waiting ones belong to the request with the same key text, not
+some other one which happens to have the same hash. */
+
+void ShareResponseWithWaitingRequests (RequestStruct *pRequest,
+  std::deque<RequestStruct *> &Finished)
+{
+  RequestsInFlightMap::iterator iFlight =
+    g_RequestsInFlight.find (pRequest->m_CacheKey);
+
+  if (iFlight == g_RequestsInFlight.end () ||
+  iFlight->second.m_pKeyText != pRequest->m_pCacheKeyText)
+    return;
+
+  std::vector<RequestStruct *> Waiting;
+  Waiting.swap (iFlight->second.m_WaitingRequests);
+  g_RequestsInFlight.erase (iFlight);
+
+  pRequest->m_pSharedOutputText = TakeResponseText (pRequest);
+  for (size_t i = 0; i < Waiting.size (); i++)
+  {
+    Waiting[i]->m_pSharedOutputText = pRequest->m_pSharedOutputText;
+    Waiting[i]->m_ExitStatus = pRequest->m_ExitStatus;
+    Finished.push_back (Waiting[i]);
+  }
+}
+
+
+void *WorkerThread (void *pArgument)
+{
+  RequestStruct *pRequest;
+
+  while (true)
+  {
+    pthread_mutex_lock (&g_QueueMutex);
+    while (g_NumberOfWaitingRequests == 0 && !g_WorkersShouldExit)
+      pthread_cond_wait (&g_QueueCondition, &g_QueueMutex);
+    if (g_NumberOfWaitingRequests == 0)
+    {
+      pthread_mutex_unlock (&g_QueueMutex);
+      break;
+    }
+    pRequest = TakeWaitingRequest ();
+    pthread_mutex_unlock (&g_QueueMutex);
+
+    g_RequestDeadline.m_WallClockDeadline = pRequest->m_WallClockDeadline;
+    g_RequestDeadline.m_CPUDeadline = 0;
+    if (g_ServerSettings.m_CPULimit > 0)
+      g_RequestDeadline.m_CPUDeadline = g_ServerSettings.m_CPULimit +
+        GetClockSeconds (CLOCK_THREAD_CPUTIME_ID);
+    g_RequestDeadline.m_CheckCounter = 0;
+    g_RequestDeadline.m_HasExpired = false;
+
+    g_pCurrentRequest = pRequest;
+    pRequest->m_ExitStatus =
+      mainloop (g_ServerSettings.m_argc, g_ServerSettings.m_argv);
+    CompressResponse (pRequest);
+    g_pCurrentRequest = NULL;
+
+    g_ServerStatistics.m_RequestsCompleted++;
+    if (g_RequestDeadline.m_HasExpired)
+    {
+      g_ServerStatistics.m_RequestsTooSlow++;
+      pRequest->m_TooSlow = true;
+    }
+
+    pthread_mutex_lock (&g_QueueMutex);
+    g_FinishedRequests.push_back (pRequest);
+    pthread_mutex_unlock (&g_QueueMutex);
+    WakeUpNetworkThread ();
+  }
+  return NULL;
+}
+
+
+/******************************************************************************
+ * Network connections from the web server.  All of the socket input and output
+ * is done by one network thread using epoll and non-blocking sockets, so any
+ * number of connections can be open without tying up a thread for each one.
+ * A connection has buffers for partially received records and for output
+ * which the socket wasn't ready to accept yet.
+ */
+
+const uint64_t EPOLL_WAKE_UP_DATA = 0;
+const uint64_t EPOLL_FIRST_LISTEN_DATA = 1;
+const uint64_t EPOLL_FIRST_CONNECTION_SERIAL = (uint64_t) 1 << 32;
+  /* The epoll user data says what had an event: the wake up eventfd, one of
+  the listen sockets (1 plus its index), or a connection (identified by its
+  serial number). */
+
+typedef std::map<int, RequestStruct *> RequestIDMap;
+
+struct OutputSliceStruct
+{
+  std::shared_ptr<std::string> m_pText;
+    /* The text being sent, usually a whole generated web page, kept alive
+    until it has all been sent.  Shared so the page isn't copied. */
+
+  size_t m_Offset;
+    /* Start of the part of the text not yet sent. */
+
+  size_t m_End;
+    /* End of this slice of the text.  Or std::string::npos for scratch text
+    (protocol headers and the like) which is still being appended to and is
+    sent up to whatever its length is. */
+};
+
+typedef std::deque<OutputSliceStruct> OutputSliceDeque;
+
+struct ConnectionStruct
+{
+  int m_Socket;
+    /* File handle of the socket connected to the web server. */
+
+  uint64_t m_Serial;
+    /* Unique number for this connection.  Never reused, so a request finished
+    after its connection closed can't be sent to some newer connection which
+    happens to have the same socket file handle. */
+
+  ProtocolType m_Protocol;
+    /* FastCGI or HTTP, depending on which listen socket accepted it. */
+
+  std::string m_InputBuffer;
+    /* Received bytes not yet processed, usually a partial record. */
+
+  OutputSliceDeque m_OutputSlices;
+    /* Output waiting to be sent, as a list of pieces of text so that protocol
+    headers and big web pages can be sent together with one system call,
+    without copying the pages into a combined buffer. */
+
+  RequestIDMap m_Requests;
+    /* Requests still being received, indexed by FastCGI request ID. */
+
+  RequestStruct *m_pHTTPRequest;
+    /* The HTTP request whose body is being received, the amount still expected
+    is in its form decoder.  NULL when waiting for the next request's
+    headers. */
+
+  int m_RequestsInWorkers;
+    /* Number of requests from this connection which have been handed to the
+    worker threads and not yet sent back. */
+
+  bool m_CloseWhenDone;
+    /* Close the connection once all output has been sent and no requests are
+    in progress.  Set when the web server didn't ask for FCGI_KEEP_CONN, or
+    when shutting down. */
+
+  bool m_WaitingToWrite;
+    /* True if epoll is also watching for the socket becoming writable, since
+    the output buffer couldn't all be sent at once. */
+
+  ConnectionStruct () : m_Socket(-1), m_Serial(0),
+    m_Protocol(PROTOCOL_FASTCGI), m_pHTTPRequest(NULL),
+    m_RequestsInWorkers(0), m_CloseWhenDone(false), m_WaitingToWrite(false)
+  {};
+};
+
+typedef std::map<uint64_t, ConnectionStruct *> ConnectionMap;
+
+static ConnectionMap g_Connections;
+  /* All the open connections, indexed by serial number.  Only used by the
+  network thread. */
+
+static uint64_t g_NextConnectionSerial = EPOLL_FIRST_CONNECTION_SERIAL;
+
+static int g_EpollFD = -1;
+
+static int g_RequestsInWorkers = 0;
+  /* Total number of requests handed to the worker threads and not yet
+  returned, from all connections.  Shutdown waits for it to reach zero. */
+
+static volatile sig_atomic_t g_ServerStopRequested = 0;
+  /* Set by a signal handler when the server is asked to exit.  It then stops
+  accepting connections and finishes the requests in progress. */
+
+
+void CloseConnection (ConnectionStruct *pConnection)
+{
+  RequestIDMap::iterator iRequest;
 
-  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+  epoll_ctl (g_EpollFD, EPOLL_CTL_DEL, pConnection->m_Socket, NULL);
+  close (pConnection->m_Socket);
+
+  // Requests already in the worker threads will be thrown away when they
+  // finish, since the connection serial number won't be found.
+
+  for (iRequest = pConnection->m_Requests.begin ();
+  iRequest != pConnection->m_Requests.end (); ++iRequest)
+    delete iRequest->second;
+  delete pConnection->m_pHTTPRequest;
+
+  g_Connections.erase (pConnection->m_Serial);
+  delete pConnection;
+}
+
+
+/******************************************************************************
+ * Add output to be sent on a connection.  Small things are appended to the
+ * scratch text at the end of the output list, which is created as needed.  Big
+ * ones are added as a slice of a shared string, to avoid copying them.
+ */
+
+std::string &GetOutputScratch (ConnectionStruct *pConnection)
+{
+  OutputSliceDeque &Slices = pConnection->m_OutputSlices;
+
+  if (Slices.empty () || Slices.back ().m_End != std::string::npos)
   {
-    std::string StartVenueHTML;
-    std::string EndVenueHTML;
-    if (!iVenue->second.m_VenueURL.empty ())
+    OutputSliceStruct Slice;
+    Slice.m_pText = std::make_shared<std::string> ();
+    Slice.m_Offset = 0;
+    Slice.m_End = std::string::npos;
+    Slices.push_back (Slice);
+  }
+  return *Slices.back ().m_pText;
+}
+
+
+void QueueOutputSlice (ConnectionStruct *pConnection,
+  const std::shared_ptr<std::string> &pText, size_t Offset, size_t End)
+{
+  OutputSliceStruct Slice;
+
+  if (End <= Offset)
+    return;
+  Slice.m_pText = pText;
+  Slice.m_Offset = Offset;
+  Slice.m_End = End;
+  pConnection->m_OutputSlices.push_back (Slice);
+}
+
+
+/******************************************************************************
+ * Send as much of the output as the socket will take, gathering up to 64
+ * slices into each system call.  If some is left over, have epoll tell us
+ * when the socket can take more.  Closes the connection if it's finished or
+ * has an error, returning false if it was closed.
+ */
+
+bool WriteConnectionOutput (ConnectionStruct *pConnection)
+{
+  OutputSliceDeque &Slices = pConnection->m_OutputSlices;
+  const int MAX_VECTORS = 64;
+  struct iovec Vectors[MAX_VECTORS];
+  struct msghdr Message;
+  OutputSliceDeque::iterator iSlice;
+
+  while (!Slices.empty ())
+  {
+    int nVectors = 0;
+    for (iSlice = Slices.begin ();
+    iSlice != Slices.end () && nVectors < MAX_VECTORS; ++iSlice)
     {
-      StartVenueHTML.append ("<A HREF=\"");
-      StartVenueHTML.append (iVenue->second.m_VenueURL);
-      StartVenueHTML.append ("\">");
-      EndVenueHTML.insert (0, "</A>");
+      size_t End = (iSlice->m_End == std::string::npos) ?
+        iSlice->m_pText->size () : iSlice->m_End;
+      if (End <= iSlice->m_Offset)
+        continue;
+      Vectors[nVectors].iov_base = &(*iSlice->m_pText)[iSlice->m_Offset];
+      Vectors[nVectors].iov_len = End - iSlice->m_Offset;
+      nVectors++;
+    }
+    if (nVectors == 0)
+    {
+      Slices.clear (); // Just empty scratch text left.
+      break;
     }
 
-    printf ("<TR VALIGN=\"TOP\"><TD>%s%s%s</TD><TD>%d</TD><TD>%d</TD></TR>\n",
-      StartVenueHTML.c_str (), iVenue->first.c_str(), EndVenueHTML.c_str (),
-      iVenue->second.m_EventCount,
-      (int) iVenue->second.m_TravelTimesToOtherPlaces.size ());
+    // Like writev() but without SIGPIPE if the other end has gone away.
+
+    memset (&Message, 0, sizeof (Message));
+    Message.msg_iov = Vectors;
+    Message.msg_iovlen = nVectors;
+    ssize_t AmountSent =
+      sendmsg (pConnection->m_Socket, &Message, MSG_NOSIGNAL);
+    if (AmountSent < 0 && errno == EINTR)
+      continue;
+    if (AmountSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (AmountSent <= 0)
+    {
+      CloseConnection (pConnection);
+      return false;
+    }
+
+    // Remove the slices which were completely sent, and advance through the
+    // partially sent one.
+
+    while (!Slices.empty ())
+    {
+      OutputSliceStruct &Slice = Slices.front ();
+      size_t End = (Slice.m_End == std::string::npos) ?
+        Slice.m_pText->size () : Slice.m_End;
+      if ((size_t) AmountSent < End - Slice.m_Offset)
+      {
+        Slice.m_Offset += AmountSent;
+        break;
+      }
+      AmountSent -= End - Slice.m_Offset;
+      Slices.pop_front ();
+    }
   }
 
-  printf ("</TABLE>\n");
+  // Other requests multiplexed on the connection may still be arriving when
+  // the web server says it's done with it.  Those get finished too, unless
+  // we're shutting down.
 
-  // Write the hidden text box with the last update date, so we can tell if the
-  // form controls match the pasted in state data.  If not, the controls will
-  // be ignored as things like checkboxes won't match.
+  if (Slices.empty () && pConnection->m_CloseWhenDone &&
+  pConnection->m_RequestsInWorkers == 0 &&
+  (pConnection->m_Requests.empty () || g_ServerStopRequested))
+  {
+    CloseConnection (pConnection);
+    return false;
+  }
 
-  printf ("<INPUT TYPE=\"HIDDEN\" NAME=\"LastUpdateTime\" VALUE=\"%s\">\n",
-    g_AllSettings["LastUpdateTime"].c_str ());
+  bool WantToWrite = !Slices.empty ();
+  if (WantToWrite != pConnection->m_WaitingToWrite)
+  {
+    struct epoll_event Event;
+    memset (&Event, 0, sizeof (Event));
+    Event.events = EPOLLIN | (WantToWrite ? EPOLLOUT : 0);
+    Event.data.u64 = pConnection->m_Serial;
+    epoll_ctl (g_EpollFD, EPOLL_CTL_MOD, pConnection->m_Socket, &Event);
+    pConnection->m_WaitingToWrite = WantToWrite;
+  }
+  return true;
+}
 
-  // Write out the SavedState giant text area.  To avoid HTML misinterpretation
-  // problems, encode suspect characters for the data inside the textarea.
 
-  char Separator = g_CommonUserSettings.m_OnlyTab ? '\t' : '|';
+/******************************************************************************
+ * The FastCGI protocol, as described in the FastCGI Specification by Mark R.
+ * Brown of Open Market, 1996.  Everything is sent as records, each with an
+ * 8 byte header (version, record type, request ID, content length and padding
+ * length) followed by the content and padding.  Requests start with a begin
+ * record, then a stream of parameter records, then a stream of standard input
+ * records.  A stream ends with an empty record.  Our reply is a stream of
+ * standard output records and an end request record.
+ */
 
-  printf ("<H2><A NAME=\"RawData\"></A>Raw Data</H2>"
-    "<P>You can copy this out and save it in a text file to preserve your "
-    "selections.  Paste it back in later and hit the update button to "
-    "restore your custom schedule.  Or maybe just save the whole web page "
-    "or e-mail it to yourself.  If things go awry (or updated schedule "
-    "times have been posted for your festival), start a fresh session for "
-    "your festival and append just the lines near the end that start with "
-    "\"Selected\" or \"Favourite\".\n"
-    "<P><TEXTAREA NAME=\"SavedState\" cols=80 rows=40>\n");
+enum FastCGIRecordTypes
+{
+  FCGI_BEGIN_REQUEST = 1,
+  FCGI_ABORT_REQUEST,
+  FCGI_END_REQUEST,
+  FCGI_PARAMS,
+  FCGI_STDIN,
+  FCGI_STDOUT,
+  FCGI_STDERR,
+  FCGI_DATA,
+  FCGI_GET_VALUES,
+  FCGI_GET_VALUES_RESULT,
+  FCGI_UNKNOWN_TYPE
+};
 
-  // Dump the settings state.  Do it first so default settings get used when
-  // reading the events.
+enum FastCGIProtocolStatus
+{
+  FCGI_REQUEST_COMPLETE = 0,
+  FCGI_CANT_MPX_CONN,
+  FCGI_OVERLOADED,
+  FCGI_UNKNOWN_ROLE
+};
 
-  for (iSetting = g_AllSettings.begin(); iSetting != g_AllSettings.end();
-  ++iSetting)
+const int FCGI_VERSION_1 = 1;
+const int FCGI_HEADER_LEN = 8;
+const int FCGI_KEEP_CONN = 1; /* Flag in the begin request record. */
+const int FCGI_RESPONDER = 1; /* The only role we do. */
+
+const size_t FCGI_MAX_STREAM_RECORD = 65528;
+  /* Largest multiple of 8 that fits in the 16 bit content length, so that
+  full sized stream records don't need padding. */
+
+
+/* Append just the record header, returns the amount of padding needed after
+the content. */
+
+int AppendFastCGIHeader (std::string &Output, int RecordType, int RequestID,
+  size_t ContentLength)
+{
+  unsigned char Header[FCGI_HEADER_LEN];
+  int PaddingLength = (8 - ContentLength % 8) % 8;
+
+  Header[0] = FCGI_VERSION_1;
+  Header[1] = RecordType;
+  Header[2] = (RequestID >> 8) & 0xFF;
+  Header[3] = RequestID & 0xFF;
+  Header[4] = (ContentLength >> 8) & 0xFF;
+  Header[5] = ContentLength & 0xFF;
+  Header[6] = PaddingLength;
+  Header[7] = 0;
+  Output.append ((char *) Header, FCGI_HEADER_LEN);
+  return PaddingLength;
+}
+
+
+void AppendFastCGIRecord (std::string &Output, int RecordType, int RequestID,
+  const char *pContent, size_t ContentLength)
+{
+  int PaddingLength =
+    AppendFastCGIHeader (Output, RecordType, RequestID, ContentLength);
+  Output.append (pContent, ContentLength);
+  Output.append (PaddingLength, 0);
+}
+
+
+/* Break up the text into stream records, with an empty one at the end.  The
+text itself isn't copied, just the headers and padding go into the scratch
+output in between slices of the text. */
+
+void QueueFastCGIStream (ConnectionStruct *pConnection, int RecordType,
+  int RequestID, const std::shared_ptr<std::string> &pText)
+{
+  size_t Offset;
+  size_t ContentLength;
+  int PaddingLength;
+
+  for (Offset = 0; Offset < pText->size (); Offset += ContentLength)
   {
-    snprintf (OutputBuffer, sizeof (OutputBuffer), "Setting%c%s%c%s\n",
-      Separator, iSetting->first.c_str(), Separator, iSetting->second.c_str());
-    EncodeAndPrintText (OutputBuffer);
+    ContentLength = pText->size () - Offset;
+    if (ContentLength > FCGI_MAX_STREAM_RECORD)
+      ContentLength = FCGI_MAX_STREAM_RECORD;
+    PaddingLength = AppendFastCGIHeader (GetOutputScratch (pConnection),
+      RecordType, RequestID, ContentLength);
+    QueueOutputSlice (pConnection, pText, Offset, Offset + ContentLength);
+    GetOutputScratch (pConnection).append (PaddingLength, 0);
   }
+  AppendFastCGIRecord (GetOutputScratch (pConnection), RecordType, RequestID,
+    "", 0);
+}
 
-  // Dump the event states.
 
-  int PreviousDayOfMonth = 0;
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
-  {
-    EventTime = iEvent->first.m_EventTime;
-    localtime_r (&EventTime, &BrokenUpDate);
+void AppendFastCGIEndRequest (std::string &Output, int RequestID,
+  int AppStatus, int ProtocolStatus)
+{
+  char Content[8];
+
+  Content[0] = (AppStatus >> 24) & 0xFF;
+  Content[1] = (AppStatus >> 16) & 0xFF;
+  Content[2] = (AppStatus >> 8) & 0xFF;
+  Content[3] = AppStatus & 0xFF;
+  Content[4] = ProtocolStatus;
+  Content[5] = Content[6] = Content[7] = 0;
+  AppendFastCGIRecord (Output, FCGI_END_REQUEST, RequestID, Content, 8);
+}
 
-    if (PreviousDayOfMonth != BrokenUpDate.tm_mday)
-    {
-      strftime (TimeString, sizeof (TimeString), "%A, %B %d, %Y",
-        &BrokenUpDate);
-      printf ("%s\n", TimeString);
-      PreviousDayOfMonth = BrokenUpDate.tm_mday;
-    }
 
-    strftime (TimeString, sizeof (TimeString), "%H:%M", &BrokenUpDate);
-    bool empty_extra = iEvent->second.m_ShowingSpecificInfo.empty(); 
-    snprintf (OutputBuffer, sizeof (OutputBuffer),
-      empty_extra ? "%s%c%s%c%s\n" : "%s%c%s%c%s%c%s\n", /* AGMS20250608 */
-      TimeString, Separator,
-      iEvent->second.m_ShowIter->first.c_str(), Separator,
-      iEvent->first.m_Venue->first.c_str(), Separator,
-      iEvent->second.m_ShowingSpecificInfo.c_str());
-    EncodeAndPrintText (OutputBuffer);
+/* Name and value lengths are one byte if less than 128, otherwise four bytes
+with the high bit set. */
+
+void AppendFastCGINameValueLength (std::string &Output, size_t Length)
+{
+  if (Length < 128)
+    Output.append (1, (char) Length);
+  else
+  {
+    Output.append (1, (char) (((Length >> 24) & 0x7F) | 0x80));
+    Output.append (1, (char) ((Length >> 16) & 0xFF));
+    Output.append (1, (char) ((Length >> 8) & 0xFF));
+    Output.append (1, (char) (Length & 0xFF));
   }
+}
 
-  // Dump the show states, for the duration if not default, and the URL.
-  // Favourites done later to make cutting and pasting easier.
 
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+bool ReadFastCGINameValueLength (const unsigned char *&pData,
+  const unsigned char *pEnd, size_t &Length)
+{
+  if (pData >= pEnd)
+    return false;
+  if (*pData < 128)
   {
-    if (iShow->second.m_ShowDuration !=
-    g_CommonUserSettings.m_DefaultShowDuration)
-    {
-      snprintf (OutputBuffer, sizeof (OutputBuffer),
-        "ShowDuration%c%s%c%d\n", Separator, iShow->first.c_str (), Separator,
-        iShow->second.m_ShowDuration / 60);
-      EncodeAndPrintText (OutputBuffer);
-    }
+    Length = *pData++;
+    return true;
+  }
+  if (pEnd - pData < 4)
+    return false;
+  Length = ((size_t) (pData[0] & 0x7F) << 24) | ((size_t) pData[1] << 16) |
+    ((size_t) pData[2] << 8) | pData[3];
+  pData += 4;
+  return true;
+}
 
-    if (!iShow->second.m_ShowURL.empty ())
-    {
-      snprintf (OutputBuffer, sizeof (OutputBuffer),
-        "ShowURL%c%s%c%s\n", Separator, iShow->first.c_str(), Separator,
-        iShow->second.m_ShowURL.c_str());
-      EncodeAndPrintText (OutputBuffer);
-    }
+
+/* Decode the name and value pairs from a parameters stream.  If a name
+appears more than once, the first one is used, like getenv() would. */
+
+void DecodeFastCGINameValues (const std::string &Text, ParameterMap &Pairs)
+{
+  const unsigned char *pData = (const unsigned char *) Text.data ();
+  const unsigned char *pEnd = pData + Text.size ();
+  size_t NameLength;
+  size_t ValueLength;
+
+  while (ReadFastCGINameValueLength (pData, pEnd, NameLength) &&
+  ReadFastCGINameValueLength (pData, pEnd, ValueLength))
+  {
+    if (NameLength > (size_t) (pEnd - pData) ||
+    ValueLength > (size_t) (pEnd - pData) - NameLength)
+      break; // Corrupt lengths.
+    Pairs.insert (ParameterMap::value_type (
+      std::string ((const char *) pData, NameLength),
+      std::string ((const char *) pData + NameLength, ValueLength)));
+    pData += NameLength + ValueLength;
   }
+}
 
-  // Dump the venue states, URL and user specified path finding data.
 
-  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+/******************************************************************************
+ * Write out the server statistics as a plain text CGI response.  Only called
+ * by the network thread.
+ */
+
+void WriteServerStatistics (std::string &Output)
+{
+  char Buffer[1024];
+  size_t QueueLengths[PRIORITY_MAX];
+  int iPriority;
+
+  pthread_mutex_lock (&g_QueueMutex);
+  for (iPriority = 0; iPriority < PRIORITY_MAX; iPriority++)
+    QueueLengths[iPriority] = g_WaitingRequests[iPriority].size ();
+  pthread_mutex_unlock (&g_QueueMutex);
+
+  snprintf (Buffer, sizeof (Buffer),
+    "Content-Type: text/plain\r\n\r\n"
+    "ProcessID %d\n"
+    "WorkerThreads %d\n"
+    "OpenConnections %lu\n"
+    "ConnectionsAccepted %llu\n"
+    "RequestsReceived %llu\n"
+    "PrintRequests %llu\n"
+    "NormalRequests %llu\n"
+    "HeavyRequests %llu\n"
+    "RequestsCompleted %llu\n"
+    "RequestsRejected %llu\n"
+    "RequestsTooSlow %llu\n"
+    "RequestsTooLarge %llu\n"
+    "RequestsInProgress %d\n"
+    "PrintQueueLength %lu\n"
+    "NormalQueueLength %lu\n"
+    "HeavyQueueLength %lu\n"
+    "LongestQueue %llu\n"
+    "QueueLimit %d\n"
+    "TimeLimit %g\n"
+    "CPULimit %g\n"
+    "ResponsesCompressed %llu\n"
+    "BytesBeforeCompression %llu\n"
+    "BytesAfterCompression %llu\n"
+    "CacheHits %llu\n"
+    "CacheMisses %llu\n"
+    "CachedResponses %lu\n"
+    "CachedBytes %lu\n"
+    "RequestsCoalesced %llu\n"
+    "DateMemoHits %llu\n"
+    "DateMemoMisses %llu\n",
+    (int) getpid (),
+    g_ServerSettings.m_NumberOfThreads,
+    (unsigned long) g_Connections.size (),
+    (unsigned long long) g_ServerStatistics.m_ConnectionsAccepted,
+    (unsigned long long) g_ServerStatistics.m_RequestsReceived,
+    (unsigned long long)
+      g_ServerStatistics.m_RequestsByPriority[PRIORITY_PRINT],
+    (unsigned long long)
+      g_ServerStatistics.m_RequestsByPriority[PRIORITY_NORMAL],
+    (unsigned long long)
+      g_ServerStatistics.m_RequestsByPriority[PRIORITY_HEAVY],
+    (unsigned long long) g_ServerStatistics.m_RequestsCompleted,
+    (unsigned long long) g_ServerStatistics.m_RequestsRejected,
+    (unsigned long long) g_ServerStatistics.m_RequestsTooSlow,
+    (unsigned long long) g_ServerStatistics.m_RequestsTooLarge,
+    g_RequestsInWorkers,
+    (unsigned long) QueueLengths[PRIORITY_PRINT],
+    (unsigned long) QueueLengths[PRIORITY_NORMAL],
+    (unsigned long) QueueLengths[PRIORITY_HEAVY],
+    (unsigned long long) g_ServerStatistics.m_LongestQueue,
+    g_ServerSettings.m_QueueLimit,
+    g_ServerSettings.m_TimeLimit,
+    g_ServerSettings.m_CPULimit,
+    (unsigned long long) g_ServerStatistics.m_ResponsesCompressed,
+    (unsigned long long) g_ServerStatistics.m_BytesBeforeCompression,
+    (unsigned long long) g_ServerStatistics.m_BytesAfterCompression,
+    (unsigned long long) g_ServerStatistics.m_CacheHits,
+    (unsigned long long) g_ServerStatistics.m_CacheMisses,
+    (unsigned long) g_CachedResponses.size (),
+    (unsigned long) g_CachedResponsesSize,
+    (unsigned long long) g_ServerStatistics.m_RequestsCoalesced,
+    (unsigned long long) g_DateMemoHits,
+    (unsigned long long) g_DateMemoMisses);
+  Output.append (Buffer);
+}
+
+
+/******************************************************************************
+ * Decide which waiting queue a request goes in.  Look for the PrintSchedule
+ * button among the names in the decoded form data, that makes it a print
+ * request (quick to do, since only the user's events get listed).  Otherwise
+ * it's heavy if there's a lot of form data, else normal.
+ */
+
+RequestPriority ClassifyRequest (const RequestStruct *pRequest)
+{
+  const std::string &FormText = pRequest->m_FormDecoder.m_FormText;
+  const char *pName;
+  size_t NameStart;
+  size_t ValueStart;
+
+  for (NameStart = 0; NameStart < FormText.size ();
+  NameStart = ValueStart + strlen (FormText.c_str () + ValueStart) + 1)
   {
-    // List the venue's URL string, if present.
+    pName = FormText.c_str () + NameStart;
+    if (strcmp (pName, "PrintSchedule") == 0)
+      return PRIORITY_PRINT;
+    ValueStart = NameStart + strlen (pName) + 1;
+    if (ValueStart >= FormText.size ())
+      break;
+  }
+  if (FormText.size () > g_ServerSettings.m_HeavySize)
+    return PRIORITY_HEAVY;
+  return PRIORITY_NORMAL;
+}
 
-    if (!iVenue->second.m_VenueURL.empty ())
-    {
-      snprintf (OutputBuffer, sizeof (OutputBuffer), "VenueURL%c%s%c%s\n",
-        Separator, iVenue->first.c_str(), Separator,
-        iVenue->second.m_VenueURL.c_str());
-      EncodeAndPrintText (OutputBuffer);
-    }
 
-    // List all the destinations you can go to from this venue, and their
-    // travel properties.
+/******************************************************************************
+ * Hand a completely received request over to the worker threads.  If too many
+ * are already waiting, answer it right away with a busy page.  Requests for
+ * the server statistics (if allowed) are also answered right away.  Those go
+ * straight onto the finished queue so they get sent the usual way.
+ */
 
-    TravelTimeIterator iTravelTime;
-    TravelTimeIterator iTravelEnd =
-      iVenue->second.m_TravelTimesToOtherPlaces.end ();
-    for (iTravelTime = iVenue->second.m_TravelTimesToOtherPlaces.begin ();
-    iTravelTime != iTravelEnd; iTravelTime++)
-    {
-      if (iTravelTime->second.m_IsPhantomReverse)
-        continue; // Don't dump the phantoms, only genuine user data.
+const char SERVER_BUSY_TEXT[] =
+  "Status: 503 Service Unavailable\r\n"
+  "Retry-After: 10\r\n"
+  "Content-Type: text/html\r\n\r\n"
+  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
+  "<HTML><HEAD><TITLE>FFVSO - Busy</TITLE></HEAD>\n"
+  "<BODY><H1>Busy</H1>\n"
+  "<P>Sorry, the server is too busy right now.  Please go back and try "
+  "again in a few seconds.\n"
+  "</BODY></HTML>\n";
+
+const char REQUEST_TOO_LARGE_TEXT[] =
+  "Status: 413 Payload Too Large\r\n"
+  "Content-Type: text/html\r\n\r\n"
+  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
+  "<HTML><HEAD><TITLE>FFVSO - Too Large</TITLE></HEAD>\n"
+  "<BODY><H1>Too Large</H1>\n"
+  "<P>Sorry, that's too much form data for the server to handle.\n"
+  "</BODY></HTML>\n";
+
+
+void StartRequest (ConnectionStruct *pConnection, RequestStruct *pRequest)
+{
+  bool AnswerNow = false;
 
-      snprintf (OutputBuffer, sizeof (OutputBuffer),
-        "TravelTime%c%s%c%s%c%d",
-        Separator, iVenue->first.c_str(), Separator,
-        iTravelTime->first->first.c_str(), Separator,
-        iTravelTime->second.m_DistanceInMeters);
-      char *pNextOut = OutputBuffer + strlen (OutputBuffer);
-      int LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
+  pConnection->m_Requests.erase (pRequest->m_RequestID);
+  pConnection->m_RequestsInWorkers++;
+  g_RequestsInWorkers++;
+  g_ServerStatistics.m_RequestsReceived++;
 
-      if (iTravelTime->second.m_WorstCaseDelaySeconds != 0 ||
-      !iTravelTime->second.m_Notes.empty ())
-      {
-        snprintf (pNextOut, LengthRemaining,
-          "%c%d", Separator, iTravelTime->second.m_WorstCaseDelaySeconds);
-        pNextOut = OutputBuffer + strlen (OutputBuffer);
-        LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
-      }
+  FinishFormInput (pRequest->m_FormDecoder);
 
-      if (!iTravelTime->second.m_Notes.empty ())
-      {
-        snprintf (pNextOut, LengthRemaining,
-          "%c%s", Separator, iTravelTime->second.m_Notes.c_str ());
-        pNextOut = OutputBuffer + strlen (OutputBuffer);
-        LengthRemaining = OutputBuffer + sizeof (OutputBuffer) - pNextOut;
-      }
+  if (g_ServerSettings.m_TimeLimit > 0)
+    pRequest->m_WallClockDeadline =
+      GetClockSeconds (CLOCK_MONOTONIC) + g_ServerSettings.m_TimeLimit;
 
-      if (LengthRemaining >= 2)
-        strcpy (pNextOut, "\n");
+  pRequest->m_Priority = ClassifyRequest (pRequest);
+  g_ServerStatistics.m_RequestsByPriority[pRequest->m_Priority]++;
 
-      EncodeAndPrintText (OutputBuffer);
+  ParameterMap::iterator iQuery =
+    pRequest->m_Parameters.find ("QUERY_STRING");
+  if (g_ServerSettings.m_ServeStatistics &&
+  iQuery != pRequest->m_Parameters.end () &&
+  iQuery->second == "ServerStatistics")
+  {
+    WriteServerStatistics (pRequest->m_OutputText);
+    AnswerNow = true;
+  }
+  else
+  {
+    pRequest->m_CacheKey = ComputeResponseCacheKey (pRequest);
+    if (pRequest->m_CacheKey != 0)
+    {
+      const std::string &KeyText = *pRequest->m_pCacheKeyText;
+      if (g_ServerSettings.m_CacheSize > 0)
+        pRequest->m_pSharedOutputText =
+          LookUpCachedResponse (pRequest->m_CacheKey, KeyText);
+      if (pRequest->m_pSharedOutputText)
+        AnswerNow = true;
+      else
+      {
+        RequestsInFlightMap::iterator iFlight =
+          g_RequestsInFlight.find (pRequest->m_CacheKey);
+        if (iFlight != g_RequestsInFlight.end () &&
+        SameCacheKeyText (*iFlight->second.m_pKeyText, KeyText))
+        {
+          // Same as one in progress, wait for it to finish.
+          pRequest->m_CacheKey = 0;
+          pRequest->m_pCacheKeyText.reset ();
+          iFlight->second.m_WaitingRequests.push_back (pRequest);
+          g_ServerStatistics.m_RequestsCoalesced++;
+          return;
+        }
+      }
     }
   }
 
-  // Write out the favourite shows.
+  pthread_mutex_lock (&g_QueueMutex);
+  if (!AnswerNow && g_ServerSettings.m_QueueLimit > 0 &&
+  g_NumberOfWaitingRequests >= (size_t) g_ServerSettings.m_QueueLimit)
+  {
+    pRequest->m_OutputText.assign (SERVER_BUSY_TEXT);
+    pRequest->m_CacheKey = 0;
+    g_ServerStatistics.m_RequestsRejected++;
+    AnswerNow = true;
+  }
+  if (AnswerNow)
+    g_FinishedRequests.push_back (pRequest);
+  else
+  {
+    if (pRequest->m_CacheKey != 0 && g_RequestsInFlight.count (
+    pRequest->m_CacheKey) == 0) // Others can now wait for it.
+      g_RequestsInFlight[pRequest->m_CacheKey].m_pKeyText =
+        pRequest->m_pCacheKeyText;
+    g_WaitingRequests[pRequest->m_Priority].push_back (pRequest);
+    g_NumberOfWaitingRequests++;
+    if (g_NumberOfWaitingRequests > g_ServerStatistics.m_LongestQueue)
+      g_ServerStatistics.m_LongestQueue = g_NumberOfWaitingRequests;
+    pthread_cond_signal (&g_QueueCondition);
+  }
+  pthread_mutex_unlock (&g_QueueMutex);
 
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  if (AnswerNow)
+    WakeUpNetworkThread ();
+}
+
+
+/******************************************************************************
+ * Send the generated web page back to the web server, and then end the
+ * request.  Deletes the request.
+ */
+
+void SendFastCGIResponse (ConnectionStruct *pConnection,
+  RequestStruct *pRequest)
+{
+  std::shared_ptr<std::string> pText = TakeResponseText (pRequest);
+
+  QueueFastCGIStream (pConnection, FCGI_STDOUT, pRequest->m_RequestID, pText);
+  AppendFastCGIEndRequest (GetOutputScratch (pConnection),
+    pRequest->m_RequestID,
+    pRequest->m_ExitStatus, FCGI_REQUEST_COMPLETE);
+  if (!pRequest->m_KeepConnection)
+    pConnection->m_CloseWhenDone = true;
+  delete pRequest;
+}
+
+
+/******************************************************************************
+ * Handle one record received from the web server.  Any reply is appended to
+ * the connection's output buffer, sent later.
+ */
+
+void ProcessFastCGIRecord (ConnectionStruct *pConnection, int RecordType,
+  int RequestID, const char *pContent, size_t ContentLength)
+{
+  std::string &Output = GetOutputScratch (pConnection);
+  RequestIDMap::iterator iRequest;
+  RequestStruct *pRequest = NULL;
+
+  if (RequestID == 0) // A management record, not part of a request.
   {
-    if (iShow->second.m_IsFavourite)
+    if (RecordType == FCGI_GET_VALUES)
     {
-      snprintf (OutputBuffer, sizeof (OutputBuffer),
-        "Favourite%c%s\n", Separator, iShow->first.c_str());
-      EncodeAndPrintText (OutputBuffer);
+      ParameterMap Names;
+      ParameterMap::iterator iName;
+      std::string Reply;
+
+      DecodeFastCGINameValues (std::string (pContent, ContentLength), Names);
+      for (iName = Names.begin (); iName != Names.end (); ++iName)
+      {
+        const char *pValue;
+        if (iName->first == "FCGI_MAX_CONNS")
+          pValue = "1000";
+        else if (iName->first == "FCGI_MAX_REQS")
+          pValue = "1000";
+        else if (iName->first == "FCGI_MPXS_CONNS")
+          pValue = "1";
+        else
+          continue; // Unknown ones are left out of the reply.
+        AppendFastCGINameValueLength (Reply, iName->first.size ());
+        AppendFastCGINameValueLength (Reply, strlen (pValue));
+        Reply.append (iName->first);
+        Reply.append (pValue);
+      }
+      AppendFastCGIRecord (Output, FCGI_GET_VALUES_RESULT, 0,
+        Reply.data (), Reply.size ());
+    }
+    else
+    {
+      char Content[8];
+      memset (Content, 0, sizeof (Content));
+      Content[0] = RecordType;
+      AppendFastCGIRecord (Output, FCGI_UNKNOWN_TYPE, 0, Content, 8);
     }
+    return;
   }
 
-  // Write out the selected event flags.  Done after everything else, so the
-  // user can more easily cut and paste their selections into a new schedule.
+  iRequest = pConnection->m_Requests.find (RequestID);
+  if (iRequest != pConnection->m_Requests.end ())
+    pRequest = iRequest->second;
 
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
+  switch (RecordType)
   {
-    if (!iEvent->second.m_IsSelectedByUser)
-      continue;
+    case FCGI_BEGIN_REQUEST:
+    {
+      if (pRequest != NULL || ContentLength < 8)
+        break; // Duplicate request ID or corrupt record, ignore it.
+      const unsigned char *pBody = (const unsigned char *) pContent;
+      int Role = (pBody[0] << 8) | pBody[1];
+      bool KeepConnection = (pBody[2] & FCGI_KEEP_CONN) != 0;
+      if (Role != FCGI_RESPONDER)
+      {
+        AppendFastCGIEndRequest (Output, RequestID, 0, FCGI_UNKNOWN_ROLE);
+        if (!KeepConnection)
+          pConnection->m_CloseWhenDone = true;
+        break;
+      }
+      pRequest = new RequestStruct;
+      pRequest->m_ConnectionSerial = pConnection->m_Serial;
+      pRequest->m_RequestID = RequestID;
+      pRequest->m_KeepConnection = KeepConnection;
+      pConnection->m_Requests[RequestID] = pRequest;
+      break;
+    }
 
-    EventTime = iEvent->first.m_EventTime;
-    localtime_r (&EventTime, &BrokenUpDate);
-    strftime (TimeString, sizeof (TimeString), "%c", &BrokenUpDate);
+    case FCGI_ABORT_REQUEST:
+      // Can only abort requests we're still receiving.  Ones in the worker
+      // threads will finish normally, which is allowed by the specification.
+      if (pRequest == NULL)
+        break;
+      pConnection->m_Requests.erase (iRequest);
+      AppendFastCGIEndRequest (Output, RequestID, 0, FCGI_REQUEST_COMPLETE);
+      if (!pRequest->m_KeepConnection)
+        pConnection->m_CloseWhenDone = true;
+      delete pRequest;
+      break;
+
+    case FCGI_PARAMS:
+    {
+      if (pRequest == NULL)
+        break;
+      if (ContentLength > 0)
+      {
+        pRequest->m_ParameterText.append (pContent, ContentLength);
+        break;
+      }
 
-    snprintf (OutputBuffer, sizeof (OutputBuffer), "Selected%c%s%c%s\n",
-      Separator, TimeString, Separator,
-      iEvent->first.m_Venue->first.c_str());
-    EncodeAndPrintText (OutputBuffer);
-  }
+      // End of the parameters.  Now we know how much form data is coming,
+      // and can turn away requests too big to handle before reading it.
+
+      DecodeFastCGINameValues (pRequest->m_ParameterText,
+        pRequest->m_Parameters);
+      pRequest->m_ParameterText.clear ();
+      ParameterMap::iterator iLength =
+        pRequest->m_Parameters.find ("CONTENT_LENGTH");
+      if (iLength == pRequest->m_Parameters.end ())
+        break; // Read up to the maximum.
+      long long Length = atoll (iLength->second.c_str ());
+      if (Length <= MAX_CONTENT_LENGTH)
+      {
+        pRequest->m_FormDecoder.m_BytesWanted = (Length < 0) ? 0 : Length;
+        break;
+      }
+      pConnection->m_Requests.erase (iRequest);
+      g_ServerStatistics.m_RequestsTooLarge++;
+      pRequest->m_OutputText.assign (REQUEST_TOO_LARGE_TEXT);
+      SendFastCGIResponse (pConnection, pRequest);
+      break;
+    }
 
-  printf ("</TEXTAREA>\n");
+    case FCGI_STDIN:
+      if (pRequest == NULL)
+        break;
+      if (ContentLength == 0) // End of the input stream, request complete.
+        StartRequest (pConnection, pRequest);
+      else
+        DecodeFormInput (pRequest->m_FormDecoder, pContent, ContentLength);
+      break;
 
+    case FCGI_DATA: // Only used by the filter role, ignore it.
+      break;
 
-  printf ("<H3>Raw Data Keywords and Use</H3>\n");
-  printf ("<P>Here's some documentation, in case you're interested in "
-    "details.  In general fields are separated by tabs or vertical bar \"|\" "
-    "characters.  The first field specifies what to do with the rest of the "
-    "line of raw data.  Here's the list of possibilities:\n<UL>\n");
-  printf ("<LI>An event is defined by an optional date and time field "
-    "followed by a show name field and then a venue name field and finally an "
-    "optional extra showing specific info (like are face masks required) "
-    "field.  You can also "
-    "specify a date or time by itself (such as \"Thursday, June 19, 2014\", "
-    "or \"7:00 PM\"), which will be used as the day / time for the event "
-    "definitions after it (they then only need to specify the time or nothing "
-    "to use the previous date or time).  Show names that are the same as "
-    "keywords or look like dates or times (pure numbers for example) won't "
-    "work; preceed them with at least the time.\n");
-  printf ("<LI>\"Selected\" is followed by a date & time field, and a field "
-    "naming the venue.  That is enough to specify an event the user will be "
-    "attending.\n");
-  printf ("<LI>\"Favourite\" is followed by the show name.  That show is then "
-    "marked as being one of the higher priority ones for the user to see.\n");
+    default:
+    {
+      char Content[8];
+      memset (Content, 0, sizeof (Content));
+      Content[0] = RecordType;
+      AppendFastCGIRecord (Output, FCGI_UNKNOWN_TYPE, 0, Content, 8);
+      break;
+    }
+  }
+}
 
-  printf ("<LI>\"Setting\" is followed by the name of the setting and then "
-    "a field with the value to be used for that setting.  Here are some of "
-    "the settings you can use:\n<UL>\n");
-  printf ("<LI>TitleEdit - followed by HTML for the title text shown "
-    "while editing.  Useful for noting the date when the schedule "
-    "times were last updated with data from the festival.\n");
-  printf ("<LI>TitlePrint - followed by HTML for the title text shown "
-    "on the printable listing.  You may want to customise it with your "
-    "own name and other information.\n");
-  printf ("<LI>ToDo - need to finish writing this documentation.\n");
-  printf ("</UL>\n");
-
-  printf ("<LI>\"ShowURL\" has a second field that names a show and a third "
-    "that specifies a web link to show information about the show.\n");
-  printf ("<LI>\"ShowDuration\" is followed by the show name and the duration "
-    "(number of minutes) of that show.  If not specified, a default (usually "
-    "one hour, there's a setting for it) is used.\n");
-  printf ("<LI>\"VenueURL\" is followed by the name of a venue and then the "
-    "URL for information about that venue.\n");
-  printf ("<LI>\"TravelTime\" is followed by a field naming the From venue "
-    "and then a field with the To venue, then the distance in metres, and "
-    "then the optional worst case delay time in seconds, and finally another "
-    "optional field with notes for the user (like \"Take Elevator B\")."
-    "<P>This is used for calculating the shortest path between venues and the "
-    "time it takes to walk it, which is then used for detecting shows you "
-    "can't get to in time."
-    "<P>The Venues usually name places with shows, or you can make up venue "
-    "names for intermediate locations to help with the path finding.  Use "
-    "something descriptive for the user such as \"Fifth-and-Main\" street "
-    "intersections.  They'll show up as venues with no performances.  If you "
-    "want to, you can add a VenueURL for intermediate places that points to, "
-    "for example, a subway station web page."
-    "<P>The user's walking speed setting will be combined with the distance "
-    "to get their walking time.  The worst case delay time (multiplied by "
-    "(100 - Luckiness) percent) is added to the "
-    "walking time to get the time it takes to travel between venues.  If we "
-    "can't find a path between the venues, the DefaultTravelTime setting is "
-    "used for the travel time instead.  The setting for time spent in "
-    "line-ups getting tickets is added to the travel time to get the total "
-    "time to go between venues.  If a show starts before you can get to it "
-    "from the previous show, it will be displayed (usually in red) as a "
-    "conflict."
-    "<P>You don't have to specify every possible path when setting up your "
-    "Festival; the shortest path composed from multiple TravelTime segments "
-    "will be found.  A rough grid of TravelTime segments covering the "
-    "Festival's area will be sufficient.  If you don't specify a TravelTime "
-    "in the opposite direction, the reverse direction will be assumed to take "
-    "as long to travel.  If there's a one-way path for some reason, you have "
-    "to specify that there's no reverse direction by putting in a TravelTime "
-    "entry for the reverse direction with a negative distance (-1 is "
-    "good)."
-    "<P>The worst case delay time measures the time spent waiting at traffic "
-    "lights, elevators and so on.  Measure the time from when the light stops "
-    "being green (as if you just missed it) to the next time it turns green.  "
-    "Elevator worst case time is measured by sending the elevator to the "
-    "furthest floor and seeing how long it takes to go and return.  Though "
-    "crowded elevators take longer than that, so maybe measuring on a busy "
-    "day would be better.  For bus, subways, car and other vehicular travel "
-    "limited by a schedule or speed limits (all cars go about the same "
-    "speed), include the vehicular travel time and waiting time at the bus "
-    "stop/station in the worst case delay time and only count the distance "
-    "walked to the bus stop, station or parked car in the distance "
-    "measurement."
-    "<P>Bicycle travel would be somewhat complicated (are they walking or "
-    "biking indoors or both?), so we currently don't handle it, though you "
-    "can approximate it with a very fast walking speed setting."
-    "<P>The Notes field is optional, and you do need to specify a worst case "
-    "value prior to it if you use it (0 if you don't have a worst case "
-    "number).  It's included verbatim in the web output, so you can include "
-    "HTML if you wish to do something like link to information about a bus "
-    "route.\n");
 
-  printf ("</UL>\n");
+/******************************************************************************
+ * Process all the complete records in the connection's input buffer, leaving
+ * any partial record for later.  Returns false if the input is garbage.
+ */
 
-  printf ("<P><FONT SIZE=\"-1\">Software version "
-    "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
-    "was compiled on " __DATE__ " at " __TIME__ ".  This program is "
-    "copyright 2014 by Alexander G. M. Smith.  You can contact me at <A "
-    "HREF=\"mailto:?to=%%22Alexander G. M. Smith%%22 "
-    "%%3Cagmsmith@ncf.ca%%3E&amp;subject=Fringe Festival Visitor Schedule "
-    "Optimizer\">agmsmith@ncf.ca</A> or on Twitter as <A "
-    "HREF=\"http://twitter.com/agms00\">@AGMS00</A> or with the <A "
-    "HREF=\"http://twitter.com/search?q=%%23FFVSO\">#FFVSO</A> "
-    "hashtag.  This program is distributed under the GNU General Public "
-    "License, version 3, which may be available at <A "
-    "HREF=\"http://www.gnu.org/copyleft/gpl.html\">"
-    "http://www.gnu.org/copyleft/gpl.html</A>.  Source code for this program "
-    "is available on GitHub at <A HREF=\"http://github.com/agmsmith/FFVSO\">"
-    "http://github.com/agmsmith/FFVSO</A>.</FONT>\n");
+bool ProcessFastCGIInput (ConnectionStruct *pConnection)
+{
+  std::string &Input = pConnection->m_InputBuffer;
+  size_t Offset = 0;
 
-  printf ("</FORM>\n");
+  while (Input.size () - Offset >= (size_t) FCGI_HEADER_LEN)
+  {
+    const unsigned char *pHeader =
+      (const unsigned char *) Input.data () + Offset;
+    if (pHeader[0] != FCGI_VERSION_1)
+      return false;
+    size_t ContentLength = (pHeader[4] << 8) | pHeader[5];
+    size_t RecordLength = FCGI_HEADER_LEN + ContentLength + pHeader[6];
+    if (Input.size () - Offset < RecordLength)
+      break;
+    ProcessFastCGIRecord (pConnection, pHeader[1],
+      (pHeader[2] << 8) | pHeader[3],
+      Input.data () + Offset + FCGI_HEADER_LEN, ContentLength);
+    Offset += RecordLength;
+  }
+  Input.erase (0, Offset);
+  return true;
 }
 
 
 /******************************************************************************
- * Write out HTML for just the user's events, using only plain text, no form
- * controls or other things that would look bad on a printed page.
+ * The HTTP/1.1 protocol, for serving web browsers directly without a web
+ * server in front.  Only our own CGI path is served, the form is POSTed to it
+ * or it can be fetched with GET for a blank schedule.  The request headers are
+ * turned into the same CGI parameters a web server would send, and the CGI
+ * headers at the start of our output are turned into an HTTP status line and
+ * response headers.  Connections are kept alive and requests can be
+ * pipelined, though only one at a time from each connection is given to the
+ * worker threads so that the responses go out in order.  The body must have a
+ * Content-Length, chunked uploads aren't supported unless something in front
+ * has already decoded them and supplied the length.
  */
 
-void WritePrintableListing ()
-{
-  struct tm BrokenUpDate;
-  EventIterator iEvent;
-  char TimeString[60]; // Need at least 50 for date+time in September.
-
-  printf ("%s\n", g_AllSettings["TitlePrint"].c_str ());
+const char HTTP_CGI_PATH[] = "/cgi-bin/FFVSO.cgi";
 
-  // Write out the event listing, with just the user's selected events.  Done
-  // as a table with five columns: event time, duration, spare time,
-  // show name, venue name.
+const size_t MAX_HTTP_HEADER_LENGTH = 65536;
+  /* Give up on clients sending more header text than this. */
 
-  printf ("<TABLE BORDER=\"1\" CELLPADDING=\"1\">\n");
 
-  time_t EventTime = 0;
-  time_t PreviousTime = 0;
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end();
-  ++iEvent)
-  {
-    if (!iEvent->second.m_IsSelectedByUser)
-      continue;
+/* The body is the part of the text after the offset.  It isn't copied, just
+queued for output after the headers. */
 
-    // If long enough time has gone by, print out a new day heading.
+void AppendHTTPResponse (ConnectionStruct *pConnection, const char *pStatus,
+  const std::string &Headers, const std::shared_ptr<std::string> &pText,
+  size_t BodyOffset, bool SendBody, bool KeepConnection)
+{
+  std::string &Output = GetOutputScratch (pConnection);
+  size_t BodyLength = pText->size () - BodyOffset;
+  char Buffer[128];
+  time_t TimeNow;
+  struct tm BrokenUpTime;
 
-    EventTime = iEvent->first.m_EventTime;
-    localtime_r (&EventTime, &BrokenUpDate);
-    double DeltaTime = difftime (EventTime, PreviousTime);
-    if (fabs (DeltaTime) > g_CommonUserSettings.m_NewDayGap)
-    {
-      strftime (TimeString, sizeof (TimeString), "%A, %B %d, %Y",
-        &BrokenUpDate);
-      printf ("<TR><TH COLSPAN=\"5\">%s</TH></TR>\n", TimeString);
-    }
+  time (&TimeNow);
+  gmtime_r (&TimeNow, &BrokenUpTime);
+  strftime (Buffer, sizeof (Buffer), "%a, %d %b %Y %H:%M:%S GMT",
+    &BrokenUpTime);
+
+  Output.append ("HTTP/1.1 ");
+  Output.append (pStatus);
+  Output.append ("\r\nDate: ");
+  Output.append (Buffer);
+  Output.append ("\r\nServer: FFVSO\r\n");
+  Output.append (Headers);
+  if (strncmp (pStatus, "304", 3) != 0) // Not modified never has a body.
+  {
+    snprintf (Buffer, sizeof (Buffer), "Content-Length: %lu\r\n",
+      (unsigned long) BodyLength);
+    Output.append (Buffer);
+  }
+  Output.append (KeepConnection ?
+    "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+  if (SendBody)
+    QueueOutputSlice (pConnection, pText, BodyOffset, pText->size ());
 
-    // Print out the event itself.
+  if (!KeepConnection)
+    pConnection->m_CloseWhenDone = true;
+}
 
-    WriteHTMLEventRow (iEvent, false /* bIncludeEditModeFeatures */);
 
-    // Update the previous time but only for events which are printed.  This
-    // lets us skip whole days if the user isn't going to see anything then.
+/* For problems with the request itself.  The connection is closed afterwards,
+since any request body would be unread and we'd lose our place. */
 
-    PreviousTime = EventTime;
-  }
+void AppendHTTPErrorResponse (ConnectionStruct *pConnection,
+  const char *pStatus, const std::string &Headers = std::string ())
+{
+  std::shared_ptr<std::string> pBody = std::make_shared<std::string> ();
+
+  pBody->append ("<HTML><HEAD><TITLE>");
+  pBody->append (pStatus);
+  pBody->append ("</TITLE></HEAD>\n<BODY><H1>");
+  pBody->append (pStatus);
+  pBody->append ("</H1></BODY></HTML>\n");
+  AppendHTTPResponse (pConnection, pStatus,
+    Headers + "Content-Type: text/html\r\n", pBody, 0, true, false);
+}
 
-  printf ("</TABLE>\n");
 
-  // Print a footer with the statistics.
+/******************************************************************************
+ * Send the generated web page back to the web browser.  The CGI headers at the
+ * start of the output are passed through as HTTP headers, except for the
+ * special CGI Status header which becomes the HTTP status line.  Deletes the
+ * request.
+ */
 
-  printf ("<P ALIGN=\"CENTER\">");
-  printf ("<P ALIGN=\"CENTER\">You have %d conflicts and you are seeing %d "
-    "performances (total time %d:%02d).<BR>"
-    "There are %d redundant, %d unseen shows, and %d unseen favourites.\n",
-    g_Statistics.m_TotalNumberOfConflicts,
-    g_Statistics.m_TotalNumberOfEventsScheduled,
-    g_Statistics.m_TotalSecondsWatched / 60 / 60,
-    g_Statistics.m_TotalSecondsWatched / 60 % 60,
-    g_Statistics.m_TotalNumberOfRedundantShows,
-    g_Statistics.m_TotalNumberOfUnseenShows,
-    g_Statistics.m_TotalNumberOfUnseenFavouriteShows);
+void SendHTTPResponse (ConnectionStruct *pConnection, RequestStruct *pRequest)
+{
+  std::shared_ptr<std::string> pText = TakeResponseText (pRequest);
+  const std::string &Text = *pText;
+  std::string Status ("200 OK");
+  std::string Headers;
+  size_t BodyStart = 0;
+  size_t LineStart = 0;
+  bool HaveStatus = false;
+
+  while (LineStart < Text.size ())
+  {
+    size_t LineEnd = Text.find ('\n', LineStart);
+    if (LineEnd == std::string::npos)
+    {
+      LineStart = 0; // No end of headers, treat it all as the body.
+      break;
+    }
+    std::string Line (Text, LineStart, LineEnd - LineStart);
+    LineStart = LineEnd + 1;
+    if (!Line.empty () && Line[Line.size () - 1] == '\r')
+      Line.resize (Line.size () - 1);
+    if (Line.empty ())
+    {
+      BodyStart = LineStart;
+      break;
+    }
 
-  // Include the time when the table was printed, so you can tell different
-  // versions of the table apart.
+    size_t Colon = Line.find (':');
+    size_t ValueStart = Line.find_first_not_of (" \t", Colon + 1);
+    if (Colon == std::string::npos || ValueStart == std::string::npos)
+      continue;
+    if (strncasecmp (Line.c_str (), "Status:", 7) == 0)
+    {
+      Status.assign (Line, ValueStart, std::string::npos);
+      HaveStatus = true;
+      continue;
+    }
+    if (strncasecmp (Line.c_str (), "Location:", 9) == 0 && !HaveStatus)
+      Status = "302 Found";
+    Headers.append (Line);
+    Headers.append ("\r\n");
+  }
+  if (LineStart == 0)
+    BodyStart = 0;
 
-  time_t CurrentTime;
-  time (&CurrentTime);
-  localtime_r (&CurrentTime, &BrokenUpDate);
-  strftime (TimeString, sizeof (TimeString), "%A, %B %d, %Y at %T",
-    &BrokenUpDate);
-  printf ("<P><FONT SIZE=\"-1\">Printed on %s.&nbsp;  Software version "
-    "$Id: FFVSO.cpp,v 1.64 2025/06/09 01:28:06 agmsmith Exp $ "
-    "was compiled on " __DATE__ " at " __TIME__ ".</FONT>\n", TimeString);
+  bool IsHead = (pRequest->m_Parameters["REQUEST_METHOD"] == "HEAD");
+  AppendHTTPResponse (pConnection, Status.c_str (), Headers, pText,
+    BodyStart, !IsHead, pRequest->m_KeepConnection);
+  delete pRequest;
 }
 
 
 /******************************************************************************
- * Build a list of all the events sorted by time and show name, a more
- * convenient order for the user than time and venue name.
+ * Parse the request line and headers of an HTTP request, creating a new
+ * request with the equivalent CGI parameters.  Returns false if there's
+ * something wrong with it, after appending an error response.
  */
 
-bool CompareEventByTimeAndShowName (EventIterator ItemA, EventIterator ItemB)
+bool ParseHTTPRequestHeaders (ConnectionStruct *pConnection,
+  const std::string &HeaderText)
 {
-  // Compare the starting time of the events first.
-
-  if (ItemA->first.m_EventTime < ItemB->first.m_EventTime)
-    return true;
-
-  if (ItemA->first.m_EventTime > ItemB->first.m_EventTime)
+  size_t LineStart;
+  size_t LineEnd;
+
+  LineEnd = HeaderText.find ("\r\n");
+  if (LineEnd == std::string::npos)
+    LineEnd = HeaderText.size (); // Just the request line, no headers.
+  std::string RequestLine (HeaderText, 0, LineEnd);
+  size_t FirstSpace = RequestLine.find (' ');
+  size_t SecondSpace = RequestLine.find (' ', FirstSpace + 1);
+  if (FirstSpace == std::string::npos || SecondSpace == std::string::npos)
+  {
+    AppendHTTPErrorResponse (pConnection, "400 Bad Request");
     return false;
+  }
+  std::string Method (RequestLine, 0, FirstSpace);
+  std::string Target (RequestLine, FirstSpace + 1,
+    SecondSpace - FirstSpace - 1);
+  std::string Version (RequestLine, SecondSpace + 1, std::string::npos);
+  if (Version.compare (0, 7, "HTTP/1.") != 0)
+  {
+    AppendHTTPErrorResponse (pConnection, "505 HTTP Version Not Supported");
+    return false;
+  }
 
-  // If at the same time, then compare show names to sort them out.
+  RequestStruct *pRequest = new RequestStruct;
+  ParameterMap &Parameters = pRequest->m_Parameters;
+  pRequest->m_ConnectionSerial = pConnection->m_Serial;
+  pRequest->m_KeepConnection = (Version != "HTTP/1.0");
+
+  size_t QuestionMark = Target.find ('?');
+  std::string Path (Target, 0, QuestionMark);
+  Parameters["GATEWAY_INTERFACE"] = "CGI/1.1";
+  Parameters["REQUEST_METHOD"] = Method;
+  Parameters["REQUEST_SCHEME"] = "http";
+  Parameters["REQUEST_URI"] = Target;
+  Parameters["SCRIPT_NAME"] = Path;
+  Parameters["SERVER_PROTOCOL"] = Version;
+  Parameters["SERVER_SOFTWARE"] = "FFVSO";
+  Parameters["QUERY_STRING"] = (QuestionMark == std::string::npos) ?
+    std::string () : std::string (Target, QuestionMark + 1);
+
+  bool ExpectContinue = false;
+  bool BadHeader = false;
+  bool Chunked = false;
+
+  for (LineStart = LineEnd + 2; LineStart < HeaderText.size ();
+  LineStart = LineEnd + 2)
+  {
+    LineEnd = HeaderText.find ("\r\n", LineStart);
+    if (LineEnd == std::string::npos)
+      LineEnd = HeaderText.size ();
+    std::string Line (HeaderText, LineStart, LineEnd - LineStart);
+    size_t Colon = Line.find (':');
+    if (Colon == std::string::npos || Colon == 0 ||
+    Line[0] == ' ' || Line[0] == '\t')
+    {
+      BadHeader = true;
+      break;
+    }
 
-  int StringTest = strcasecmp (
-    ItemA->second.m_ShowIter->first.c_str (),
-    ItemB->second.m_ShowIter->first.c_str ());
+    std::string Name ("HTTP_");
+    for (size_t i = 0; i < Colon; i++)
+      Name.append (1, Line[i] == '-' ? '_' : toupper (Line[i]));
+    size_t ValueStart = Line.find_first_not_of (" \t", Colon + 1);
+    size_t ValueEnd = Line.find_last_not_of (" \t");
+    std::string Value;
+    if (ValueStart != std::string::npos)
+      Value.assign (Line, ValueStart, ValueEnd + 1 - ValueStart);
+
+    if (Name == "HTTP_CONTENT_LENGTH" || Name == "HTTP_CONTENT_TYPE")
+      Name.erase (0, 5); // CGI leaves the prefix off these two.
+    else if (Name == "HTTP_CONNECTION")
+    {
+      if (strcasestr (Value.c_str (), "close") != NULL)
+        pRequest->m_KeepConnection = false;
+      else if (strcasestr (Value.c_str (), "keep-alive") != NULL)
+        pRequest->m_KeepConnection = true;
+    }
+    else if (Name == "HTTP_EXPECT")
+      ExpectContinue = (strcasecmp (Value.c_str (), "100-continue") == 0);
+    else if (Name == "HTTP_TRANSFER_ENCODING")
+    {
+      // Only a body whose last coding is chunked can't be read without a
+      // length.  Others like "identity" are fine, as is chunked already
+      // undone by a front end which supplied the length.  Repeated headers
+      // add on to the list, so the last one has the last coding.
+
+      size_t CodingStart = Value.rfind (',');
+      CodingStart = Value.find_first_not_of (" \t",
+        (CodingStart == std::string::npos) ? 0 : CodingStart + 1);
+      Chunked = (CodingStart != std::string::npos &&
+        strncasecmp (Value.c_str () + CodingStart, "chunked", 7) == 0 &&
+        strchr (" \t;", Value[CodingStart + 7]) != NULL); // NUL matches too.
+    }
 
-  if (StringTest < 0)
-    return true;
+    // The first one wins if a header is repeated, like getenv() would.
+    Parameters.insert (ParameterMap::value_type (Name, Value));
+  }
 
-  if (StringTest > 0)
+  const char *pError = NULL;
+  std::string ErrorHeaders;
+  long long ContentLength = 0;
+  ParameterMap::iterator iLength = Parameters.find ("CONTENT_LENGTH");
+  if (iLength != Parameters.end ())
+  {
+    const char *pDigits = iLength->second.c_str ();
+    char *pEnd;
+    ContentLength = strtoll (pDigits, &pEnd, 10);
+    if (pEnd == pDigits || *pEnd != 0 || ContentLength < 0)
+      pError = "400 Bad Request";
+    else if (ContentLength > MAX_CONTENT_LENGTH)
+    {
+      pError = "413 Payload Too Large";
+      g_ServerStatistics.m_RequestsTooLarge++;
+    }
+  }
+
+  if (BadHeader)
+    pError = "400 Bad Request";
+  else if (Version != "HTTP/1.0" &&
+  Parameters.find ("HTTP_HOST") == Parameters.end ())
+    pError = "400 Bad Request"; // HTTP/1.1 requires a Host header.
+  else if (Chunked && iLength == Parameters.end ())
+    pError = "411 Length Required";
+  else if (Path != HTTP_CGI_PATH)
+    pError = "404 Not Found";
+  else if (Method != "GET" && Method != "HEAD" && Method != "POST")
+  {
+    pError = "405 Method Not Allowed";
+    ErrorHeaders = "Allow: GET, HEAD, POST\r\n";
+  }
+  if (pError != NULL)
+  {
+    delete pRequest;
+    AppendHTTPErrorResponse (pConnection, pError, ErrorHeaders);
     return false;
+  }
 
-  // Fall back to comparing venue names.  Could happen if the show is showing
-  // at two venues at the same time.
+  if (ExpectContinue && ContentLength > 0)
+    GetOutputScratch (pConnection).append ("HTTP/1.1 100 Continue\r\n\r\n");
+  pConnection->m_pHTTPRequest = pRequest;
+  pRequest->m_FormDecoder.m_BytesWanted = ContentLength;
+  return true;
+}
 
-  StringTest = strcasecmp (
-    ItemA->first.m_Venue->first.c_str (),
-    ItemB->first.m_Venue->first.c_str ());
 
-  if (StringTest < 0)
-    return true;
+/******************************************************************************
+ * Process the received HTTP text, collecting request headers and the body.
+ * Once a request is complete it's given to the worker threads, and any
+ * following pipelined requests wait in the input buffer until its response
+ * has been sent.  Returns false if the input is garbage.
+ */
 
-  return false;
-}
+bool ProcessHTTPInput (ConnectionStruct *pConnection)
+{
+  std::string &Input = pConnection->m_InputBuffer;
 
+  while (!pConnection->m_CloseWhenDone &&
+  pConnection->m_RequestsInWorkers == 0)
+  {
+    if (pConnection->m_pHTTPRequest == NULL)
+    {
+      // Blank lines before a request are allowed, and ignored.
+      size_t Start = Input.find_first_not_of ("\r\n");
+      Input.erase (0, Start == std::string::npos ? Input.size () : Start);
 
-void SortEventsByTimeAndShow ()
-{
-  EventIterator iEvent;
+      size_t HeaderEnd = Input.find ("\r\n\r\n");
+      if (HeaderEnd == std::string::npos)
+      {
+        if (Input.size () > MAX_HTTP_HEADER_LENGTH)
+        {
+          AppendHTTPErrorResponse (pConnection,
+            "431 Request Header Fields Too Large");
+          Input.clear ();
+        }
+        break;
+      }
+      std::string HeaderText (Input, 0, HeaderEnd);
+      Input.erase (0, HeaderEnd + 4);
+      if (!ParseHTTPRequestHeaders (pConnection, HeaderText))
+        break;
+    }
 
-  g_EventsSortedByTimeAndShow.clear ();
-  g_EventsSortedByTimeAndShow.reserve (g_AllEvents.size ());
+    RequestStruct *pRequest = pConnection->m_pHTTPRequest;
+    FormDecoderStruct &Decoder = pRequest->m_FormDecoder;
+    size_t AmountWanted = Decoder.m_BytesWanted;
+    if (AmountWanted > Input.size ())
+      AmountWanted = Input.size ();
+    DecodeFormInput (Decoder, Input.data (), AmountWanted);
+    Input.erase (0, AmountWanted);
+    if (Decoder.m_BytesWanted > 0)
+      break;
+
+    pConnection->m_pHTTPRequest = NULL;
+    StartRequest (pConnection, pRequest);
+  }
+  return true;
+}
 
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
-    g_EventsSortedByTimeAndShow.push_back (iEvent);
 
-  std::sort (g_EventsSortedByTimeAndShow.begin (),
-    g_EventsSortedByTimeAndShow.end (),
-    CompareEventByTimeAndShowName);
+/* Process newly received input, or input left waiting for a previous request
+to be finished.  Returns false if the input is garbage. */
+
+bool ProcessConnectionInput (ConnectionStruct *pConnection)
+{
+  if (pConnection->m_Protocol == PROTOCOL_HTTP)
+    return ProcessHTTPInput (pConnection);
+  return ProcessFastCGIInput (pConnection);
 }
 
 
 /******************************************************************************
- * Generate the phantom reverse travel times for all the ones the user has
- * specified which don't already have a reverse direction entry.
+ * Read whatever the web server has sent on a connection and process it.
+ * Closes the connection if the web server has closed its end or on errors.
  */
 
-void GeneratePhantomReverseTravelTimes ()
+void ReadConnectionInput (ConnectionStruct *pConnection)
 {
-  VenueIterator iFromVenue, iFromVenueEnd;
-  TravelTimeIterator iToVenueTravelTime, iToVenueTravelTimeEnd;
+  char Buffer[65536];
+  ssize_t AmountRead;
 
-  iFromVenueEnd = g_AllVenues.end ();
-  for (iFromVenue = g_AllVenues.begin (); iFromVenue != iFromVenueEnd;
-  iFromVenue++)
+  while (true)
   {
-    iToVenueTravelTimeEnd =
-      iFromVenue->second.m_TravelTimesToOtherPlaces.end ();
-    for (iToVenueTravelTime =
-    iFromVenue->second.m_TravelTimesToOtherPlaces.begin ();
-    iToVenueTravelTime != iToVenueTravelTimeEnd; iToVenueTravelTime++)
+    AmountRead = recv (pConnection->m_Socket, Buffer, sizeof (Buffer), 0);
+    if (AmountRead < 0 && errno == EINTR)
+      continue;
+    if (AmountRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (AmountRead <= 0)
     {
-      if (iToVenueTravelTime->second.m_IsPhantomReverse)
-        continue; // Don't make phantoms from phantoms.
+      CloseConnection (pConnection);
+      return;
+    }
+    pConnection->m_InputBuffer.append (Buffer, AmountRead);
+    if (!ProcessConnectionInput (pConnection))
+    {
+      CloseConnection (pConnection);
+      return;
+    }
+  }
+  WriteConnectionOutput (pConnection);
+}
 
-      VenueIterator iReverseFromVenue, iReverseToVenue;
 
-      iReverseFromVenue = iToVenueTravelTime->first;
-      iReverseToVenue = iFromVenue;
+void AcceptConnections (const ListenSocketStruct &Listen)
+{
+  int Socket;
 
-      // See if the reverse direction TravelTime entry exists.
+  while (true)
+  {
+    Socket = accept4 (Listen.m_Socket, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (Socket < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break; // Usually EAGAIN, nothing more waiting.  Or out of file handles.
+    }
 
-      TravelTimeIterator iReverseTravelTime = iReverseFromVenue->
-        second.m_TravelTimesToOtherPlaces.find (iReverseToVenue);
-      if (iReverseTravelTime ==
-      iReverseFromVenue->second.m_TravelTimesToOtherPlaces.end ())
-      {
-        // Not there, make a phantom reverse travel time record.
+    ConnectionStruct *pConnection = new ConnectionStruct;
+    pConnection->m_Socket = Socket;
+    pConnection->m_Serial = g_NextConnectionSerial++;
+    pConnection->m_Protocol = Listen.m_Protocol;
+    g_Connections[pConnection->m_Serial] = pConnection;
+    g_ServerStatistics.m_ConnectionsAccepted++;
+
+    struct epoll_event Event;
+    memset (&Event, 0, sizeof (Event));
+    Event.events = EPOLLIN;
+    Event.data.u64 = pConnection->m_Serial;
+    epoll_ctl (g_EpollFD, EPOLL_CTL_ADD, Socket, &Event);
+  }
+}
 
-        TravelTimeRecord NewTravelTime (iToVenueTravelTime->second);
-        NewTravelTime.m_IsPhantomReverse = true;
 
-        TravelTimeMap::value_type NewTravelTimePair (
-          iReverseToVenue, NewTravelTime);
+/******************************************************************************
+ * Send back the requests which the worker threads have finished.  Ones for
+ * connections that have since closed are thrown away.
+ */
 
-        iReverseFromVenue->second.m_TravelTimesToOtherPlaces.insert
-          (NewTravelTimePair);
+void SendFinishedRequests ()
+{
+  uint64_t Counter;
+  ssize_t AmountRead;
+  std::deque<RequestStruct *> Finished;
+  std::set<ConnectionStruct *> ConnectionsToWrite;
+  std::set<ConnectionStruct *>::iterator iConnection;
+
+  AmountRead = read (g_WakeUpEventFD, &Counter, sizeof (Counter));
+  (void) AmountRead; // Just resetting the counter, don't care about errors.
+
+  pthread_mutex_lock (&g_QueueMutex);
+  Finished.swap (g_FinishedRequests);
+  pthread_mutex_unlock (&g_QueueMutex);
+
+  while (!Finished.empty ())
+  {
+    RequestStruct *pRequest = Finished.front ();
+    Finished.pop_front ();
+    g_RequestsInWorkers--;
+    if (pRequest->m_CacheKey != 0)
+      ShareResponseWithWaitingRequests (pRequest, Finished);
+
+    ConnectionMap::iterator iFound =
+      g_Connections.find (pRequest->m_ConnectionSerial);
+    if (iFound == g_Connections.end ())
+    {
+      delete pRequest;
+      continue;
+    }
+    ConnectionStruct *pConnection = iFound->second;
+    pConnection->m_RequestsInWorkers--;
+    if (pConnection->m_Protocol == PROTOCOL_HTTP)
+    {
+      // Now that the response is out, start on any pipelined request.
+      SendHTTPResponse (pConnection, pRequest);
+      if (!ProcessHTTPInput (pConnection))
+      {
+        ConnectionsToWrite.erase (pConnection);
+        CloseConnection (pConnection);
+        continue;
       }
     }
+    else
+      SendFastCGIResponse (pConnection, pRequest);
+    ConnectionsToWrite.insert (pConnection);
   }
+
+  for (iConnection = ConnectionsToWrite.begin ();
+  iConnection != ConnectionsToWrite.end (); ++iConnection)
+    WriteConnectionOutput (*iConnection);
 }
 
 
 /******************************************************************************
- * Find the shortest path from the origin to the destination.  Stores the path
- * in the ResultingPath vector.  Returns true if a path was found, false if the
- * destination is unreachable (vector will be empty in that case).
+ * Binary upgrades without downtime.  Sending SIGUSR2 to the server (or to the
+ * supervisor process if using several processes) makes it start a fresh copy
+ * of the program from disk, usually a newly installed version.  The listen
+ * sockets are inherited by the new process, with their file handles listed in
+ * an environment variable, so connections waiting to be accepted aren't lost
+ * and nobody gets "connection refused".  Once the new process has opened any
+ * other sockets and warmed up, it sends SIGTERM to the old one, which stops
+ * accepting, finishes its requests in progress and exits.  If the new program
+ * fails to start, the old one just keeps on running.
  */
 
-struct VenuePathLengthComparator {
-  bool operator() (
-    const VenueIterator ItemA,
-    const VenueIterator ItemB) const
-  {
-    int PathLengthA = ItemA->second.m_PathSearchTravelTimeToHere;
-    int PathLengthB = ItemB->second.m_PathSearchTravelTimeToHere;
-
-    if (PathLengthA < PathLengthB)
-      return true;
-    if (PathLengthA > PathLengthB)
-      return false;
+const char LISTEN_FDS_VARIABLE[] = "FFVSO_LISTEN_FDS";
+  /* Environment variable with the inherited listen sockets, one per line,
+  each being the file handle number, a space, and the listen address. */
 
-    // For equal path lengths, sort by venue name.
+const char OLD_PID_VARIABLE[] = "FFVSO_OLD_PID";
+  /* Environment variable with the process ID of the old server, which the new
+  one tells to exit once it's ready. */
 
-    const char *NameA = ItemA->first.c_str ();
-    const char *NameB = ItemB->first.c_str ();
-    return (strcmp (NameA, NameB) < 0);
-  }
-};
+static volatile sig_atomic_t g_UpgradeRequested = 0;
+  /* Set by the SIGUSR2 signal handler. */
 
 
-bool FindShortestPath (VenueIterator iOriginVenue,
-  VenueIterator iDestinationVenue,
-  PathVector &ResultingPath, int &PathTravelTime)
+void UpgradeSignalHandler (int SignalNumber)
 {
-  typedef std::set<VenueIterator, VenuePathLengthComparator> VenuesSortedSet;
-  VenuesSortedSet ExploreableVenues;
+  g_UpgradeRequested = 1;
+  WakeUpNetworkThread (); // Harmless if there isn't one.
+}
 
-  ResultingPath.clear ();
-  PathTravelTime = 0;
 
-  // Mark all nodes in the graph (venues) as unreached.
+void StartNewBinary ()
+{
+  std::vector<ListenSocketStruct> &ListenSockets =
+    g_ServerSettings.m_ListenSockets;
+  std::string ListenVariable (LISTEN_FDS_VARIABLE);
+  std::string PIDVariable (OLD_PID_VARIABLE);
+  std::vector<char *> Environment;
+  char Buffer[32];
+  char **ppEnv;
+
+  // Build the environment ahead of time, since only async-signal-safe
+  // functions should be used in the child of a multi-threaded process.
+
+  ListenVariable.append ("=");
+  for (size_t iListen = 0; iListen < ListenSockets.size (); iListen++)
+  {
+    snprintf (Buffer, sizeof (Buffer), "%d ", ListenSockets[iListen].m_Socket);
+    ListenVariable.append (Buffer);
+    ListenVariable.append (ListenSockets[iListen].m_Address);
+    ListenVariable.append ("\n");
+  }
+  snprintf (Buffer, sizeof (Buffer), "=%d", (int) getpid ());
+  PIDVariable.append (Buffer);
 
-  VenueIterator iVenue, iVenueEnd;
+  for (ppEnv = environ; *ppEnv != NULL; ppEnv++)
+  {
+    if (strncmp (*ppEnv, LISTEN_FDS_VARIABLE,
+    sizeof (LISTEN_FDS_VARIABLE) - 1) != 0 &&
+    strncmp (*ppEnv, OLD_PID_VARIABLE, sizeof (OLD_PID_VARIABLE) - 1) != 0)
+      Environment.push_back (*ppEnv);
+  }
+  Environment.push_back (&ListenVariable[0]);
+  Environment.push_back (&PIDVariable[0]);
+  Environment.push_back (NULL);
 
-  iVenueEnd = g_AllVenues.end ();
-  for (iVenue = g_AllVenues.begin (); iVenue != iVenueEnd; iVenue++)
+  // Fork twice so the new server isn't our child, otherwise the supervisor
+  // would wait for it to exit when shutting down.
+
+  pid_t ChildPID = fork ();
+  if (ChildPID == 0)
   {
-    iVenue->second.m_PathSearchTravelledFromVenue = iVenueEnd;
-    iVenue->second.m_PathSearchTravelTimeToHere = -1;
+    if (fork () == 0)
+    {
+      sigset_t NoSignals; // The supervisor blocks some, don't pass that on.
+      sigemptyset (&NoSignals);
+      sigprocmask (SIG_SETMASK, &NoSignals, NULL);
+      for (size_t iListen = 0; iListen < ListenSockets.size (); iListen++)
+        fcntl (ListenSockets[iListen].m_Socket, F_SETFD, 0); // Keep on exec.
+      execvpe (g_ServerSettings.m_ProgramPath.c_str (),
+        g_ServerSettings.m_argv, &Environment[0]);
+      _exit (127);
+    }
+    _exit (0);
   }
+  if (ChildPID > 0)
+    waitpid (ChildPID, NULL, 0);
+}
 
-  // Start with the origin as the first place to explore.
 
-  iOriginVenue->second.m_PathSearchTravelTimeToHere = 0;
-  ExploreableVenues.insert (iOriginVenue);
+/******************************************************************************
+ * Run one throwaway request, for a blank schedule, before accepting any
+ * connections.  That loads the time zone files, builds parsedate's tables and
+ * pages in the code, so the first real user doesn't have to wait for it.
+ * With several processes, it's done before forking so they all share it.
+ */
 
-  // Get the next exploreable venue with the smallest path from the origin
-  // found so far.  This must be the shortest possible path to that venue.
-  // If it's the destination, then we're done.  If everything has been
-  // explored, then we can't get to the destination from the origin.
+void WarmUp ()
+{
+  RequestStruct WarmUpRequest;
 
-  while (!ExploreableVenues.empty ())
-  {
-    // Remove the venue with the shortest path from the unexplored list,
-    // we're now searching that far from the origin and we know no paths
-    // shorter than that exist.
+  WarmUpRequest.m_Parameters["REQUEST_METHOD"] = "GET";
+  WarmUpRequest.m_Parameters["CONTENT_LENGTH"] = "0";
+  g_pCurrentRequest = &WarmUpRequest;
+  mainloop (g_ServerSettings.m_argc, g_ServerSettings.m_argv);
+  g_pCurrentRequest = NULL;
+}
 
-    VenueIterator iCurrentVenue = *ExploreableVenues.begin ();
-    ExploreableVenues.erase (ExploreableVenues.begin ());
 
-    // If the destination is reached, build the path vector by backtracking
-    // to the original venue and return it.  Mission accomplished.
+/******************************************************************************
+ * The network thread's event loop.  Starts up the worker threads, then
+ * accepts connections, reads requests and sends back the results until told
+ * to stop by a signal.  Then it stops accepting new connections, finishes the
+ * requests in progress and waits for the worker threads to exit.  Returns the
+ * exit code for the process.
+ */
 
-    if (iCurrentVenue == iDestinationVenue)
-    {
-      // Count up the number of venues in the path.
+void ServerSignalHandler (int SignalNumber)
+{
+  g_ServerStopRequested = 1;
+  WakeUpNetworkThread ();
+}
 
-      VenueIterator iBacktrackVenue = iCurrentVenue;
-      int PathSize = 0;
-      do {
-        PathSize++;
-        if (iBacktrackVenue == iOriginVenue)
-          break;
-        iBacktrackVenue =
-          iBacktrackVenue->second.m_PathSearchTravelledFromVenue;
-      } while (PathSize < 1000);
 
-      ResultingPath.resize (PathSize, iVenueEnd);
+int RunServer ()
+{
+  const int MAX_EVENTS = 64;
+  struct epoll_event Events[MAX_EVENTS];
+  struct epoll_event Event;
+  int iEvent;
+  int iThread;
+  bool Listening = true;
+
+  ChooseCacheKeySeed (); // Each process picks its own.
+  g_WakeUpEventFD = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  g_EpollFD = epoll_create1 (EPOLL_CLOEXEC);
+  if (g_WakeUpEventFD < 0 || g_EpollFD < 0)
+    return 1;
+
+  memset (&Event, 0, sizeof (Event));
+  Event.events = EPOLLIN;
+  Event.data.u64 = EPOLL_WAKE_UP_DATA;
+  epoll_ctl (g_EpollFD, EPOLL_CTL_ADD, g_WakeUpEventFD, &Event);
+
+  // With several processes sharing the listen sockets, only wake up one of
+  // them for each new connection.
+
+  std::vector<ListenSocketStruct> &ListenSockets =
+    g_ServerSettings.m_ListenSockets;
+  for (size_t iListen = 0; iListen < ListenSockets.size (); iListen++)
+  {
+    int Socket = ListenSockets[iListen].m_Socket;
+    fcntl (Socket, F_SETFL, fcntl (Socket, F_GETFL) | O_NONBLOCK);
+    Event.events = EPOLLIN;
+    if (g_ServerSettings.m_NumberOfProcesses > 1)
+      Event.events |= EPOLLEXCLUSIVE;
+    Event.data.u64 = EPOLL_FIRST_LISTEN_DATA + iListen;
+    epoll_ctl (g_EpollFD, EPOLL_CTL_ADD, Socket, &Event);
+  }
 
-      // Write the backtracked path in reverse order, so it appears in the
-      // ResultingPath vector from origin to destination.
+  struct sigaction SignalAction;
+  memset (&SignalAction, 0, sizeof (SignalAction));
+  SignalAction.sa_handler = ServerSignalHandler;
+  sigaction (SIGTERM, &SignalAction, NULL);
+  sigaction (SIGINT, &SignalAction, NULL);
+  SignalAction.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &SignalAction, NULL);
 
-      iBacktrackVenue = iCurrentVenue;
-      int iPath = PathSize;
-      do {
-        iPath--;
-        ResultingPath[iPath] = iBacktrackVenue;
-        if (iBacktrackVenue == iOriginVenue)
-          break;
-        iBacktrackVenue =
-          iBacktrackVenue->second.m_PathSearchTravelledFromVenue;
-      } while (iPath > 0);
+  // Upgrades are done by the supervisor if there is one.
 
-      PathTravelTime = iCurrentVenue->second.m_PathSearchTravelTimeToHere;
-      return true;
-    }
+  if (g_ServerSettings.m_NumberOfProcesses == 1)
+    SignalAction.sa_handler = UpgradeSignalHandler;
+  sigaction (SIGUSR2, &SignalAction, NULL);
 
-    // Check all the places that you can go to from this venue.  If they have
-    // shorter paths than any other path found so far to that place, update
-    // their path as coming from this venue and put them in the unexplored
-    // list.
+  std::vector<pthread_t> ThreadIDs (g_ServerSettings.m_NumberOfThreads);
+  for (iThread = 0; iThread < g_ServerSettings.m_NumberOfThreads; iThread++)
+    pthread_create (&ThreadIDs[iThread], NULL, WorkerThread, NULL);
 
-    TravelTimeIterator iTravelTimeEnd =
-      iCurrentVenue->second.m_TravelTimesToOtherPlaces.end ();
-    TravelTimeIterator iTravelTime =
-      iCurrentVenue->second.m_TravelTimesToOtherPlaces.begin ();
-    for (; iTravelTime != iTravelTimeEnd; iTravelTime++)
+  while (true)
+  {
+    if (g_UpgradeRequested)
     {
-      VenueIterator iNextVenue = iTravelTime->first;
+      g_UpgradeRequested = 0;
+      if (Listening)
+        StartNewBinary ();
+    }
 
-      int TravelDistance = iTravelTime->second.m_DistanceInMeters;
-      if (TravelDistance < 0)
-        continue; // Marks a non-traversable edge, wrong way on one way street.
+    if (g_ServerStopRequested && Listening)
+    {
+      // Stop taking new connections, and close the idle ones.  Busy ones get
+      // closed once their requests are done.
+
+      for (size_t iListen = 0; iListen < ListenSockets.size (); iListen++)
+        epoll_ctl (g_EpollFD, EPOLL_CTL_DEL, ListenSockets[iListen].m_Socket,
+          NULL);
+      Listening = false;
+
+      std::vector<uint64_t> Serials;
+      ConnectionMap::iterator iConnection;
+      for (iConnection = g_Connections.begin ();
+      iConnection != g_Connections.end (); ++iConnection)
+        Serials.push_back (iConnection->first);
+      for (size_t iSerial = 0; iSerial < Serials.size (); iSerial++)
+      {
+        ConnectionStruct *pConnection = g_Connections[Serials[iSerial]];
+        pConnection->m_CloseWhenDone = true;
+        WriteConnectionOutput (pConnection);
+      }
+    }
 
-      int OriginToNextVenueTime = (int) (
-        TravelDistance / g_CommonUserSettings.m_WalkingSpeed +
-        iTravelTime->second.m_WorstCaseDelaySeconds *
-          (100 - g_CommonUserSettings.m_Luckiness) / 100 +
-        iCurrentVenue->second.m_PathSearchTravelTimeToHere);
+    if (!Listening && g_Connections.empty () && g_RequestsInWorkers == 0)
+      break;
 
-      if (iNextVenue->second.m_PathSearchTravelTimeToHere < 0 ||
-      OriginToNextVenueTime < iNextVenue->second.m_PathSearchTravelTimeToHere)
-      {
-        // Have found a shorter path to iNextVenue.  Update its distance and
-        // backtrack path info, and (re)add it to the exploreable list in the
-        // new distance position.
+    int nEvents = epoll_wait (g_EpollFD, Events, MAX_EVENTS, -1);
+    if (nEvents < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
 
-        ExploreableVenues.erase (iNextVenue);
+    for (iEvent = 0; iEvent < nEvents; iEvent++)
+    {
+      uint64_t Data = Events[iEvent].data.u64;
 
-        iNextVenue->second.m_PathSearchTravelTimeToHere =
-          OriginToNextVenueTime;
-        iNextVenue->second.m_PathSearchTravelledFromVenue = iCurrentVenue;
+      if (Data == EPOLL_WAKE_UP_DATA)
+        SendFinishedRequests ();
+      else if (Data < EPOLL_FIRST_CONNECTION_SERIAL)
+      {
+        if (Listening)
+          AcceptConnections (ListenSockets[Data - EPOLL_FIRST_LISTEN_DATA]);
+      }
+      else
+      {
+        // May have been closed while handling an earlier event.
+        ConnectionMap::iterator iFound = g_Connections.find (Data);
+        if (iFound == g_Connections.end ())
+          continue;
+        ConnectionStruct *pConnection = iFound->second;
 
-        ExploreableVenues.insert (iNextVenue);
+        if (Events[iEvent].events & EPOLLOUT)
+        {
+          if (!WriteConnectionOutput (pConnection))
+            continue;
+        }
+        if (Events[iEvent].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          ReadConnectionInput (pConnection);
       }
     }
   }
 
-  return false;
+  pthread_mutex_lock (&g_QueueMutex);
+  g_WorkersShouldExit = true;
+  pthread_cond_broadcast (&g_QueueCondition);
+  pthread_mutex_unlock (&g_QueueMutex);
+  for (iThread = 0; iThread < g_ServerSettings.m_NumberOfThreads; iThread++)
+    pthread_join (ThreadIDs[iThread], NULL);
+
+  close (g_EpollFD);
+  close (g_WakeUpEventFD);
+  return 0;
 }
 
 
 /******************************************************************************
- * Compute conflicts, estimate walking times for the user, count number of
- * times the user sees each show and compute various other statistics.
+ * Pre-forked multi-process serving.  The parent process forks off a number of
+ * child processes after the listen socket has been opened, so they all accept
+ * connections from the same socket.  Each child runs the usual worker threads
+ * and the parent just sits around restarting any children that die.  This
+ * gets us the use of more processor cores without depending on the thread
+ * safety of the code, and a crash only takes out one child.  Read-only data
+ * set up before forking (parsedate's tables, the program code) is shared
+ * between the processes by the operating system's copy-on-write paging.
  */
 
-void ComputeConflictsAndStatistics ()
-{
-  EventIterator iEvent;
-
-  /* Count up the scheduled events.  Each one gets added to the total for the
-  show, and to the grand total. */
-
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
-  {
-    if (!iEvent->second.m_IsSelectedByUser)
-      continue;
-
-    ShowIterator iShow = iEvent->second.m_ShowIter;
-
-    if (iShow->second.m_ScheduledCount <= 0) // First one?
-      iShow->second.m_ScheduledFirstTime = iEvent->first.m_EventTime;
-    else // Keep earliest start time.
-    {
-      if (difftime(iEvent->first.m_EventTime,
-      iShow->second.m_ScheduledFirstTime) < 0.0)
-        iShow->second.m_ScheduledFirstTime = iEvent->first.m_EventTime;
-    }
-
-    iShow->second.m_ScheduledCount++;
+static volatile sig_atomic_t g_SupervisorStopRequested = 0;
+  /* Set by a signal handler when the parent process is asked to exit. */
 
-    g_Statistics.m_TotalNumberOfEventsScheduled++;
 
-    g_Statistics.m_TotalSecondsWatched +=
-      iShow->second.m_ShowDuration;
-  }
+void SupervisorSignalHandler (int SignalNumber)
+{
+  g_SupervisorStopRequested = 1;
+}
 
-  /* Look for conflicts, where the start time of a show is inside the time
-  range of the previous show (including the time it takes to walk between
-  venues and the time it takes to wait in line to buy tickets).  Fortunately
-  the events are already sorted by start time.  Only consider adjacent shows,
-  don't worry about a really long show that overlaps multiple following
-  shows.  Also do a shortest path search to calculate the time it takes to
-  go from one venue to another.  No more big approximations! */
 
-  EventIterator iPreviousEvent = g_AllEvents.end();
+void ChildExitSignalHandler (int SignalNumber)
+{
+  // Nothing to do, just having a handler makes SIGCHLD wake up sigsuspend().
+}
 
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
-  {
-    if (!iEvent->second.m_IsSelectedByUser)
-      continue;
 
-    // Find out how long it takes to travel between events.  Sort of
-    // retroactively find it for the previous event.  The result gets
-    // saved in the event structure so it can be printed non-retroactively
-    // when showing that previous event later on.
+int RunSupervisor ()
+{
+  int iChild;
+  const int nChildren = g_ServerSettings.m_NumberOfProcesses;
+  std::vector<pid_t> ChildPIDs (nChildren, 0);
+  std::vector<time_t> ChildStartTimes (nChildren, 0);
+  sigset_t SupervisorSignals;
+  sigset_t WaitingMask;
+
+  // The signals we care about are blocked except while waiting in
+  // sigsuspend(), so one arriving just after the flags were checked isn't
+  // missed until some child happens to exit.
+
+  sigemptyset (&SupervisorSignals);
+  sigaddset (&SupervisorSignals, SIGTERM);
+  sigaddset (&SupervisorSignals, SIGINT);
+  sigaddset (&SupervisorSignals, SIGHUP);
+  sigaddset (&SupervisorSignals, SIGUSR2);
+  sigaddset (&SupervisorSignals, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &SupervisorSignals, &WaitingMask);
+
+  struct sigaction SignalAction;
+  memset (&SignalAction, 0, sizeof (SignalAction));
+  SignalAction.sa_handler = SupervisorSignalHandler;
+  sigaction (SIGTERM, &SignalAction, NULL);
+  sigaction (SIGINT, &SignalAction, NULL);
+  sigaction (SIGHUP, &SignalAction, NULL);
+  SignalAction.sa_handler = UpgradeSignalHandler;
+  sigaction (SIGUSR2, &SignalAction, NULL);
+  SignalAction.sa_handler = ChildExitSignalHandler;
+  sigaction (SIGCHLD, &SignalAction, NULL);
+
+  while (!g_SupervisorStopRequested)
+  {
+    if (g_UpgradeRequested)
+    {
+      g_UpgradeRequested = 0;
+      StartNewBinary ();
+    }
 
-    int TravelTime = 0;
-    time_t PreviousEventEndTime = 0;
+    // Forget about children which have died.
 
-    if (iPreviousEvent != g_AllEvents.end())
+    int Status;
+    pid_t DeadPID;
+    while ((DeadPID = waitpid (-1, &Status, WNOHANG)) > 0)
     {
-      if (!FindShortestPath (iPreviousEvent->first.m_Venue,
-      iEvent->first.m_Venue, iPreviousEvent->second.m_PathToNextEvent,
-      TravelTime))
+      for (iChild = 0; iChild < nChildren; iChild++)
       {
-        // Not found, empty path, use default time.
-        TravelTime = g_CommonUserSettings.m_DefaultTravelTime;
+        if (ChildPIDs[iChild] == DeadPID)
+          ChildPIDs[iChild] = 0;
       }
-      iPreviousEvent->second.m_TravelTimeToNextEvent = TravelTime;
-
-      PreviousEventEndTime = iPreviousEvent->first.m_EventTime +
-        iPreviousEvent->second.m_ShowIter->second.m_ShowDuration +
-        TravelTime + g_CommonUserSettings.m_LineupTime;
-
-      iPreviousEvent->second.m_SpareTimeBeforeNextEvent =
-        iEvent->first.m_EventTime - PreviousEventEndTime;
     }
 
-    if (iEvent->first.m_EventTime < PreviousEventEndTime &&
-    iPreviousEvent != g_AllEvents.end())
+    // Start up any missing children.  If one died right after it was started,
+    // wait a bit before replacing it so a broken child doesn't turn into a
+    // fork bomb.
+
+    for (iChild = 0; iChild < nChildren; iChild++)
     {
-      // Have a conflict with the previous event.
+      if (ChildPIDs[iChild] > 0)
+        continue;
 
-      iEvent->second.m_IsConflicting = true;
-      g_Statistics.m_TotalNumberOfConflicts++;
+      if (time (NULL) - ChildStartTimes[iChild] < 1)
+        sleep (1);
+      if (g_SupervisorStopRequested)
+        break;
+
+      pid_t NewPID = fork ();
+      if (NewPID == 0) // In the child process.
+      {
+        SignalAction.sa_handler = SIG_DFL;
+        sigaction (SIGTERM, &SignalAction, NULL);
+        sigaction (SIGINT, &SignalAction, NULL);
+        sigaction (SIGHUP, &SignalAction, NULL);
+        sigaction (SIGCHLD, &SignalAction, NULL);
+        sigprocmask (SIG_SETMASK, &WaitingMask, NULL);
+        _exit (RunServer ());
+      }
+      if (NewPID > 0)
+      {
+        ChildPIDs[iChild] = NewPID;
+        ChildStartTimes[iChild] = time (NULL);
+      }
     }
 
-    iPreviousEvent = iEvent;
+    // Wait for a child to die, or a signal to arrive.
+
+    if (!g_SupervisorStopRequested && !g_UpgradeRequested)
+      sigsuspend (&WaitingMask);
   }
 
-  // Count up the shows seen more than once and ones not seen at all.
+  // Shutting down.  Tell the children to quit, and wait for them to do so.
 
-  ShowIterator iShow;
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  for (iChild = 0; iChild < nChildren; iChild++)
   {
-    if (iShow->second.m_ScheduledCount > 1)
-      g_Statistics.m_TotalNumberOfRedundantShows++;
-    else if (iShow->second.m_ScheduledCount <= 0)
-    {
-      g_Statistics.m_TotalNumberOfUnseenShows++;
-
-      if (iShow->second.m_IsFavourite)
-        g_Statistics.m_TotalNumberOfUnseenFavouriteShows++;
-    }
+    if (ChildPIDs[iChild] > 0)
+      kill (ChildPIDs[iChild], SIGTERM);
   }
+  while (waitpid (-1, NULL, 0) > 0 || errno == EINTR)
+    ;
+
+  return 0;
 }
 
 
 /******************************************************************************
- * The main FastCGI processing loop contents.
+ * Open a socket listening for connections from the web server.  The address
+ * is one of:
+ *
+ *   host:port      IPv4 address or host name and TCP port, like 127.0.0.1:9000
+ *   [host]:port    IPv6 address and port, like [::1]:9000
+ *   *:port         All network interfaces.
+ *   unix:path      Unix domain socket, like unix:/run/ffvso.sock which is
+ *                  faster than TCP when the web server is on the same machine.
+ *
+ * followed by optional comma separated settings:
+ *
+ *   mode=octal     File permissions for a Unix domain socket, like mode=0660
+ *                  so that the web server's group can connect to it.
+ *   http           Speak HTTP/1.1 rather than the default protocol.
+ *   fastcgi        Speak FastCGI rather than the default protocol.
+ *
+ * Returns false with errno set if something went wrong.
  */
 
-int mainloop (int argc, char **argv)
+bool OpenListenSocket (ListenSocketStruct &Listen, int Backlog)
 {
-  FormNameToValuesMap::iterator iFormPair;
-
-  const int MAX_CONTENT_LENGTH = 50000000;
-    /* Should be big enough for the largest Fringe show, but not so large that
-    it will cause an out of memory problem (max 800MB user space in BeOS, minus
-    overhead of web server). */
-
-  // Get the host name the user used for this web server.  We'll echo it back
-  // in the URL for POSTing the form next time.  That way, if they copy and
-  // paste the web page, it will have an absolute reference to the web server
-  // and still work.  But yet also work with a LAN IP address as the host name.
-  // And preserve the http or https type of reference; we want to support both
-  // for compatibility with older unupgradable browsers.
-
-  const char *pHostName;
-  pHostName = getenv ("HTTP_HOST");
-  if (pHostName != NULL)
+  std::string Endpoint;
+  mode_t Mode = 0;
+  bool HaveMode = false;
+  int Socket;
+  int SavedErrno;
+
+  Listen.m_Protocol = g_ServerSettings.m_DefaultProtocol;
+  size_t Comma = Listen.m_Address.find (',');
+  Endpoint.assign (Listen.m_Address, 0, Comma);
+  while (Comma != std::string::npos)
   {
-    const char *pRequestScheme;
-    pRequestScheme = getenv ("REQUEST_SCHEME"); // Returns "http" or "https".
-    if (pRequestScheme == NULL || pRequestScheme[0] == 0)
-      pRequestScheme = "http";
-    g_HostNameURLFragment.assign (pRequestScheme);
-    g_HostNameURLFragment.append ("://");
-    g_HostNameURLFragment.append (pHostName);
+    size_t NextComma = Listen.m_Address.find (',', Comma + 1);
+    std::string Option (Listen.m_Address, Comma + 1,
+      NextComma == std::string::npos ?
+      std::string::npos : NextComma - Comma - 1);
+    Comma = NextComma;
+
+    if (Option == "http")
+      Listen.m_Protocol = PROTOCOL_HTTP;
+    else if (Option == "fastcgi")
+      Listen.m_Protocol = PROTOCOL_FASTCGI;
+    else if (Option.compare (0, 5, "mode=") == 0)
+    {
+      Mode = strtol (Option.c_str () + 5, NULL, 8);
+      HaveMode = true;
+    }
+    else
+    {
+      errno = EINVAL;
+      return false;
+    }
   }
-  else
-    g_HostNameURLFragment.clear ();
 
-  /* Read the data from the web browser, via standard input.  An environment
-  variable specifies the maximum length to be read, if known.  Use it so that
-  multiple transfers per HTTP session work.  If not present, read until end of
-  file.  Stuff it all into a big memory buffer which will be worked over later.
-  */
+  if (Listen.m_Socket >= 0)
+    return true; // Inherited from the old server during an upgrade.
+
+  if (Endpoint.compare (0, 5, "unix:") == 0)
+  {
+    struct sockaddr_un Address;
+    struct stat FileInfo;
+    std::string Path (Endpoint, 5);
 
-  int ContentLength = MAX_CONTENT_LENGTH; // Default if none specified.
-  const char *pContentLength;
-  pContentLength = getenv ("CONTENT_LENGTH");
-  if (pContentLength != NULL)
-    ContentLength = atoi (pContentLength);
-  if (ContentLength < 0)
-    ContentLength = 0;
-  if (ContentLength > MAX_CONTENT_LENGTH)
-    ContentLength = MAX_CONTENT_LENGTH;
+    memset (&Address, 0, sizeof (Address));
+    Address.sun_family = AF_UNIX;
+    if (Path.empty () || Path.size () >= sizeof (Address.sun_path))
+    {
+      errno = EINVAL;
+      return false;
+    }
+    strcpy (Address.sun_path, Path.c_str ());
 
-  g_InputFormText = new char [ContentLength+1];
+    // Remove a leftover socket from a previous run, else bind fails.  But if
+    // something is still listening on it, it's another running copy of the
+    // server, so leave it alone and let bind fail.
 
-  int AmountRead = fread (g_InputFormText, 1, ContentLength, stdin);
-  g_InputFormText[AmountRead ] = 0;
+    if (lstat (Path.c_str (), &FileInfo) == 0 && S_ISSOCK (FileInfo.st_mode))
+    {
+      int ProbeSocket = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (ProbeSocket >= 0)
+      {
+        if (connect (ProbeSocket, (struct sockaddr *) &Address,
+        sizeof (Address)) != 0 && errno == ECONNREFUSED)
+          unlink (Path.c_str ());
+        close (ProbeSocket);
+      }
+    }
 
-  WriteHTMLHeader ();
+    Socket = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (Socket < 0)
+      return false;
+    if (bind (Socket, (struct sockaddr *) &Address, sizeof (Address)) != 0 ||
+    (HaveMode && chmod (Path.c_str (), Mode) != 0) ||
+    listen (Socket, Backlog) != 0)
+    {
+      SavedErrno = errno;
+      close (Socket);
+      errno = SavedErrno;
+      return false;
+    }
+    Listen.m_Socket = Socket;
+    return true;
+  }
 
-#if 0
-  printf ("<PRE>Argc %d, argv: ", argc);
-  for (int i = 0; i < argc; i++)
-    printf ("%s%s", argv[i], (i < argc - 1) ? ", " : "\n");
-  printf ("Content length is %d.\n", ContentLength);
-  printf ("AmountRead is %d.\n", AmountRead);
-  printf ("Original text: %s\n", g_InputFormText);
-  printf ("Environment strings are:\n");
+  std::string Host;
+  std::string Port;
+  size_t ColonPosition;
+  if (Endpoint[0] == '[') // IPv6 addresses have colons of their own.
   {
-    int iEnv = 0;
-    char **ppEnv;
-    for (ppEnv = environ; *ppEnv != NULL; ppEnv++, iEnv++)
+    size_t Bracket = Endpoint.find (']');
+    if (Bracket == std::string::npos || Bracket + 1 >= Endpoint.size () ||
+    Endpoint[Bracket + 1] != ':')
     {
-      printf ("%02d: \"%s\"\n", iEnv, *ppEnv);
+      errno = EINVAL;
+      return false;
     }
+    Host.assign (Endpoint, 1, Bracket - 1);
+    ColonPosition = Bracket + 1;
+  }
+  else
+  {
+    ColonPosition = Endpoint.rfind (':');
+    if (ColonPosition == std::string::npos)
+    {
+      errno = EINVAL;
+      return false;
+    }
+    Host.assign (Endpoint, 0, ColonPosition);
+  }
+  Port.assign (Endpoint, ColonPosition + 1, std::string::npos);
+
+  struct addrinfo Hints;
+  struct addrinfo *pAddresses = NULL;
+  memset (&Hints, 0, sizeof (Hints));
+  Hints.ai_family = AF_UNSPEC;
+  Hints.ai_socktype = SOCK_STREAM;
+  Hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  if (getaddrinfo ((Host.empty () || Host == "*") ? NULL : Host.c_str (),
+  Port.c_str (), &Hints, &pAddresses) != 0 || pAddresses == NULL)
+  {
+    errno = EADDRNOTAVAIL;
+    return false;
   }
-  printf ("</PRE>\n");
-#endif
 
-  BuildFormNameAndValuePairsFromFormInput ();
+  // Host names can have several addresses, and "*" gives both IPv6 and IPv4
+  // ones.  Use the first which works, some may be for a kind of network this
+  // machine doesn't have.
 
-#if 0
-  printf ("Converted form input:\n<PRE>");
-  for (iFormPair = g_FormNameValuePairs.begin();
-  iFormPair != g_FormNameValuePairs.end(); ++iFormPair)
+  int OptionValue = 1;
+  Socket = -1;
+  for (struct addrinfo *pAddress = pAddresses;
+  pAddress != NULL && Socket < 0; pAddress = pAddress->ai_next)
   {
-    printf ("Name \"%s\", value: %s\n", iFormPair->first, iFormPair->second);
+    Socket = socket (pAddress->ai_family, pAddress->ai_socktype,
+      pAddress->ai_protocol);
+    if (Socket < 0)
+      continue;
+    setsockopt (Socket, SOL_SOCKET, SO_REUSEADDR,
+      &OptionValue, sizeof (OptionValue));
+    if (bind (Socket, pAddress->ai_addr, pAddress->ai_addrlen) != 0 ||
+    listen (Socket, Backlog) != 0)
+    {
+      SavedErrno = errno;
+      close (Socket);
+      errno = SavedErrno;
+      Socket = -1;
+    }
   }
-  printf ("</PRE>\n");
-#endif
+  SavedErrno = errno;
+  freeaddrinfo (pAddresses);
+  errno = SavedErrno;
 
-  // Set up the global list of settings, for things like the HTML strings that
-  // highlight selected items.  They will be overwritten by user provided
-  // settings.  Some are also used for defaults while reading other values.
+  Listen.m_Socket = Socket;
+  return Socket >= 0;
+}
 
-  InitialiseDefaultSettings ();
 
-  // Load up the saved state information first, we'll apply the user's changes
-  // (checkbox markings) afterwards.  If there isn't any saved data, just leave
-  // it empty.
+/******************************************************************************
+ * Pick up the listen sockets passed on by the old server when upgrading, see
+ * StartNewBinary().  They're matched up with our listen addresses, so a Unix
+ * domain socket doesn't get deleted and recreated, and so a TCP port doesn't
+ * have to be rebound while the old server still has it.  Any that are no
+ * longer wanted are closed.
+ */
 
-  iFormPair = g_FormNameValuePairs.find (
-    const_cast<char *>("SavedState"));
-  if (iFormPair != g_FormNameValuePairs.end ())
+void AdoptInheritedListenSockets ()
+{
+  std::vector<ListenSocketStruct> &ListenSockets =
+    g_ServerSettings.m_ListenSockets;
+  const char *pVariable;
+  size_t LineStart;
+  size_t LineEnd;
+
+  pVariable = getenv (LISTEN_FDS_VARIABLE);
+  if (pVariable == NULL)
+    return;
+
+  std::string Text (pVariable);
+  for (LineStart = 0; LineStart < Text.size (); LineStart = LineEnd + 1)
   {
-    LoadStateInformation (iFormPair->second);
+    LineEnd = Text.find ('\n', LineStart);
+    if (LineEnd == std::string::npos)
+      LineEnd = Text.size ();
+    std::string Line (Text, LineStart, LineEnd - LineStart);
+    size_t Space = Line.find (' ');
+    int Socket = atoi (Line.c_str ());
+    if (Space == std::string::npos || Socket <= STDERR_FILENO)
+      continue;
+
+    std::string Address (Line, Space + 1, std::string::npos);
+    size_t iListen;
+    for (iListen = 0; iListen < ListenSockets.size (); iListen++)
+    {
+      if (ListenSockets[iListen].m_Socket < 0 &&
+      ListenSockets[iListen].m_Address == Address)
+      {
+        ListenSockets[iListen].m_Socket = Socket;
+        break;
+      }
+    }
+    if (iListen >= ListenSockets.size ())
+      close (Socket);
   }
+  unsetenv (LISTEN_FDS_VARIABLE);
+}
 
-  // Check that the submitted form controls match the SavedState data.  They
-  // can mismatch if someone pastes in some old or new data into the SavedState
-  // text box.  If so, don't read the controls from the form, they are invalid
-  // in so many ways.
 
-  bool bFormDataMatchesStateData = false;
-  iFormPair = g_FormNameValuePairs.find (
-    const_cast<char *> ("LastUpdateTime"));
-  if (iFormPair != g_FormNameValuePairs.end ())
+/******************************************************************************
+ * Server options, which can come from the command line or from a
+ * configuration file.  The option name is the long form without the leading
+ * dashes, like "threads".  Returns the number of values used (0 or 1), or -1
+ * if the option is unknown, is missing its value or the value is unusable.
+ * The "config" option for reading a configuration file is handled by the
+ * callers.
+ */
+
+int SetServerOption (const std::string &Name, const char *pValue)
+{
+  if (Name == "http")
   {
-    bFormDataMatchesStateData =
-     (g_AllSettings["LastUpdateTime"] == iFormPair->second);
+    g_ServerSettings.m_DefaultProtocol = PROTOCOL_HTTP;
+    return 0;
   }
-  if (bFormDataMatchesStateData)
+  if (Name == "statistics")
   {
-    ReadFormControls ();
+    g_ServerSettings.m_ServeStatistics = true;
+    return 0;
   }
 
-  ValidateUserSettings ();
-  SortEventsByTimeAndShow ();
-  GeneratePhantomReverseTravelTimes ();
-  ComputeConflictsAndStatistics ();
-  ResetDynamicSettings (); // New form needs new date.
-
-  if (g_FormNameValuePairs.find (const_cast<char *> ("PrintSchedule")) !=
-  g_FormNameValuePairs.end ()) // Was the printable schedule button used?
-    WritePrintableListing (); // Just the user's events listed plainly.
-  else // Output the user interface with all the bells and whistles.
-    WriteHTMLForm ();
-
-  // Dump out some debug information.
+  if (pValue == NULL)
+    return -1;
 
-#if 0
-  printf ("<PRE>\n");
-  printf ("List of %lu shows:\n", g_AllShows.size ());
-  ShowIterator iShow;
-  for (iShow = g_AllShows.begin(); iShow != g_AllShows.end(); ++iShow)
+  if (Name == "backlog")
+    g_ServerSettings.m_Backlog = atoi (pValue);
+  else if (Name == "cache-max-age")
+    g_ServerSettings.m_CacheMaxAge = atof (pValue);
+  else if (Name == "cache-size")
+    g_ServerSettings.m_CacheSize = atol (pValue);
+  else if (Name == "compress-level")
   {
-    printf ("Show \"%s\", Favourite %d, EventCount %d, ScheduledCount %d, URL \"%s\".\n",
-      iShow->first.c_str(), iShow->second.m_IsFavourite,
-      iShow->second.m_EventCount, iShow->second.m_ScheduledCount,
-      iShow->second.m_ShowURL.c_str());
+    g_ServerSettings.m_CompressLevel = atoi (pValue);
+    if (g_ServerSettings.m_CompressLevel < 0 ||
+    g_ServerSettings.m_CompressLevel > 9)
+      return -1; // zlib would fail on every page, or -1 means its default.
   }
-
-  printf ("List of %lu venues:\n", g_AllVenues.size ());
-  VenueIterator iVenue;
-  for (iVenue = g_AllVenues.begin(); iVenue != g_AllVenues.end(); ++iVenue)
+  else if (Name == "compress-min-size")
+    g_ServerSettings.m_CompressMinSize = atol (pValue);
+  else if (Name == "heavy-size")
+    g_ServerSettings.m_HeavySize = atol (pValue);
+  else if (Name == "listen")
   {
-    printf ("Venue \"%s\", EventCount %d, URL \"%s\".\n",
-      iVenue->first.c_str(), iVenue->second.m_EventCount,
-      iVenue->second.m_VenueURL.c_str());
+    ListenSocketStruct Listen;
+    Listen.m_Address = pValue;
+    g_ServerSettings.m_ListenSockets.push_back (Listen);
   }
+  else if (Name == "cpu-limit")
+    g_ServerSettings.m_CPULimit = atof (pValue);
+  else if (Name == "parse-threads")
+    g_ParseThreads = atoi (pValue);
+  else if (Name == "processes")
+    g_ServerSettings.m_NumberOfProcesses = atoi (pValue);
+  else if (Name == "queue-limit")
+    g_ServerSettings.m_QueueLimit = atoi (pValue);
+  else if (Name == "threads")
+    g_ServerSettings.m_NumberOfThreads = atoi (pValue);
+  else if (Name == "time-limit")
+    g_ServerSettings.m_TimeLimit = atof (pValue);
+  else
+    return -1;
+  return 1;
+}
 
-  printf ("List of %lu events:\n", g_AllEvents.size ());
-  EventIterator iEvent;
-  for (iEvent = g_AllEvents.begin(); iEvent != g_AllEvents.end(); ++iEvent)
-  {
-    struct tm BrokenUpDate;
-    char TimeString[60];
 
-    localtime_r (&iEvent->first.m_EventTime, &BrokenUpDate);
-    strcpy (TimeString, asctime (&BrokenUpDate));
-    TimeString[strlen(TimeString)-1] = 0; // Trash trailing linefeed.
+/******************************************************************************
+ * Read server options from a configuration file.  Each line has an option
+ * name (same as the long command line option but without the dashes) and
+ * usually a value, separated by spaces.  Blank lines and lines starting with
+ * a # are ignored.  For example:
+ *
+ *   # Serve NGINX through a Unix socket, and web browsers on port 8080.
+ *   listen unix:/run/ffvso.sock,mode=0660
+ *   listen 127.0.0.1:8080,http
+ *   backlog 500
+ *   threads 4
+ *
+ * Returns false if the file can't be read or has a bad line, after printing
+ * an error message.
+ */
 
-    printf ("Event %s/%s, \"%s\"%s\n",
-      TimeString, iEvent->first.m_Venue->first.c_str(),
-      iEvent->second.m_ShowIter->first.c_str(),
-      (iEvent->second.m_IsSelectedByUser) ? ", Selected" : "");
-  }
+bool ReadConfigurationFile (const char *pFileName)
+{
+  FILE *pFile;
+  char Line[1024];
+  int LineNumber = 0;
+  bool Success = true;
+  static int NestingLevel = 0;
 
-  printf ("List of %lu settings:\n", g_AllSettings.size ());
-  SettingIterator iSetting;
-  for (iSetting = g_AllSettings.begin(); iSetting != g_AllSettings.end(); ++iSetting)
+  if (NestingLevel > 10)
   {
-    printf ("Setting \"%s\" is \"%s\".\n",
-      iSetting->first.c_str(), iSetting->second.c_str());
+    fprintf (stderr, "Configuration files nested too deeply at \"%s\".\n",
+      pFileName);
+    return false;
   }
-  printf ("</PRE>\n");
-#endif
 
-  printf ("</BODY>\n</HTML>\n");
+  pFile = fopen (pFileName, "r");
+  if (pFile == NULL)
+  {
+    fprintf (stderr, "Unable to read configuration file \"%s\": %s\n",
+      pFileName, strerror (errno));
+    return false;
+  }
 
-  // Clearing all variables at the end of the program paid off for FastCGI
-  // where the program becomes a repeated loop.
+  NestingLevel++;
+  while (Success && fgets (Line, sizeof (Line), pFile) != NULL)
+  {
+    LineNumber++;
+    std::string Text (Line);
+    size_t Start = Text.find_first_not_of (" \t\r\n");
+    if (Start == std::string::npos || Text[Start] == '#')
+      continue;
+    size_t End = Text.find_last_not_of (" \t\r\n");
+    Text = Text.substr (Start, End + 1 - Start);
+
+    size_t NameEnd = Text.find_first_of (" \t");
+    std::string Name (Text, 0, NameEnd);
+    std::string Value;
+    if (NameEnd != std::string::npos)
+      Value.assign (Text, Text.find_first_not_of (" \t", NameEnd),
+        std::string::npos);
+
+    int UsedValues;
+    if (Name == "config" && !Value.empty ())
+      UsedValues = ReadConfigurationFile (Value.c_str ()) ? 1 : -1;
+    else
+      UsedValues =
+        SetServerOption (Name, Value.empty () ? NULL : Value.c_str ());
+    if (UsedValues < 0 || (UsedValues == 0 && !Value.empty ()))
+    {
+      fprintf (stderr, "Bad option \"%s\" on line %d of configuration "
+        "file \"%s\".\n", Text.c_str (), LineNumber, pFileName);
+      Success = false;
+    }
+  }
+  NestingLevel--;
 
-  g_EventsSortedByTimeAndShow.clear();
-  g_AllEvents.clear();
-  g_AllShows.clear();
-  g_AllVenues.clear();
-  g_AllSettings.clear();
-  g_FormNameValuePairs.clear ();
-  delete [] g_InputFormText;
-  g_InputFormText = NULL;
-  g_HostNameURLFragment.clear();
-  g_Statistics.m_TotalNumberOfConflicts = 0;
-  g_Statistics.m_TotalNumberOfEventsScheduled = 0;
-  g_Statistics.m_TotalNumberOfRedundantShows = 0;
-  g_Statistics.m_TotalNumberOfUnseenFavouriteShows = 0;
-  g_Statistics.m_TotalNumberOfUnseenShows = 0;
-  g_Statistics.m_TotalSecondsWatched = 0;
-  return 0;
+  fclose (pFile);
+  return Success;
 }
 
 
 /******************************************************************************
- * Finally, the main program which drives it all.
+ * Finally, the main program which drives it all.  Command line options are:
+ *
+ * -b number or --backlog number
+ *   Length of the queue of pending connections for each listen socket.
+ *   Defaults to 100.
+ *
+ * --cache-max-age seconds
+ *   How long a web page stays in the response cache, since it has the time it
+ *   was made in it.  Defaults to 300, zero for no limit.
+ *
+ * --cache-size bytes
+ *   Memory budget for the cache of recently generated web pages, used to
+ *   answer repeats of the same request without redoing the work.  Defaults
+ *   to 32000000, zero turns off the cache.
+ *
+ * --compress-level number
+ *   zlib compression level for web pages sent to browsers which accept gzip
+ *   or deflate, from 1 (fastest) to 9 (smallest).  Defaults to 6, zero turns
+ *   off compression.
+ *
+ * --compress-min-size bytes
+ *   Pages smaller than this are sent uncompressed.  Defaults to 1024.
+ *
+ * --cpu-limit seconds
+ *   CPU time allowed for generating one web page, after which the user gets
+ *   an error page instead.  Defaults to 10, zero for no limit.
+ *
+ * -c file or --config file
+ *   Read more options from a configuration file, see ReadConfigurationFile().
+ *   Later options override earlier ones, except --listen which adds up.
+ *
+ * --heavy-size bytes
+ *   Requests with more form data than this are handled after the others.
+ *   Defaults to 200000, several times the size of a full festival schedule.
+ *
+ * --http
+ *   Serve web browsers directly with HTTP/1.1 rather than talking FastCGI to
+ *   a web server.  The form is at http://127.0.0.1:9000/cgi-bin/FFVSO.cgi
+ *   unless a different --listen address is used.
+ *
+ * -l address or --listen address
+ *   Listen for connections on the given address, see OpenListenSocket() for
+ *   the format.  Can be repeated to listen on several addresses at once.
+ *   Defaults to 127.0.0.1:9000 if none are given.
+ *
+ * --parse-threads number
+ *   Number of threads used for parsing a SavedState of half a megabyte or
+ *   more, including the worker thread handling the request.  The extra
+ *   threads are shared by all the worker threads in a process.  Defaults to
+ *   1, parsing it all on the worker thread.  Only worth raising when there
+ *   are more processors than busy worker threads.
+ *
+ * -p number or --processes number
+ *   Number of worker processes to pre-fork, each with its own threads.
+ *   Defaults to 1, which runs everything in the original process.
+ *
+ * --queue-limit number
+ *   Maximum number of requests waiting for a worker thread, after that they
+ *   get an immediate busy page.  Defaults to 100, zero for no limit.
+ *
+ * --statistics
+ *   Answer requests for the CGI path with a query string of "ServerStatistics"
+ *   with counts of requests, queue lengths, cache use and so on.  Off by
+ *   default, since anybody could ask.
+ *
+ * -t number or --threads number
+ *   Number of worker threads to use in each process.  Defaults to the number
+ *   of processors, or to 1 when there are several processes.
+ *
+ * --time-limit seconds
+ *   Time allowed for a request, including time waiting in the queue, after
+ *   which the user gets an error page.  Defaults to 30, zero for no limit.
+ *
+ * Signals are SIGTERM or SIGINT to finish the requests in progress and exit,
+ * and SIGUSR2 to upgrade to a new copy of the program, see StartNewBinary().
  */
 
 int main (int argc, char **argv)
 {
-  int returncode;
-  int sockfd;
+  int iArg;
+
+  g_ServerSettings.m_argc = argc;
+  g_ServerSettings.m_argv = argv;
+  g_ServerSettings.m_NumberOfThreads = 0; // Zero until the user picks one.
 
-  // Open a socket listening for network connections, and force it to use file
-  // handle FCGI_LISTENSOCK_FILENO.  Then use that one as our FastCGI default
-  // input socket.  Needed since NGINX doesn't fire up FastCGI programs and the
-  // spawn-fcgi utility doesn't work right.
+  g_ServerSettings.m_ProgramPath = argv[0];
+  if (strchr (argv[0], '/') != NULL) // Else it was found in the PATH.
+  {
+    char *pFullPath = realpath (argv[0], NULL);
+    if (pFullPath != NULL)
+      g_ServerSettings.m_ProgramPath = pFullPath;
+    free (pFullPath);
+  }
+
+  for (iArg = 1; iArg < argc; iArg++)
+  {
+    std::string Name;
+    if (strncmp (argv[iArg], "--", 2) == 0)
+      Name = argv[iArg] + 2;
+    else if (strcmp (argv[iArg], "-b") == 0)
+      Name = "backlog";
+    else if (strcmp (argv[iArg], "-c") == 0)
+      Name = "config";
+    else if (strcmp (argv[iArg], "-l") == 0)
+      Name = "listen";
+    else if (strcmp (argv[iArg], "-p") == 0)
+      Name = "processes";
+    else if (strcmp (argv[iArg], "-t") == 0)
+      Name = "threads";
+
+    const char *pValue = (iArg + 1 < argc) ? argv[iArg + 1] : NULL;
+    int UsedValues;
+    if (Name == "config" && pValue != NULL)
+      UsedValues = ReadConfigurationFile (pValue) ? 1 : -1;
+    else
+      UsedValues = SetServerOption (Name, pValue);
+    if (UsedValues < 0)
+    {
+      fprintf (stderr, "Bad command line option \"%s\".\n"
+        "Usage: %s [-c ConfigFile] [-l ListenAddress]... [-b Backlog] "
+        "[--http]\n  [-p NumberOfProcesses] [-t NumberOfThreads] "
+        "[--queue-limit Requests]\n  [--time-limit Seconds] "
+        "[--cpu-limit Seconds]\n  [--heavy-size Bytes] "
+        "[--parse-threads NumberOfThreads] [--statistics]\n"
+        "  [--cache-size Bytes] [--cache-max-age Seconds]\n"
+        "  [--compress-level 0-9] [--compress-min-size Bytes]\n",
+        argv[iArg], argv[0]);
+      return 1;
+    }
+    iArg += UsedValues;
+  }
+  if (g_ServerSettings.m_Backlog < 1)
+    g_ServerSettings.m_Backlog = 1;
+  if (g_ServerSettings.m_NumberOfProcesses < 1)
+    g_ServerSettings.m_NumberOfProcesses = 1;
+
+  // Each process gets the use of its own processor core, so several processes
+  // default to one worker thread each, and don't need to be thread safe.
+
+  if (g_ServerSettings.m_NumberOfThreads < 1)
+    g_ServerSettings.m_NumberOfThreads =
+      (g_ServerSettings.m_NumberOfProcesses > 1) ?
+      1 : sysconf (_SC_NPROCESSORS_ONLN);
+  if (g_ServerSettings.m_NumberOfThreads < 1)
+    g_ServerSettings.m_NumberOfThreads = 1;
+  if (g_ParseThreads < 1)
+    g_ParseThreads = 1;
+  if (g_ServerSettings.m_ListenSockets.empty ())
+    SetServerOption ("listen", "127.0.0.1:9000");
+
+  // Open the sockets listening for network connections from the web server.
+  // Needed since NGINX doesn't fire up FastCGI programs and the spawn-fcgi
+  // utility doesn't work right.  Then point the standard input and output at
+  // /dev/null, so stray printing doesn't go anywhere important.
+
+  AdoptInheritedListenSockets ();
+  std::vector<ListenSocketStruct> &ListenSockets =
+    g_ServerSettings.m_ListenSockets;
+  for (size_t iListen = 0; iListen < ListenSockets.size (); iListen++)
+  {
+    if (!OpenListenSocket (ListenSockets[iListen], g_ServerSettings.m_Backlog))
+    {
+      fprintf (stderr, "Unable to listen on \"%s\": %s\n",
+        ListenSockets[iListen].m_Address.c_str (), strerror (errno));
+      return 1;
+    }
+  }
 
-  close (STDIN_FILENO);
-  close (STDOUT_FILENO);
-  close (STDERR_FILENO);
-  sockfd = FCGX_OpenSocket ("127.0.0.1:9000", 100);
-  if (sockfd != FCGI_LISTENSOCK_FILENO) {
-    close (FCGI_LISTENSOCK_FILENO);
-    dup2(sockfd, FCGI_LISTENSOCK_FILENO);
-    close(sockfd);
+  int NullFile = open ("/dev/null", O_RDWR);
+  if (NullFile >= 0)
+  {
+    dup2 (NullFile, STDIN_FILENO);
+    dup2 (NullFile, STDOUT_FILENO);
+    dup2 (NullFile, STDERR_FILENO);
+    if (NullFile > STDERR_FILENO)
+      close (NullFile);
   }
 
-  while (FCGI_Accept() >= 0)
+  // If we're the new server in an upgrade, now that we're ready, tell the old
+  // one to stop accepting connections and exit once it has finished its work.
+
+  WarmUp ();
+  const char *pOldPID = getenv (OLD_PID_VARIABLE);
+  if (pOldPID != NULL)
   {
-    returncode = mainloop(argc, argv);
-    FCGI_SetExitStatus(returncode);
+    kill (atoi (pOldPID), SIGTERM);
+    unsetenv (OLD_PID_VARIABLE);
   }
+
+  if (g_ServerSettings.m_NumberOfProcesses > 1)
+    return RunSupervisor ();
+
+  return RunServer ();
 }
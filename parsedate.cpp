@@ -11,10 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <map>
+#include <new>
+#include <vector>
+
 // Haiku specific #include <OS.h>
 #include <sys/types.h>
 typedef __uint8_t uint8;
 typedef __int8_t int8;
+typedef __uint16_t uint16;
+typedef __int16_t int16;
 typedef __int32_t int32;
 typedef __uint32_t uint32;
 typedef __int64_t bigtime_t;
@@ -115,7 +122,6 @@ static const char * const kFormatsTable[] = {
 	"H [p]",
 	NULL
 };
-static const char* const* sFormatsTable = kFormatsTable;
 
 
 enum field_type {
@@ -551,6 +557,189 @@ DateMask::IsComplete()
 //	#pragma mark -
 
 
+#define IDENTIFIER_SLOTS		512
+#define IDENTIFIER_BUCKETS		128
+#define MAX_IDENTIFIER_LENGTH	15
+
+/*!	Perfect hash of the names (and alternate names) of the known identifiers,
+	so that a word can be looked up with a single comparison instead of
+	going through the whole table, no matter how many time zones or languages
+	it has.  This uses "hash, displace and compress": the names are put into
+	buckets by one hash, and each bucket gets a displacement which moves all
+	of its names into free slots.  Names are hashed in lower case, since they
+	are compared ignoring case.  If two identifiers have the same name, the
+	first one in the table wins, just like with a linear search.
+*/
+class IdentifierHash {
+	public:
+		IdentifierHash();
+
+		bool IsValid() const { return fValid; }
+		const known_identifier* Find(const char* string, int32 length) const;
+
+	private:
+		static void Hash(const char* string, int32 length, uint32& bucket,
+			uint32& slot, uint32& step);
+
+		bool	fValid;
+		uint16	fDisplacements[IDENTIFIER_BUCKETS];
+		const known_identifier* fIdentifiers[IDENTIFIER_SLOTS];
+		const char* fNames[IDENTIFIER_SLOTS];
+};
+
+
+IdentifierHash::IdentifierHash()
+	:
+	fValid(false)
+{
+	memset(fDisplacements, 0, sizeof(fDisplacements));
+	memset(fIdentifiers, 0, sizeof(fIdentifiers));
+	memset(fNames, 0, sizeof(fNames));
+
+	// collect the names, skipping ones which are already there
+
+	std::vector<const char*> names;
+	std::vector<const known_identifier*> identifiers;
+	for (const known_identifier* identifier = kIdentifiers;
+			identifier->string; identifier++) {
+		const char* strings[2]
+			= {identifier->string, identifier->alternate_string};
+		for (int32 i = 0; i < 2; i++) {
+			if (strings[i] == NULL)
+				continue;
+			if (strlen(strings[i]) > MAX_IDENTIFIER_LENGTH)
+				return;
+
+			bool known = false;
+			for (size_t j = 0; j < names.size() && !known; j++)
+				known = !strcasecmp(names[j], strings[i]);
+			if (!known) {
+				names.push_back(strings[i]);
+				identifiers.push_back(identifier);
+			}
+		}
+	}
+	if (names.size() > IDENTIFIER_SLOTS / 2)
+		return;
+
+	// place the buckets with the most names first, while there are still
+	// plenty of free slots
+
+	std::vector<std::vector<int32> > buckets(IDENTIFIER_BUCKETS);
+	for (size_t i = 0; i < names.size(); i++) {
+		uint32 bucket, slot, step;
+		Hash(names[i], strlen(names[i]), bucket, slot, step);
+		buckets[bucket].push_back(i);
+	}
+
+	std::vector<int32> order(IDENTIFIER_BUCKETS);
+	for (int32 i = 0; i < IDENTIFIER_BUCKETS; i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int32 a, int32 b) {
+		return buckets[a].size() > buckets[b].size();
+	});
+
+	for (int32 i = 0; i < IDENTIFIER_BUCKETS; i++) {
+		const std::vector<int32>& bucket = buckets[order[i]];
+		if (bucket.empty())
+			break;
+
+		uint32 displacement = 0;
+		for (; displacement < 65536; displacement++) {
+			uint32 slots[IDENTIFIER_SLOTS];
+			bool fits = true;
+			for (size_t j = 0; j < bucket.size() && fits; j++) {
+				const char* name = names[bucket[j]];
+				uint32 unused, slot, step;
+				Hash(name, strlen(name), unused, slot, step);
+				slots[j] = (slot + displacement * step) % IDENTIFIER_SLOTS;
+				fits = fNames[slots[j]] == NULL;
+				for (size_t k = 0; k < j && fits; k++)
+					fits = slots[k] != slots[j];
+			}
+			if (!fits)
+				continue;
+
+			for (size_t j = 0; j < bucket.size(); j++) {
+				fNames[slots[j]] = names[bucket[j]];
+				fIdentifiers[slots[j]] = identifiers[bucket[j]];
+			}
+			break;
+		}
+		if (displacement >= 65536)
+			return;
+
+		fDisplacements[order[i]] = displacement;
+	}
+
+	fValid = true;
+}
+
+
+/*static*/ void
+IdentifierHash::Hash(const char* string, int32 length, uint32& bucket,
+	uint32& slot, uint32& step)
+{
+	// two FNV-1a hashes with different starting values
+
+	uint32 first = 2166136261U;
+	uint32 second = 0x5bd1e995;
+	for (int32 i = 0; i < length; i++) {
+		uint8 c = tolower(string[i]);
+		first = (first ^ c) * 16777619U;
+		second = (second ^ c) * 16777619U;
+	}
+
+	bucket = (second >> 8) % IDENTIFIER_BUCKETS;
+	slot = first % IDENTIFIER_SLOTS;
+	step = (first >> 16) | 1;
+}
+
+
+const known_identifier*
+IdentifierHash::Find(const char* string, int32 length) const
+{
+	if (length > MAX_IDENTIFIER_LENGTH)
+		return NULL;
+
+	uint32 bucket, slot, step;
+	Hash(string, length, bucket, slot, step);
+	slot = (slot + fDisplacements[bucket] * step) % IDENTIFIER_SLOTS;
+
+	const char* name = fNames[slot];
+	if (name != NULL && !strncasecmp(name, string, length) && !name[length])
+		return fIdentifiers[slot];
+
+	return NULL;
+}
+
+
+static const known_identifier*
+findIdentifier(const char* string, int32 length)
+{
+	static const IdentifierHash sHash;
+	if (sHash.IsValid())
+		return sHash.Find(string, length);
+
+	// compare with known strings
+	// ToDo: should understand other languages as well...
+
+	const known_identifier* identifier = kIdentifiers;
+	for (; identifier->string; identifier++) {
+		if (!strncasecmp(identifier->string, string, length)
+			&& !identifier->string[length])
+			return identifier;
+
+		if (identifier->alternate_string != NULL
+			&& !strncasecmp(identifier->alternate_string, string, length)
+			&& !identifier->alternate_string[length])
+			return identifier;
+	}
+
+	return NULL;
+}
+
+
 static status_t
 preparseDate(const char* dateString, parsed_element* elements)
 {
@@ -625,21 +814,8 @@ preparseDate(const char* dateString, parsed_element* elements)
 				dateString++;
 			int32 length = dateString + 1 - string;
 
-			// compare with known strings
-			// ToDo: should understand other languages as well...
-
-			const known_identifier* identifier = kIdentifiers;
-			for (; identifier->string; identifier++) {
-				if (!strncasecmp(identifier->string, string, length)
-					&& !identifier->string[length])
-					break;
-
-				if (identifier->alternate_string != NULL
-					&& !strncasecmp(identifier->alternate_string, string, length)
-					&& !identifier->alternate_string[length])
-					break;
-			}
-			if (identifier->string == NULL) {
+			const known_identifier* identifier = findIdentifier(string, length);
+			if (identifier == NULL) {
 				// unknown string, we don't have to parse any further
 				return B_ERROR;
 			}
@@ -762,8 +938,9 @@ computeRelativeUnit(parsed_element& element, struct tm& tm, int* _flags)
 	Will also set the day/minute relative flags in "_flags".
 */
 static time_t
-computeDate(const char* format, bool* optional, parsed_element* elements,
-	time_t now, DateMask dateMask, int* _flags)
+computeDate(const parsedate_time_rules& rules, const char* format,
+	bool* optional, parsed_element* elements, time_t now, DateMask dateMask,
+	int* _flags)
 {
 	TRACE(("matches: %s\n", format));
 
@@ -778,7 +955,7 @@ computeDate(const char* format, bool* optional, parsed_element* elements,
 	if (dateMask.IsComplete())
 		memset(&tm, 0, sizeof(tm));
 	else {
-		localtime_r(&now, &tm);
+		rules.local_time(&now, &tm, rules.cookie);
 		nowYear = tm.tm_year;
 		if (dateMask.HasTime()) {
 			tm.tm_min = 0;
@@ -832,7 +1009,7 @@ computeDate(const char* format, bool* optional, parsed_element* elements,
 					{
 						if (nowYear < 0) {
 							struct tm tmNow;
-							localtime_r(&now, &tmNow);
+							rules.local_time(&now, &tmNow, rules.cookie);
 							nowYear	= tmNow.tm_year;
 						}
 						int nowYearInCentury = nowYear % 100;
@@ -862,7 +1039,8 @@ computeDate(const char* format, bool* optional, parsed_element* elements,
 								+ (element->value % 100) * 60;
 						if (element->modifier == MODIFY_MINUS)
 							value *= -1;
-						tm.tm_sec -= value + timezone;
+						tm.tm_sec -= value
+							+ rules.standard_offset(rules.cookie);
 						break;
 					}
 					case 'T':
@@ -892,7 +1070,8 @@ computeDate(const char* format, bool* optional, parsed_element* elements,
 						break;
 					case 'z':	// time zone
 					case 'Z':
-						tm.tm_sec -= element->value + timezone;
+						tm.tm_sec -= element->value
+							+ rules.standard_offset(rules.cookie);
 						break;
 					case 'T':	// time unit
 						if ((element->flags & FLAG_NOW) != 0) {
@@ -916,230 +1095,778 @@ computeDate(const char* format, bool* optional, parsed_element* elements,
 		element++;
 	}
 
-	return mktime(&tm);
+	return rules.make_time(&tm, rules.cookie);
 }
 
 
-// #pragma mark - public API
+enum {
+	MATCH_FAILED,
+	MATCH_ELEMENT,
+	MATCH_ELEMENT_AGAIN
+		// a number's dash matched, the number still has to be matched with
+		// the rest of the format
+};
 
 
-time_t
-parsedate_etc(const char* dateString, time_t now, int* _flags)
+/*!	Checks if the element matches the format character, and sets the
+	date mask flags for it.
+*/
+static int32
+matchElement(char formatChar, const parsed_element& element,
+	DateMask& dateMask)
 {
-	// preparse date string so that it can be easily compared to our formats
+	switch (element.value_type) {
+		case VALUE_CHAR:
+			// check the allowed single characters
+
+			switch (element.type) {
+				case TYPE_DOT:
+					return formatChar == '.' ? MATCH_ELEMENT : MATCH_FAILED;
+				case TYPE_DASH:
+					return formatChar == '-' ? MATCH_ELEMENT : MATCH_FAILED;
+				case TYPE_COMMA:
+					return formatChar == ',' ? MATCH_ELEMENT : MATCH_FAILED;
+				case TYPE_COLON:
+					return formatChar == ':' ? MATCH_ELEMENT : MATCH_FAILED;
+				default:
+					return MATCH_FAILED;
+			}
 
-	parsed_element elements[MAX_ELEMENTS];
+		case VALUE_NUMERICAL:
+			// make sure that unit types are respected
+			if (element.type == TYPE_UNIT && formatChar != 'T')
+				return MATCH_FAILED;
 
-	if (preparseDate(dateString, elements) < B_OK) {
-		*_flags = PARSEDATE_INVALID_DATE;
-		return B_ERROR;
+			switch (formatChar) {
+				case 'd':
+					if (element.value > 31)
+						return MATCH_FAILED;
+
+					dateMask.Set(TYPE_DAY);
+					break;
+				case 'm':
+					if (element.value > 12)
+						return MATCH_FAILED;
+
+					dateMask.Set(TYPE_MONTH);
+					break;
+				case 'H':
+				case 'I':
+					if (element.value > 24)
+						return MATCH_FAILED;
+
+					dateMask.Set(TYPE_HOUR);
+					break;
+				case 'M':
+					dateMask.Set(TYPE_MINUTE);
+				case 'S':
+					if (element.value > 59)
+						return MATCH_FAILED;
+
+					break;
+				case 'y':
+				case 'Y':
+					// accept all values
+					break;
+				case 'z':	// time zone
+				case 'Z':
+					// a numerical timezone must be introduced by '+'
+					// or '-' and it must not exceed 2399
+					if ((element.modifier != MODIFY_MINUS
+							&& element.modifier != MODIFY_PLUS)
+						|| element.value > 2399)
+						return MATCH_FAILED;
+					break;
+				case 'T':
+					dateMask.Set(TYPE_UNIT);
+					break;
+				case '-':
+					if ((element.flags & FLAG_HAS_DASH) != 0) {
+						// consider this element again
+						return MATCH_ELEMENT_AGAIN;
+					}
+					return MATCH_FAILED;
+				default:
+					return MATCH_FAILED;
+			}
+			return MATCH_ELEMENT;
+
+		case VALUE_STRING:
+			switch (formatChar) {
+				case 'a':	// weekday
+				case 'A':
+					if (element.type != TYPE_WEEKDAY)
+						return MATCH_FAILED;
+					break;
+				case 'b':	// month
+				case 'B':
+					if (element.type != TYPE_MONTH)
+						return MATCH_FAILED;
+
+					dateMask.Set(TYPE_MONTH);
+					break;
+				case 'p':	// meridian
+					if (element.type != TYPE_MERIDIAN)
+						return MATCH_FAILED;
+					break;
+				case 'z':	// time zone
+				case 'Z':
+					if (element.type != TYPE_TIME_ZONE)
+						return MATCH_FAILED;
+					break;
+				case 'T':	// time unit
+					if (element.type != TYPE_UNIT)
+						return MATCH_FAILED;
+
+					dateMask.Set(TYPE_UNIT);
+					break;
+				default:
+					return MATCH_FAILED;
+			}
+			return MATCH_ELEMENT;
 	}
 
-#if TRACE_PARSEDATE
-	printf("parsedate(\"%s\", now %ld)\n", dateString, now);
-	for (int32 index = 0; elements[index].type != TYPE_END; index++) {
-		parsed_element e = elements[index];
+	return MATCH_FAILED;
+}
 
-		printf("  %ld: type = %u, base_type = %u, unit = %u, flags = %u, "
-			"modifier = %u, value = %Ld (%s)\n", index, e.type, e.base_type,
-			e.unit, e.flags, e.modifier, e.value,
-			e.value_type == VALUE_NUMERICAL ? "numerical"
-				: (e.value_type == VALUE_STRING ? "string" : "char"));
+
+/*!	Checks if the rest of the format is optional, so it can end here. */
+static bool
+formatCanEnd(const char* format)
+{
+	while (format[0]) {
+		if (format[0] == '[')
+			format += 3;
+		else if (isspace(format[0]))
+			format++;
+		else
+			break;
 	}
-#endif
 
-	bool optional[MAX_ELEMENTS];
+	return format[0] == '\0';
+}
+
 
-	for (int32 index = 0; sFormatsTable[index]; index++) {
-		// test if this format matches our date string
+/*!	Tests if the elements match the format, and if so, fills in which of its
+	optional fields are present, and the date mask.
+*/
+static bool
+matchFormat(const char* format, const parsed_element* elements,
+	bool* optional, DateMask& dateMask)
+{
+	uint32 position = 0;
 
-		const char* format = sFormatsTable[index];
-		uint32 position = 0;
-		DateMask dateMask;
+	const parsed_element* element = elements;
+	while (element->type != TYPE_END) {
+		// skip whitespace
+		while (isspace(format[0]))
+			format++;
 
-		parsed_element* element = elements;
-		while (element->type != TYPE_END) {
-			// skip whitespace
-			while (isspace(format[0]))
-				format++;
+		if (format[0] == '[' && format[2] == ']') {
+			optional[position] = true;
+			format++;
+		} else
+			optional[position] = false;
 
-			if (format[0] == '[' && format[2] == ']') {
-				optional[position] = true;
+		int32 match = matchElement(format[0], *element, dateMask);
+		if (match != MATCH_FAILED) {
+			// format matched at this point, check next element
+			if (optional[position])
 				format++;
-			} else
-				optional[position] = false;
+			format++;
+			position++;
+			if (match == MATCH_ELEMENT)
+				element++;
+			continue;
+		}
 
-			switch (element->value_type) {
-				case VALUE_CHAR:
-					// check the allowed single characters
+		// format didn't match element - let's see if the current
+		// one is only optional (in which case we can continue)
+		if (!optional[position])
+			return false;
 
-					switch (element->type) {
-						case TYPE_DOT:
-							if (format[0] != '.')
-								goto next_format;
-							break;
-						case TYPE_DASH:
-							if (format[0] != '-')
-								goto next_format;
-							break;
-						case TYPE_COMMA:
-							if (format[0] != ',')
-								goto next_format;
-							break;
-						case TYPE_COLON:
-							if (format[0] != ':')
-								goto next_format;
-							break;
-						default:
-							goto next_format;
-					}
-					break;
+		optional[position] = false;
+		format += 2;
+		position++;
+			// skip the closing ']'
+	}
 
-				case VALUE_NUMERICAL:
-					// make sure that unit types are respected
-					if (element->type == TYPE_UNIT && format[0] != 'T')
-						goto next_format;
+	// check if the format is already empty (since we reached our last
+	// element)
+	return formatCanEnd(format);
+}
 
-					switch (format[0]) {
-						case 'd':
-							if (element->value > 31)
-								goto next_format;
 
-							dateMask.Set(TYPE_DAY);
-							break;
-						case 'm':
-							if (element->value > 12)
-								goto next_format;
+// #pragma mark - format automaton
 
-							dateMask.Set(TYPE_MONTH);
-							break;
-						case 'H':
-						case 'I':
-							if (element->value > 24)
-								goto next_format;
 
-							dateMask.Set(TYPE_HOUR);
-							break;
-						case 'M':
-							dateMask.Set(TYPE_MINUTE);
-						case 'S':
-							if (element->value > 59)
-								goto next_format;
+#define ELEMENT_CLASS_COUNT		36
+#define MAX_AUTOMATON_STATES	8192
 
-							break;
-						case 'y':
-						case 'Y':
-							// accept all values
-							break;
-						case 'z':	// time zone
-						case 'Z':
-							// a numerical timezone must be introduced by '+'
-							// or '-' and it must not exceed 2399
-							if ((element->modifier != MODIFY_MINUS
-									&& element->modifier != MODIFY_PLUS)
-								|| element->value > 2399)
-								goto next_format;
-							break;
-						case 'T':
-							dateMask.Set(TYPE_UNIT);
-							break;
-						case '-':
-							if ((element->flags & FLAG_HAS_DASH) != 0) {
-								element--;	// consider this element again
-								break;
-							}
-							// supposed to fall through
-						default:
-							goto next_format;
-					}
-					break;
+/*!	Sorts elements into classes which every format character treats the
+	same way: the kind of single character or string, or for numbers,
+	whether they have a unit, their range, a sign and a dash.
+*/
+static int32
+elementClass(const parsed_element& element)
+{
+	switch (element.value_type) {
+		case VALUE_CHAR:
+			switch (element.type) {
+				case TYPE_DOT:
+					return 0;
+				case TYPE_DASH:
+					return 1;
+				case TYPE_COMMA:
+					return 2;
+				case TYPE_COLON:
+					return 3;
+				default:
+					return 4;
+			}
 
-				case VALUE_STRING:
-					switch (format[0]) {
-						case 'a':	// weekday
-						case 'A':
-							if (element->type != TYPE_WEEKDAY)
-								goto next_format;
-							break;
-						case 'b':	// month
-						case 'B':
-							if (element->type != TYPE_MONTH)
-								goto next_format;
+		case VALUE_STRING:
+			switch (element.type) {
+				case TYPE_WEEKDAY:
+					return 5;
+				case TYPE_MONTH:
+					return 6;
+				case TYPE_MERIDIAN:
+					return 7;
+				case TYPE_TIME_ZONE:
+					return 8;
+				case TYPE_UNIT:
+					return 9;
+				default:
+					return 10;
+			}
 
-							dateMask.Set(TYPE_MONTH);
-							break;
-						case 'p':	// meridian
-							if (element->type != TYPE_MERIDIAN)
-								goto next_format;
-							break;
-						case 'z':	// time zone
-						case 'Z':
-							if (element->type != TYPE_TIME_ZONE)
-								goto next_format;
-							break;
-						case 'T':	// time unit
-							if (element->type != TYPE_UNIT)
-								goto next_format;
+		default:
+		{
+			if (element.type == TYPE_UNIT)
+				return 11;
+
+			int32 range = element.value <= 12 ? 0 : element.value <= 24 ? 1
+				: element.value <= 31 ? 2 : element.value <= 59 ? 3
+				: element.value <= 2399 ? 4 : 5;
+			bool sign = element.modifier == MODIFY_MINUS
+				|| element.modifier == MODIFY_PLUS;
+			bool dash = (element.flags & FLAG_HAS_DASH) != 0;
+			return 12 + range * 4 + (sign ? 2 : 0) + (dash ? 1 : 0);
+		}
+	}
+}
 
-							dateMask.Set(TYPE_UNIT);
-							break;
-						default:
-							goto next_format;
-					}
-					break;
-			}
 
-			// format matched at this point, check next element
-			if (optional[position])
-				format++;
-			format++;
-			position++;
-			element++;
+/*!	Makes up an element belonging to the given class. */
+static void
+classElement(int32 elementClass, parsed_element& element)
+{
+	static const uint8 kCharTypes[]
+		= {TYPE_DOT, TYPE_DASH, TYPE_COMMA, TYPE_COLON, TYPE_UNKNOWN};
+	static const uint8 kStringTypes[] = {TYPE_WEEKDAY, TYPE_MONTH,
+		TYPE_MERIDIAN, TYPE_TIME_ZONE, TYPE_UNIT, TYPE_MODIFIER};
+	static const bigtime_t kRangeValues[] = {12, 24, 31, 59, 2399, 2400};
+
+	memset(&element, 0, sizeof(parsed_element));
+
+	if (elementClass < 5) {
+		element.SetCharType(kCharTypes[elementClass]);
+	} else if (elementClass < 11) {
+		element.base_type = element.type = kStringTypes[elementClass - 5];
+		element.value_type = VALUE_STRING;
+	} else if (elementClass == 11) {
+		element.base_type = element.type = TYPE_UNIT;
+		element.value_type = VALUE_NUMERICAL;
+	} else {
+		int32 number = elementClass - 12;
+		element.value_type = VALUE_NUMERICAL;
+		element.value = kRangeValues[number / 4];
+		element.modifier = (number & 2) != 0 ? MODIFY_PLUS : MODIFY_NONE;
+		element.flags = (number & 1) != 0 ? FLAG_HAS_DASH : FLAG_NONE;
+	}
+}
+
+
+/*!	Moves through the format past one element, the same way matchFormat()
+	does.  Returns the new offset in the format, or -1 if it doesn't match.
+*/
+static int32
+advanceFormat(const char* format, int32 offset, const parsed_element& element)
+{
+	DateMask dateMask;
+
+	while (true) {
+		while (isspace(format[offset]))
+			offset++;
+
+		bool isOptional = format[offset] == '[' && format[offset + 2] == ']';
+		if (isOptional)
+			offset++;
+
+		int32 match = matchElement(format[offset], element, dateMask);
+		if (match != MATCH_FAILED) {
+			offset += isOptional ? 2 : 1;
+			if (match == MATCH_ELEMENT)
+				return offset;
 			continue;
+		}
 
-		next_format:
-			// format didn't match element - let's see if the current
-			// one is only optional (in which case we can continue)
-			if (!optional[position])
-				goto skip_format;
+		if (!isOptional)
+			return -1;
 
-			optional[position] = false;
-			format += 2;
-			position++;
-				// skip the closing ']'
+		offset += 2;
+	}
+}
+
+
+/*!	The formats table compiled into a deterministic automaton over element
+	classes, so that finding the first matching format takes one table
+	lookup per element, no matter how many formats there are.  Each state
+	is where every format would be after the elements so far (or that it
+	has already failed), and knows the first format which could end there.
+	If the table is too big for that, IsValid() is false and the formats
+	have to be tried one after the other.
+*/
+class FormatAutomaton {
+	public:
+		FormatAutomaton(const char* const* formats);
+
+		bool IsValid() const { return !fTransitions.empty(); }
+		int32 FindFormat(const parsed_element* elements) const;
+
+	private:
+		std::vector<int32>	fTransitions;
+			// for each state and element class, the next state or -1
+		std::vector<int32>	fEndFormats;
+			// for each state, the first format which can end there or -1
+};
+
+
+FormatAutomaton::FormatAutomaton(const char* const* formats)
+{
+	int32 formatCount = 0;
+	while (formats[formatCount])
+		formatCount++;
+
+	parsed_element classElements[ELEMENT_CLASS_COUNT];
+	for (int32 i = 0; i < ELEMENT_CLASS_COUNT; i++)
+		classElement(i, classElements[i]);
+
+	std::vector<std::vector<int16> > states;
+	std::map<std::vector<int16>, int32> stateNumbers;
+
+	states.push_back(std::vector<int16>(formatCount, 0));
+	stateNumbers[states[0]] = 0;
+
+	std::vector<int32> transitions;
+	for (size_t state = 0; state < states.size(); state++) {
+		int32 endFormat = -1;
+		for (int32 i = 0; i < formatCount && endFormat < 0; i++) {
+			if (states[state][i] >= 0
+				&& formatCanEnd(formats[i] + states[state][i]))
+				endFormat = i;
 		}
+		fEndFormats.push_back(endFormat);
+
+		for (int32 elementClass = 0; elementClass < ELEMENT_CLASS_COUNT;
+				elementClass++) {
+			std::vector<int16> next(formatCount, -1);
+			bool alive = false;
+			for (int32 i = 0; i < formatCount; i++) {
+				if (states[state][i] < 0)
+					continue;
+
+				int32 offset = advanceFormat(formats[i], states[state][i],
+					classElements[elementClass]);
+				if (offset > 0x7fff)
+					return;
+
+				next[i] = offset;
+				alive |= offset >= 0;
+			}
+			if (!alive) {
+				transitions.push_back(-1);
+				continue;
+			}
 
-		// check if the format is already empty (since we reached our last
-		// element)
-		while (format[0]) {
-			if (format[0] == '[')
-				format += 3;
-			else if (isspace(format[0]))
-				format++;
-			else
-				break;
+			std::map<std::vector<int16>, int32>::iterator found
+				= stateNumbers.find(next);
+			if (found != stateNumbers.end()) {
+				transitions.push_back(found->second);
+				continue;
+			}
+
+			if (states.size() >= MAX_AUTOMATON_STATES)
+				return;
+
+			stateNumbers[next] = states.size();
+			transitions.push_back(states.size());
+			states.push_back(next);
 		}
-		if (format[0])
-			goto skip_format;
+	}
 
-		// made it here? then we seem to have found our guy
+	fTransitions.swap(transitions);
+}
 
-		return computeDate(sFormatsTable[index], optional, elements, now,
-			dateMask, _flags);
 
-	skip_format:
-		// check if the next format has the same beginning as the skipped one,
-		// and if so, skip that one, too.
+int32
+FormatAutomaton::FindFormat(const parsed_element* elements) const
+{
+	int32 state = 0;
+	for (; elements->type != TYPE_END; elements++) {
+		state = fTransitions[state * ELEMENT_CLASS_COUNT
+			+ elementClass(*elements)];
+		if (state < 0)
+			return -1;
+	}
 
-		int32 length = format + 1 - sFormatsTable[index];
+	return fEndFormats[state];
+}
 
-		while (sFormatsTable[index + 1]
-			&& !strncmp(sFormatsTable[index], sFormatsTable[index + 1], length))
-			index++;
+
+/*!	The automaton for kFormatsTable, shared by all contexts using it. */
+static const FormatAutomaton*
+defaultAutomaton()
+{
+	static const FormatAutomaton sDefaultAutomaton(kFormatsTable);
+
+	return &sDefaultAutomaton;
+}
+
+
+// #pragma mark - common formats
+
+
+static const char*
+skipSpaces(const char* string)
+{
+	while (isspace(string[0]))
+		string++;
+
+	return string;
+}
+
+
+/*!	Reads a number of at most \a maxDigits digits, which mustn't be followed
+	by letters (like "1st" or "7pm").
+*/
+static bool
+fetchNumber(const char*& string, int32 maxDigits, int32& value)
+{
+	string = skipSpaces(string);
+
+	int32 digits = 0;
+	value = 0;
+	while (isdigit(string[0])) {
+		if (++digits > maxDigits)
+			return false;
+
+		value = value * 10 + string[0] - '0';
+		string++;
+	}
+
+	return digits > 0 && !isalpha(string[0]);
+}
+
+
+static const known_identifier*
+fetchIdentifier(const char*& string)
+{
+	string = skipSpaces(string);
+
+	const char* start = string;
+	while (isalpha(string[0]))
+		string++;
+
+	if (string == start)
+		return NULL;
+
+	return findIdentifier(start, string - start);
+}
+
+
+static void
+skipComma(const char*& string)
+{
+	string = skipSpaces(string);
+	if (string[0] == ',')
+		string++;
+}
+
+
+/*!	Fast path for the few shapes nearly all festival schedules are made of:
+	"H:M" event times, "Weekday, Month d, Y" day headings, and the
+	"Wed Jun 13 19:00:00 2018" dates FFVSO writes for its Selected lines.
+	They would be matched by the "[A][,] H:M [p]", "[A][,] B d[,] Y" and
+	"[A][,] B d[,] H:M:S [p] Y[,] [Z]" formats, which never have a complete
+	date mask (the year doesn't count), so the result is worked out here the
+	same way computeDate() would, starting from "now" in local time.
+	Returns false for anything else (including any variation, like an "am"
+	or a two digit year), leaving it to the general format matcher.
+*/
+static bool
+parseCommonDate(const parsedate_time_rules& rules, const char* dateString,
+	time_t now, int* _flags, time_t* _date)
+{
+	const char* string = skipSpaces(dateString);
+	int32 hour = -1, minute = 0, second = 0;
+	int32 month = 0, day = 0, year = 0;
+	bool hasWeekday = false;
+
+	if (isdigit(string[0])) {
+		// "H:M"
+		if (!fetchNumber(string, 2, hour) || hour > 24)
+			return false;
+
+		string = skipSpaces(string);
+		if (string[0] != ':')
+			return false;
+
+		string++;
+		if (!fetchNumber(string, 2, minute) || minute > 59)
+			return false;
+	} else {
+		// "[A][,] B d[,] Y" or "[A][,] B d[,] H:M:S Y"
+		const known_identifier* identifier = fetchIdentifier(string);
+		if (identifier != NULL && identifier->type == TYPE_WEEKDAY) {
+			hasWeekday = true;
+			skipComma(string);
+			identifier = fetchIdentifier(string);
+		}
+		if (identifier == NULL || identifier->type != TYPE_MONTH)
+			return false;
+
+		month = identifier->value;
+		if (!fetchNumber(string, 2, day) || day > 31)
+			return false;
+
+		skipComma(string);
+		int32 number;
+		if (!fetchNumber(string, 4, number))
+			return false;
+
+		string = skipSpaces(string);
+		if (string[0] == ':') {
+			hour = number;
+			string++;
+			if (hour > 24 || !fetchNumber(string, 2, minute) || minute > 59)
+				return false;
+
+			string = skipSpaces(string);
+			if (string[0] != ':')
+				return false;
+
+			string++;
+			if (!fetchNumber(string, 2, second) || second > 59
+				|| !fetchNumber(string, 4, number))
+				return false;
+		}
+
+		// years before 1900 are relative to the current century
+		year = number;
+		if (year < 1900)
+			return false;
+	}
+
+	if (skipSpaces(string)[0] != '\0')
+		return false;
+
+	if (now == -1)
+		now = time(NULL);
+
+	struct tm tm;
+	rules.local_time(&now, &tm, rules.cookie);
+
+	if (month != 0) {
+		if (hasWeekday) {
+			// the weekday resets the time to midnight, and the day of the
+			// month then overrides where it went
+			tm.tm_hour = 0;
+			tm.tm_min = 0;
+			tm.tm_sec = 0;
+		}
+		tm.tm_mon = month - 1;
+		tm.tm_mday = day;
+		tm.tm_year = year - 1900;
+	}
+	if (hour >= 0) {
+		tm.tm_hour = hour;
+		tm.tm_min = minute;
+		tm.tm_sec = second;
+	}
+
+	*_flags = PARSEDATE_RELATIVE_TIME;
+	*_date = rules.make_time(&tm, rules.cookie);
+	return true;
+}
+
+
+// #pragma mark - contexts
+
+
+static struct tm*
+defaultLocalTime(const time_t* time, struct tm* tm, void* /*cookie*/)
+{
+	return localtime_r(time, tm);
+}
+
+
+static time_t
+defaultMakeTime(struct tm* tm, void* /*cookie*/)
+{
+	return mktime(tm);
+}
+
+
+static long
+defaultStandardOffset(void* /*cookie*/)
+{
+	return timezone;
+}
+
+
+static const parsedate_time_rules kDefaultTimeRules = {
+	defaultLocalTime,
+	defaultMakeTime,
+	defaultStandardOffset,
+	NULL
+};
+
+
+/*!	Everything parsedate_r() needs, so that nothing is shared with other
+	contexts except for read only tables.
+*/
+struct parsedate_ctx {
+	const char* const*		formats;
+	const FormatAutomaton*	automaton;
+		// NULL for kFormatsTable, which uses defaultAutomaton()
+	parsedate_time_rules	rules;
+};
+
+
+static parsedate_ctx sDefaultContext = {
+	kFormatsTable,
+	NULL,
+	kDefaultTimeRules
+};
+	// used by the non reentrant functions
+
+
+// #pragma mark - public API
+
+
+parsedate_ctx*
+parsedate_ctx_create(const char** table, const parsedate_time_rules* rules)
+{
+	parsedate_ctx* context = new(std::nothrow) parsedate_ctx;
+	if (context == NULL)
+		return NULL;
+
+	context->formats = table ? table : kFormatsTable;
+	context->automaton = NULL;
+	context->rules = rules ? *rules : kDefaultTimeRules;
+
+	if (context->formats != kFormatsTable) {
+		// the formats are compiled now, so later changes to the table
+		// don't count
+		context->automaton
+			= new(std::nothrow) FormatAutomaton(context->formats);
+		if (context->automaton == NULL) {
+			delete context;
+			return NULL;
+		}
+	}
+
+	return context;
+}
+
+
+void
+parsedate_ctx_delete(parsedate_ctx* context)
+{
+	if (context == NULL)
+		return;
+
+	delete context->automaton;
+	delete context;
+}
+
+
+time_t
+parsedate_r(const parsedate_ctx* context, const char* dateString, time_t now,
+	int* _flags)
+{
+	const parsedate_time_rules& rules = context->rules;
+
+	// try the usual festival schedule formats first, unless someone has
+	// changed the formats table
+
+	time_t date;
+	if (context->formats == kFormatsTable && dateString != NULL
+		&& parseCommonDate(rules, dateString, now, _flags, &date))
+		return date;
+
+	// preparse date string so that it can be easily compared to our formats
+
+	parsed_element elements[MAX_ELEMENTS];
+
+	if (preparseDate(dateString, elements) < B_OK) {
+		*_flags = PARSEDATE_INVALID_DATE;
+		return B_ERROR;
+	}
+
+#if TRACE_PARSEDATE
+	printf("parsedate(\"%s\", now %ld)\n", dateString, now);
+	for (int32 index = 0; elements[index].type != TYPE_END; index++) {
+		parsed_element e = elements[index];
+
+		printf("  %ld: type = %u, base_type = %u, unit = %u, flags = %u, "
+			"modifier = %u, value = %Ld (%s)\n", index, e.type, e.base_type,
+			e.unit, e.flags, e.modifier, e.value,
+			e.value_type == VALUE_NUMERICAL ? "numerical"
+				: (e.value_type == VALUE_STRING ? "string" : "char"));
 	}
+#endif
+
+	// find the first format which matches
+
+	const char* const* formats = context->formats;
+	const FormatAutomaton* automaton = context->automaton != NULL
+		? context->automaton : defaultAutomaton();
+
+	int32 index = -1;
+	if (automaton->IsValid())
+		index = automaton->FindFormat(elements);
+	else {
+		bool optional[MAX_ELEMENTS];
+		for (int32 i = 0; formats[i] && index < 0; i++) {
+			DateMask dateMask;
+			if (matchFormat(formats[i], elements, optional, dateMask))
+				index = i;
+		}
+	}
+
+	if (index < 0) {
+		// didn't find any matching formats
+		return B_ERROR;
+	}
+
+	// made it here? then we seem to have found our guy
 
-	// didn't find any matching formats
-	return B_ERROR;
+	bool optional[MAX_ELEMENTS];
+	DateMask dateMask;
+	matchFormat(formats[index], elements, optional, dateMask);
+
+	return computeDate(rules, formats[index], optional, elements, now,
+		dateMask, _flags);
+}
+
+
+time_t
+parsedate_etc(const char* dateString, time_t now, int* _flags)
+{
+	return parsedate_r(&sDefaultContext, dateString, now, _flags);
 }
 
 
@@ -1155,13 +1882,21 @@ parsedate(const char* dateString, time_t now)
 void
 set_dateformats(const char** table)
 {
-	sFormatsTable = table ? table : kFormatsTable;
+	// the formats are compiled now, so later changes to the table don't count
+
+	const char* const* formats = table ? table : kFormatsTable;
+	const FormatAutomaton* automaton = NULL;
+	if (formats != kFormatsTable)
+		automaton = new FormatAutomaton(formats);
+
+	delete sDefaultContext.automaton;
+	sDefaultContext.formats = formats;
+	sDefaultContext.automaton = automaton;
 }
 
 
 const char**
 get_dateformats(void)
 {
-	return const_cast<const char**>(sFormatsTable);
+	return const_cast<const char**>(sDefaultContext.formats);
 }
-
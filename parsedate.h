@@ -27,6 +27,29 @@ extern time_t parsedate_etc(const char *dateString, time_t now, int *_storedFlag
 extern void set_dateformats(const char *table[]);
 extern const char **get_dateformats(void);
 
+/* reentrant interface: a context has its own formats table and its own way of
+ * converting between time_t and local time, so several threads can parse at
+ * once without sharing any state, and parsedate_r() doesn't allocate memory */
+typedef struct parsedate_time_rules {
+	struct tm *(*local_time)(const time_t *time, struct tm *tm, void *cookie);
+		/* like localtime_r() */
+	time_t (*make_time)(struct tm *tm, void *cookie);
+		/* like mktime() */
+	long (*standard_offset)(void *cookie);
+		/* seconds west of UTC without daylight saving, like timezone */
+	void *cookie;
+} parsedate_time_rules;
+
+typedef struct parsedate_ctx parsedate_ctx;
+
+/* NULL for the table or the rules uses the defaults (the system's local time
+ * functions), the table is compiled and can't change afterwards */
+extern parsedate_ctx *parsedate_ctx_create(const char *table[],
+	const parsedate_time_rules *rules);
+extern void parsedate_ctx_delete(parsedate_ctx *context);
+extern time_t parsedate_r(const parsedate_ctx *context, const char *dateString,
+	time_t now, int *_storedFlags);
+
 #ifdef __cplusplus
 }
 #endif